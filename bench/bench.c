@@ -0,0 +1,1158 @@
+/* bench.c
+
+   Headless benchmark driver. Links against a renderer built with
+   HEADLESS defined (either clip.c or zsort.c), flies a fixed camera
+   path through the world by feeding the same inputs the keyboard
+   handler would to UpdateViewPos, and times every call to
+   UpdateWorld.
+
+   Because the path is driven purely by the frame number, and both
+   renderers build the same benchmark scene, every run sees exactly
+   the same sequence of views, so numbers from the two renderers,
+   and from different builds of either, can be compared directly.
+
+   Besides the renderers' own grid of cubes, the driver can generate
+   bigger scenes of boxes (grids, cities, and interiors) from a
+   seed, at any polygon count, to see how each stage scales.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "bench.h"
+
+#define DEFAULT_FRAMES      2000
+#define DEFAULT_WARMUP      100
+#define DEFAULT_CUBES       16
+#define MAX_SWEEP           16      // max entries in a sweep list
+#define PI                  3.141592
+#define PATH_FRAMES         720     // frames for one lap of the path
+#define PATH_SPEED          1.0     // forward speed along the path
+#define PATH_PITCH          (PI/8.0)// max look up/down along the path
+#define REF_INTERVAL        50      // frames between reference images
+#define PATH_RADIUS         110.0   // the path circles the point
+                                    //  (PATH_RADIUS, 0, 0), this far
+                                    //  from it, at height 0
+#define PATH_CLEARANCE      25.0    // generated boxes stay this far
+                                    //  from the path, unless they're
+                                    //  higher up than this
+#define FLOOR_HEIGHT        -20.0   // the renderers' floor
+#define DEFAULT_SEED        1
+#define MAX_SHAPES          32      // box shapes in a generated scene
+#define BOX_GAP             1.0     // space left between boxes that
+                                    //  would otherwise touch, and
+                                    //  under them, since the
+                                    //  renderers can't sort objects
+                                    //  that touch
+
+// Kinds of scene; SCENE_CUBES is the renderers' own
+#define SCENE_CUBES         0
+#define SCENE_GRID          1       // boxes on a grid
+#define SCENE_CITY          2       // blocks of tall buildings
+#define SCENE_INTERIOR      3       // rooms, walls, and ceilings
+#define NUM_SCENES          4
+
+typedef struct {
+    double  time;
+    double  latency;        // ms from starting the frame to presenting it
+    int     pixels;
+    int     spans;
+    int     maxdepth;
+    double  meandepth;
+    int     depthhist[MAX_DEPTH_COMPLEXITY];
+} framestat_t;
+
+FILE    *csvfile;
+char    *heatmapprefix;     // set if gathering overdraw stats
+char    *refprefix;         // set if comparing to reference images
+char    *worldfile;         // set if running on a world file
+FILE    *summaryfile;       // set if writing a line per run
+char    *scenenames[NUM_SCENES] = {"cubes", "grid", "city", "interior"};
+int     scene;              // SCENE_ value
+#ifdef STAGE_TIMING
+char    *stagesprefix;      // set if writing out stage times
+#endif
+
+/////////////////////////////////////////////////////////////////////
+// Returns the current time in seconds from an arbitrary base.
+/////////////////////////////////////////////////////////////////////
+double Sys_FloatTime(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER    freq;
+    LARGE_INTEGER           count;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * (1.0 / 1000000000.0);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up the inputs for the specified frame of the camera path.
+// The camera circles the world at walking speed, turning steadily
+// and nodding up and down twice per lap, so the amount of geometry
+// in view changes continuously over the run.
+/////////////////////////////////////////////////////////////////////
+void SetCameraForFrame(int frame)
+{
+    double  t;
+
+    t = (double)(frame % PATH_FRAMES) / (double)PATH_FRAMES;
+
+    roll = 0.0;
+    yaw = t * PI * 2;
+    pitch = sin(t * PI * 4) * PATH_PITCH;
+    currentspeed = PATH_SPEED;
+}
+
+// A generated scene is built up here from its seed, then handed to
+// the renderer
+unsigned int    sceneseed = DEFAULT_SEED;
+unsigned int    randstate;
+benchshape_t    shapes[MAX_SHAPES];
+int             numshapes;
+benchbox_t      *boxes;
+int             numboxes, maxboxes;
+
+/////////////////////////////////////////////////////////////////////
+// Returns the next random number, from 0 to 32767. This is a plain
+// linear congruential generator rather than rand(), so the same
+// seed makes the same scene with every C library.
+/////////////////////////////////////////////////////////////////////
+int SceneRand(void)
+{
+    randstate = randstate * 1103515245 + 12345;
+
+    return (randstate >> 16) & 0x7FFF;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns a random number from min to max.
+/////////////////////////////////////////////////////////////////////
+double SceneRandRange(double min, double max)
+{
+    return min + (max - min) * SceneRand() / 32767.0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add a box shape of the specified half-sizes, in a random color.
+// Returns its index.
+/////////////////////////////////////////////////////////////////////
+int AddShape(double halfx, double halfy, double halfz)
+{
+    benchshape_t    *pshape;
+
+    pshape = &shapes[numshapes];
+    pshape->halfsize[0] = halfx;
+    pshape->halfsize[1] = halfy;
+    pshape->halfsize[2] = halfz;
+    pshape->color = 2 + SceneRand() % 14;
+
+    return numshapes++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add a box of the specified shape, centered on x and z, with its
+// bottom BOX_GAP above the specified height, unless it would be in
+// the camera's way, or the scene is already full.
+/////////////////////////////////////////////////////////////////////
+void AddBox(int shape, double x, double bottom, double z)
+{
+    double          dx, dz, nearx, nearz, nearest, farthest;
+    benchshape_t    *pshape;
+
+    if (numboxes >= maxboxes)
+        return;
+
+    pshape = &shapes[shape];
+
+    // Boxes that reach down to the camera's height must not come
+    // within PATH_CLEARANCE of its circle; that is, the nearest
+    // point of the box's footprint must be outside the circle's
+    // clearance, or the farthest inside it
+    if (bottom < PATH_CLEARANCE)
+    {
+        dx = fabs(x - PATH_RADIUS);
+        dz = fabs(z);
+        nearx = (dx > pshape->halfsize[0]) ? dx - pshape->halfsize[0] : 0;
+        nearz = (dz > pshape->halfsize[2]) ? dz - pshape->halfsize[2] : 0;
+        nearest = sqrt(nearx * nearx + nearz * nearz);
+        farthest = sqrt((dx + pshape->halfsize[0]) *
+                        (dx + pshape->halfsize[0]) +
+                        (dz + pshape->halfsize[2]) *
+                        (dz + pshape->halfsize[2]));
+        if ((nearest < PATH_RADIUS + PATH_CLEARANCE) &&
+            (farthest > PATH_RADIUS - PATH_CLEARANCE))
+        {
+            return;
+        }
+    }
+
+    boxes[numboxes].center[0] = x;
+    boxes[numboxes].center[1] = bottom + BOX_GAP + pshape->halfsize[1];
+    boxes[numboxes].center[2] = z;
+    boxes[numboxes].shape = shape;
+    numboxes++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Fill the cell with its near corner at x, z with one box standing
+// on the floor somewhere in it.
+/////////////////////////////////////////////////////////////////////
+void BuildGridCell(double x, double z, double cellsize)
+{
+    int     shape;
+    double  roomx, roomz;
+
+    shape = SceneRand() % numshapes;
+    roomx = cellsize / 2.0 - shapes[shape].halfsize[0] - 2.0;
+    roomz = cellsize / 2.0 - shapes[shape].halfsize[2] - 2.0;
+
+    AddBox(shape, x + cellsize / 2.0 + SceneRandRange(-roomx, roomx),
+           FLOOR_HEIGHT,
+           z + cellsize / 2.0 + SceneRandRange(-roomz, roomz));
+}
+
+/////////////////////////////////////////////////////////////////////
+// Fill the city block with its near corner at x, z with a 3x3 grid
+// of buildings of assorted heights, leaving a street along its near
+// edges.
+/////////////////////////////////////////////////////////////////////
+void BuildCityBlock(double x, double z, double cellsize)
+{
+    int     i;
+    double  lotsize;
+
+    lotsize = (cellsize - 40.0) / 3.0;
+
+    for (i=0 ; i<9 ; i++)
+    {
+        AddBox(SceneRand() % numshapes,
+               x + 40.0 + ((i % 3) + 0.5) * lotsize, FLOOR_HEIGHT,
+               z + 40.0 + ((i / 3) + 0.5) * lotsize);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Fill the room with its near corner at x, z with a corner post, the
+// walls along its near edges, each with a doorway in the middle, a
+// ceiling, and three pieces of furniture, one in each third of the
+// room along x. Shapes 0 through 3 are the post, walls along x and
+// along z, and ceiling; the rest are furniture. No two pieces touch,
+// in this room or the next: the walls stop BOX_GAP short of the
+// posts, the ceiling is BOX_GAP above them and BOX_GAP smaller
+// than the room, and the furniture stays BOX_GAP clear of the walls
+// and of the other thirds.
+/////////////////////////////////////////////////////////////////////
+void BuildRoom(double x, double z, double cellsize)
+{
+    int             i, shape;
+    double          post, wallx, wallz, ceiling, third, roomx, roomz;
+    benchshape_t    *pshape;
+
+    post = shapes[0].halfsize[0];
+    wallx = shapes[1].halfsize[0];
+    wallz = shapes[2].halfsize[2];
+    ceiling = FLOOR_HEIGHT + shapes[0].halfsize[1] * 2.0 + BOX_GAP;
+
+    AddBox(0, x, FLOOR_HEIGHT, z);
+    AddBox(1, x + post + BOX_GAP + wallx, FLOOR_HEIGHT, z);
+    AddBox(1, x + cellsize - post - BOX_GAP - wallx, FLOOR_HEIGHT, z);
+    AddBox(2, x, FLOOR_HEIGHT, z + post + BOX_GAP + wallz);
+    AddBox(2, x, FLOOR_HEIGHT, z + cellsize - post - BOX_GAP - wallz);
+    AddBox(3, x + cellsize / 2.0, ceiling, z + cellsize / 2.0);
+
+    third = (cellsize - post * 2.0) / 3.0;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        shape = 4 + SceneRand() % (numshapes - 4);
+        pshape = &shapes[shape];
+        roomx = third / 2.0 - pshape->halfsize[0] - BOX_GAP;
+        roomz = cellsize / 2.0 - post - pshape->halfsize[2] - BOX_GAP;
+
+        AddBox(shape,
+               x + post + third * (i + 0.5) +
+                    SceneRandRange(-roomx, roomx), FLOOR_HEIGHT,
+               z + cellsize / 2.0 + SceneRandRange(-roomz, roomz));
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the current kind of scene with count boxes (the renderer's
+// own scene with count cubes, for SCENE_CUBES) and hand it to the
+// renderer. Generated scenes are made of cells (a grid square, a
+// city block, or a room) laid out in square rings spreading out from
+// the middle of the camera path until there are enough boxes, so
+// bigger scenes just extend smaller ones with the same seed. Returns
+// the number of polygons in the world, or 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildScene(int count)
+{
+    int     i, ring, ix, iz, numpolys;
+    double  cellsize;
+
+    if ((scene == SCENE_CUBES) || (count <= 0))
+        return BuildBenchScene(count);
+
+    boxes = malloc(count * sizeof(benchbox_t));
+    if (boxes == NULL)
+        return 0;
+
+    randstate = sceneseed;
+    numshapes = numboxes = 0;
+    maxboxes = count;
+
+    switch (scene)
+    {
+    case SCENE_GRID:
+        cellsize = 40.0;
+        for (i=0 ; i<8 ; i++)
+        {
+            AddShape(SceneRandRange(5.0, 15.0), SceneRandRange(5.0, 25.0),
+                     SceneRandRange(5.0, 15.0));
+        }
+        break;
+
+    case SCENE_CITY:
+        cellsize = 160.0;
+        for (i=0 ; i<16 ; i++)
+        {
+            AddShape(SceneRandRange(10.0, 18.0),
+                     SceneRandRange(15.0, 100.0),
+                     SceneRandRange(10.0, 18.0));
+        }
+        break;
+
+    default:
+        cellsize = 80.0;
+        AddShape(2.0, 30.0, 2.0);
+        AddShape(15.0, 30.0, 2.0);
+        AddShape(2.0, 30.0, 15.0);
+        AddShape(cellsize / 2.0 - BOX_GAP / 2.0, 2.0,
+                 cellsize / 2.0 - BOX_GAP / 2.0);
+        for (i=0 ; i<6 ; i++)
+        {
+            AddShape(SceneRandRange(3.0, 10.0), SceneRandRange(3.0, 12.0),
+                     SceneRandRange(3.0, 10.0));
+        }
+        break;
+    }
+
+    for (ring=0 ; numboxes<maxboxes ; ring++)
+    {
+        for (iz=-ring ; (iz<=ring) && (numboxes<maxboxes) ; iz++)
+        {
+            for (ix=-ring ; (ix<=ring) && (numboxes<maxboxes) ; ix++)
+            {
+                if ((abs(ix) != ring) && (abs(iz) != ring))
+                    continue;   // in an inner ring
+
+                switch (scene)
+                {
+                case SCENE_GRID:
+                    BuildGridCell(PATH_RADIUS + (ix - 0.5) * cellsize,
+                                  (iz - 0.5) * cellsize, cellsize);
+                    break;
+                case SCENE_CITY:
+                    BuildCityBlock(PATH_RADIUS + (ix - 0.5) * cellsize,
+                                   (iz - 0.5) * cellsize, cellsize);
+                    break;
+                default:
+                    BuildRoom(PATH_RADIUS + (ix - 0.5) * cellsize,
+                              (iz - 0.5) * cellsize, cellsize);
+                    break;
+                }
+            }
+        }
+    }
+
+    numpolys = BuildBoxScene(shapes, numshapes, boxes, numboxes);
+
+    free(boxes);
+    boxes = NULL;
+
+    return numpolys;
+}
+
+/////////////////////////////////////////////////////////////////////
+// qsort comparison for frame times.
+/////////////////////////////////////////////////////////////////////
+int CompareTimes(const void *p1, const void *p2)
+{
+    double  t1 = *(const double *)p1;
+    double  t2 = *(const double *)p2;
+
+    if (t1 < t2)
+        return -1;
+    if (t1 > t2)
+        return 1;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the specified percentile of a sorted array of times.
+/////////////////////////////////////////////////////////////////////
+double Percentile(double *sorted, int count, double pct)
+{
+    int     i;
+
+    i = (int)(pct / 100.0 * (count - 1) + 0.5);
+
+    return sorted[i];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the index of the argument following the specified one,
+// or 0 if it's not present.
+/////////////////////////////////////////////////////////////////////
+int CheckParm(int argc, char **argv, char *parm)
+{
+    int     i;
+
+    for (i=1 ; i<argc-1 ; i++)
+    {
+        if (!strcmp(argv[i], parm))
+            return i + 1;
+    }
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Parse a comma-separated list of integers, such as "10,100,1000".
+// Returns the number of entries parsed.
+/////////////////////////////////////////////////////////////////////
+int ParseList(char *str, int *list, int maxcount)
+{
+    int     count;
+
+    for (count=0 ; count<maxcount ; count++)
+    {
+        list[count] = atoi(str);
+        str = strchr(str, ',');
+        if (str == NULL)
+            return count + 1;
+        str++;
+    }
+
+    return count;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Parse a comma-separated list of resolutions, such as
+// "320x240,640x480". Returns the number of entries parsed.
+/////////////////////////////////////////////////////////////////////
+int ParseResList(char *str, int *widths, int *heights, int maxcount)
+{
+    int     count;
+
+    for (count=0 ; count<maxcount ; count++)
+    {
+        if (sscanf(str, "%dx%d", &widths[count], &heights[count]) != 2)
+            return count;
+        str = strchr(str, ',');
+        if (str == NULL)
+            return count + 1;
+        str++;
+    }
+
+    return count;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Compare the framebuffer to the next reference image in reffile,
+// copying it into refframe, or, if writing, append it to reffile.
+// Returns the number of pixels that differ, or -1 if reffile has
+// run out of images or can't be written.
+/////////////////////////////////////////////////////////////////////
+int CompareToReference(FILE *reffile, int writing,
+                       unsigned char *refframe)
+{
+    int     i, size, differ;
+
+    size = DIBWidth * DIBHeight;
+
+    if (writing)
+        return (fwrite(pDIBBase, 1, size, reffile) == size) ? 0 : -1;
+
+    if (fread(refframe, 1, size, reffile) != size)
+        return -1;
+
+    differ = 0;
+    for (i=0 ; i<size ; i++)
+    {
+        if (pDIBBase[i] != (char)refframe[i])
+            differ++;
+    }
+
+    return differ;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Fly the camera path through a scene of count boxes of the current
+// kind, or the world in worldfile if it's set, at the specified
+// resolution, rendering with the specified number of threads (0 for
+// one per processor), pipelined or not, texture mapped or not,
+// z-buffered (with entities) or not, and finding the visible faces
+// the specified way, and print one line of results, and append one
+// to the summary file if there is one. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int RunBenchmark(int width, int height, int count, int threads,
+                 int pipeline, int texture, int zbuffer, int vis,
+                 int frames, int warmup)
+{
+    int             i, j, numpolys, worstdepth, pipelined, lag, textured;
+    int             zbuffered, vismode;
+    double          *sorted, start, total, mean, var, dev;
+    double          totallatency;
+    double          screenpixels, overdraw, maxoverdraw;
+    double          totalpixels, totalspans, worstmean, totaldepth;
+    double          depthtotals[MAX_DEPTH_COMPLEXITY];
+    framestat_t     *stats;
+    char            filename[256];
+    FILE            *reffile;
+    unsigned char   *refframe;
+    int             writingref, refframes, differ, maxdiffer;
+    double          totaldiffer;
+    int             arena, peak, capacity, growframes, grew;
+    int             overflowframes, overflowed;
+    char            *arenaname;
+    int             hits, misses, evictions, bytesbuilt, cachedframes;
+    double          totalhits, totalmisses, totalevictions, totalbuilt;
+    int             nodes, leaves, faces, visited, culled, bspframes;
+    double          compilems, totalvisited, totalculled;
+    int             compressed, uncompressed, facesculled, pvsframes;
+    double          buildms, decompressms, totaldecompress, totalfacesculled;
+    int             cells, portals, passed, portalframes;
+    double          portalms, totalcells, totalpassed, totalfaces;
+    int             bvhnodes, bvhleaves, refit, bvhframes;
+    double          bvhms, totalbvhvisited, totalbvhculled, totalrefit;
+    double          loadms, p50, p99;
+#ifdef STAGE_TIMING
+    double          stagetimes[NUM_STAGES], stagetotals[NUM_STAGES];
+    char            tracename[256];
+
+    for (j=0 ; j<NUM_STAGES ; j++)
+        stagetotals[j] = 0.0;
+#endif
+
+    if (!InitFramebuffer(width, height))
+    {
+        fprintf(stderr, "Couldn't set up a %dx%d framebuffer\n",
+                width, height);
+        return 0;
+    }
+
+    start = Sys_FloatTime();
+    if (worldfile)
+    {
+        numpolys = LoadWorldFile(worldfile);
+        if (numpolys == 0)
+        {
+            fprintf(stderr, "Couldn't load %s\n", worldfile);
+            return 0;
+        }
+    }
+    else
+    {
+        numpolys = BuildScene(count);
+        if (numpolys == 0)
+        {
+            fprintf(stderr, "Couldn't build a %s scene of %d boxes\n",
+                    scenenames[scene], count);
+            return 0;
+        }
+    }
+    loadms = (Sys_FloatTime() - start) * 1000.0;
+
+    threads = SetRenderThreads(threads);
+    pipelined = SetPipelining(pipeline);
+    textured = SetTextureMapping(texture);
+    zbuffered = SetZBuffering(zbuffer);
+    vismode = SetVisibility(vis);
+
+    // A pipelined renderer presents each frame one call after it's
+    // built, so run one more frame up front; that way the timed
+    // frames present the same views, with the same stats and images,
+    // as they would if it weren't pipelined
+    lag = pipelined ? 1 : 0;
+
+    stats = malloc(frames * sizeof(framestat_t));
+    sorted = malloc(frames * sizeof(double));
+    if ((stats == NULL) || (sorted == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+
+    // Compare every REF_INTERVAL'th frame to the images saved by an
+    // earlier run, or save them if there's no earlier run
+    reffile = NULL;
+    refframe = NULL;
+    writingref = refframes = maxdiffer = 0;
+    totaldiffer = 0.0;
+
+    if (refprefix)
+    {
+        sprintf(filename, "%s-%s-%dx%d-%d.ref", refprefix, renderername,
+                DIBWidth, DIBHeight, numpolys);
+        reffile = fopen(filename, "rb");
+        if (reffile == NULL)
+        {
+            reffile = fopen(filename, "wb");
+            writingref = 1;
+        }
+        refframe = malloc(DIBWidth * DIBHeight);
+        if ((reffile == NULL) || (refframe == NULL))
+        {
+            fprintf(stderr, "Couldn't open %s\n", filename);
+            return 0;
+        }
+    }
+
+    overdrawcheck = (heatmapprefix != NULL);
+    worstmean = -1.0;
+    cachedframes = 0;
+    totalhits = totalmisses = totalevictions = totalbuilt = 0.0;
+    bspframes = 0;
+    totalvisited = totalculled = 0.0;
+    pvsframes = 0;
+    totaldecompress = totalfacesculled = 0.0;
+    portalframes = 0;
+    totalcells = totalpassed = totalfaces = 0.0;
+    bvhframes = 0;
+    totalbvhvisited = totalbvhculled = totalrefit = 0.0;
+    sprintf(filename, "%s-%s-%dx%d-%d.ppm", heatmapprefix ?
+            heatmapprefix : "", renderername, DIBWidth, DIBHeight,
+            numpolys);
+
+    // Run the start of the path untimed, to get caches and branch
+    // predictors into a steady state
+    for (i=0 ; i<warmup+lag ; i++)
+    {
+        SetCameraForFrame(i);
+        UpdateWorld();
+    }
+
+    for (i=0 ; i<frames ; i++)
+    {
+        SetCameraForFrame(warmup + lag + i);
+
+        start = Sys_FloatTime();
+        UpdateWorld();
+        stats[i].time = Sys_FloatTime() - start;
+        stats[i].latency = GetFrameLatency();
+        if (stats[i].latency < 0.0)
+            stats[i].latency = stats[i].time * 1000.0;
+        stats[i].pixels = numpixels;
+        stats[i].spans = numspans;
+
+        if (GetSurfaceCacheStats(&hits, &misses, &evictions, &bytesbuilt))
+        {
+            cachedframes++;
+            totalhits += hits;
+            totalmisses += misses;
+            totalevictions += evictions;
+            totalbuilt += bytesbuilt;
+        }
+
+        if (GetBSPStats(&nodes, &leaves, &faces, &compilems, &visited,
+                        &culled))
+        {
+            bspframes++;
+            totalvisited += visited;
+            totalculled += culled;
+        }
+
+        if (GetPVSStats(&compressed, &uncompressed, &buildms,
+                        &decompressms, &facesculled))
+        {
+            pvsframes++;
+            totaldecompress += decompressms;
+            totalfacesculled += facesculled;
+        }
+
+        if (GetPortalStats(&cells, &portals, &portalms, &visited,
+                           &passed, &faces))
+        {
+            portalframes++;
+            totalcells += visited;
+            totalpassed += passed;
+            totalfaces += faces;
+        }
+
+        if (GetBVHStats(&bvhnodes, &bvhleaves, &bvhms, &visited, &culled,
+                        &refit))
+        {
+            bvhframes++;
+            totalbvhvisited += visited;
+            totalbvhculled += culled;
+            totalrefit += refit;
+        }
+
+        // Report every frame that had to make more room for its
+        // edges, surfaces, or spans, or ran out of memory for them
+        for (arena=0 ; ; arena++)
+        {
+            arenaname = GetArenaStats(arena, &peak, &capacity,
+                                      &growframes, &grew,
+                                      &overflowframes, &overflowed);
+            if (arenaname == NULL)
+                break;
+            if (grew)
+            {
+                printf("         frame %d grew the %s pool to %d\n",
+                       i, arenaname, capacity);
+            }
+            if (overflowed)
+            {
+                printf("         frame %d overflowed the %s pool %d "
+                       "times\n", i, arenaname, overflowed);
+            }
+        }
+
+        if (reffile && ((i % REF_INTERVAL) == 0))
+        {
+            differ = CompareToReference(reffile, writingref, refframe);
+            if (differ < 0)
+            {
+                fprintf(stderr, "Reference images ran out or couldn't "
+                        "be written; use the same -frames and -warmup "
+                        "as the run that saved them\n");
+                fclose(reffile);
+                reffile = NULL;
+            }
+            else
+            {
+                refframes++;
+                totaldiffer += differ;
+                if (differ > maxdiffer)
+                    maxdiffer = differ;
+            }
+        }
+
+#ifdef STAGE_TIMING
+        if (GetStageTimes(stagetimes) == NUM_STAGES)
+        {
+            for (j=0 ; j<NUM_STAGES ; j++)
+                stagetotals[j] += stagetimes[j];
+        }
+#endif
+
+        if (overdrawcheck)
+        {
+            stats[i].maxdepth = maxdepth;
+            stats[i].meandepth = meandepth;
+            memcpy(stats[i].depthhist, depthhist, sizeof(depthhist));
+
+            // Keep a heatmap of the frame with the most overdraw
+            if (meandepth > worstmean)
+            {
+                worstmean = meandepth;
+                WriteOverdrawHeatmap(filename);
+            }
+        }
+    }
+
+    // Gather up the results
+    screenpixels = (double)DIBWidth * (double)DIBHeight;
+    total = totalpixels = totalspans = maxoverdraw = totaldepth = 0.0;
+    totallatency = 0.0;
+    worstdepth = 0;
+    for (j=0 ; j<MAX_DEPTH_COMPLEXITY ; j++)
+        depthtotals[j] = 0.0;
+
+    for (i=0 ; i<frames ; i++)
+    {
+        sorted[i] = stats[i].time;
+        total += stats[i].time;
+        totallatency += stats[i].latency;
+        totalpixels += stats[i].pixels;
+        totalspans += stats[i].spans;
+        overdraw = stats[i].pixels / screenpixels;
+        if (overdraw > maxoverdraw)
+            maxoverdraw = overdraw;
+
+        if (overdrawcheck)
+        {
+            totaldepth += stats[i].meandepth;
+            if (stats[i].maxdepth > worstdepth)
+                worstdepth = stats[i].maxdepth;
+            for (j=0 ; j<MAX_DEPTH_COMPLEXITY ; j++)
+                depthtotals[j] += stats[i].depthhist[j];
+        }
+
+        if (csvfile)
+        {
+            fprintf(csvfile, "%s,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.6f,%d,"
+                    "%.4f,%d,%.6f",
+                    renderername, vectypename, threads, pipelined,
+                    textured, zbuffered, vismode, DIBWidth, DIBHeight,
+                    numpolys, i,
+                    stats[i].time * 1000.0, stats[i].pixels, overdraw,
+                    stats[i].spans, stats[i].latency);
+            if (overdrawcheck)
+            {
+                fprintf(csvfile, ",%.4f,%d", stats[i].meandepth,
+                        stats[i].maxdepth);
+                for (j=0 ; j<MAX_DEPTH_COMPLEXITY ; j++)
+                    fprintf(csvfile, ",%d", stats[i].depthhist[j]);
+            }
+            fprintf(csvfile, "\n");
+        }
+    }
+
+    mean = total / frames;
+    var = 0.0;
+    for (i=0 ; i<frames ; i++)
+    {
+        dev = stats[i].time - mean;
+        var += dev * dev;
+    }
+    var /= frames;
+
+    qsort(sorted, frames, sizeof(double), CompareTimes);
+    p50 = Percentile(sorted, frames, 50.0) * 1000.0;
+    p99 = Percentile(sorted, frames, 99.0) * 1000.0;
+
+    printf("%-8s %-6s %3d %2d %2d %2d %2d %5dx%-5d %8d %9.1f %7.3f "
+           "%7.3f %7.3f %7.3f %7.3f %10.0f %6.2f %6.2f %9.1f\n",
+           renderername, vectypename, threads, pipelined, textured,
+           zbuffered, vismode, DIBWidth, DIBHeight, numpolys,
+           frames / total,
+           p50,
+           p99,
+           sorted[frames-1] * 1000.0,
+           sqrt(var) * 1000.0,
+           totallatency / frames,
+           totalpixels / frames,
+           totalpixels / frames / screenpixels,
+           maxoverdraw,
+           totalspans / frames);
+
+    if (overdrawcheck)
+    {
+        printf("         depth complexity mean %.2f, max %d; %% of "
+               "pixels at depth 0..%d+:\n        ",
+               totaldepth / frames, worstdepth,
+               MAX_DEPTH_COMPLEXITY - 1);
+        for (j=0 ; j<MAX_DEPTH_COMPLEXITY ; j++)
+            printf(" %.1f", depthtotals[j] * 100.0 / frames /
+                   screenpixels);
+        printf("\n");
+    }
+
+    if (GetArenaStats(0, &peak, &capacity, &growframes, &grew,
+                      &overflowframes, &overflowed))
+    {
+        printf("         pool peak/capacity (frames grown, "
+               "overflowed):");
+        for (arena=0 ; ; arena++)
+        {
+            arenaname = GetArenaStats(arena, &peak, &capacity,
+                                      &growframes, &grew,
+                                      &overflowframes, &overflowed);
+            if (arenaname == NULL)
+                break;
+            printf(" %s %d/%d (%d, %d)", arenaname, peak, capacity,
+                   growframes, overflowframes);
+        }
+        printf("\n");
+    }
+
+    if (cachedframes)
+    {
+        printf("         surface cache per frame: %.1f hits, %.1f misses, "
+               "%.2f evictions, %.0f bytes built\n",
+               totalhits / frames, totalmisses / frames,
+               totalevictions / frames, totalbuilt / frames);
+    }
+
+    if (worldfile)
+    {
+        printf("         world: %s, loaded and set up in %.1f ms\n",
+               worldfile, loadms);
+    }
+    else if (scene != SCENE_CUBES)
+    {
+        printf("         scene: %s, seed %u, built and set up in "
+               "%.1f ms\n", scenenames[scene], sceneseed, loadms);
+    }
+
+    if (bspframes)
+    {
+        GetBSPStats(&nodes, &leaves, &faces, &compilems, &visited,
+                    &culled);
+        printf("         bsp tree: %d nodes, %d leaves, %d faces, "
+               "compiled in %.1f ms; per frame: %.1f nodes visited, "
+               "%.1f culled\n", nodes, leaves, faces, compilems,
+               totalvisited / frames, totalculled / frames);
+    }
+
+    if (pvsframes)
+    {
+        GetPVSStats(&compressed, &uncompressed, &buildms, &decompressms,
+                    &facesculled);
+        printf("         pvs: %d bytes (%d uncompressed), built in "
+               "%.1f ms; per frame: %.3f us decompressing, %.1f faces "
+               "culled\n", compressed, uncompressed, buildms,
+               totaldecompress * 1000.0 / frames,
+               totalfacesculled / frames);
+    }
+
+    if (portalframes)
+    {
+        GetPortalStats(&cells, &portals, &portalms, &visited, &passed,
+                       &faces);
+        printf("         portals: %d cells, %d portals, built in %.1f ms; "
+               "per frame: %.1f cells visited, %.1f portals looked "
+               "through, %.1f faces added\n", cells, portals, portalms,
+               totalcells / frames, totalpassed / frames,
+               totalfaces / frames);
+    }
+
+    if (bvhframes)
+    {
+        GetBVHStats(&bvhnodes, &bvhleaves, &bvhms, &visited, &culled,
+                    &refit);
+        printf("         bvh: %d nodes, %d leaves, built in %.1f ms; "
+               "per frame: %.1f nodes visited, %.1f culled, %.1f "
+               "refit\n", bvhnodes, bvhleaves, bvhms,
+               totalbvhvisited / frames, totalbvhculled / frames,
+               totalrefit / frames);
+    }
+
+    if (writingref)
+    {
+        printf("         saved %d reference images\n", refframes);
+    }
+    else if (refframes)
+    {
+        printf("         vs %d reference images: %.4f%% of pixels "
+               "differ on average, %.4f%% in the worst\n", refframes,
+               totaldiffer * 100.0 / refframes / screenpixels,
+               maxdiffer * 100.0 / screenpixels);
+    }
+
+    if (reffile)
+        fclose(reffile);
+    free(refframe);
+
+#ifdef STAGE_TIMING
+    printf("         mean ms per stage:");
+    for (j=0 ; j<NUM_STAGES ; j++)
+        printf(" %s %.3f", stagenames[j], stagetotals[j] / frames);
+    printf("\n");
+
+    if (stagesprefix)
+    {
+        sprintf(filename, "%s-%s-%dx%d-%d.csv", stagesprefix,
+                renderername, DIBWidth, DIBHeight, numpolys);
+        sprintf(tracename, "%s-%s-%dx%d-%d.json", stagesprefix,
+                renderername, DIBWidth, DIBHeight, numpolys);
+        WriteStageTimes(filename, tracename);
+    }
+#endif
+
+    if (summaryfile)
+    {
+        fprintf(summaryfile, "%s,%s,%s,%u,%d,%d,%d,%d,%d,%d,%d,%d,%.3f,"
+                "%.3f,%.6f,%.6f,%.6f,%.6f",
+                renderername, vectypename,
+                worldfile ? worldfile : scenenames[scene], sceneseed,
+                threads, pipelined, textured, zbuffered, vismode,
+                DIBWidth, DIBHeight, numpolys, loadms, frames / total,
+                p50, p99, sorted[frames-1] * 1000.0,
+                total * 1000.0 / frames);
+#ifdef STAGE_TIMING
+        for (j=0 ; j<NUM_STAGES ; j++)
+            fprintf(summaryfile, ",%.6f", stagetotals[j] / frames);
+#endif
+        fprintf(summaryfile, "\n");
+        fflush(summaryfile);
+    }
+
+    free(stats);
+    free(sorted);
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// main
+/////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+    int     i, j, k, l, m, n, v, p, frames, warmup, numres, numcounts;
+    int     numthreads, numpipelines, numtextures, numzbuffers, numvis;
+    int     widths[MAX_SWEEP], heights[MAX_SWEEP];
+    int     counts[MAX_SWEEP], threadcounts[MAX_SWEEP];
+    int     pipelines[MAX_SWEEP], textures[MAX_SWEEP];
+    int     zbuffers[MAX_SWEEP], vismodes[MAX_SWEEP];
+
+    frames = DEFAULT_FRAMES;
+    warmup = DEFAULT_WARMUP;
+    widths[0] = 320;
+    heights[0] = 240;
+    numres = 1;
+    counts[0] = DEFAULT_CUBES;
+    numcounts = 1;
+    threadcounts[0] = 0;    // one per processor
+    numthreads = 1;
+    pipelines[0] = 0;
+    numpipelines = 1;
+    textures[0] = 0;
+    numtextures = 1;
+    zbuffers[0] = 0;
+    numzbuffers = 1;
+    vismodes[0] = 0;
+    numvis = 1;
+
+    if ((p = CheckParm(argc, argv, "-frames")) != 0)
+        frames = atoi(argv[p]);
+    if ((p = CheckParm(argc, argv, "-warmup")) != 0)
+        warmup = atoi(argv[p]);
+    if ((p = CheckParm(argc, argv, "-res")) != 0)
+        numres = ParseResList(argv[p], widths, heights, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-cubes")) != 0)
+        numcounts = ParseList(argv[p], counts, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-polys")) != 0)
+    {
+        // Every box has 6 faces
+        numcounts = ParseList(argv[p], counts, MAX_SWEEP);
+        for (i=0 ; i<numcounts ; i++)
+            counts[i] = (counts[i] + 5) / 6;
+    }
+    if ((p = CheckParm(argc, argv, "-scene")) != 0)
+    {
+        for (scene=0 ; scene<NUM_SCENES ; scene++)
+        {
+            if (!strcmp(argv[p], scenenames[scene]))
+                break;
+        }
+        if (scene == NUM_SCENES)
+        {
+            fprintf(stderr, "Unknown scene %s\n", argv[p]);
+            return 1;
+        }
+    }
+    if ((p = CheckParm(argc, argv, "-seed")) != 0)
+        sceneseed = (unsigned int)atoi(argv[p]);
+    if ((p = CheckParm(argc, argv, "-threads")) != 0)
+        numthreads = ParseList(argv[p], threadcounts, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-pipeline")) != 0)
+        numpipelines = ParseList(argv[p], pipelines, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-texture")) != 0)
+        numtextures = ParseList(argv[p], textures, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-zbuffer")) != 0)
+        numzbuffers = ParseList(argv[p], zbuffers, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-vis")) != 0)
+        numvis = ParseList(argv[p], vismodes, MAX_SWEEP);
+    if ((p = CheckParm(argc, argv, "-overdraw")) != 0)
+        heatmapprefix = argv[p];
+    if ((p = CheckParm(argc, argv, "-ref")) != 0)
+        refprefix = argv[p];
+    if ((p = CheckParm(argc, argv, "-world")) != 0)
+    {
+        worldfile = argv[p];
+        numcounts = 1;
+    }
+#ifdef STAGE_TIMING
+    if ((p = CheckParm(argc, argv, "-stages")) != 0)
+        stagesprefix = argv[p];
+#endif
+    if ((p = CheckParm(argc, argv, "-csv")) != 0)
+    {
+        csvfile = fopen(argv[p], "a");
+        if (csvfile == NULL)
+        {
+            fprintf(stderr, "Couldn't open %s\n", argv[p]);
+            return 1;
+        }
+    }
+    if ((p = CheckParm(argc, argv, "-summary")) != 0)
+    {
+        summaryfile = fopen(argv[p], "a");
+        if (summaryfile == NULL)
+        {
+            fprintf(stderr, "Couldn't open %s\n", argv[p]);
+            return 1;
+        }
+    }
+
+    if (frames < 1)
+        frames = 1;
+
+    // Just convert a scene to a world file
+    if ((p = CheckParm(argc, argv, "-saveworld")) != 0)
+    {
+        if (!InitFramebuffer(widths[0], heights[0]) ||
+            !BuildScene(counts[0]) || !SaveWorldFile(argv[p]))
+        {
+            fprintf(stderr, "Couldn't write %s\n", argv[p]);
+            return 1;
+        }
+        printf("Wrote the %s scene of %d boxes to %s\n",
+               scenenames[scene], counts[0], argv[p]);
+        FreeFramebuffer();
+        return 0;
+    }
+
+    printf("renderer vec    thr pl tx zb vi resolution     polys       fps"
+           "    p50ms   p99ms   maxms  sdevms   latms   pix/frame  overdr "
+           "maxovr spans/frm\n");
+
+    for (i=0 ; i<numcounts ; i++)
+    {
+        for (j=0 ; j<numres ; j++)
+        {
+            for (k=0 ; k<numthreads ; k++)
+            {
+                for (l=0 ; l<numpipelines ; l++)
+                {
+                    for (m=0 ; m<numtextures ; m++)
+                    {
+                        for (n=0 ; n<numzbuffers ; n++)
+                        {
+                            for (v=0 ; v<numvis ; v++)
+                            {
+                                if (!RunBenchmark(widths[j], heights[j],
+                                        counts[i], threadcounts[k],
+                                        pipelines[l], textures[m],
+                                        zbuffers[n], vismodes[v], frames,
+                                        warmup))
+                                {
+                                    return 1;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (csvfile)
+        fclose(csvfile);
+    if (summaryfile)
+        fclose(summaryfile);
+    FreeFramebuffer();
+
+    return 0;
+}
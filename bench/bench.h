@@ -0,0 +1,68 @@
+/* bench.h
+
+   Interface the benchmark driver expects from a renderer built with
+   HEADLESS defined. Both clip.c and zsort.c provide it. */
+
+#define MAX_DEPTH_COMPLEXITY 16     // must match the renderers
+#define NUM_STAGES          8       // must match zsort.c
+
+// A box shape of a generated scene, by its half-size along each
+// axis and its color, and a box of that shape, by its center
+typedef struct {
+    double  halfsize[3];
+    int     color;
+} benchshape_t;
+
+typedef struct {
+    double  center[3];
+    int     shape;          // index into the shapes
+} benchbox_t;
+
+extern char     renderername[];
+extern char     vectypename[];      // "float" or "double"
+extern char     *pDIBBase;          // top-down, pitch DIBWidth
+extern double   roll, pitch, yaw;
+extern double   currentspeed;
+extern int      DIBWidth, DIBHeight;
+extern int      numspans;
+extern int      numpixels;
+extern int      overdrawcheck;
+extern int      depthhist[MAX_DEPTH_COMPLEXITY];
+extern int      maxdepth;
+extern double   meandepth;
+
+int InitFramebuffer(int width, int height);
+void FreeFramebuffer(void);
+int BuildBenchScene(int numcubes);
+int BuildBoxScene(benchshape_t *pshapes, int numshapes,
+                  benchbox_t *pboxes, int numboxes);
+int LoadWorldFile(char *filename);
+int SaveWorldFile(char *filename);
+void UpdateWorld(void);
+int WriteOverdrawHeatmap(char *filename);
+int SetRenderThreads(int threads);
+int SetPipelining(int on);
+int SetTextureMapping(int on);
+int SetZBuffering(int on);
+int SetVisibility(int mode);
+int GetSurfaceCacheStats(int *hits, int *misses, int *evictions,
+                         int *bytesbuilt);
+int GetBSPStats(int *nodes, int *leaves, int *faces, double *compilems,
+                int *visited, int *culled);
+int GetPVSStats(int *compressed, int *uncompressed, double *buildms,
+                double *decompressms, int *culled);
+int GetPortalStats(int *cells, int *portals, double *buildms,
+                   int *visited, int *passed, int *faces);
+int GetBVHStats(int *nodes, int *leaves, double *buildms, int *visited,
+                int *culled, int *refit);
+double GetFrameLatency(void);
+char *GetArenaStats(int arena, int *peak, int *capacity, int *growframes,
+                    int *grew, int *overflowframes, int *overflowed);
+
+#ifdef STAGE_TIMING
+// Only zsort.c, built with STAGE_TIMING defined, provides these
+extern char     *stagenames[NUM_STAGES];
+
+int GetStageTimes(double *times);
+int WriteStageTimes(char *csvname, char *tracename);
+#endif
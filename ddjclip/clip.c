@@ -9,19 +9,34 @@
    if polygons shared common edges and edges shared common vertices.
    Also, indirection to vertices could be used to avoid having to
    copy all the vertices during every clip test. Outcode-type
-   testing could be used to determine completely clipped or
-   unclipped polygons ahead of time, avoiding the need to clip and
-   copy entirely for such polygons. Outcode-type tests work best in
+   testing is used to determine completely clipped or unclipped
+   polygons ahead of time, avoiding the need to clip and copy
+   entirely for such polygons, and to clip the rest only to the
+   planes they actually cross. Outcode-type tests work best in
    viewspace, with the frustum normalized so that the field of view
    is 90 degrees, so simple compares, rather than dot products, can
-   be used to categorize points with respect to the frustum. See
+   be used to categorize points with respect to the frustum; here
+   they're done in worldspace with dot products instead, since
+   that's where we clip. See
    _Computer Graphics_, by Foley & van Dam, or _Procedural Elements
    of Computer Graphics_, by Rogers, for further information.
+
+   Note: building with HEADLESS defined drops all the Win32 code and
+   renders into a plain malloc'ed framebuffer instead of a DIB
+   section, so the engine can be driven by the benchmark in
+   ../bench on any platform.
+
+   Note: all the geometry math is done in vec_t, which is double
+   unless the program's built with VEC_T_FLOAT defined, in which
+   case it's float.
 */
 
+#ifndef HEADLESS
 #include <windows.h>   	// required for all Windows applications
+#endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include "clip.h"  		// specific to this program
 
@@ -39,13 +54,34 @@
 #define MAX_COORD           0x4000
 #define NUM_FRUSTUM_PLANES  4
 #define CLIP_PLANE_EPSILON  0.0001
+#define SORT_RADIX_BITS     8       // bits of sort key per pass
+#define SORT_BUCKETS        (1 << SORT_RADIX_BITS)
+#define SORT_PASSES         4       // for 32-bit keys
+#define BENCH_CUBE_SPACING  40.0    // grid spacing of benchmark cubes
+#define BENCH_FLOOR_TILE    256.0   // size of generated scenes' floor
+                                    //  tiles
+#define MAX_DEPTH_COMPLEXITY 16      // depth complexity histogram
+                                    //  buckets; the last counts that
+                                    //  depth or more
+#define NUM_HEAT_COLORS     8
+
+#ifndef max
+#define max(a,b)            (((a) > (b)) ? (a) : (b))
+#endif
+
+// Scalar type for all the geometry math
+#ifdef VEC_T_FLOAT
+typedef float vec_t;
+#else
+typedef double vec_t;
+#endif
 
 typedef struct {
-    double v[3];
+    vec_t   v[3];
 } point_t;
 
 typedef struct {
-    double   x, y;
+    vec_t   x, y;
 } point2D_t;
 
 typedef struct {
@@ -61,11 +97,11 @@ typedef struct {
 } polygon2D_t;
 
 typedef struct convexobject_s {
-    struct convexobject_s   *pnext;
     point_t                 center;
-    double                  vdist;
     int                     numpolys;
     polygon_t               *ppoly;
+    vec_t                   radius;     // of bounding sphere around
+                                        //  center
 } convexobject_t;
 
 typedef struct {
@@ -73,32 +109,41 @@ typedef struct {
 } span_t;
 
 typedef struct {
-    double  distance;
+    vec_t   distance;
     point_t normal;
 } plane_t;
 
+#ifndef HEADLESS
 BITMAPINFO *pbmiDIB;		// pointer to the BITMAPINFO
-char *pDIB, *pDIBBase;		// pointers to DIB section we'll draw into
 HBITMAP hDIBSection;        // handle of DIB section
 HINSTANCE hInst;            // current instance
 char szAppName[] = "Clip";  // The name of this application
 char szTitle[]   = "3D clipping demo"; // The title bar text
 HPALETTE hpalold, hpalDIB;
 HWND hwndOutput;
+#else
+char renderername[] = "clip";
+#endif
+#ifdef VEC_T_FLOAT
+char vectypename[] = "float";
+#else
+char vectypename[] = "double";
+#endif
+char *pDIB, *pDIBBase;		// pointers to DIB section we'll draw into
 int DIBWidth, DIBHeight;
 int DIBPitch;
 double  roll, pitch, yaw;
 double  currentspeed;
 point_t currentpos;
-double  fieldofview, xcenter, ycenter;
-double  xscreenscale, yscreenscale, maxscale;
+vec_t   fieldofview, xcenter, ycenter;
+vec_t   xscreenscale, yscreenscale, maxscale;
 int     numobjects;
 double  speedscale = 1.0;
 plane_t frustumplanes[NUM_FRUSTUM_PLANES];
 
-double  mroll[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
-double  mpitch[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
-double  myaw[3][3] =  {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+vec_t   mroll[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+vec_t   mpitch[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+vec_t   myaw[3][3] =  {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
 point_t vpn, vright, vup;
 point_t xaxis = {1, 0, 0};
 point_t zaxis = {0, 0, 1};
@@ -118,26 +163,62 @@ polygon_t polys1[] = {
 };
 
 convexobject_t objects[] = {
-{NULL, {-50,0,70}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {0,20,70}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {50,0,70}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {-50,0,-70}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {0,20,-70}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {50,30,-70}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {-50,15,0}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {50,15,0}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {0,50,0}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {-100,100,115}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {-100,150,120}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {100,200,100}, 0, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{NULL, {0,-10000,0}, 0, sizeof(polys1) / sizeof(polys1[0]), polys1},
+{{-50,0,70}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{0,20,70}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{50,0,70}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{-50,0,-70}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{0,20,-70}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{50,30,-70}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{-50,15,0}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{50,15,0}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{0,50,0}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{-100,100,115}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{-100,150,120}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{100,200,100}, sizeof(polys0) / sizeof(polys0[0]), polys0, 0},
+{{0,-10000,0}, sizeof(polys1) / sizeof(polys1[0]), polys1, 0},
 };
 
-// Head and sentinel for object list
-convexobject_t objecthead = {NULL, {0,0,0}, -999999.0};
+// Objects to sort and draw; the built-in world unless replaced by
+// BuildBenchScene
+convexobject_t *objectlist = objects;
+
+// Indices into objectlist in drawing order, farthest first, as
+// ZSortObjects left them for sortcount objects of sortlist, a
+// scratch array of the same size to sort through, and each object's
+// sort key
+int             *sortorder, *sortscratch;
+unsigned int    *sortkeys;
+int             sortcount;
+convexobject_t  *sortlist;
+
+// Number of spans filled and pixels written in the current frame,
+// including the clear
+int numspans;
+int numpixels;
+
+// Overdraw instrumentation. When overdrawcheck is set, every pixel
+// written bumps that pixel's count in pwritecounts (screen order,
+// top to bottom), and the stats below are gathered for each frame
+int             overdrawcheck;
+unsigned char   *pwritecounts;
+int             writecountsize;
+int             depthhist[MAX_DEPTH_COMPLEXITY];
+int             maxdepth;
+double          meandepth;
+
+// Heatmap colors by depth complexity: black for never written, then
+// blue, green, yellow, orange, red, magenta, and white for 7 or more
+unsigned char   heatcolors[NUM_HEAT_COLORS][3] = {
+    {0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0},
+    {255, 128, 0}, {255, 0, 0}, {255, 0, 255}, {255, 255, 255},
+};
 
 void UpdateWorld(void);
+void InitViewState(void);
+void SetUpObjectBounds(convexobject_t *pobject);
+int WriteOverdrawHeatmap(char *filename);
 
+#ifndef HEADLESS
 /////////////////////////////////////////////////////////////////////
 // WinMain
 /////////////////////////////////////////////////////////////////////
@@ -452,22 +533,11 @@ BOOL InitInstance(
 
 		hwndOutput = hwnd;
 
-        // Set the initial location, direction, and speed
-        roll = 0.0;
-        pitch = 0.0;
-        yaw = 0.0;
-        currentspeed = 0.0;
-        currentpos.v[0] = 0.0;
-        currentpos.v[1] = 0.0;
-        currentpos.v[2] = 0.0;
-        fieldofview = 2.0;
-        xscreenscale = DIBWidth / fieldofview;
-        yscreenscale = DIBHeight / fieldofview;
-        maxscale = max(xscreenscale, yscreenscale);
-        xcenter = DIBWidth / 2.0 - 0.5;
-        ycenter = DIBHeight / 2.0 + 0.5;
+        InitViewState();
 
         numobjects = sizeof(objects) / sizeof(objects[0]);
+        for (i=0 ; i<numobjects ; i++)
+            SetUpObjectBounds(&objects[i]);
 
         return (TRUE);              // We succeeded...
 }
@@ -594,6 +664,16 @@ LRESULT CALLBACK WndProc(
             speedscale *= 0.9;
             break;
 
+        case 'O':
+            overdrawcheck = !overdrawcheck;
+            if (!overdrawcheck)
+                SetWindowText(hwnd, szTitle);
+            break;
+
+        case 'H':
+            WriteOverdrawHeatmap("overdraw.ppm");
+            break;
+
 		default:
 			break;
 		}
@@ -680,10 +760,462 @@ LRESULT CALLBACK WndProc(
     return (0);
 }
 
+#else   // HEADLESS
+
+// Storage for the benchmark scene
+convexobject_t  *benchobjects;
+polygon_t       benchfloor[1];
+polygon_t       *benchpolys;        // box shapes of a generated scene
+
+/////////////////////////////////////////////////////////////////////
+// Allocate a plain top-down framebuffer of the specified size to
+// draw into in place of the DIB section. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int InitFramebuffer(int width, int height)
+{
+    FreeFramebuffer();
+
+    if ((width < 10) || (height < 10) || (height > MAX_SCREEN_HEIGHT))
+        return 0;
+
+    DIBWidth = (width + 3) & ~3;
+    DIBHeight = height;
+
+    pDIBBase = malloc(DIBWidth * DIBHeight);
+    if (pDIBBase == NULL)
+        return 0;
+
+    pDIB = pDIBBase;
+    DIBPitch = DIBWidth;    // top-down
+
+    // Clear the framebuffer
+    memset(pDIBBase, 0, DIBWidth*DIBHeight);
+
+    InitViewState();
+    BuildBenchScene(0);
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Release the framebuffer allocated by InitFramebuffer.
+/////////////////////////////////////////////////////////////////////
+void FreeFramebuffer(void)
+{
+    free(pDIBBase);
+    pDIBBase = pDIB = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Replace the world with numcubes cubes laid out on a square grid,
+// floating at three different heights over a floor sized to cover
+// the grid, or restore the built-in world if numcubes is 0. The
+// layout matches BuildBenchScene in zsort.c exactly, so both
+// renderers draw the same geometry. Returns the number of polygons
+// in the world, or 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildBenchScene(int numcubes)
+{
+    int             i, side, numpolys;
+    double          halfsize, floorsize;
+    convexobject_t  *pobject;
+
+    free(benchobjects);
+    benchobjects = NULL;
+    free(benchpolys);
+    benchpolys = NULL;
+
+    if (numcubes <= 0)
+    {
+        objectlist = objects;
+        numobjects = sizeof(objects) / sizeof(objects[0]);
+
+        numpolys = 0;
+        for (i=0 ; i<numobjects ; i++)
+        {
+            SetUpObjectBounds(&objects[i]);
+            numpolys += objects[i].numpolys;
+        }
+
+        return numpolys;
+    }
+
+    benchobjects = malloc((numcubes + 1) * sizeof(convexobject_t));
+    if (benchobjects == NULL)
+        return 0;
+
+    side = (int)ceil(sqrt((double)numcubes));
+    halfsize = side * BENCH_CUBE_SPACING / 2.0;
+
+    for (i=0 ; i<numcubes ; i++)
+    {
+        pobject = &benchobjects[i];
+        pobject->center.v[0] = (i % side) * BENCH_CUBE_SPACING -
+                halfsize + BENCH_CUBE_SPACING / 2.0;
+        pobject->center.v[1] = 30.0 + (i % 3) * 15.0;
+        pobject->center.v[2] = (i / side) * BENCH_CUBE_SPACING -
+                halfsize + BENCH_CUBE_SPACING / 2.0;
+        pobject->numpolys = sizeof(polys0) / sizeof(polys0[0]);
+        pobject->ppoly = polys0;
+    }
+
+    // The floor is at y = -20, like the built-in world's. As with the
+    // built-in floor, its center is placed far below it, so it's
+    // always farthest away and gets drawn first
+    floorsize = halfsize + BENCH_CUBE_SPACING;
+    benchfloor[0].color = 1;
+    benchfloor[0].numverts = 4;
+    for (i=0 ; i<4 ; i++)
+        benchfloor[0].verts[i].v[1] = 9980.0;
+    benchfloor[0].verts[0].v[0] = -floorsize;
+    benchfloor[0].verts[0].v[2] = -floorsize;
+    benchfloor[0].verts[1].v[0] = -floorsize;
+    benchfloor[0].verts[1].v[2] = floorsize;
+    benchfloor[0].verts[2].v[0] = floorsize;
+    benchfloor[0].verts[2].v[2] = floorsize;
+    benchfloor[0].verts[3].v[0] = floorsize;
+    benchfloor[0].verts[3].v[2] = -floorsize;
+
+    pobject = &benchobjects[numcubes];
+    pobject->center.v[0] = 0.0;
+    pobject->center.v[1] = -10000.0;
+    pobject->center.v[2] = 0.0;
+    pobject->numpolys = 1;
+    pobject->ppoly = benchfloor;
+
+    objectlist = benchobjects;
+    numobjects = numcubes + 1;
+
+    for (i=0 ; i<numobjects ; i++)
+        SetUpObjectBounds(&benchobjects[i]);
+
+    return numcubes * (sizeof(polys0) / sizeof(polys0[0])) + 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Replace the world with a generated scene of numboxes boxes, each
+// of one of numshapes box shapes, standing on a floor of square
+// tiles that covers them all. Boxes of the same shape share their
+// polygons, as do the floor tiles. The scene matches BuildBoxScene
+// in zsort.c exactly. Returns the number of polygons in the world,
+// or 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildBoxScene(benchshape_t *pshapes, int numshapes,
+                  benchbox_t *pboxes, int numboxes)
+{
+    int             i, j, k, tilesx, tilesz, numtiles;
+    double          mins[2], maxs[2], extent;
+    convexobject_t  *pobject;
+    polygon_t       *ppoly;
+
+    free(benchobjects);
+    benchobjects = NULL;
+    free(benchpolys);
+    benchpolys = NULL;
+
+    if ((numshapes <= 0) || (numboxes <= 0))
+        return 0;
+
+    // Every shape is the unit cube stretched out to its size, so its
+    // faces wind the same way as polys0's
+    benchpolys = malloc(numshapes * 6 * sizeof(polygon_t));
+    if (benchpolys == NULL)
+        return 0;
+
+    for (i=0 ; i<numshapes ; i++)
+    {
+        for (j=0 ; j<6 ; j++)
+        {
+            ppoly = &benchpolys[i*6+j];
+            *ppoly = polys0[j];
+            ppoly->color = pshapes[i].color;
+            for (k=0 ; k<4 ; k++)
+            {
+                ppoly->verts[k].v[0] *= pshapes[i].halfsize[0] / 10.0;
+                ppoly->verts[k].v[1] *= pshapes[i].halfsize[1] / 10.0;
+                ppoly->verts[k].v[2] *= pshapes[i].halfsize[2] / 10.0;
+            }
+        }
+    }
+
+    // Find how much floor the boxes need
+    mins[0] = mins[1] = 999999.0;
+    maxs[0] = maxs[1] = -999999.0;
+    for (i=0 ; i<numboxes ; i++)
+    {
+        for (j=0 ; j<2 ; j++)
+        {
+            extent = pshapes[pboxes[i].shape].halfsize[j*2];
+            if (pboxes[i].center[j*2] - extent < mins[j])
+                mins[j] = pboxes[i].center[j*2] - extent;
+            if (pboxes[i].center[j*2] + extent > maxs[j])
+                maxs[j] = pboxes[i].center[j*2] + extent;
+        }
+    }
+    mins[0] -= BENCH_CUBE_SPACING;
+    mins[1] -= BENCH_CUBE_SPACING;
+    tilesx = (int)ceil((maxs[0] + BENCH_CUBE_SPACING - mins[0]) /
+                       BENCH_FLOOR_TILE);
+    tilesz = (int)ceil((maxs[1] + BENCH_CUBE_SPACING - mins[1]) /
+                       BENCH_FLOOR_TILE);
+    numtiles = tilesx * tilesz;
+
+    benchobjects = malloc((numboxes + numtiles) * sizeof(convexobject_t));
+    if (benchobjects == NULL)
+        return 0;
+
+    for (i=0 ; i<numboxes ; i++)
+    {
+        pobject = &benchobjects[i];
+        for (k=0 ; k<3 ; k++)
+            pobject->center.v[k] = pboxes[i].center[k];
+        pobject->numpolys = 6;
+        pobject->ppoly = &benchpolys[pboxes[i].shape*6];
+    }
+
+    // The floor is at y = -20, in tiles to match zsort.c's, and the
+    // tiles have their centers placed far below them, like the
+    // built-in floor's, so they're drawn before any box
+    benchfloor[0].color = 1;
+    benchfloor[0].numverts = 4;
+    for (i=0 ; i<4 ; i++)
+        benchfloor[0].verts[i].v[1] = 9980.0;
+    benchfloor[0].verts[0].v[0] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[0].v[2] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[1].v[0] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[1].v[2] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[2].v[0] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[2].v[2] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[3].v[0] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[3].v[2] = -BENCH_FLOOR_TILE / 2.0;
+
+    for (i=0 ; i<numtiles ; i++)
+    {
+        pobject = &benchobjects[numboxes + i];
+        pobject->center.v[0] = mins[0] +
+                ((i % tilesx) + 0.5) * BENCH_FLOOR_TILE;
+        pobject->center.v[1] = -10000.0;
+        pobject->center.v[2] = mins[1] +
+                ((i / tilesx) + 0.5) * BENCH_FLOOR_TILE;
+        pobject->numpolys = 1;
+        pobject->ppoly = benchfloor;
+    }
+
+    objectlist = benchobjects;
+    numobjects = numboxes + numtiles;
+
+    for (i=0 ; i<numobjects ; i++)
+        SetUpObjectBounds(&benchobjects[i]);
+
+    return numboxes * 6 + numtiles;
+}
+
+/////////////////////////////////////////////////////////////////////
+// The z-sorted spans demo can load and save world files; this one
+// sorts whole objects by their centers, and its floors have their
+// centers placed far below them so they're drawn first, which a
+// world file has no way to say. Returns 0 to say it can't.
+/////////////////////////////////////////////////////////////////////
+int LoadWorldFile(char *filename)
+{
+    return 0;
+}
+
+int SaveWorldFile(char *filename)
+{
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// The z-sorted spans demo's GetArenaStats reports on its per-frame
+// pools; there are none here, since each polygon is drawn as soon
+// as it's clipped.
+/////////////////////////////////////////////////////////////////////
+char *GetArenaStats(int arena, int *peak, int *capacity, int *growframes,
+                    int *grew, int *overflowframes, int *overflowed)
+{
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// The z-sorted spans demo can scan on several threads; this one
+// always draws on just the one. Returns the number of threads in
+// use.
+/////////////////////////////////////////////////////////////////////
+int SetRenderThreads(int threads)
+{
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// There's no separate front and back end to overlap here, so
+// pipelining is never on.
+/////////////////////////////////////////////////////////////////////
+int SetPipelining(int on)
+{
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Polygons here are only ever filled with their colors, so texture
+// mapping is never on.
+/////////////////////////////////////////////////////////////////////
+int SetTextureMapping(int on)
+{
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// The painter's algorithm needs no depth buffer, and there are no
+// entities here to test against one, so z-buffering is never on.
+/////////////////////////////////////////////////////////////////////
+int SetZBuffering(int on)
+{
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Objects are always depth sorted and drawn back to front here;
+// there's no BSP tree to walk instead. Returns the mode in use,
+// which is 0, walking every object.
+/////////////////////////////////////////////////////////////////////
+int SetVisibility(int mode)
+{
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// With no BSP tree, there are no BSP stats. Returns 0 to say so.
+/////////////////////////////////////////////////////////////////////
+int GetBSPStats(int *nodes, int *leaves, int *faces, double *compilems,
+                int *visited, int *culled)
+{
+    *nodes = *leaves = *faces = *visited = *culled = 0;
+    *compilems = 0.0;
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Nor is there a PVS. Returns 0 to say so.
+/////////////////////////////////////////////////////////////////////
+int GetPVSStats(int *compressed, int *uncompressed, double *buildms,
+                double *decompressms, int *culled)
+{
+    *compressed = *uncompressed = *culled = 0;
+    *buildms = *decompressms = 0.0;
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Or portals. Returns 0 to say so.
+/////////////////////////////////////////////////////////////////////
+int GetPortalStats(int *cells, int *portals, double *buildms,
+                   int *visited, int *passed, int *faces)
+{
+    *cells = *portals = *visited = *passed = *faces = 0;
+    *buildms = 0.0;
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Or a BVH. Returns 0 to say so.
+/////////////////////////////////////////////////////////////////////
+int GetBVHStats(int *nodes, int *leaves, double *buildms, int *visited,
+                int *culled, int *refit)
+{
+    *nodes = *leaves = *visited = *culled = *refit = 0;
+    *buildms = 0.0;
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// With nothing textured, there's no surface cache either. Returns 0
+// to say so.
+/////////////////////////////////////////////////////////////////////
+int GetSurfaceCacheStats(int *hits, int *misses, int *evictions,
+                         int *bytesbuilt)
+{
+    *hits = *misses = *evictions = *bytesbuilt = 0;
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Frames are presented by the call that draws them, so the latency
+// is just the frame time; returns -1 to say so.
+/////////////////////////////////////////////////////////////////////
+double GetFrameLatency(void)
+{
+    return -1.0;
+}
+
+#endif  // HEADLESS
+
+/////////////////////////////////////////////////////////////////////
+// Set the initial location, direction, and speed, and the
+// projection for the current DIB size.
+/////////////////////////////////////////////////////////////////////
+void InitViewState(void)
+{
+    int     i;
+
+    roll = 0.0;
+    pitch = 0.0;
+    yaw = 0.0;
+    currentspeed = 0.0;
+    currentpos.v[0] = 0.0;
+    currentpos.v[1] = 0.0;
+    currentpos.v[2] = 0.0;
+    // No view direction until the first UpdateViewPos, so the first
+    // frame doesn't move the viewpoint, just as at start-up
+    for (i=0 ; i<3 ; i++)
+        vpn.v[i] = vright.v[i] = vup.v[i] = 0.0;
+    fieldofview = 2.0;
+    xscreenscale = DIBWidth / fieldofview;
+    yscreenscale = DIBHeight / fieldofview;
+    maxscale = max(xscreenscale, yscreenscale);
+    xcenter = DIBWidth / 2.0 - 0.5;
+    ycenter = DIBHeight / 2.0 + 0.5;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set the radius of the object's bounding sphere, which is centered
+// on the object's center, from its polygons.
+/////////////////////////////////////////////////////////////////////
+void SetUpObjectBounds(convexobject_t *pobject)
+{
+    int         i, j;
+    vec_t       distsq, maxdistsq;
+    polygon_t   *ppoly;
+
+    maxdistsq = 0.0;
+
+    for (i=0 ; i<pobject->numpolys ; i++)
+    {
+        ppoly = &pobject->ppoly[i];
+
+        for (j=0 ; j<ppoly->numverts ; j++)
+        {
+            // Polygon vertices are relative to the object center
+            distsq = ppoly->verts[j].v[0] * ppoly->verts[j].v[0] +
+                     ppoly->verts[j].v[1] * ppoly->verts[j].v[1] +
+                     ppoly->verts[j].v[2] * ppoly->verts[j].v[2];
+            if (distsq > maxdistsq)
+                maxdistsq = distsq;
+        }
+    }
+
+    pobject->radius = sqrt(maxdistsq);
+}
+
 /////////////////////////////////////////////////////////////////////
 // 3-D dot product.
 /////////////////////////////////////////////////////////////////////
-double DotProduct(point_t *vec1, point_t *vec2)
+vec_t DotProduct(point_t *vec1, point_t *vec2)
 {
     return vec1->v[0] * vec2->v[0] +
            vec1->v[1] * vec2->v[1] +
@@ -703,7 +1235,7 @@ void CrossProduct(point_t *in1, point_t *in2, point_t *out)
 /////////////////////////////////////////////////////////////////////
 // Concatenate two 3x3 matrices.
 /////////////////////////////////////////////////////////////////////
-void MConcat(double in1[3][3], double in2[3][3], double out[3][3])
+void MConcat(vec_t in1[3][3], vec_t in2[3][3], vec_t out[3][3])
 {
     int     i, j;
 
@@ -718,6 +1250,108 @@ void MConcat(double in1[3][3], double in2[3][3], double out[3][3])
     }
 }
 
+/////////////////////////////////////////////////////////////////////
+// Clear the per-pixel write counts for a new frame, reallocating
+// them if the DIB has changed size. Turns overdraw checking off if
+// there's not enough memory for the counts.
+/////////////////////////////////////////////////////////////////////
+void ClearWriteCounts(void)
+{
+    if (writecountsize != DIBWidth*DIBHeight)
+    {
+        free(pwritecounts);
+        writecountsize = DIBWidth*DIBHeight;
+        pwritecounts = malloc(writecountsize);
+        if (pwritecounts == NULL)
+        {
+            writecountsize = 0;
+            overdrawcheck = 0;
+            return;
+        }
+    }
+
+    memset(pwritecounts, 0, writecountsize);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Count one more write to each pixel of a span. Counts stick at 255.
+/////////////////////////////////////////////////////////////////////
+void CountSpanWrites(int x, int y, int count)
+{
+    unsigned char   *pcount;
+
+    pcount = pwritecounts + (DIBWidth * y) + x;
+
+    while (count-- > 0)
+    {
+        if (*pcount < 255)
+            (*pcount)++;
+        pcount++;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the depth complexity histogram, and the max and mean number
+// of writes per pixel, from the write counts for the frame just
+// drawn.
+/////////////////////////////////////////////////////////////////////
+void GatherOverdrawStats(void)
+{
+    int     i, depth, total;
+
+    for (i=0 ; i<MAX_DEPTH_COMPLEXITY ; i++)
+        depthhist[i] = 0;
+
+    maxdepth = 0;
+    total = 0;
+
+    for (i=0 ; i<writecountsize ; i++)
+    {
+        depth = pwritecounts[i];
+        total += depth;
+        if (depth > maxdepth)
+            maxdepth = depth;
+        if (depth >= MAX_DEPTH_COMPLEXITY)
+            depth = MAX_DEPTH_COMPLEXITY - 1;
+        depthhist[depth]++;
+    }
+
+    meandepth = (double)total / (double)writecountsize;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Write the write counts for the last frame out as a false-color
+// heatmap, in binary PPM format. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int WriteOverdrawHeatmap(char *filename)
+{
+    int             i, depth;
+    unsigned char   *pcolor;
+    FILE            *f;
+
+    if (pwritecounts == NULL)
+        return 0;
+
+    f = fopen(filename, "wb");
+    if (f == NULL)
+        return 0;
+
+    fprintf(f, "P6\n%d %d\n255\n", DIBWidth, DIBHeight);
+
+    for (i=0 ; i<writecountsize ; i++)
+    {
+        depth = pwritecounts[i];
+        if (depth >= NUM_HEAT_COLORS)
+            depth = NUM_HEAT_COLORS - 1;
+        pcolor = heatcolors[depth];
+        fwrite(pcolor, 1, 3, f);
+    }
+
+    fclose(f);
+
+    return 1;
+}
+
 /////////////////////////////////////////////////////////////////////
 // Fills a screen polygon.
 // Polygon is assumed to contain only valid, on-screen coordinates.
@@ -727,7 +1361,7 @@ void FillPolygon2D(polygon2D_t *ppoly)
 {
     int     i, j, topvert, bottomvert, leftvert, rightvert, nextvert;
     int     itopy, ibottomy, islope, spantopy, spanbottomy, x, count;
-    double  topy, bottomy, slope, height, width, prestep;
+    vec_t   topy, bottomy, slope, height, width, prestep;
     span_t  spans[MAX_SCREEN_HEIGHT], *pspan;
 
     topy = 999999.0;
@@ -831,6 +1465,11 @@ void FillPolygon2D(polygon2D_t *ppoly)
             memset (pDIB + (DIBPitch * i) + pspan->xleft,
                     ppoly->color,
                     count);
+            numspans++;
+            numpixels += count;
+
+            if (overdrawcheck)
+                CountSpanWrites(pspan->xleft, i, count);
         }
         pspan++;
     }
@@ -844,7 +1483,7 @@ void FillPolygon2D(polygon2D_t *ppoly)
 void ProjectPolygon (polygon_t *ppoly, polygon2D_t *ppoly2D)
 {
     int     i;
-    double  zrecip;
+    vec_t   zrecip;
 
     for (i=0 ; i<ppoly->numverts ; i++)
     {
@@ -860,41 +1499,120 @@ void ProjectPolygon (polygon_t *ppoly, polygon2D_t *ppoly2D)
 }
 
 /////////////////////////////////////////////////////////////////////
-// Sort the objects according to z distance from viewpoint.
+// Sort the objects according to distance from viewpoint, farthest
+// first, into sortorder. Each object's key is its squared distance,
+// as a float, whose bits compare as an unsigned int the same way
+// the distances do, complemented so the farthest is smallest; an
+// LSD radix sort then orders the indices one byte of key at a time,
+// in time linear in the number of objects. The sort is stable, and
+// starts from last frame's order, so objects at the same distance
+// stay in the order they were drawn in; and if that order is still
+// sorted, as it usually is when the viewer moves a little, it's kept
+// as is. If there's no memory for the order, it's left empty, and
+// nothing gets drawn.
 /////////////////////////////////////////////////////////////////////
 void ZSortObjects(void)
 {
-    int             i, j;
-    double          vdist;
-    convexobject_t  *pobject;
-    point_t         dist;
+    int             i, j, pass, shift, digit, total, count;
+    int             *psrc, *pdst;
+    int             counts[SORT_PASSES][SORT_BUCKETS];
+    vec_t           distsq, d;
+    union {
+        float           f;
+        unsigned int    i;
+    } key;
+
+    // Start over with a new list of objects, in reverse, so objects
+    // at the same distance are drawn later objects first, as they
+    // were when they were insertion-sorted
+    if ((objectlist != sortlist) || (numobjects != sortcount))
+    {
+        free(sortorder);
+        free(sortscratch);
+        free(sortkeys);
+        sortorder = malloc(numobjects * sizeof(int));
+        sortscratch = malloc(numobjects * sizeof(int));
+        sortkeys = malloc(numobjects * sizeof(unsigned int));
+        sortlist = objectlist;
+        sortcount = 0;
+        if ((sortorder == NULL) || (sortscratch == NULL) ||
+            (sortkeys == NULL))
+        {
+            return;
+        }
 
-    objecthead.pnext = &objecthead;
+        sortcount = numobjects;
+        for (i=0 ; i<sortcount ; i++)
+            sortorder[i] = sortcount - 1 - i;
+    }
 
-    for (i=0 ; i<numobjects ; i++)
+    for (i=0 ; i<sortcount ; i++)
     {
+        distsq = 0.0;
         for (j=0 ; j<3 ; j++)
         {
-            dist.v[j] = objects[i].center.v[j] - currentpos.v[j];
+            d = objectlist[i].center.v[j] - currentpos.v[j];
+            distsq += d * d;
         }
 
-        objects[i].vdist = sqrt(dist.v[0] * dist.v[0] +
-                                dist.v[1] * dist.v[1] +
-                                dist.v[2] * dist.v[2]);
+        key.f = (float)distsq;
+        sortkeys[i] = ~key.i;
+    }
 
-        pobject = &objecthead;
-        vdist = objects[i].vdist;
+    // Keep last frame's order if it's still in order
+    for (i=1 ; i<sortcount ; i++)
+    {
+        if (sortkeys[sortorder[i]] < sortkeys[sortorder[i-1]])
+            break;
+    }
+    if (i >= sortcount)
+        return;
+
+    // Count every byte of every key at once, then sort on each byte
+    // in turn, lowest first, skipping bytes that are the same in
+    // every key
+    memset(counts, 0, sizeof(counts));
+    for (i=0 ; i<sortcount ; i++)
+    {
+        for (pass=0 ; pass<SORT_PASSES ; pass++)
+        {
+            digit = (sortkeys[i] >> (pass * SORT_RADIX_BITS)) &
+                    (SORT_BUCKETS - 1);
+            counts[pass][digit]++;
+        }
+    }
+
+    psrc = sortorder;
+    pdst = sortscratch;
+
+    for (pass=0 ; pass<SORT_PASSES ; pass++)
+    {
+        shift = pass * SORT_RADIX_BITS;
+        digit = (sortkeys[psrc[0]] >> shift) & (SORT_BUCKETS - 1);
+        if (counts[pass][digit] == sortcount)
+            continue;
+
+        // Turn the counts into where each bucket starts
+        total = 0;
+        for (digit=0 ; digit<SORT_BUCKETS ; digit++)
+        {
+            count = counts[pass][digit];
+            counts[pass][digit] = total;
+            total += count;
+        }
 
-        // Viewspace-distance-sort this object into the others.
-        // Guaranteed to terminate because of sentinel
-        while (vdist < pobject->pnext->vdist)
+        for (i=0 ; i<sortcount ; i++)
         {
-            pobject = pobject->pnext;
+            digit = (sortkeys[psrc[i]] >> shift) & (SORT_BUCKETS - 1);
+            pdst[counts[pass][digit]++] = psrc[i];
         }
 
-        objects[i].pnext = pobject->pnext;
-        pobject->pnext = &objects[i];
+        pdst = psrc;
+        psrc = (psrc == sortorder) ? sortscratch : sortorder;
     }
+
+    sortorder = psrc;
+    sortscratch = pdst;
 }
 
 
@@ -905,7 +1623,7 @@ void UpdateViewPos()
 {
     int     i;
     point_t motionvec;
-    double  s, c, mtemp1[3][3], mtemp2[3][3];
+    vec_t   s, c, mtemp1[3][3], mtemp2[3][3];
 
     // Move in the view direction, across the x-y plane, as if
     // walking. This approach moves slower when looking up or
@@ -1065,7 +1783,7 @@ void SetWorldspaceClipPlane(point_t *normal, plane_t *plane)
 /////////////////////////////////////////////////////////////////////
 void SetUpFrustum(void)
 {
-    double  angle, s, c;
+    vec_t   angle, s, c;
     point_t normal;
 
     angle = atan(2.0 / fieldofview * maxscale / xscreenscale);
@@ -1103,7 +1821,7 @@ void SetUpFrustum(void)
 int ClipToPlane(polygon_t *pin, plane_t *pplane, polygon_t *pout)
 {
     int     i, j, nextvert, curin, nextin;
-    double  curdot, nextdot, scale;
+    vec_t   curdot, nextdot, scale;
     point_t *pinvert, *poutvert;
 
     pinvert = pin->verts;
@@ -1152,31 +1870,117 @@ int ClipToPlane(polygon_t *pin, plane_t *pplane, polygon_t *pout)
 }
 
 /////////////////////////////////////////////////////////////////////
-// Clip a polygon to the frustum.
+// Test an object's bounding sphere against the frustum. Returns -1
+// if the object is entirely outside the frustum; otherwise, returns
+// the clip flags for the object's polygons: a bit set for each
+// frustum plane the sphere crosses. Planes the sphere is entirely
+// inside of can't clip any of the object's polygons.
 /////////////////////////////////////////////////////////////////////
-int ClipToFrustum(polygon_t *pin, polygon_t *pout)
+int ObjectClipFlags(convexobject_t *pobject)
 {
-    int         i, curpoly;
-    polygon_t   tpoly[2], *ppoly;
+    int     i, clipflags;
+    vec_t   dist;
 
-    curpoly = 0;
-    ppoly = pin;
+    clipflags = 0;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
+    {
+        dist = DotProduct(&pobject->center, &frustumplanes[i].normal) -
+                frustumplanes[i].distance;
+
+        if (dist < -pobject->radius)
+            return -1;      // entirely outside this plane
+
+        if (dist < pobject->radius)
+            clipflags |= 1 << i;
+    }
 
-    for (i=0 ; i<(NUM_FRUSTUM_PLANES-1); i++)
+    return clipflags;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the outcode of a point: a bit set for each of the frustum
+// planes in clipflags that the point is outside of.
+/////////////////////////////////////////////////////////////////////
+int PointOutcode(point_t *ppoint, int clipflags)
+{
+    int     i, outcode;
+
+    outcode = 0;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
     {
-        if (!ClipToPlane(ppoly,
-                         &frustumplanes[i],
-                         &tpoly[curpoly]))
+        if (!(clipflags & (1 << i)))
+            continue;
+
+        // Same test ClipToPlane uses, so a point that's in here is
+        // in there, too
+        if (DotProduct(ppoint, &frustumplanes[i].normal) <
+                frustumplanes[i].distance)
         {
-            return 0;
+            outcode |= 1 << i;
         }
-        ppoly = &tpoly[curpoly];
+    }
+
+    return outcode;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clip a polygon to the frustum planes in clipflags; the polygon is
+// known to be inside the rest. Returns a pointer to the clipped
+// polygon, which is pin itself if it's entirely inside the frustum
+// and pout otherwise, or NULL if the polygon is entirely clipped
+// away.
+/////////////////////////////////////////////////////////////////////
+polygon_t *ClipToFrustum(polygon_t *pin, polygon_t *pout, int clipflags)
+{
+    int         i, curpoly, andcodes, orcodes, outcode;
+    polygon_t   tpoly[2], *ppoly, *pclipped;
+
+    // Classify each vertex against all the planes at once. If every
+    // vertex is outside the same plane, the polygon is entirely
+    // outside the frustum; if no vertex is outside any plane, it's
+    // entirely inside
+    if (!clipflags)
+        return pin;     // nothing to clip to
+
+    andcodes = clipflags;
+    orcodes = 0;
+
+    for (i=0 ; i<pin->numverts ; i++)
+    {
+        outcode = PointOutcode(&pin->verts[i], clipflags);
+        andcodes &= outcode;
+        orcodes |= outcode;
+    }
+
+    if (andcodes)
+        return NULL;    // trivially rejected
+
+    if (!orcodes)
+        return pin;     // trivially accepted; no clipping or copying
+
+    // Clip to just the planes the polygon straddles, with the last
+    // one clipping into pout
+    curpoly = 0;
+    ppoly = pin;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
+    {
+        if (!(orcodes & (1 << i)))
+            continue;
+
+        orcodes &= ~(1 << i);
+        pclipped = orcodes ? &tpoly[curpoly] : pout;
+
+        if (!ClipToPlane(ppoly, &frustumplanes[i], pclipped))
+            return NULL;
+
+        ppoly = pclipped;
         curpoly ^= 1;
     }
 
-    return ClipToPlane(ppoly,
-                       &frustumplanes[NUM_FRUSTUM_PLANES-1],
-                       pout);
+    return pout;
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -1184,24 +1988,37 @@ int ClipToFrustum(polygon_t *pin, polygon_t *pout)
 /////////////////////////////////////////////////////////////////////
 void UpdateWorld()
 {
+#ifndef HEADLESS
 	HPALETTE        holdpal;
     HDC             hdcScreen, hdcDIBSection;
     HBITMAP         holdbitmap;
+    char            text[128];
+#endif
     polygon2D_t     screenpoly;
-    polygon_t       *ppoly, tpoly0, tpoly1, tpoly2;
+    polygon_t       *ppoly, tpoly0, tpoly1, tpoly2, *pclipped;
     convexobject_t  *pobject;
-    int             i, j, k;
+    int             i, j, k, n, clipflags;
 
     UpdateViewPos();
     memset(pDIBBase, 0, DIBWidth*DIBHeight);    // clear frame
+    numspans = 0;
+    numpixels = DIBWidth*DIBHeight;
+    if (overdrawcheck)
+        ClearWriteCounts();
     SetUpFrustum();
     ZSortObjects();
 
     // Draw all visible faces in all objects
-    pobject = objecthead.pnext;
-
-    while (pobject != &objecthead)
+    for (n=0 ; n<sortcount ; n++)
     {
+        pobject = &objectlist[sortorder[n]];
+
+        // Skip the object entirely if its bounding sphere is outside
+        // the frustum
+        clipflags = ObjectClipFlags(pobject);
+        if (clipflags == -1)
+            continue;
+
         ppoly = pobject->ppoly;
 
         for (i=0 ; i<pobject->numpolys ; i++)
@@ -1218,9 +2035,10 @@ void UpdateWorld()
 
             if (PolyFacesViewer(&tpoly0))
             {
-                if (ClipToFrustum(&tpoly0, &tpoly1))
+                pclipped = ClipToFrustum(&tpoly0, &tpoly1, clipflags);
+                if (pclipped)
                 {
-                    TransformPolygon (&tpoly1, &tpoly2);
+                    TransformPolygon (pclipped, &tpoly2);
                     ProjectPolygon (&tpoly2, &screenpoly);
                     FillPolygon2D (&screenpoly);
                 }
@@ -1228,8 +2046,17 @@ void UpdateWorld()
 
             ppoly++;
         }
+    }
 
-        pobject = pobject->pnext;
+    if (overdrawcheck)
+        GatherOverdrawStats();
+
+#ifndef HEADLESS
+    if (overdrawcheck)
+    {
+        sprintf(text, "%s - depth complexity mean %.2f, max %d",
+                szTitle, meandepth, maxdepth);
+        SetWindowText(hwndOutput, text);
     }
 
 	// We've drawn the frame; copy it to the screen
@@ -1247,4 +2074,5 @@ void UpdateWorld()
 	ReleaseDC(hwndOutput, hdcScreen);
     SelectObject(hdcDIBSection, holdbitmap);
     DeleteDC(hdcDIBSection);
+#endif
 }
@@ -8,6 +8,47 @@
 
 #define CURRENT_VERSION		1		// version of program
 
+#ifndef HEADLESS
 BOOL InitApplication(HANDLE);
 BOOL InitInstance(HANDLE, int);
 LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
+#else
+// A box shape of a generated scene, by its half-size along each
+// axis and its color, and a box of that shape, by its center;
+// must match bench.h
+typedef struct {
+    double  halfsize[3];
+    int     color;
+} benchshape_t;
+
+typedef struct {
+    double  center[3];
+    int     shape;          // index into the shapes
+} benchbox_t;
+
+int InitFramebuffer(int width, int height);
+void FreeFramebuffer(void);
+int BuildBenchScene(int numcubes);
+int BuildBoxScene(benchshape_t *pshapes, int numshapes,
+                  benchbox_t *pboxes, int numboxes);
+int LoadWorldFile(char *filename);
+int SaveWorldFile(char *filename);
+int SetRenderThreads(int threads);
+int SetPipelining(int on);
+int SetTextureMapping(int on);
+int SetZBuffering(int on);
+int SetVisibility(int mode);
+int GetSurfaceCacheStats(int *hits, int *misses, int *evictions,
+                         int *bytesbuilt);
+int GetBSPStats(int *nodes, int *leaves, int *faces, double *compilems,
+                int *visited, int *culled);
+int GetPVSStats(int *compressed, int *uncompressed, double *buildms,
+                double *decompressms, int *culled);
+int GetPortalStats(int *cells, int *portals, double *buildms,
+                   int *visited, int *passed, int *faces);
+int GetBVHStats(int *nodes, int *leaves, double *buildms, int *visited,
+                int *culled, int *refit);
+double GetFrameLatency(void);
+char *GetArenaStats(int arena, int *peak, int *capacity, int *growframes,
+                    int *grew, int *overflowframes, int *overflowed);
+#endif
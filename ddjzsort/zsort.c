@@ -14,24 +14,53 @@
    More complex, slower sorting is required to make those cases
    work reliably.
    
-   Note: polygon processing could be considerably more efficient
-   if polygons shared common edges and edges shared common vertices.
-   Also, indirection to vertices could be used to avoid having to
-   copy all the vertices during every clip test. Outcode-type
-   testing could be used to determine completely clipped or
-   unclipped polygons ahead of time, avoiding the need to clip and
-   copy entirely for such polygons. Outcode-type tests work best in
-   viewspace, with the frustum normalized so that the field of view
-   is 90 degrees, so simple compares, rather than dot products, can
-   be used to categorize points with respect to the frustum. See
+   Note: polygons are converted at startup into indexed meshes, in
+   which faces share common edges and edges share common vertices,
+   so each vertex is transformed and each edge is set up just once
+   per frame. Outcode-type tests determine completely clipped or
+   unclipped polygons ahead of time, so only the rest are copied
+   and clipped, and only to the planes they cross. They're done in
+   worldspace with dot products, since that's where we clip; see
    _Computer Graphics_, by Foley & van Dam, or _Procedural Elements
    of Computer Graphics_, by Rogers, for further information.
+
+   Note: press X to toggle texture mapping, E z-buffered moving
+   objects, P pipelining the front and back ends, and V to cycle
+   through walking the object list, a BSP tree, the tree with a
+   PVS, the tree's portals, and a bounding volume hierarchy to find
+   the visible faces. The build options, and the headless benchmark
+   that exercises all of these, are described in ../bench/readme.txt.
 */
 
+#if !defined(HEADLESS) || defined(_WIN32)
 #include <windows.h>   	// required for all Windows applications
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#if defined(HEADLESS) && !defined(_WIN32)
+#include <time.h>
+#endif
+#if !defined(NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define SIMD_SSE2
+#define SIMD_AVX
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#if defined(STAGE_TIMING) && defined(_MSC_VER)
+#include <intrin.h>             // for __rdtsc
+#endif
 #include "zsort.h" 		// specific to this program
 
 #define INITIAL_DIB_WIDTH  	320		// initial dimensions of DIB
@@ -52,27 +81,281 @@
 #define MAX_COORD           0x4000
 #define NUM_FRUSTUM_PLANES  4
 #define CLIP_PLANE_EPSILON  0.0001
-#define MAX_SPANS           10000
-#define MAX_SURFS           1000
-#define MAX_EDGES           5000
-
+#define INITIAL_SPANS       10000   // starting sizes of the per-frame
+#define INITIAL_SURFS       1000    //  pools, which grow as needed
+#define INITIAL_EDGES       5000
+#define INITIAL_BAND_SPANS  2000    // starting sizes of each band's
+#define INITIAL_BAND_EDGES  500     //  pools
+#define MAX_THREADS         32      // including the main thread
+#define BANDS_PER_THREAD    2       // more bands than threads evens
+                                    //  out the load
+#define MAX_BANDS           (MAX_THREADS * BANDS_PER_THREAD)
+#define SORT_RADIX_BITS     8       // bits of edge x sorted on per
+#define SORT_BUCKETS        (1 << SORT_RADIX_BITS)  //  pass
+#define SORT_PASSES         4       // for 32-bit x
+#define MAX_MESH_VERTS      8192    // most vertices and edges in one
+#define MAX_MESH_EDGES      16384   //  object, after subdivision
+#define MAX_QUEUED_FACES    256     // faces batched up before their
+                                    //  edges are added
+#define VERT_BATCH          8       // mesh vertex arrays are padded
+                                    //  to a multiple of this, the
+                                    //  widest transform kernel batch
+#define BENCH_CUBE_SPACING  40.0    // grid spacing of benchmark cubes
+#define BENCH_FLOOR_TILE    256.0   // size of generated scenes' floor
+                                    //  tiles
+#define MAX_DEPTH_COMPLEXITY 16      // depth complexity histogram
+                                    //  buckets; the last counts that
+                                    //  depth or more
+#define NUM_HEAT_COLORS     8
+#define TEXTURE_SHIFT       6       // textures are 64x64 texels
+#define TEXTURE_SIZE        (1 << TEXTURE_SHIFT)
+#define TEXELS_PER_UNIT     2.0     // texture scale in worldspace
+#define BRICK_WIDTH         32      // texels, including mortar
+#define BRICK_HEIGHT        16
+#ifndef SPAN_SUBDIV_SHIFT
+#define SPAN_SUBDIV_SHIFT   4       // 3 for 8-pixel subdivision
+#endif
+#define SPAN_SUBDIV         (1 << SPAN_SUBDIV_SHIFT)
+#define MIN_TEXTURE_ZINV    0.0001  // 1/z clamp, for imprecision at
+                                    //  the edges of surfaces
+#define MIP_LEVELS          4
+#define LIGHTMAP_SHIFT      4       // a light sample every 16 texels
+#define LIGHTMAP_GRID       (1 << LIGHTMAP_SHIFT)
+#define LIGHT_LEVELS        32      // rows in the colormap
+#define LIGHT_FULLBRIGHT    24      // light level that leaves texels
+                                    //  as they are; above, brightens
+#define AMBIENT_LIGHT       64      // light everywhere, 0-255 scale
+#define MAX_SURFACE_EXTENT  256     // texels; faces are subdivided to
+#define SUBDIVIDE_SIZE      (MAX_SURFACE_EXTENT - 2 * LIGHTMAP_GRID)
+                                    //  stay within it, allowing for
+                                    //  lightmap grid alignment
+#define SURFCACHE_SIZE      (4 * 1024 * 1024)   // bytes
+#define MIN_CACHE_BLOCK     64      // smallest free block split off
+#define ZBUFFER_SCALE       0x8000  // 1/z buffer values are 1/z times
+#define MAX_ZBUFFER_ZINV    1.99    //  this, so 1/z is clamped to fit
+                                    //  16 bits; anything nearer than
+                                    //  half a unit looks equally near
+#define NUM_ENTITIES        6
+#define MAX_ENTITY_POLYS    (NUM_ENTITIES * 12)     // most faces an
+                                                    //  entity has is 12
+#define ENTITY_SPEED        0.01    // radians of orbit per frame
+#define BSP_EPSILON         0.01    // vertices this near a splitting
+                                    //  plane count as on it
+#define BSP_CANDIDATES      64      // most splitting planes tried for
+                                    //  any one node
+#define BSP_SPLIT_COST      8       // splitter score of splitting a
+                                    //  face, vs. 1 per face of
+                                    //  imbalance or face lying on it
+#define MAX_BSP_DEPTH       256     // most node planes a leaf's cell
+                                    //  is cut from
+#define MAX_VIEW_VERTS      16      // most vertices of the outline of
+                                    //  the views into a leaf
+#define PORTAL_EPSILON      0.01    // how close the viewpoint can be
+                                    //  to a portal of its own leaf
+                                    //  before it's treated as on it
+#define MAX_CELL_VERTS      64      // most vertices on a face of a
+                                    //  leaf's cell
+#define CELL_MARGIN         64.0    // units the leaves' cells extend
+                                    //  past the faces
+#define PVS_EPSILON         0.01    // how far behind a plane the PVS
+                                    //  builder keeps what it clips
+                                    //  to it, to stay conservative
+#define PVS_ON_EPSILON      0.0001  // how far off a separating plane
+                                    //  a corner can be and still be
+                                    //  taken to be on it
+#define PVS_CLUSTER_LEAVES  16      // most leaves the PVS builder
+                                    //  floods out from at once
+#define PVS_SLICE_SECONDS   0.02    // time a frame spends on the
+                                    //  PVS while it's being built
+#define BVH_BINS            16      // buckets objects are sorted into
+                                    //  to find a node's split
+#define BVH_NODE_COST       1.0     // cost of testing a node's box,
+                                    //  vs. 1 per object's box
+#define MAX_BVH_LEAF_OBJECTS 4      // most objects a leaf is left
+                                    //  with when splitting looks no
+                                    //  cheaper
+#define MAX_BVH_DEPTH       64      // most nodes above a BVH leaf
+#define STAGE_HISTORY       1024    // frames of stage times kept
+#define WORLD_IDENT         (('D'<<24)+('L'<<16)+('W'<<8)+'Z')
+                                    // "ZWLD", the first four bytes of
+                                    //  a world file
+#define WORLD_VERSION       1
+
+// Ways of finding the faces that might be visible
+#define VIS_OBJECTS         0       // walk every object
+#define VIS_BSP             1       // walk the BSP tree front to back
+#define VIS_PVS             2       // walk just the parts of the BSP
+                                    //  tree the PVS says can be seen
+#define VIS_PORTALS         3       // walk the leaves that can be seen
+                                    //  into through portals
+#define VIS_BVH             4       // walk a bounding volume hierarchy
+                                    //  over the objects
+#define NUM_VIS_MODES       5
+
+// The tables in a world file
+#define LUMP_VERTEXES       0
+#define LUMP_PLANES         1
+#define LUMP_POLYGONS       2
+#define LUMP_OBJECTS        3
+#define NUM_LUMPS           4
+
+// Where a polygon is relative to a plane
+#define BSP_FRONT           0
+#define BSP_BACK            1
+#define BSP_ON              2
+#define BSP_SPLIT           3
+
+// Stages of UpdateWorld that are timed separately
+#define STAGE_VIEWPOS       0
+#define STAGE_FRUSTUM       1
+#define STAGE_CLEAREDGES    2
+#define STAGE_OBJECTS       3       // includes STAGE_ADDEDGES
+#define STAGE_ADDEDGES      4
+#define STAGE_SCANEDGES     5
+#define STAGE_DRAWSPANS     6
+#define STAGE_PRESENT       7
+#define NUM_STAGES          8
+
+// Stages entered once per object or BSP node, in the inner loop of
+// the front end, are timed by the CPU's timestamp counter where
+// there is one, which takes a few cycles to read, rather than the
+// frame clock, which can take a system call; the counter's converted
+// to seconds at the end of each frame by the frame clock's time for
+// the whole frame
+#ifdef STAGE_TIMING
+#define BEGIN_STAGE(stage)  BeginStage(stage)
+#define END_STAGE(stage)    EndStage(stage)
+#define BEGIN_INNER_STAGE(stage)    BeginInnerStage(stage)
+#define END_INNER_STAGE(stage)      EndInnerStage(stage)
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define ReadStageTicks()    __rdtsc()
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ReadStageTicks()    __builtin_ia32_rdtsc()
+#else
+#define ReadStageTicks()    ((unsigned long long)(FrameClock() * 1e9))
+#endif
+#else
+#define BEGIN_STAGE(stage)
+#define END_STAGE(stage)
+#define BEGIN_INNER_STAGE(stage)
+#define END_INNER_STAGE(stage)
+#endif
+
+// Timing each face's edges as they're added would cost more than
+// adding them, so with STAGE_TIMING faces are queued and their edges
+// added, and timed, a batch at a time; otherwise they're added
+// straight away
+#ifdef STAGE_TIMING
+#define ADD_POLYGON_EDGES(pplane, pscreenpoly)  \
+    QueueFace(pplane, pscreenpoly, NULL, NULL)
+#define ADD_MESH_POLYGON_EDGES(pplane, pmesh, pface)    \
+    QueueFace(pplane, NULL, pmesh, pface)
+#define ADD_QUEUED_FACES()  AddQueuedFaces()
+#else
+#define ADD_POLYGON_EDGES(pplane, pscreenpoly)  \
+    AddPolygonEdges(pplane, pscreenpoly)
+#define ADD_MESH_POLYGON_EDGES(pplane, pmesh, pface)    \
+    AddMeshPolygonEdges(pplane, pmesh, pface)
+#define ADD_QUEUED_FACES()
+#endif
+
+#if defined(SIMD_AVX) && defined(__GNUC__)
+#define AVX_FUNCTION        __attribute__((target("avx")))
+#else
+#define AVX_FUNCTION
+#endif
+
+// Intrinsics for the transform kernels, in whichever precision
+// vec_t is
+#ifndef SIMD_SSE2
+#elif defined(VEC_T_FLOAT)
+#define SSE_LANES           4
+#define sse_t               __m128
+#define SSE_SET1            _mm_set1_ps
+#define SSE_LOAD            _mm_loadu_ps
+#define SSE_STORE           _mm_storeu_ps
+#define SSE_ADD             _mm_add_ps
+#define SSE_SUB             _mm_sub_ps
+#define SSE_MUL             _mm_mul_ps
+#define SSE_DIV             _mm_div_ps
+#define SSE_MIN             _mm_min_ps
+#define SSE_MAX             _mm_max_ps
+#define SSE_UNPACKLO        _mm_unpacklo_ps
+#define SSE_UNPACKHI        _mm_unpackhi_ps
+#define AVX_LANES           8
+#define avx_t               __m256
+#define AVX_SET1            _mm256_set1_ps
+#define AVX_LOAD            _mm256_loadu_ps
+#define AVX_STORE           _mm256_storeu_ps
+#define AVX_ADD             _mm256_add_ps
+#define AVX_SUB             _mm256_sub_ps
+#define AVX_MUL             _mm256_mul_ps
+#define AVX_DIV             _mm256_div_ps
+#define AVX_MIN             _mm256_min_ps
+#define AVX_MAX             _mm256_max_ps
+#define AVX_UNPACKLO        _mm256_unpacklo_ps
+#define AVX_UNPACKHI        _mm256_unpackhi_ps
+#define AVX_PERMUTE2F128    _mm256_permute2f128_ps
+#else
+#define SSE_LANES           2
+#define sse_t               __m128d
+#define SSE_SET1            _mm_set1_pd
+#define SSE_LOAD            _mm_loadu_pd
+#define SSE_STORE           _mm_storeu_pd
+#define SSE_ADD             _mm_add_pd
+#define SSE_SUB             _mm_sub_pd
+#define SSE_MUL             _mm_mul_pd
+#define SSE_DIV             _mm_div_pd
+#define SSE_MIN             _mm_min_pd
+#define SSE_MAX             _mm_max_pd
+#define SSE_UNPACKLO        _mm_unpacklo_pd
+#define SSE_UNPACKHI        _mm_unpackhi_pd
+#define AVX_LANES           4
+#define avx_t               __m256d
+#define AVX_SET1            _mm256_set1_pd
+#define AVX_LOAD            _mm256_loadu_pd
+#define AVX_STORE           _mm256_storeu_pd
+#define AVX_ADD             _mm256_add_pd
+#define AVX_SUB             _mm256_sub_pd
+#define AVX_MUL             _mm256_mul_pd
+#define AVX_DIV             _mm256_div_pd
+#define AVX_MIN             _mm256_min_pd
+#define AVX_MAX             _mm256_max_pd
+#define AVX_UNPACKLO        _mm256_unpacklo_pd
+#define AVX_UNPACKHI        _mm256_unpackhi_pd
+#define AVX_PERMUTE2F128    _mm256_permute2f128_pd
+#endif
+
+#ifndef max
+#define max(a,b)            (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef min
+#define min(a,b)            (((a) < (b)) ? (a) : (b))
+#endif
+
+// Scalar type for all the geometry and gradient math
+#ifdef VEC_T_FLOAT
+typedef float vec_t;
+#else
+typedef double vec_t;
+#endif
 
 typedef struct {
-    double v[3];
+    vec_t   v[3];
 } point_t;
 
 typedef struct {
-    double   x, y;
+    vec_t   x, y;
 } point2D_t;
 
-typedef struct {
-    int x, y;
-    int count;
-    int color;
+typedef struct span_s {
+    struct span_s   *pnext;     // next span of the same surface
+    int             x, y;
+    int             count;
 } span_t;
 
 typedef struct {
-    double  distance;
+    vec_t   distance;
     point_t normal;
 } plane_t;
 
@@ -87,8 +370,16 @@ typedef struct surf_s {
     struct surf_s   *pnext, *pprev;
     int             color;
     int             visxstart;
-    double          zinv00, zinvstepx, zinvstepy;
+    int             key;        // BSP order, nearest first; surfaces
+                                //  with the same key sort by 1/z
+    vec_t           zinv00, zinvstepx, zinvstepy;
+    struct litface_s *plitface; // NULL to fill with color
+    int             miplevel;
+    struct surfcache_s *pcache; // lit texture to draw with this frame
+    vec_t           sdivz00, sdivzstepx, sdivzstepy;
+    vec_t           tdivz00, tdivzstepx, tdivzstepy;
     int             state;
+    span_t          *spans;     // spans scanned out for this surface
 } surf_t;
 
 typedef struct {
@@ -96,45 +387,394 @@ typedef struct {
     point2D_t   verts[MAX_POLY_VERTS];
 } polygon2D_t;
 
+// A world file, which is mapped into memory and used where it lies.
+// Everything in it is little-endian, and every table is found by its
+// offset from the start of the file, so the file can be mapped
+// anywhere. Vertices and planes are relative to the center of the
+// object they're in, and objects made of the same polygons share
+// them, as the built-in world's objects share their arrays
+typedef struct {
+    int     fileofs, filelen;
+} lump_t;
+
+typedef struct {
+    int     ident;                  // WORLD_IDENT
+    int     version;                // WORLD_VERSION
+    lump_t  lumps[NUM_LUMPS];
+} dheader_t;
+
+typedef struct {
+    float   point[3];
+} dvertex_t;
+
+typedef struct {
+    float   normal[3];
+    float   dist;
+} dplane_t;
+
+typedef struct {
+    int     firstvert;              // numverts vertices in a row
+    short   numverts;
+    short   color;
+    int     planenum;
+} dpolygon_t;
+
+typedef struct {
+    float   center[3];
+    int     firstpoly;              // numpolys polygons in a row
+    int     numpolys;
+} dobject_t;
+
+// Indexed form of an object's polygons, built at startup, in which
+// faces share edges and edges share vertices
+typedef struct {
+    int     v[2];                   // vertex indices
+} medge_t;
+
+typedef struct {
+    int     color;
+    unsigned char *ptexture;        // NULL if it can't be textured
+    point_t texaxis[2];             // s and t axes, in texels per
+                                    //  unit
+    int     numverts;
+    int     verts[MAX_POLY_VERTS];  // vertex indices
+    int     edges[MAX_POLY_VERTS];  // edge from each vertex to the
+                                    //  next; negative if the face
+                                    //  runs from the edge's v[1] to
+                                    //  its v[0]
+    plane_t plane;
+} mface_t;
+
+typedef struct mesh_s {
+    struct mesh_s   *pnext;
+    polygon_t       *ppoly;         // polygons the mesh was built
+    dpolygon_t      *pdpoly;        //  from, one or the other
+    int             numpolys;
+    int             numverts;
+    point_t         *verts;         // relative to the object center
+    vec_t           *vertx;         // verts again as separate x, y,
+    vec_t           *verty;         //  and z arrays, padded for the
+    vec_t           *vertz;         //  transform kernels
+    int             numedges;       // edge 0 is unused, so every
+    medge_t         *edges;         //  edge can be negated
+    int             numfaces;
+    mface_t         *faces;
+} mesh_t;
+
+// A block of the surface cache, holding one face's texture, lit and
+// at one mip level. Blocks are kept in address order, free or not;
+// those in use are also kept most recently used first
+typedef struct surfcache_s {
+    struct surfcache_s  *pnext, *pprev;         // in address order
+    struct surfcache_s  *plrunext, *plruprev;   // most recent first
+    struct surfcache_s  **powner;   // cachespot that points at this;
+                                    //  NULL if free
+    int                 size;       // bytes, including this header
+    int                 lastframe;  // cacheframe last drawn in
+    int                 width, height;
+} surfcache_t;
+
+// Lighting of one face of one object, and its cached lit textures
+typedef struct litface_s {
+    unsigned char   *ptexture;          // base texture and its mips
+    int             texturemins[2];     // texels, on the light grid
+    int             extents[2];
+    int             lightwidth;         // light samples per row
+    unsigned char   *lightmap;          // 0-255
+    surfcache_t     *cachespots[MIP_LEVELS];
+} litface_t;
+
+// A node of the bounding volume hierarchy over the objects' boxes.
+// Each node's box is around its children's, and a leaf's is around
+// its objects, which are the run of bvhobjects it holds
+typedef struct bvhnode_s {
+    point_t                 mins, maxs;
+    struct bvhnode_s        *parent;    // NULL for the root
+    struct bvhnode_s        *children[2];   // NULL in a leaf
+    int                     firstobject;    // in bvhobjects
+    int                     numobjects;
+} bvhnode_t;
+
 typedef struct convexobject_s {
     struct convexobject_s   *pnext;
     point_t                 center;
     int                     numpolys;
     polygon_t               *ppoly;
+    vec_t                   radius;     // of bounding sphere around
+                                        //  center
+    point_t                 mins, maxs; // of bounding box, relative
+                                        //  to center
+    bvhnode_t               *pbvhleaf;  // BVH leaf it's in, if any
+    mesh_t                  *pmesh;     // indexed form of ppoly
+    litface_t               *plitfaces; // one per mesh face
+    dpolygon_t              *pdpoly;    // in a world file, if ppoly
+                                        //  is NULL
 } convexobject_t;
 
+// A mesh face, or a piece of one, in the BSP tree, in worldspace.
+// Faces a splitting plane crosses are split, and every piece is lit
+// and textured from the whole face's lightmap and cached textures
+typedef struct bspface_s {
+    struct bspface_s        *pnext;     // next on the same node
+    convexobject_t          *pobject;
+    int                     face;       // in pobject's mesh
+    int                     flipped;    // faces the node plane's back
+    int                     visframe;   // visframecount if in the PVS
+    polygon_t               poly;
+} bspface_t;
+
+// An opening between two leaves: a piece of a node's plane not
+// covered by a face facing back the way it's looked through, which
+// the leaf on one side can be seen into from the other. Each leaf
+// keeps a list of the portals out of it
+typedef struct portal_s {
+    struct portal_s         *pnext;     // next out of the same leaf
+    struct bspnode_s        *pleaf;     // leaf it leads into
+    int                     num;        // in the order it was built
+    polygon_t               poly;       // plane faces into pleaf
+} portal_t;
+
+// A node of the BSP tree the world's faces are compiled into. The
+// faces that lie on a node's plane are kept on the node; the rest go
+// down the side they're on. Where there are no faces left to put on
+// one side, the child is a leaf: one of the convex empty spaces the
+// planes carve the world into. Leaves keep a list of the faces on
+// their boundary that face into them, which are what can be seen
+// of them, the offset of their row of the PVS, their portals, and
+// the outline of the views into them through portals this frame
+typedef struct bspnode_s {
+    int                     leaf;       // leaf number; -1 if a node
+    plane_t                 plane;
+    struct bspnode_s        *parent;    // NULL for the root
+    struct bspnode_s        *children[2];   // front, back
+    bspface_t               *faces;     // on the plane
+    point_t                 mins, maxs; // around the faces under it
+    int                     visframe;   // visframecount if a leaf
+                                        //  under it is in the PVS
+    bspface_t               **markfaces;    // leaves only
+    int                     nummarkfaces;
+    int                     visofs;     // -1 if it sees everything
+    portal_t                *portals;   // leaves only
+    int                     portalframe;    // visframecount if a leaf
+                                            //  under it is seen into
+                                            //  through portals
+    int                     numviewverts;   // leaves only
+    point2D_t               viewverts[MAX_VIEW_VERTS];
+} bspnode_t;
+
+// A face of the convex cell a leaf bounds, which can have more
+// vertices than a polygon
+typedef struct {
+    int                     numverts;
+    point_t                 verts[MAX_CELL_VERTS];
+} winding_t;
+
+// A piece of a face on the boundary of a leaf it faces into
+typedef struct {
+    bspnode_t               *pleaf;
+    bspface_t               *pface;
+} leafmark_t;
+
+// A flood out from a cluster of leaves through the portals: for
+// each portal, by number, the box around what it's seen through it,
+// the cluster it last saw through it from and queued it to be
+// flooded on from for, and the queue of portals to flood on from,
+// which never holds one twice; the number of leaves a portal leads
+// into it hasn't marked, so it can stop once there are none; and the
+// row it marks them in
+typedef struct {
+    point_t                 *ppassmins, *ppassmaxs;
+    int                     *ppassfrom, *pqueuedfrom;
+    portal_t                **pqueue;
+    int                     queuehead, queuetail;
+    int                     unseen;
+    unsigned char           *prow;
+} pvsflood_t;
+
+typedef struct {
+    point_t     origin;
+    vec_t       intensity;          // light at the origin, 0-255;
+                                    //  falls off 1 per unit
+} light_t;
+
+#ifdef STAGE_TIMING
+// A face clipped and projected, waiting with the surface state it's
+// to be drawn with to have its edges added. An unclipped mesh face's
+// vertices are in screenverts, so only the face is kept
+typedef struct {
+    plane_t         plane;          // in viewspace
+    int             color;
+    litface_t       *plitface;
+    point_t         *ptexaxis;
+    mesh_t          *pmesh;         // NULL if screenpoly holds the face
+    mface_t         *pface;
+    polygon2D_t     screenpoly;
+} queuedface_t;
+#endif
+
+// A mesh vertex transformed for the current object this frame
+typedef struct {
+    unsigned    stamp;          // cachestamp world, outcode set at
+    int         outcode;
+    point_t     world;
+} cachedvert_t;
+
+// An edge set up for stepping across scan lines
+typedef struct {
+    unsigned    stamp;          // cachestamp set up at
+    int         topy, bottomy;  // equal if it crosses no scan lines
+    int         x, xstep;       // 16.16 fixed point, x at topy
+    int         leading;        // when run from v[0] to v[1]
+} cachededge_t;
+
 typedef struct edge_s {
     int             x;
     int             xstep;
     int             leading;
-    surf_t          *psurf;
+    int             surf;           // index in the table's surfs; 0
+                                    //  is the background
+    int             topy, bottomy;  // scan lines it covers, and its x
+    int             topx;           //  at topy, which isn't stepped
     struct edge_s   *pnext, *pprev;
     struct edge_s   *pnextremove;
 } edge_t;
 
+// A pool of fixed-size items, handed out in order, that's reset at
+// the start of every frame rather than freed. When a frame runs out
+// of room, the pool doubles its capacity: by adding a block, if
+// items can't move because they're linked to by pointer, or by
+// reallocating its one block if they can. The next reset merges
+// the blocks, so after the first few frames nothing is allocated
+typedef struct arenablock_s {
+    struct arenablock_s *pnext;
+    int                 numitems;
+    char                *pitems;
+} arenablock_t;
+
+typedef struct {
+    char            *name;
+    int             itemsize;
+    int             movable;        // items can move as it grows
+    arenablock_t    *pblocks;
+    arenablock_t    *pcurrent;      // block items are coming from
+    char            *plimit;        // end of current block
+    int             capacity;       // items in all blocks
+    int             usedbefore;     // items in blocks before current
+    int             used;           // items used by the last frame
+    int             peak;           // most items used by any frame
+    int             grew;           // set if the last frame grew it
+    int             growframes;     // frames that grew it
+    int             overflowed;     // times the last frame found it
+                                    //  full and couldn't grow it
+    int             overflowframes; // frames that overflowed it
+} arena_t;
+
+// What a pool holds, to set up an arena with
+typedef struct {
+    char            *name;
+    int             itemsize;
+    int             movable;
+} arenadef_t;
+
+// Each edge table's pools
+#define TABLE_EDGES         0
+#define TABLE_SURFS         1
+#define NUM_TABLE_ARENAS    2
+
+// A scan line's run of an edge table's list of edges to add or
+// remove
+typedef struct {
+    int         first;
+    int         count;
+} edgebucket_t;
+
+// A moving entity's polygon, clipped and projected, to be drawn
+// z-buffered after the world
+typedef struct {
+    int         color;
+    polygon2D_t screenpoly;
+    vec_t       zinv00, zinvstepx, zinvstepy;
+} entitypoly_t;
+
+// A global edge table: everything the front end of a frame (the
+// object loop) builds for the back end (ScanEdges and DrawSpans) to
+// scan and draw from
+typedef struct {
+    arena_t     arenas[NUM_TABLE_ARENAS];
+    surf_t      *surfs;             // first is the background
+    int         numsurfs;
+    edge_t      **newedges;         // edges to add on each scan
+    edge_t      **removeedges;      //  line, by x, and to remove
+                                    //  after each, each scan line's
+                                    //  together, in its bucket
+    int         edgelistsize;       // edges the lists have room for
+    edgebucket_t newbuckets[MAX_SCREEN_HEIGHT];
+    edgebucket_t removebuckets[MAX_SCREEN_HEIGHT];
+    int         dirtynew[MAX_SCREEN_HEIGHT];    // scan lines whose
+    int         numdirtynew;                    //  buckets have
+    int         dirtyremove[MAX_SCREEN_HEIGHT]; //  edges in them
+    int         numdirtyremove;
+    int         zbuffered;          // set to fill the 1/z buffer and
+                                    //  draw the entities
+    int         numentitypolys;
+    entitypoly_t entitypolys[MAX_ENTITY_POLYS];
+    double      starttime;          // when the frame was begun
+} edgetable_t;
+
+// Each band's pools
+#define BAND_SPANS          0
+#define BAND_EDGES          1       // copies of edges from above top
+#define BAND_SURFS          2       // copies of surfs
+#define NUM_BAND_ARENAS     3
+
+// A horizontal band of the screen, scanned into spans separately
+// from the others, possibly at the same time
+typedef struct {
+    int         top, bottom;        // scan lines, bottom exclusive
+    edge_t      edgehead, edgetail; // active edge list
+    surf_t      *psurfs;            // surfaces it scanned with, or
+                                    //  NULL if it ran out of memory
+    arena_t     arenas[NUM_BAND_ARENAS];
+    int         numspans, numpixels;
+} band_t;
+
+typedef void (*jobfunc_t)(int job);
+
+#ifndef HEADLESS
 BITMAPINFO *pbmiDIB;		// pointer to the BITMAPINFO
-char *pDIB, *pDIBBase;		// pointers to DIB section we'll draw into
 HBITMAP hDIBSection;        // handle of DIB section
 HINSTANCE hInst;            // current instance
 char szAppName[] = "Clip";  // The name of this application
 char szTitle[]   = "3D clipping demo"; // The title bar text
 HPALETTE hpalold, hpalDIB;
 HWND hwndOutput;
+#else
+char renderername[] = "zsort";
+#endif
+#ifdef VEC_T_FLOAT
+char vectypename[] = "float";
+#else
+char vectypename[] = "double";
+#endif
+char *pDIB, *pDIBBase;		// pointers to DIB section we'll draw into
 int DIBWidth, DIBHeight;
 int DIBPitch;
 double  roll, pitch, yaw;
 double  currentspeed;
 point_t currentpos;
-double  fieldofview, xcenter, ycenter;
-double  xscreenscale, yscreenscale, maxscale;
-double  maxscreenscaleinv;
+vec_t   fieldofview, xcenter, ycenter;
+vec_t   xscreenscale, yscreenscale, maxscale;
+vec_t   maxscreenscaleinv;
 int     numobjects;
 double  speedscale = 1.0;
 plane_t frustumplanes[NUM_FRUSTUM_PLANES];
+point2D_t frustumoutline[4];    // where the frustum planes cross the
+                                //  plane a unit in front of the
+                                //  viewpoint, in viewspace
 
-double  mroll[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
-double  mpitch[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
-double  myaw[3][3] =  {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+vec_t   mroll[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+vec_t   mpitch[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+vec_t   myaw[3][3] =  {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
 point_t vpn, vright, vup;
 point_t xaxis = {1, 0, 0};
 point_t zaxis = {0, 0, 1};
@@ -189,54 +829,438 @@ polygon_t polys2[] = {
 extern convexobject_t   objecthead;
 
 convexobject_t objects[] = {
-{&objects[1], {-50,0,70}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objects[2], {0,20,70}, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{&objects[3], {50,0,70}, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{&objects[4], {-50,0,-70}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objects[5], {0,20,-70}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objects[6], {50,30,-70}, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{&objects[7], {-50,15,0}, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{&objects[8], {50,15,0}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objects[9], {0,50,0}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objects[10], {-100,100,115}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objects[11], {-100,150,120}, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{&objects[12], {100,200,100}, sizeof(polys0) / sizeof(polys0[0]), polys0},
-{&objects[13], {100,100,100}, sizeof(polys2) / sizeof(polys2[0]), polys2},
-{&objecthead, {0,-20,0}, sizeof(polys1) / sizeof(polys1[0]), polys1},
+{&objects[1], {-50,0,70}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[2], {0,20,70}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[3], {50,0,70}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[4], {-50,0,-70}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[5], {0,20,-70}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[6], {50,30,-70}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[7], {-50,15,0}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[8], {50,15,0}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[9], {0,50,0}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[10], {-100,100,115}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[11], {-100,150,120}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[12], {100,200,100}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objects[13], {100,100,100}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{&objecthead, {0,-20,0}, sizeof(polys1) / sizeof(polys1[0]), polys1,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
 };
 
 // Head and tail for the object list
-convexobject_t objecthead = {&objects[0]};
-
-// Span, edge, and surface lists
-span_t  spans[MAX_SPANS];
-edge_t  edges[MAX_EDGES];
-surf_t  surfs[MAX_SURFS];
-
-// Bucket list of new edges to add on each scan line
-edge_t  newedges[MAX_SCREEN_HEIGHT];
+convexobject_t objecthead = {&objects[0], {0,0,0}, 0, NULL,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL};
+
+// The world file the world was loaded from, if it was, mapped into
+// memory, its tables, and the objects built from it
+unsigned char   *worldbase;
+int             worldsize;
+dvertex_t       *worldverts;
+int             numworldverts;
+dplane_t        *worldplanes;
+int             numworldplanes;
+dpolygon_t      *worldpolys;
+int             numworldpolys;
+convexobject_t  *worldobjects;
+
+// Global edge tables, with their edge and surface pools. Edges are
+// linked together by pointer, so they have to stay put; surfaces
+// are referred to by index, so they don't. Normally both the front
+// and back ends use the first table. When pipelining, the front end
+// builds one frame's table while the back end scans the last
+// frame's from the other, on another thread, and they trade tables
+// at the end of each frame
+edgetable_t edgetables[2];
+edgetable_t *pbuildtable = &edgetables[0];
+edgetable_t *pscantable = &edgetables[0];
+int         pipelining;
+int         framepending;   // set if pscantable has yet to be scanned
+
+// Seconds from the start of the UpdateWorld call that began the
+// frame last presented to the end of the one that presented it
+double      framelatency;
+
+// Bands the screen is split into for scanning, top to bottom. The
+// first one scans with the edge table's surfaces themselves, the
+// rest with copies
+band_t  bands[MAX_BANDS];
+int     numbands = 1;
+
+// Pool names and item sizes of each edge table's arenas
+arenadef_t tablearenas[NUM_TABLE_ARENAS] = {
+    {"edges", sizeof(edge_t), 0},
+    {"surfs", sizeof(surf_t), 1},
+};
 
-// Bucket list of edges to remove on each scan line
-edge_t  *removeedges[MAX_SCREEN_HEIGHT];
+// Pool names and item sizes of each band's arenas; band pools are
+// reported as totals over all the bands
+arenadef_t bandarenas[NUM_BAND_ARENAS] = {
+    {"spans", sizeof(span_t), 0},   // linked into surfaces' lists
+    {"edge copies", sizeof(edge_t), 1},
+    {"surf copies", sizeof(surf_t), 1},
+};
 
-// Head and tail for the active edge list
-edge_t  edgehead;
-edge_t  edgetail;
+// Lists of copied edges to remove on each scan line, like
+// removeedges; each band uses the entries for its own scan lines
+edge_t  *removecopies[MAX_SCREEN_HEIGHT];
+
+// Lists the edges are gathered into and sorted through on their way
+// to an edge table's lists, and the number of edges they have room
+// for
+edge_t  **edgesortlists[2];
+int     edgesortsize;
+
+// pointers to next available surface and edge, and the ends of
+// the blocks they're in
+surf_t  *pavailsurf, *psurflimit;
+edge_t  *pavailedge, *pedgelimit;
+
+// All meshes built so far, shared by objects made of the same
+// polygons
+mesh_t  *meshes;
+
+// Transformed vertices and set-up edges of the mesh of the object
+// being drawn. Each object is drawn once per frame, and cachestamp
+// is bumped before each one, which invalidates every entry at
+// once; an entry is filled in the first time a face needs it, and
+// reused by every other face that shares it
+cachedvert_t    vertcache[MAX_MESH_VERTS];
+cachededge_t    edgecache[MAX_MESH_EDGES];
+unsigned        cachestamp;
+
+// Screen coordinates of all the vertices of the mesh of the object
+// being drawn, projected together the first time one of its faces
+// that's entirely inside the frustum needs them
+point2D_t       screenverts[MAX_MESH_VERTS];
+
+// Transform kernel for the CPU we're running on
+void TransformMeshVertsScalar(mesh_t *pmesh, point_t *pcenter,
+                              point2D_t *pscreen);
+void (*TransformMeshVerts)(mesh_t *pmesh, point_t *pcenter,
+                           point2D_t *pscreen) = TransformMeshVertsScalar;
+char *transformkernelname = "scalar";
+
+// Worker threads, which take jobs from RunJobs along with the main
+// thread. numthreads includes the main thread
+int             numthreads = 1;
+int             numworkers;
+int             workersquit;
+jobfunc_t       jobfunc;
+int             numjobs;
+#ifdef _WIN32
+HANDLE          workerthreads[MAX_THREADS];
+HANDLE          workerstart[MAX_THREADS], workerdone[MAX_THREADS];
+int             workerindex[MAX_THREADS];
+volatile LONG   nextjob;
+#else
+pthread_t       workerthreads[MAX_THREADS];
+pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  jobstart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  jobsdone = PTHREAD_COND_INITIALIZER;
+int             jobround;       // bumped for each RunJobs
+int             workerround[MAX_THREADS];
+int             workersbusy;
+int             nextjob;
+#endif
+
+// Back end thread, which scans and draws one frame while the main
+// thread builds the next when pipelining. It hands the bands out to
+// the workers itself
+int             backendquit;
+#ifdef _WIN32
+HANDLE          backendthread, backendstart, backenddone;
+#else
+pthread_t       backendthread;
+pthread_cond_t  backendcond = PTHREAD_COND_INITIALIZER;
+int             backendbusy;
+#endif
 
-// Edge used as sentinel of new edge lists
-edge_t  maxedge = {0x7FFFFFFF};
+int currentcolor;
+litface_t *pcurrentlitface;
+point_t *pcurrenttexaxis;
+
+#ifdef STAGE_TIMING
+// Faces waiting to have their edges added, so it's done a batch at a
+// time, and the batch can be timed as a whole
+queuedface_t    queuedfaces[MAX_QUEUED_FACES];
+int             numqueuedfaces;
+#endif
+
+// Set to draw textured surfaces with their textures rather than
+// their colors
+int texturemapping;
+
+// Brick textures in each color, each followed by its mips, built as
+// the meshes that use them are
+unsigned char *textures[256];
+int     mipoffsets[MIP_LEVELS] = {
+    0,
+    TEXTURE_SIZE * TEXTURE_SIZE,
+    TEXTURE_SIZE * TEXTURE_SIZE * 5 / 4,
+    TEXTURE_SIZE * TEXTURE_SIZE * 21 / 16,
+};
+#define MIPPED_TEXTURE_SIZE (TEXTURE_SIZE * TEXTURE_SIZE * 85 / 64)
+
+// Palette index of each texel color at each light level
+unsigned char   colormap[LIGHT_LEVELS][256];
+int             colormapbuilt;
+
+// Lights that light the faces' lightmaps, which are built with the
+// scene; the world is lit the same whatever's in it
+light_t lights[] = {
+    {{0, 80, 0}, 260},
+    {{-120, 60, -120}, 220},
+    {{120, 60, 120}, 220},
+    {{120, 60, -120}, 200},
+    {{-120, 60, 120}, 200},
+};
 
-// Head/tail/sentinel/background surface of active surface stack
-surf_t  surfstack;
+// The surface cache: a fixed-size block of memory that lit textures
+// are built into as faces come into view, at the mip level their
+// size on screen calls for, and reused until they're evicted, least
+// recently used first, to make room for others. cacheframe counts
+// the frames drawn, so blocks in use in the current frame are never
+// evicted
+unsigned char   *surfcachebase;
+surfcache_t     *plruhead, *plrutail;
+int             cacheframe;
+
+// Surface cache counters for the last frame drawn
+int             cachehits, cachemisses, cacheevictions;
+int             cachebytesbuilt;
+
+// Set to fill a 1/z buffer from the world's spans as they're drawn,
+// and draw the moving entities into it, z-buffered
+int             zbuffering;
+unsigned short  *pzbuffer;          // top-down, pitch zbufferwidth
+int             zbufferwidth, zbufferheight;
+int             zfilling;           // set while drawing a z-buffered
+                                    //  frame with a 1/z buffer
+
+// Entities: objects that move every frame, so they're left out of
+// the edge table and z-buffered in after the world is drawn.
+// Their centers are set as they move
+convexobject_t entities[NUM_ENTITIES] = {
+{NULL, {0,0,0}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{NULL, {0,0,0}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{NULL, {0,0,0}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{NULL, {0,0,0}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{NULL, {0,0,0}, sizeof(polys0) / sizeof(polys0[0]), polys0,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+{NULL, {0,0,0}, sizeof(polys2) / sizeof(polys2[0]), polys2,
+    0, {0,0,0}, {0,0,0}, NULL, NULL, NULL, NULL},
+};
+int             entityframe;        // frames the entities have moved
+
+// Left and right edges of the entity polygon being drawn on each
+// scan line, in 16.16 fixed point
+int             entityleft[MAX_SCREEN_HEIGHT];
+int             entityright[MAX_SCREEN_HEIGHT];
+
+// How the front end finds the faces that might be visible, one of
+// the VIS_ modes
+int             vismode;
+
+// The world compiled into a BSP tree, built the first time it's
+// needed after the world is set up, and its size
+bspnode_t       *bsptree;
+int             numbspnodes, numbspleaves, numbspfaces;
+double          bspcompiletime;     // seconds
+
+// Key given to the surfaces being added; bumped after each BSP node
+// so nearer nodes' surfaces sort in front. Always 0 otherwise
+int             currentkey;
+
+// BSP counters for the last frame built
+int             bspnodesvisited, bspnodesculled;
+
+// The BSP tree's leaves, and the faces each faces into, found the
+// first time the PVS or portals need them after the tree is built
+// and kept until it's freed, and, while they're being found, the
+// pieces of faces on each leaf's boundary they're found from
+bspnode_t       **bspleaves;        // by leaf number
+bspface_t       **bspmarkfaces;     // all the leaves' markfaces
+leafmark_t      *leafmarks;
+int             numleafmarks, maxleafmarks;
+int             *leaffirstmark;     // where each leaf's marks start
+
+// The potentially visible set: for each leaf, a bit for every leaf
+// that can be seen from somewhere in it, with runs of zero bytes
+// compressed, as Quake does, built the first time it's needed after
+// the tree is. Nodes and faces in the PVS of the leaf the viewpoint
+// is in are marked with visframecount, which only has to be redone,
+// along with decompressing the leaf's row, when the viewpoint moves
+// to another leaf
+unsigned char   *pvsdata;
+int             pvsrowbytes, pvssize, pvsmaxsize;
+double          pvsbuildtime;       // seconds
+unsigned char   *pvsrow;            // viewleaf's, decompressed
+bspnode_t       *viewleaf;
+int             visframecount;
+int             pvsfacesvisible;    // faces in the current PVS
+double          pvsdecompresstime;  // seconds, last frame built
+
+// What the PVS builder works with until it's done, which, if
+// pvsslice is set, is spread over frames: the box around each
+// portal, by number; which leaves a portal leads into, as a row, and
+// how many; each cluster's node, first leaf and number of leaves,
+// the cluster each leaf is in, and the next cluster to flood out
+// from; the box the leaves' cells are clipped to; and a flood for
+// each thread
+point_t         *pvsportalmins, *pvsportalmaxs;
+unsigned char   *pvsentered;
+int             numpvsentered;
+bspnode_t       **pvsclusternodes;
+int             *pvsclusterfirst, *pvsclusterleaves, *pvsleafcluster;
+int             numpvsclusters, nextpvscluster;
+point_t         pvsworldmins, pvsworldmaxs;
+pvsflood_t      pvsfloods[MAX_THREADS];
+int             numpvsfloods;
+int             pvsbuilding;
+#ifdef HEADLESS
+double          pvsslice = 0.0;     // the bench times it all at once
+#else
+double          pvsslice = PVS_SLICE_SECONDS;
+#endif
+
+// The portals between the BSP tree's leaves, built the first time
+// they're needed after the tree is, the leaf the viewpoint's in, and
+// counters for the last frame built. Faces are marked with
+// visframecount as they're added, since a face can be on the
+// boundary of more than one leaf
+int             numportals;
+bspnode_t       *portalviewleaf;
+double          portalbuildtime;    // seconds
+int             portalcellsvisited, portalspassed, portalfacesadded;
+
+// The bounding volume hierarchy over the world's objects and the
+// entities, built the first time it's needed after the world is set
+// up, with the objects in the order its leaves hold them, and
+// counters for the last frame built. The entities' leaves, and the
+// nodes above them, are refit as they move
+bvhnode_t       *bvhnodes;          // the root is first
+convexobject_t  **bvhobjects;
+int             numbvhnodes, numbvhleaves;
+double          bvhbuildtime;       // seconds
+int             bvhnodesvisited, bvhnodesculled, bvhnodesrefit;
+
+// Number of spans emitted by the last ScanEdges, and pixels they
+// wrote
+int numspans;
+int numpixels;
+
+// Overdraw instrumentation. When overdrawcheck is set, every pixel
+// written bumps that pixel's count in pwritecounts (screen order,
+// top to bottom), and the stats below are gathered for each frame
+int             overdrawcheck;
+unsigned char   *pwritecounts;
+int             writecountsize;
+int             depthhist[MAX_DEPTH_COMPLEXITY];
+int             maxdepth;
+double          meandepth;
+
+// Heatmap colors by depth complexity: black for never written, then
+// blue, green, yellow, orange, red, magenta, and white for 7 or more
+unsigned char   heatcolors[NUM_HEAT_COLORS][3] = {
+    {0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0},
+    {255, 128, 0}, {255, 0, 0}, {255, 0, 255}, {255, 255, 255},
+};
 
-// pointers to next available surface and edge
-surf_t  *pavailsurf;
-edge_t  *pavailedge;
+#ifdef STAGE_TIMING
+typedef struct {
+    int     frame;
+    double  start, end;             // whole frame
+    double  stagestart[NUM_STAGES]; // start of first call
+    double  stagetime[NUM_STAGES];  // total time over all calls
+    unsigned long long  stageticks[NUM_STAGES]; // inner stages' time
+                                    //  until the frame's done
+    int     stagecalls[NUM_STAGES];
+    int     pipelined;              // scan and draw ran on back end
+} stageframe_t;
+
+char *stagenames[NUM_STAGES] = {
+    "UpdateViewPos", "SetUpFrustum", "ClearEdgeLists", "ObjectLoop",
+    "AddPolygonEdges", "ScanEdges", "DrawSpans", "Present",
+};
 
-int currentcolor;
+// Rolling window of the last STAGE_HISTORY frames' stage times.
+// Times are in seconds since timing started
+stageframe_t    stagehistory[STAGE_HISTORY];
+stageframe_t    *pstageframe;
+int             numstageframes;
+double          stagebase;
+double          stageentry[NUM_STAGES];
+unsigned long long  stageentryticks[NUM_STAGES];
+unsigned long long  frameticks;     // ReadStageTicks at frame start
+#endif
 
 void UpdateWorld(void);
-
+void InitViewState(void);
+void SetUpObjectBounds(convexobject_t *pobject);
+int SetUpObjectMesh(convexobject_t *pobject);
+int SetUpWorld(convexobject_t *pobjects, int count);
+void ReleaseWorld(void);
+int LoadWorldFile(char *filename);
+int SaveWorldFile(char *filename);
+void FreeWorldFile(void);
+vec_t DotProduct(point_t *vec1, point_t *vec2);
+void CrossProduct(point_t *in1, point_t *in2, point_t *out);
+int ClipToPlane(polygon_t *pin, plane_t *pplane, polygon_t *pout);
+int SetUpObjectLighting(convexobject_t *pobject);
+void FreeLighting(void);
+int InitSurfaceCache(void);
+void FlushSurfaceCache(void);
+void FreeMeshes(void);
+int InitArenas(void);
+int InitBandArenas(band_t *pband);
+int SetRenderThreads(int threads);
+void RunJobs(jobfunc_t func, int count);
+int SetPipelining(int on);
+int SetTextureMapping(int on);
+int SetZBuffering(int on);
+int SetVisibility(int mode);
+int BuildBSPTree(void);
+void FreeBSPTree(void);
+int BuildLeafFaces(void);
+void FreeLeafFaces(void);
+int BuildPVS(void);
+int StartPVS(void);
+int ContinuePVS(void);
+void FreePVS(void);
+int BuildPortals(void);
+void FreePortals(void);
+int BuildBVH(void);
+void FreeBVH(void);
+void RefitBVH(convexobject_t *pobject);
+void TransformPlane(plane_t *pin, point_t *pcenter, plane_t *pout);
+void MoveEntities(void);
+void AddEntityPolys(edgetable_t *ptable, convexobject_t *pentity,
+                    int clipflags);
+void AddEntities(edgetable_t *ptable);
+int InitTableArenas(edgetable_t *ptable);
+double FrameClock(void);
+void ResetArenaStats(void);
+void SelectTransformKernel(void);
+int WriteOverdrawHeatmap(char *filename);
+int WriteStageTimes(char *csvname, char *tracename);
+
+#ifndef HEADLESS
 /////////////////////////////////////////////////////////////////////
 // WinMain
 /////////////////////////////////////////////////////////////////////
@@ -257,6 +1281,12 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
         return (FALSE);
     }
 
+    // A world file named on the command line replaces the built-in
+    // world
+    if ((lpCmdLine[0] != 0) && !LoadWorldFile(lpCmdLine)) {
+        return (FALSE);
+    }
+
     hAccelTable = LoadAccelerators (hInstance, szAppName);
 
     // Acquire and dispatch messages until a WM_QUIT message is
@@ -280,8 +1310,6 @@ int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 
 Done:
     return (msg.wParam); // Returns the value from PostQuitMessage
-
-    lpCmdLine; // This will prevent 'unused formal parameter' warnings
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -550,23 +1578,29 @@ BOOL InitInstance(
 
 		hwndOutput = hwnd;
 
-        // Set the initial location, direction, and speed
-        roll = 0.0;
-        pitch = 0.0;
-        yaw = 0.0;
-        currentspeed = 0.0;
-        currentpos.v[0] = 0.0;
-        currentpos.v[1] = 0.0;
-        currentpos.v[2] = 0.0;
-        fieldofview = 2.0;
-        xscreenscale = DIBWidth / fieldofview;
-        yscreenscale = DIBHeight / fieldofview;
-        maxscale = max(xscreenscale, yscreenscale);
-        maxscreenscaleinv = 1.0 / maxscale;
-        xcenter = DIBWidth / 2.0 - 0.5;
-        ycenter = DIBHeight / 2.0 - 0.5;
+        InitViewState();
+        SelectTransformKernel();
+
+        if (!InitArenas() || !InitSurfaceCache())
+            return (FALSE);
+
+        for (i=0 ; i<NUM_ENTITIES ; i++)
+            SetUpObjectBounds(&entities[i]);
+
+        // Scan with a thread per processor
+        SetRenderThreads(0);
+        SetTextureMapping(1);
 
         numobjects = sizeof(objects) / sizeof(objects[0]);
+        for (i=0 ; i<numobjects ; i++)
+        {
+            SetUpObjectBounds(&objects[i]);
+            if (!SetUpObjectMesh(&objects[i]) ||
+                !SetUpObjectLighting(&objects[i]))
+            {
+                return (FALSE);
+            }
+        }
 
         return (TRUE);              // We succeeded...
 }
@@ -693,6 +1727,36 @@ LRESULT CALLBACK WndProc(
             speedscale *= 0.9;
             break;
 
+        case 'O':
+            overdrawcheck = !overdrawcheck;
+            if (!overdrawcheck)
+                SetWindowText(hwnd, szTitle);
+            break;
+
+        case 'H':
+            WriteOverdrawHeatmap("overdraw.ppm");
+            break;
+
+        case 'T':
+            WriteStageTimes("stages.csv", "stages.json");
+            break;
+
+        case 'P':
+            SetPipelining(!pipelining);
+            break;
+
+        case 'X':
+            SetTextureMapping(!texturemapping);
+            break;
+
+        case 'E':
+            SetZBuffering(!zbuffering);
+            break;
+
+        case 'V':
+            SetVisibility((vismode + 1) % NUM_VIS_MODES);
+            break;
+
 		default:
 			break;
 		}
@@ -760,8 +1824,10 @@ LRESULT CALLBACK WndProc(
     			DIBHeight = oldDIBHeight;
             }
 
-			// Clear the DIB
+			// Clear the DIB, and drop any frame that was built for
+			// the old size
 			memset(pDIBBase, 0, DIBWidth*DIBHeight);
+            framepending = 0;
 		}
 		break;
 
@@ -779,771 +1845,8452 @@ LRESULT CALLBACK WndProc(
     return (0);
 }
 
+#else   // HEADLESS
+
+// Storage for the benchmark scene
+convexobject_t  *benchobjects;
+polygon_t       benchfloor[1];
+polygon_t       *benchpolys;        // box shapes of a generated scene
+
 /////////////////////////////////////////////////////////////////////
-// 3-D dot product.
+// Allocate a plain top-down framebuffer of the specified size to
+// draw into in place of the DIB section. Returns 0 on failure.
 /////////////////////////////////////////////////////////////////////
-double DotProduct(point_t *vec1, point_t *vec2)
+int InitFramebuffer(int width, int height)
 {
-    return vec1->v[0] * vec2->v[0] +
-           vec1->v[1] * vec2->v[1] +
-           vec1->v[2] * vec2->v[2];
+    int     i;
+
+    FreeFramebuffer();
+
+    if ((width < 10) || (height < 10) || (height > MAX_SCREEN_HEIGHT))
+        return 0;
+
+    DIBWidth = (width + 3) & ~3;
+    DIBHeight = height;
+
+    pDIBBase = malloc(DIBWidth * DIBHeight);
+    if (pDIBBase == NULL)
+        return 0;
+
+    pDIB = pDIBBase;
+    DIBPitch = DIBWidth;    // top-down
+
+    // Clear the framebuffer, and drop any frame that was built for
+    // the old one
+    memset(pDIBBase, 0, DIBWidth*DIBHeight);
+    framepending = 0;
+
+    InitViewState();
+    SelectTransformKernel();
+    if (!InitArenas() || !InitSurfaceCache())
+        return 0;
+    for (i=0 ; i<NUM_ENTITIES ; i++)
+        SetUpObjectBounds(&entities[i]);
+    BuildBenchScene(0);
+
+    return 1;
 }
 
 /////////////////////////////////////////////////////////////////////
-// 3-D cross product.
+// Release the framebuffer allocated by InitFramebuffer.
 /////////////////////////////////////////////////////////////////////
-void CrossProduct(point_t *in1, point_t *in2, point_t *out)
+void FreeFramebuffer(void)
 {
-    out->v[0] = in1->v[1] * in2->v[2] - in1->v[2] * in2->v[1];
-    out->v[1] = in1->v[2] * in2->v[0] - in1->v[0] * in2->v[2];
-    out->v[2] = in1->v[0] * in2->v[1] - in1->v[1] * in2->v[0];
+    free(pDIBBase);
+    pDIBBase = pDIB = NULL;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Concatenate two 3x3 matrices.
+// Replace the world with numcubes cubes laid out on a square grid,
+// floating at three different heights over a floor sized to cover
+// the grid, or restore the built-in world if numcubes is 0. The
+// layout matches BuildBenchScene in clip.c exactly, so both
+// renderers draw the same geometry. Returns the number of polygons
+// in the world, or 0 on failure.
 /////////////////////////////////////////////////////////////////////
-void MConcat(double in1[3][3], double in2[3][3], double out[3][3])
+int BuildBenchScene(int numcubes)
 {
-    int     i, j;
+    int             i, side;
+    double          halfsize, floorsize;
+    convexobject_t  *pobject;
 
-    for (i=0 ; i<3 ; i++)
-    {
-        for (j=0 ; j<3 ; j++)
-        {
-            out[i][j] = in1[i][0] * in2[0][j] +
-                        in1[i][1] * in2[1][j] +
-                        in1[i][2] * in2[2][j];
-        }
-    }
-}
+    ReleaseWorld();
 
-/////////////////////////////////////////////////////////////////////
-// Project viewspace polygon vertices into screen coordinates.
-// Note that the y axis goes up in worldspace and viewspace, but
-// goes down in screenspace.
-/////////////////////////////////////////////////////////////////////
-void ProjectPolygon (polygon_t *ppoly, polygon2D_t *ppoly2D)
-{
-    int     i;
-    double  zrecip;
+    free(benchobjects);
+    benchobjects = NULL;
+    free(benchpolys);
+    benchpolys = NULL;
 
-    for (i=0 ; i<ppoly->numverts ; i++)
+    if (numcubes <= 0)
+        return SetUpWorld(objects, sizeof(objects) / sizeof(objects[0]));
+
+    benchobjects = calloc(numcubes + 1, sizeof(convexobject_t));
+    if (benchobjects == NULL)
+        return 0;
+
+    side = (int)ceil(sqrt((double)numcubes));
+    halfsize = side * BENCH_CUBE_SPACING / 2.0;
+
+    for (i=0 ; i<numcubes ; i++)
     {
-        zrecip = 1.0 / ppoly->verts[i].v[2];
-        ppoly2D->verts[i].x =
-                ppoly->verts[i].v[0] * zrecip * maxscale + xcenter;
-        ppoly2D->verts[i].y = ycenter -
-                (ppoly->verts[i].v[1] * zrecip * maxscale);
+        pobject = &benchobjects[i];
+        pobject->center.v[0] = (i % side) * BENCH_CUBE_SPACING -
+                halfsize + BENCH_CUBE_SPACING / 2.0;
+        pobject->center.v[1] = 30.0 + (i % 3) * 15.0;
+        pobject->center.v[2] = (i / side) * BENCH_CUBE_SPACING -
+                halfsize + BENCH_CUBE_SPACING / 2.0;
+        pobject->numpolys = sizeof(polys0) / sizeof(polys0[0]);
+        pobject->ppoly = polys0;
     }
 
-    ppoly2D->numverts = ppoly->numverts;
+    // The floor is at y = -20, like the built-in world's, and is
+    // last in the list
+    floorsize = halfsize + BENCH_CUBE_SPACING;
+    benchfloor[0].color = 1;
+    benchfloor[0].numverts = 4;
+    for (i=0 ; i<4 ; i++)
+        benchfloor[0].verts[i].v[1] = 0.0;
+    benchfloor[0].verts[0].v[0] = -floorsize;
+    benchfloor[0].verts[0].v[2] = -floorsize;
+    benchfloor[0].verts[1].v[0] = -floorsize;
+    benchfloor[0].verts[1].v[2] = floorsize;
+    benchfloor[0].verts[2].v[0] = floorsize;
+    benchfloor[0].verts[2].v[2] = floorsize;
+    benchfloor[0].verts[3].v[0] = floorsize;
+    benchfloor[0].verts[3].v[2] = -floorsize;
+    benchfloor[0].plane.distance = 0.0;
+    benchfloor[0].plane.normal.v[0] = 0.0;
+    benchfloor[0].plane.normal.v[1] = 1.0;
+    benchfloor[0].plane.normal.v[2] = 0.0;
+
+    pobject = &benchobjects[numcubes];
+    pobject->center.v[0] = 0.0;
+    pobject->center.v[1] = -20.0;
+    pobject->center.v[2] = 0.0;
+    pobject->numpolys = 1;
+    pobject->ppoly = benchfloor;
+
+    return SetUpWorld(benchobjects, numcubes + 1);
 }
 
 /////////////////////////////////////////////////////////////////////
-// Move the view position and set the world->view transform.
+// Replace the world with a generated scene of numboxes boxes, each
+// of one of numshapes box shapes, standing on a floor of square
+// tiles that covers them all. Boxes of the same shape share their
+// polygons, and so their mesh, and the floor tiles share theirs.
+// The scene matches BuildBoxScene in clip.c exactly. Returns the
+// number of polygons in the world, or 0 on failure.
 /////////////////////////////////////////////////////////////////////
-void UpdateViewPos()
+int BuildBoxScene(benchshape_t *pshapes, int numshapes,
+                  benchbox_t *pboxes, int numboxes)
 {
-    int     i;
-    point_t motionvec;
-    double  s, c, mtemp1[3][3], mtemp2[3][3];
+    int             i, j, k, tilesx, tilesz, numtiles;
+    double          mins[2], maxs[2], extent;
+    convexobject_t  *pobject;
+    polygon_t       *ppoly;
 
-    // Move in the view direction, across the x-y plane, as if
-    // walking. This approach moves slower when looking up or
-    // down at more of an angle
-    motionvec.v[0] = DotProduct(&vpn, &xaxis);
-    motionvec.v[1] = 0.0;
-    motionvec.v[2] = DotProduct(&vpn, &zaxis);
+    ReleaseWorld();
 
-    for (i=0 ; i<3 ; i++)
-    {
-        currentpos.v[i] += motionvec.v[i] * currentspeed;
-        if (currentpos.v[i] > MAX_COORD)
-            currentpos.v[i] = MAX_COORD;
-        if (currentpos.v[i] < -MAX_COORD)
-            currentpos.v[i] = -MAX_COORD;
-    }
+    free(benchobjects);
+    benchobjects = NULL;
+    free(benchpolys);
+    benchpolys = NULL;
 
-    // Set up the world-to-view rotation.
-    // Note: much of the work done in concatenating these matrices
-    // can be factored out, since it contributes nothing to the
-    // final result; multiply the three matrices together on paper
-    // to generate a minimum equation for each of the 9 final elements
-    s = sin(roll);
-    c = cos(roll);
-    mroll[0][0] = c;
-    mroll[0][1] = s;
-    mroll[1][0] = -s;
-    mroll[1][1] = c;
+    if ((numshapes <= 0) || (numboxes <= 0))
+        return 0;
 
-    s = sin(pitch);
-    c = cos(pitch);
-    mpitch[1][1] = c;
-    mpitch[1][2] = s;
-    mpitch[2][1] = -s;
-    mpitch[2][2] = c;
+    // Every shape is the unit cube stretched out to its size, so its
+    // faces wind the same way, and face the same ways, as polys0's
+    benchpolys = malloc(numshapes * 6 * sizeof(polygon_t));
+    if (benchpolys == NULL)
+        return 0;
 
-    s = sin(yaw);
-    c = cos(yaw);
-    myaw[0][0] = c;
-    myaw[0][2] = -s;
-    myaw[2][0] = s;
-    myaw[2][2] = c;
+    for (i=0 ; i<numshapes ; i++)
+    {
+        for (j=0 ; j<6 ; j++)
+        {
+            ppoly = &benchpolys[i*6+j];
+            *ppoly = polys0[j];
+            ppoly->color = pshapes[i].color;
+            ppoly->plane.distance = 0.0;
+            for (k=0 ; k<3 ; k++)
+            {
+                ppoly->plane.distance += fabs(ppoly->plane.normal.v[k]) *
+                        pshapes[i].halfsize[k];
+            }
+            for (k=0 ; k<4 ; k++)
+            {
+                ppoly->verts[k].v[0] *= pshapes[i].halfsize[0] / 10.0;
+                ppoly->verts[k].v[1] *= pshapes[i].halfsize[1] / 10.0;
+                ppoly->verts[k].v[2] *= pshapes[i].halfsize[2] / 10.0;
+            }
+        }
+    }
 
-    MConcat(mroll, myaw, mtemp1);
-    MConcat(mpitch, mtemp1, mtemp2);
+    // Find how much floor the boxes need
+    mins[0] = mins[1] = 999999.0;
+    maxs[0] = maxs[1] = -999999.0;
+    for (i=0 ; i<numboxes ; i++)
+    {
+        for (j=0 ; j<2 ; j++)
+        {
+            extent = pshapes[pboxes[i].shape].halfsize[j*2];
+            if (pboxes[i].center[j*2] - extent < mins[j])
+                mins[j] = pboxes[i].center[j*2] - extent;
+            if (pboxes[i].center[j*2] + extent > maxs[j])
+                maxs[j] = pboxes[i].center[j*2] + extent;
+        }
+    }
+    mins[0] -= BENCH_CUBE_SPACING;
+    mins[1] -= BENCH_CUBE_SPACING;
+    tilesx = (int)ceil((maxs[0] + BENCH_CUBE_SPACING - mins[0]) /
+                       BENCH_FLOOR_TILE);
+    tilesz = (int)ceil((maxs[1] + BENCH_CUBE_SPACING - mins[1]) /
+                       BENCH_FLOOR_TILE);
+    numtiles = tilesx * tilesz;
+
+    benchobjects = calloc(numboxes + numtiles, sizeof(convexobject_t));
+    if (benchobjects == NULL)
+        return 0;
 
-    // Break out the rotation matrix into vright, vup, and vpn.
-    // We could work directly with the matrix; breaking it out
-    // into three vectors is just to make things clearer
-    for (i=0 ; i<3 ; i++)
+    for (i=0 ; i<numboxes ; i++)
     {
-        vright.v[i] = mtemp2[0][i];
-        vup.v[i] = mtemp2[1][i];
-        vpn.v[i] = mtemp2[2][i];
+        pobject = &benchobjects[i];
+        for (k=0 ; k<3 ; k++)
+            pobject->center.v[k] = pboxes[i].center[k];
+        pobject->numpolys = 6;
+        pobject->ppoly = &benchpolys[pboxes[i].shape*6];
     }
 
-    // Simulate crude friction
-    if (currentspeed > (MOVEMENT_SPEED * speedscale / 2.0))
-        currentspeed -= MOVEMENT_SPEED * speedscale / 2.0;
-    else if (currentspeed < -(MOVEMENT_SPEED * speedscale / 2.0))
-        currentspeed += MOVEMENT_SPEED * speedscale / 2.0;
-    else
-        currentspeed = 0.0;
+    // The floor is at y = -20, like the built-in world's, and one
+    // floor polygon that big would be cut into more pieces than a
+    // mesh can hold, so it's laid in tiles, after the boxes
+    benchfloor[0].color = 1;
+    benchfloor[0].numverts = 4;
+    for (i=0 ; i<4 ; i++)
+        benchfloor[0].verts[i].v[1] = 0.0;
+    benchfloor[0].verts[0].v[0] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[0].v[2] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[1].v[0] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[1].v[2] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[2].v[0] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[2].v[2] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[3].v[0] = BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].verts[3].v[2] = -BENCH_FLOOR_TILE / 2.0;
+    benchfloor[0].plane.distance = 0.0;
+    benchfloor[0].plane.normal.v[0] = 0.0;
+    benchfloor[0].plane.normal.v[1] = 1.0;
+    benchfloor[0].plane.normal.v[2] = 0.0;
+
+    for (i=0 ; i<numtiles ; i++)
+    {
+        pobject = &benchobjects[numboxes + i];
+        pobject->center.v[0] = mins[0] +
+                ((i % tilesx) + 0.5) * BENCH_FLOOR_TILE;
+        pobject->center.v[1] = -20.0;
+        pobject->center.v[2] = mins[1] +
+                ((i / tilesx) + 0.5) * BENCH_FLOOR_TILE;
+        pobject->numpolys = 1;
+        pobject->ppoly = benchfloor;
+    }
+
+    return SetUpWorld(benchobjects, numboxes + numtiles);
 }
 
 /////////////////////////////////////////////////////////////////////
-// Rotate a vector from viewspace to worldspace.
+// Returns the time in milliseconds from the start of the
+// UpdateWorld call that began the last frame presented to the end
+// of presenting it; one frame time more than the frame time when
+// pipelining.
 /////////////////////////////////////////////////////////////////////
-void BackRotateVector(point_t *pin, point_t *pout)
+double GetFrameLatency(void)
 {
-    int     i;
-
-    // Rotate into the world orientation
-    for (i=0 ; i<3 ; i++)
-    {
-        pout->v[i] = pin->v[0] * vright.v[i] +
-                     pin->v[1] * vup.v[i] +
-                     pin->v[2] * vpn.v[i];
-    }
+    return framelatency * 1000.0;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Transform a point from worldspace to viewspace.
+// Returns the name of the specified per-frame pool, and its peak
+// use and capacity in items, the number of frames that have had to
+// grow it, whether the last one did, the number of frames that had
+// to drop polygons, spans, or bands because it was full and memory
+// ran out, and how many times the last one did, or NULL if there's
+// no such pool. The edge tables' and the bands' pools are reported
+// as the totals over all the tables and bands in use.
 /////////////////////////////////////////////////////////////////////
-void TransformPoint(point_t *pin, point_t *pout)
+char *GetArenaStats(int arena, int *peak, int *capacity, int *growframes,
+                    int *grew, int *overflowframes, int *overflowed)
 {
-    int     i;
-    point_t tvert;
+    int     i, count;
+    arena_t *parena;
 
-    // Translate into a viewpoint-relative coordinate
-    for (i=0 ; i<3 ; i++)
+    if ((arena < 0) || (arena >= NUM_TABLE_ARENAS + NUM_BAND_ARENAS))
+        return NULL;
+
+    *peak = *capacity = *growframes = *grew = 0;
+    *overflowframes = *overflowed = 0;
+
+    count = (arena < NUM_TABLE_ARENAS) ? (pipelining ? 2 : 1) : numbands;
+
+    for (i=0 ; i<count ; i++)
     {
-        tvert.v[i] = pin->v[i] - currentpos.v[i];
+        if (arena < NUM_TABLE_ARENAS)
+            parena = &edgetables[i].arenas[arena];
+        else
+            parena = &bands[i].arenas[arena - NUM_TABLE_ARENAS];
+
+        *peak += parena->peak;
+        *capacity += parena->capacity;
+        *growframes += parena->growframes;
+        *grew |= parena->grew;
+        *overflowframes += parena->overflowframes;
+        *overflowed += parena->overflowed;
     }
 
-    // Rotate into the view orientation
-    pout->v[0] = DotProduct(&tvert, &vright);
-    pout->v[1] = DotProduct(&tvert, &vup);
-    pout->v[2] = DotProduct(&tvert, &vpn);
+    // Named from the tables, since the first band never sets up its
+    // copy pools
+    if (arena < NUM_TABLE_ARENAS)
+        return tablearenas[arena].name;
+
+    return bandarenas[arena - NUM_TABLE_ARENAS].name;
 }
 
+#endif  // HEADLESS
+
 /////////////////////////////////////////////////////////////////////
-// Transform a polygon from worldspace to viewspace.
+// Throw away the current world, and everything built from it.
 /////////////////////////////////////////////////////////////////////
-void TransformPolygon(polygon_t *pinpoly, polygon_t *poutpoly)
+void ReleaseWorld(void)
 {
-    int     i;
-
-    for (i=0 ; i<pinpoly->numverts ; i++)
-    {
-        TransformPoint(&pinpoly->verts[i], &poutpoly->verts[i]);
-    }
-
-    poutpoly->numverts = pinpoly->numverts;
+    // Lighting is per object, and the cache is full of textures lit
+    // with it, so both go with the objects, as does the BSP tree
+    // compiled from them and the BVH over them. Any frame built but
+    // not yet scanned is of the old objects, so it's dropped
+    FreeLighting();
+    FreeBSPTree();
+    FreeBVH();
+    framepending = 0;
+
+    // Start the entities over at the beginning of their orbits
+    entityframe = 0;
+
+    // Meshes are shared by objects made of the same polygons, but
+    // the next world's polygons may be somewhere else entirely
+    FreeMeshes();
+
+    // Pools keep the capacity they've grown to, but start counting
+    // afresh
+    ResetArenaStats();
+
+    free(worldobjects);
+    worldobjects = NULL;
+    FreeWorldFile();
 }
 
 /////////////////////////////////////////////////////////////////////
-// Returns true if polygon faces the viewpoint, assuming a clockwise
-// winding of vertices as seen from the front.
+// Make the world out of count objects, linked into the object list
+// in order, set up their bounds, meshes, and lighting, and build
+// whatever the visibility mode walks. Returns the number of polygons
+// in the world, or 0 on failure.
 /////////////////////////////////////////////////////////////////////
-int PolyFacesViewer(polygon_t *ppoly, plane_t *pplane)
+int SetUpWorld(convexobject_t *pobjects, int count)
 {
-    int     i;
-    point_t viewvec;
+    int     i, numpolys;
 
-    for (i=0 ; i<3 ; i++)
+    objecthead.pnext = &pobjects[0];
+    numobjects = count;
+
+    numpolys = 0;
+    for (i=0 ; i<count ; i++)
     {
-        viewvec.v[i] = ppoly->verts[0].v[i] - currentpos.v[i];
-    }
+        pobjects[i].pnext = (i < count - 1) ? &pobjects[i+1] :
+                &objecthead;
 
-    // Use an epsilon here so we don't get polygons tilted so
-    // sharply that the gradients are unusable or invalid
-    if (DotProduct (&viewvec, &pplane->normal) < -0.01)
-        return 1;
-    else
+        SetUpObjectBounds(&pobjects[i]);
+        if (!SetUpObjectMesh(&pobjects[i]) ||
+            !SetUpObjectLighting(&pobjects[i]))
+        {
+            return 0;
+        }
+        numpolys += pobjects[i].numpolys;
+    }
+
+    if ((vismode >= VIS_BSP) && (vismode <= VIS_PORTALS) &&
+        !BuildBSPTree())
+    {
+        return 0;
+    }
+    if ((vismode == VIS_PVS) && !BuildPVS())
+        return 0;
+    if ((vismode == VIS_PORTALS) && !BuildPortals())
         return 0;
+    if ((vismode == VIS_BVH) && !BuildBVH())
+        return 0;
+
+    return numpolys;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Set up a clip plane with the specified normal.
+// Returns one of an object's polygons. Polygons in a world file are
+// copied out into ptemp, and a pointer to that is returned.
 /////////////////////////////////////////////////////////////////////
-void SetWorldspaceClipPlane(point_t *normal, plane_t *plane)
+polygon_t *GetObjectPolygon(convexobject_t *pobject, int poly,
+                            polygon_t *ptemp)
 {
+    int         i, j;
+    dpolygon_t  *pdpoly;
+    dvertex_t   *pdvert;
+    dplane_t    *pdplane;
 
-    // Rotate the plane normal into worldspace
-    BackRotateVector(normal, &plane->normal);
+    if (pobject->ppoly)
+        return &pobject->ppoly[poly];
 
-    plane->distance = DotProduct(&currentpos, &plane->normal) +
-            CLIP_PLANE_EPSILON;
+    pdpoly = &pobject->pdpoly[poly];
+    pdvert = &worldverts[pdpoly->firstvert];
+    pdplane = &worldplanes[pdpoly->planenum];
+
+    ptemp->color = pdpoly->color;
+    ptemp->numverts = pdpoly->numverts;
+    for (i=0 ; i<pdpoly->numverts ; i++)
+    {
+        for (j=0 ; j<3 ; j++)
+            ptemp->verts[i].v[j] = pdvert[i].point[j];
+    }
+    for (j=0 ; j<3 ; j++)
+        ptemp->plane.normal.v[j] = pdplane->normal[j];
+    ptemp->plane.distance = pdplane->dist;
+
+    return ptemp;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Set up the planes of the frustum, in worldspace coordinates.
+// Returns true if ints and floats are stored little-endian, as they
+// are in world files.
 /////////////////////////////////////////////////////////////////////
-void SetUpFrustum(void)
+int HostIsLittleEndian(void)
 {
-    double  angle, s, c;
-    point_t normal;
+    int     one;
 
-    angle = atan(2.0 / fieldofview * maxscale / xscreenscale);
-    s = sin(angle);
-    c = cos(angle);
+    one = 1;
 
-    // Left clip plane
-    normal.v[0] = s;
-    normal.v[1] = 0;
-    normal.v[2] = c;
-    SetWorldspaceClipPlane(&normal, &frustumplanes[0]);
+    return *(unsigned char *)&one == 1;
+}
 
-    // Right clip plane
-    normal.v[0] = -s;
-    SetWorldspaceClipPlane(&normal, &frustumplanes[1]);
+/////////////////////////////////////////////////////////////////////
+// Map a world file into memory, read-only, and set worldbase and
+// worldsize. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int MapWorldFile(char *filename)
+{
+#if !defined(HEADLESS) || defined(_WIN32)
+    HANDLE          hfile, hmapping;
+    DWORD           size;
 
-    angle = atan(2.0 / fieldofview * maxscale / yscreenscale);
-    s = sin(angle);
-    c = cos(angle);
+    hfile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE)
+        return 0;
 
-    // Bottom clip plane
-    normal.v[0] = 0;
-    normal.v[1] = s;
-    normal.v[2] = c;
-    SetWorldspaceClipPlane(&normal, &frustumplanes[2]);
+    size = GetFileSize(hfile, NULL);
+    if ((size == INVALID_FILE_SIZE) || (size < sizeof(dheader_t)) ||
+        (size > MAX_INT))
+    {
+        CloseHandle(hfile);
+        return 0;
+    }
 
-    // Top clip plane
-    normal.v[1] = -s;
-    SetWorldspaceClipPlane(&normal, &frustumplanes[3]);
+    // The view keeps the file open until it's unmapped
+    hmapping = CreateFileMapping(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hfile);
+    if (hmapping == NULL)
+        return 0;
+
+    worldbase = MapViewOfFile(hmapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmapping);
+    worldsize = (int)size;
+#else
+    int             fd;
+    struct stat     st;
+    void            *pbase;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if ((fstat(fd, &st) < 0) ||
+        (st.st_size < (off_t)sizeof(dheader_t)) ||
+        (st.st_size > MAX_INT))
+    {
+        close(fd);
+        return 0;
+    }
+
+    // The mapping keeps the file open until it's unmapped
+    pbase = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    worldbase = (pbase == MAP_FAILED) ? NULL : pbase;
+    worldsize = (int)st.st_size;
+#endif
+
+    return (worldbase != NULL);
 }
 
 /////////////////////////////////////////////////////////////////////
-// Clip a polygon to a plane.
+// Unmap the world file mapped by MapWorldFile, if there is one.
 /////////////////////////////////////////////////////////////////////
-int ClipToPlane(polygon_t *pin, plane_t *pplane, polygon_t *pout)
+void FreeWorldFile(void)
 {
-    int     i, j, nextvert, curin, nextin;
-    double  curdot, nextdot, scale;
-    point_t *pinvert, *poutvert;
+    if (worldbase == NULL)
+        return;
+
+#if !defined(HEADLESS) || defined(_WIN32)
+    UnmapViewOfFile(worldbase);
+#else
+    munmap(worldbase, worldsize);
+#endif
+
+    worldbase = NULL;
+    worldsize = 0;
+    worldverts = NULL;
+    worldplanes = NULL;
+    worldpolys = NULL;
+    numworldverts = numworldplanes = numworldpolys = 0;
+}
 
-    pinvert = pin->verts;
-    poutvert = pout->verts;
+/////////////////////////////////////////////////////////////////////
+// Returns a pointer to one of the mapped world file's tables, and
+// sets *pcount to the number of entries of the specified size in it,
+// or returns NULL if the table isn't all in the file, or isn't
+// aligned, or isn't a whole number of entries.
+/////////////////////////////////////////////////////////////////////
+void *GetWorldLump(int lump, int entrysize, int *pcount)
+{
+    lump_t  *plump;
 
-    curdot = DotProduct(pinvert, &pplane->normal);
-    curin = (curdot >= pplane->distance);
+    plump = &((dheader_t *)worldbase)->lumps[lump];
 
-    for (i=0 ; i<pin->numverts ; i++)
+    if ((plump->fileofs < (int)sizeof(dheader_t)) ||
+        (plump->fileofs > worldsize) ||
+        (plump->filelen < 0) ||
+        (plump->filelen > worldsize - plump->fileofs) ||
+        (plump->fileofs & 3) ||
+        (plump->filelen % entrysize))
     {
-        nextvert = (i + 1) % pin->numverts;
+        return NULL;
+    }
 
-        // Keep the current vertex if it's inside the plane
-        if (curin)
-            *poutvert++ = *pinvert;
+    *pcount = plump->filelen / entrysize;
 
-        nextdot = DotProduct(&pin->verts[nextvert], &pplane->normal);
-        nextin = (nextdot >= pplane->distance);
+    return worldbase + plump->fileofs;
+}
 
-        // Add a clipped vertex if one end of the current edge is
-        // inside the plane and the other is outside
-        if (curin != nextin)
+/////////////////////////////////////////////////////////////////////
+// Replace the world with the one in a world file. The file is mapped
+// into memory, and its tables are used right where they are; after
+// a check that everything in them refers to something that's there,
+// all that's built is an object for each of its objects, and the
+// meshes and lighting that are built for any world. If the file
+// can't be used, the built-in world is restored. Returns the number
+// of polygons in the world, or 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int LoadWorldFile(char *filename)
+{
+    int             i, j, numdobjects, numpolys;
+    dheader_t       *pheader;
+    dobject_t       *pdobjects, *pdobject;
+    dpolygon_t      *pdpoly;
+    convexobject_t  *pobject;
+
+    ReleaseWorld();
+#ifdef HEADLESS
+    free(benchobjects);
+    benchobjects = NULL;
+#endif
+
+    if (!HostIsLittleEndian() || !MapWorldFile(filename))
+        goto Failed;
+
+    pheader = (dheader_t *)worldbase;
+    if ((pheader->ident != WORLD_IDENT) ||
+        (pheader->version != WORLD_VERSION))
+    {
+        goto Failed;
+    }
+
+    worldverts = GetWorldLump(LUMP_VERTEXES, sizeof(dvertex_t),
+                              &numworldverts);
+    worldplanes = GetWorldLump(LUMP_PLANES, sizeof(dplane_t),
+                               &numworldplanes);
+    worldpolys = GetWorldLump(LUMP_POLYGONS, sizeof(dpolygon_t),
+                              &numworldpolys);
+    pdobjects = GetWorldLump(LUMP_OBJECTS, sizeof(dobject_t),
+                             &numdobjects);
+    if ((worldverts == NULL) || (worldplanes == NULL) ||
+        (worldpolys == NULL) || (pdobjects == NULL) ||
+        (numdobjects < 1))
+    {
+        goto Failed;
+    }
+
+    for (i=0 ; i<numworldpolys ; i++)
+    {
+        pdpoly = &worldpolys[i];
+        if ((pdpoly->numverts < 3) ||
+            (pdpoly->numverts > MAX_POLY_VERTS) ||
+            (pdpoly->firstvert < 0) ||
+            (pdpoly->firstvert > numworldverts - pdpoly->numverts) ||
+            (pdpoly->planenum < 0) ||
+            (pdpoly->planenum >= numworldplanes) ||
+            (pdpoly->color < 0) || (pdpoly->color > 255))
         {
-            scale = (pplane->distance - curdot) /
-                    (nextdot - curdot);
-            for (j=0 ; j<3 ; j++)
+            goto Failed;
+        }
+    }
+
+    worldobjects = calloc(numdobjects, sizeof(convexobject_t));
+    if (worldobjects == NULL)
+        goto Failed;
+
+    for (i=0 ; i<numdobjects ; i++)
+    {
+        pdobject = &pdobjects[i];
+        if ((pdobject->numpolys < 1) || (pdobject->firstpoly < 0) ||
+            (pdobject->firstpoly > numworldpolys - pdobject->numpolys))
+        {
+            goto Failed;
+        }
+
+        pobject = &worldobjects[i];
+        for (j=0 ; j<3 ; j++)
+            pobject->center.v[j] = pdobject->center[j];
+        pobject->numpolys = pdobject->numpolys;
+        pobject->pdpoly = &worldpolys[pdobject->firstpoly];
+    }
+
+    numpolys = SetUpWorld(worldobjects, numdobjects);
+    if (numpolys == 0)
+        goto Failed;
+
+    return numpolys;
+
+Failed:
+    ReleaseWorld();
+    SetUpWorld(objects, sizeof(objects) / sizeof(objects[0]));
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Write the current world out as a world file, converting it from
+// whatever tables it's in. Objects made of the same polygons share
+// them in the file, and each object's polygons share planes. Returns
+// 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int SaveWorldFile(char *filename)
+{
+    int             i, j, k, numverts, numplanes, numpolys, count;
+    int             ok;
+    FILE            *pfile;
+    dheader_t       header;
+    dvertex_t       *pdverts;
+    dplane_t        *pdplanes, dplane;
+    dpolygon_t      *pdpolys;
+    dobject_t       *pdobjects;
+    convexobject_t  *pobject, *pother;
+    polygon_t       temppoly, *ppoly;
+
+    if (!HostIsLittleEndian())
+        return 0;
+
+    // Allocate for the worst case, with nothing shared
+    numverts = numpolys = 0;
+    for (pobject = objecthead.pnext ; pobject != &objecthead ;
+         pobject = pobject->pnext)
+    {
+        for (i=0 ; i<pobject->numpolys ; i++)
+        {
+            ppoly = GetObjectPolygon(pobject, i, &temppoly);
+            numverts += ppoly->numverts;
+        }
+        numpolys += pobject->numpolys;
+    }
+
+    pdverts = malloc(numverts * sizeof(dvertex_t));
+    pdplanes = malloc(numpolys * sizeof(dplane_t));
+    pdpolys = malloc(numpolys * sizeof(dpolygon_t));
+    pdobjects = malloc(numobjects * sizeof(dobject_t));
+    pfile = NULL;
+    ok = 0;
+
+    if ((pdverts == NULL) || (pdplanes == NULL) || (pdpolys == NULL) ||
+        (pdobjects == NULL))
+    {
+        goto Done;
+    }
+
+    numverts = numplanes = numpolys = count = 0;
+    for (pobject = objecthead.pnext ; pobject != &objecthead ;
+         pobject = pobject->pnext, count++)
+    {
+        for (j=0 ; j<3 ; j++)
+            pdobjects[count].center[j] = (float)pobject->center.v[j];
+        pdobjects[count].numpolys = pobject->numpolys;
+
+        // Share the polygons of an earlier object made of the same
+        // ones
+        for (pother = objecthead.pnext, k = 0 ; pother != pobject ;
+             pother = pother->pnext, k++)
+        {
+            if ((pother->ppoly == pobject->ppoly) &&
+                (pother->pdpoly == pobject->pdpoly) &&
+                (pother->numpolys == pobject->numpolys))
             {
-                poutvert->v[j] = pinvert->v[j] +
-                    ((pin->verts[nextvert].v[j] - pinvert->v[j]) *
-                     scale);
+                break;
             }
-            poutvert++;
+        }
+        if (pother != pobject)
+        {
+            pdobjects[count].firstpoly = pdobjects[k].firstpoly;
+            continue;
         }
 
-        curdot = nextdot;
-        curin = nextin;
-        pinvert++;
+        pdobjects[count].firstpoly = numpolys;
+
+        for (i=0 ; i<pobject->numpolys ; i++)
+        {
+            ppoly = GetObjectPolygon(pobject, i, &temppoly);
+
+            for (j=0 ; j<3 ; j++)
+                dplane.normal[j] = (float)ppoly->plane.normal.v[j];
+            dplane.dist = (float)ppoly->plane.distance;
+
+            for (k=pdobjects[count].firstpoly ; k<numpolys ; k++)
+            {
+                if (!memcmp(&pdplanes[pdpolys[k].planenum], &dplane,
+                            sizeof(dplane_t)))
+                {
+                    break;
+                }
+            }
+
+            pdpolys[numpolys].planenum = (k < numpolys) ?
+                    pdpolys[k].planenum : numplanes;
+            if (k == numpolys)
+                pdplanes[numplanes++] = dplane;
+
+            pdpolys[numpolys].color = (short)ppoly->color;
+            pdpolys[numpolys].numverts = (short)ppoly->numverts;
+            pdpolys[numpolys].firstvert = numverts;
+            for (k=0 ; k<ppoly->numverts ; k++)
+            {
+                for (j=0 ; j<3 ; j++)
+                {
+                    pdverts[numverts].point[j] =
+                            (float)ppoly->verts[k].v[j];
+                }
+                numverts++;
+            }
+
+            numpolys++;
+        }
     }
 
-    pout->numverts = poutvert - pout->verts;
-    if (pout->numverts < 3)
-        return 0;
+    // The tables follow the header, in lump order
+    header.ident = WORLD_IDENT;
+    header.version = WORLD_VERSION;
+    header.lumps[LUMP_VERTEXES].fileofs = sizeof(dheader_t);
+    header.lumps[LUMP_VERTEXES].filelen = numverts * sizeof(dvertex_t);
+    header.lumps[LUMP_PLANES].fileofs =
+            header.lumps[LUMP_VERTEXES].fileofs +
+            header.lumps[LUMP_VERTEXES].filelen;
+    header.lumps[LUMP_PLANES].filelen = numplanes * sizeof(dplane_t);
+    header.lumps[LUMP_POLYGONS].fileofs =
+            header.lumps[LUMP_PLANES].fileofs +
+            header.lumps[LUMP_PLANES].filelen;
+    header.lumps[LUMP_POLYGONS].filelen = numpolys * sizeof(dpolygon_t);
+    header.lumps[LUMP_OBJECTS].fileofs =
+            header.lumps[LUMP_POLYGONS].fileofs +
+            header.lumps[LUMP_POLYGONS].filelen;
+    header.lumps[LUMP_OBJECTS].filelen = count * sizeof(dobject_t);
+
+    pfile = fopen(filename, "wb");
+    if (pfile == NULL)
+        goto Done;
+
+    ok = (fwrite(&header, sizeof(header), 1, pfile) == 1) &&
+         (fwrite(pdverts, sizeof(dvertex_t), numverts, pfile) ==
+                numverts) &&
+         (fwrite(pdplanes, sizeof(dplane_t), numplanes, pfile) ==
+                numplanes) &&
+         (fwrite(pdpolys, sizeof(dpolygon_t), numpolys, pfile) ==
+                numpolys) &&
+         (fwrite(pdobjects, sizeof(dobject_t), count, pfile) == count);
+
+    if (fclose(pfile) != 0)
+        ok = 0;
 
-    return 1;
+Done:
+    free(pdverts);
+    free(pdplanes);
+    free(pdpolys);
+    free(pdobjects);
+
+    return ok;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Clip a polygon to the frustum.
+// Set the initial location, direction, and speed, and the
+// projection for the current framebuffer size.
 /////////////////////////////////////////////////////////////////////
-int ClipToFrustum(polygon_t *pin, polygon_t *pout)
+void InitViewState(void)
 {
-    int         i, curpoly;
-    polygon_t   tpoly[2], *ppoly;
+    int     i;
 
-    curpoly = 0;
-    ppoly = pin;
+    roll = 0.0;
+    pitch = 0.0;
+    yaw = 0.0;
+    currentspeed = 0.0;
+    currentpos.v[0] = 0.0;
+    currentpos.v[1] = 0.0;
+    currentpos.v[2] = 0.0;
+    // No view direction until the first UpdateViewPos, so the first
+    // frame doesn't move the viewpoint, just as at start-up
+    for (i=0 ; i<3 ; i++)
+        vpn.v[i] = vright.v[i] = vup.v[i] = 0.0;
+    fieldofview = 2.0;
+    xscreenscale = DIBWidth / fieldofview;
+    yscreenscale = DIBHeight / fieldofview;
+    maxscale = max(xscreenscale, yscreenscale);
+    maxscreenscaleinv = 1.0 / maxscale;
+    xcenter = DIBWidth / 2.0 - 0.5;
+    ycenter = DIBHeight / 2.0 - 0.5;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set the radius of the object's bounding sphere, which is centered
+// on the object's center, and its bounding box, from its polygons.
+/////////////////////////////////////////////////////////////////////
+void SetUpObjectBounds(convexobject_t *pobject)
+{
+    int         i, j, k;
+    vec_t       distsq, maxdistsq;
+    polygon_t   *ppoly, temppoly;
+
+    maxdistsq = 0.0;
+    for (k=0 ; k<3 ; k++)
+        pobject->mins.v[k] = pobject->maxs.v[k] = 0.0;
 
-    for (i=0 ; i<(NUM_FRUSTUM_PLANES-1); i++)
+    for (i=0 ; i<pobject->numpolys ; i++)
     {
-        if (!ClipToPlane(ppoly,
-                         &frustumplanes[i],
-                         &tpoly[curpoly]))
+        ppoly = GetObjectPolygon(pobject, i, &temppoly);
+
+        for (j=0 ; j<ppoly->numverts ; j++)
         {
-            return 0;
+            // Polygon vertices are relative to the object center
+            distsq = ppoly->verts[j].v[0] * ppoly->verts[j].v[0] +
+                     ppoly->verts[j].v[1] * ppoly->verts[j].v[1] +
+                     ppoly->verts[j].v[2] * ppoly->verts[j].v[2];
+            if (distsq > maxdistsq)
+                maxdistsq = distsq;
+
+            for (k=0 ; k<3 ; k++)
+            {
+                if (ppoly->verts[j].v[k] < pobject->mins.v[k])
+                    pobject->mins.v[k] = ppoly->verts[j].v[k];
+                if (ppoly->verts[j].v[k] > pobject->maxs.v[k])
+                    pobject->maxs.v[k] = ppoly->verts[j].v[k];
+            }
         }
-        ppoly = &tpoly[curpoly];
-        curpoly ^= 1;
     }
 
-    return ClipToPlane(ppoly,
-                       &frustumplanes[NUM_FRUSTUM_PLANES-1],
-                       pout);
+    pobject->radius = sqrt(maxdistsq);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the index of the mesh vertex at the specified point,
+// adding the point to the mesh if it's not already there.
+/////////////////////////////////////////////////////////////////////
+int FindMeshVertex(mesh_t *pmesh, point_t *ppoint)
+{
+    int     i;
+
+    for (i=0 ; i<pmesh->numverts ; i++)
+    {
+        if ((pmesh->verts[i].v[0] == ppoint->v[0]) &&
+            (pmesh->verts[i].v[1] == ppoint->v[1]) &&
+            (pmesh->verts[i].v[2] == ppoint->v[2]))
+        {
+            return i;
+        }
+    }
+
+    pmesh->verts[i] = *ppoint;
+    pmesh->numverts++;
+
+    return i;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the index of the mesh edge running from vertex v0 to
+// vertex v1, negated if the edge is stored running from v1 to v0,
+// as it is when another face has already added it, adding the edge
+// to the mesh if it's not already there.
+/////////////////////////////////////////////////////////////////////
+int FindMeshEdge(mesh_t *pmesh, int v0, int v1)
+{
+    int     i;
+
+    for (i=1 ; i<pmesh->numedges ; i++)
+    {
+        if ((pmesh->edges[i].v[0] == v1) && (pmesh->edges[i].v[1] == v0))
+            return -i;
+        if ((pmesh->edges[i].v[0] == v0) && (pmesh->edges[i].v[1] == v1))
+            return i;
+    }
+
+    pmesh->edges[i].v[0] = v0;
+    pmesh->edges[i].v[1] = v1;
+    pmesh->numedges++;
+
+    return i;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the color in the 6x6x6 color cube, or the gray ramp after
+// it, that's the specified number of steps brighter (or darker, if
+// negative) than the specified one.
+/////////////////////////////////////////////////////////////////////
+int ShadeColor(int color, int steps)
+{
+    int     i, c[3];
+
+    if (color >= 216)
+    {
+        color += steps * 2;
+        if (color < 216)
+            color = 216;
+        if (color > 235)
+            color = 235;
+        return color;
+    }
+
+    c[0] = color / 36;
+    c[1] = (color / 6) % 6;
+    c[2] = color % 6;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        // Leave black components black, so the hue holds as it
+        // brightens
+        if (c[i] == 0)
+            continue;
+        c[i] += steps;
+        if (c[i] < 0)
+            c[i] = 0;
+        if (c[i] > 5)
+            c[i] = 5;
+    }
+
+    return c[0] * 36 + c[1] * 6 + c[2];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Get the red, green, and blue components, 0-255, of a color in the
+// palette set up by InitInstance: the 6x6x6 color cube, then 20
+// grays.
+/////////////////////////////////////////////////////////////////////
+void PaletteRGB(int color, int *prgb)
+{
+    if (color >= 216)
+    {
+        prgb[0] = prgb[1] = prgb[2] = (color - 216) * 255 / 20;
+        return;
+    }
+
+    prgb[0] = (color / 36) * 255 / 6;
+    prgb[1] = ((color / 6) % 6) * 255 / 6;
+    prgb[2] = (color % 6) * 255 / 6;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the palette color closest to the specified red, green, and
+// blue components, from the gray ramp if gray is set, or else from
+// the color cube, so shading and averaging colors never changes
+// their hue to gray and back. The cube's levels are evenly spaced,
+// so the closest is just each component rounded to the closest
+// level.
+/////////////////////////////////////////////////////////////////////
+int NearestColor(int *prgb, int gray)
+{
+    int     i, c[3];
+
+    if (gray)
+    {
+        c[0] = ((prgb[0] + prgb[1] + prgb[2]) * 20 + 382) / 765;
+        return 216 + ((c[0] > 19) ? 19 : c[0]);
+    }
+
+    for (i=0 ; i<3 ; i++)
+    {
+        c[i] = (prgb[i] * 6 + 127) / 255;
+        if (c[i] > 5)
+            c[i] = 5;
+    }
+
+    return c[0] * 36 + c[1] * 6 + c[2];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the brick texture in the specified color, followed by its
+// mips at 1/2, 1/4, and 1/8 size, building them if they haven't been
+// already, or NULL if there's no memory for them. The bricks are the
+// color, flecked a step lighter, with mortar a step darker. Each mip
+// texel is the palette color closest to the average of the four
+// texels it covers in the mip above.
+/////////////////////////////////////////////////////////////////////
+unsigned char *GetTexture(int color)
+{
+    int             x, y, row, fleck, mip, size, i, j, sum[3], rgb[3];
+    unsigned char   *ptexel, *psrc;
+
+    color &= 0xFF;
+    if (textures[color])
+        return textures[color];
+
+    ptexel = textures[color] = malloc(MIPPED_TEXTURE_SIZE);
+    if (ptexel == NULL)
+        return NULL;
+
+    for (y=0 ; y<TEXTURE_SIZE ; y++)
+    {
+        row = y / BRICK_HEIGHT;
+
+        for (x=0 ; x<TEXTURE_SIZE ; x++)
+        {
+            fleck = ((x * 7 + y * 13) ^ (x * y)) & 15;
+
+            // Every other row of bricks is offset by half a brick
+            if (((y % BRICK_HEIGHT) == 0) ||
+                (((x + (row & 1) * (BRICK_WIDTH / 2)) % BRICK_WIDTH) == 0))
+            {
+                *ptexel++ = ShadeColor(color, -1);
+            }
+            else if (fleck == 0)
+            {
+                *ptexel++ = ShadeColor(color, 1);
+            }
+            else
+            {
+                *ptexel++ = color;
+            }
+        }
+    }
+
+    for (mip=1 ; mip<MIP_LEVELS ; mip++)
+    {
+        psrc = textures[color] + mipoffsets[mip - 1];
+        size = TEXTURE_SIZE >> mip;
+
+        for (y=0 ; y<size ; y++)
+        {
+            for (x=0 ; x<size ; x++)
+            {
+                sum[0] = sum[1] = sum[2] = 0;
+
+                for (i=0 ; i<4 ; i++)
+                {
+                    PaletteRGB(psrc[(y * 2 + (i >> 1)) * size * 2 +
+                                    x * 2 + (i & 1)], rgb);
+                    for (j=0 ; j<3 ; j++)
+                        sum[j] += rgb[j];
+                }
+
+                for (j=0 ; j<3 ; j++)
+                    sum[j] /= 4;
+
+                *ptexel++ = NearestColor(sum, color >= 216);
+            }
+        }
+    }
+
+    return textures[color];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Pick the texture s and t axes for a face from the worldspace axis
+// its normal is closest to, the way Quake does, so textures line up
+// across faces in the same plane. t runs down walls, so the bricks
+// stand the right way up.
+/////////////////////////////////////////////////////////////////////
+void SetUpTextureAxes(point_t *pnormal, point_t *paxes)
+{
+    int     i;
+    vec_t   ax, ay, az;
+
+    for (i=0 ; i<3 ; i++)
+        paxes[0].v[i] = paxes[1].v[i] = 0.0;
+
+    ax = fabs(pnormal->v[0]);
+    ay = fabs(pnormal->v[1]);
+    az = fabs(pnormal->v[2]);
+
+    if ((ay >= ax) && (ay >= az))
+    {
+        // Floor or ceiling
+        paxes[0].v[0] = TEXELS_PER_UNIT;
+        paxes[1].v[2] = TEXELS_PER_UNIT;
+    }
+    else if (ax >= az)
+    {
+        paxes[0].v[2] = TEXELS_PER_UNIT;
+        paxes[1].v[1] = -TEXELS_PER_UNIT;
+    }
+    else
+    {
+        paxes[0].v[0] = TEXELS_PER_UNIT;
+        paxes[1].v[1] = -TEXELS_PER_UNIT;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Split a polygon in half along whichever texture axis it spans
+// more than SUBDIVIDE_SIZE texels of, on a lightmap grid line, and
+// the halves again, until no piece is that big, so no face's lit
+// texture is too big to cache. The pieces are stored in pout, if
+// it's not NULL; returns how many there are, either way.
+/////////////////////////////////////////////////////////////////////
+int SubdividePolygon(polygon_t *ppoly, point_t *paxes, polygon_t *pout)
+{
+    int         i, j, axis, count;
+    vec_t       mins, maxs, dot, mid;
+    plane_t     plane;
+    polygon_t   halves[2];
+
+    for (axis=0 ; axis<2 ; axis++)
+    {
+        mins = 999999.0;
+        maxs = -999999.0;
+
+        for (i=0 ; i<ppoly->numverts ; i++)
+        {
+            dot = DotProduct(&ppoly->verts[i], &paxes[axis]);
+            if (dot < mins)
+                mins = dot;
+            if (dot > maxs)
+                maxs = dot;
+        }
+
+        if ((maxs - mins) <= SUBDIVIDE_SIZE)
+            continue;
+
+        mid = floor((mins + maxs) / (2 * LIGHTMAP_GRID)) * LIGHTMAP_GRID;
+
+        // Keep what's at or past mid along the axis, then what's at or
+        // before it. A vertex that was already on the line comes out
+        // twice, so drop repeats
+        plane.normal = paxes[axis];
+        plane.distance = mid;
+        ClipToPlane(ppoly, &plane, &halves[0]);
+
+        for (i=0 ; i<3 ; i++)
+            plane.normal.v[i] = -plane.normal.v[i];
+        plane.distance = -mid;
+        ClipToPlane(ppoly, &plane, &halves[1]);
+
+        count = 0;
+
+        for (i=0 ; i<2 ; i++)
+        {
+            halves[i].color = ppoly->color;
+            halves[i].plane = ppoly->plane;
+
+            for (j=halves[i].numverts-1 ; j>=0 ; j--)
+            {
+                if (memcmp(&halves[i].verts[j],
+                           &halves[i].verts[(j + 1) % halves[i].numverts],
+                           sizeof(point_t)) == 0)
+                {
+                    memmove(&halves[i].verts[j], &halves[i].verts[j+1],
+                            (halves[i].numverts - j - 1) * sizeof(point_t));
+                    halves[i].numverts--;
+                }
+            }
+
+            count += SubdividePolygon(&halves[i], paxes,
+                                      pout ? pout + count : NULL);
+        }
+
+        return count;
+    }
+
+    if (pout)
+        *pout = *ppoly;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the indexed mesh for an object's polygons, welding together
+// vertices at the same location and edges between the same two
+// vertices. Polygons too big to cache lit are subdivided, so there
+// can be more faces than polygons. Returns NULL on failure.
+/////////////////////////////////////////////////////////////////////
+mesh_t *BuildMesh(convexobject_t *pobject)
+{
+    int         i, j, maxverts, nextvert, padded, numfaces;
+    mesh_t      *pmesh;
+    mface_t     *pface;
+    polygon_t   *pfaces, *ppoly, temppoly;
+    point_t     texaxis[2];
+
+    numfaces = 0;
+    for (i=0 ; i<pobject->numpolys ; i++)
+    {
+        ppoly = GetObjectPolygon(pobject, i, &temppoly);
+        SetUpTextureAxes(&ppoly->plane.normal, texaxis);
+        numfaces += SubdividePolygon(ppoly, texaxis, NULL);
+    }
+
+    pfaces = malloc(numfaces * sizeof(polygon_t));
+    if (pfaces == NULL)
+        return NULL;
+
+    numfaces = 0;
+    maxverts = 0;
+    for (i=0 ; i<pobject->numpolys ; i++)
+    {
+        ppoly = GetObjectPolygon(pobject, i, &temppoly);
+        SetUpTextureAxes(&ppoly->plane.normal, texaxis);
+        numfaces += SubdividePolygon(ppoly, texaxis, &pfaces[numfaces]);
+    }
+
+    for (i=0 ; i<numfaces ; i++)
+        maxverts += pfaces[i].numverts;
+
+    // Allocate for the worst case, with nothing shared
+    pmesh = malloc(sizeof(mesh_t));
+    if (pmesh == NULL)
+    {
+        free(pfaces);
+        return NULL;
+    }
+
+    pmesh->ppoly = pobject->ppoly;
+    pmesh->pdpoly = pobject->pdpoly;
+    pmesh->numpolys = pobject->numpolys;
+    pmesh->numverts = 0;
+    pmesh->numedges = 1;
+    pmesh->numfaces = numfaces;
+    pmesh->verts = malloc(maxverts * sizeof(point_t));
+    pmesh->vertx = NULL;
+    pmesh->edges = malloc((maxverts + 1) * sizeof(medge_t));
+    pmesh->faces = malloc(numfaces * sizeof(mface_t));
+
+    if ((pmesh->verts == NULL) || (pmesh->edges == NULL) ||
+        (pmesh->faces == NULL))
+    {
+        goto Failed;
+    }
+
+    for (i=0 ; i<numfaces ; i++)
+    {
+        pface = &pmesh->faces[i];
+        pface->color = pfaces[i].color;
+        pface->numverts = pfaces[i].numverts;
+        pface->plane = pfaces[i].plane;
+        pface->ptexture = GetTexture(pface->color);
+        SetUpTextureAxes(&pface->plane.normal, pface->texaxis);
+
+        for (j=0 ; j<pface->numverts ; j++)
+        {
+            pface->verts[j] = FindMeshVertex(pmesh, &pfaces[i].verts[j]);
+        }
+
+        for (j=0 ; j<pface->numverts ; j++)
+        {
+            nextvert = j + 1;
+            if (nextvert >= pface->numverts)
+                nextvert = 0;
+
+            pface->edges[j] = FindMeshEdge(pmesh, pface->verts[j],
+                                           pface->verts[nextvert]);
+        }
+    }
+
+    // The caches only have room for so much of one object
+    if ((pmesh->numverts > MAX_MESH_VERTS) ||
+        (pmesh->numedges > MAX_MESH_EDGES))
+    {
+        goto Failed;
+    }
+
+    // Lay the vertices out again as separate x, y, and z arrays for
+    // the transform kernels, padded to a whole number of batches by
+    // repeating the last vertex
+    padded = (pmesh->numverts + VERT_BATCH - 1) & ~(VERT_BATCH - 1);
+    pmesh->vertx = malloc(padded * 3 * sizeof(vec_t));
+    if (pmesh->vertx == NULL)
+        goto Failed;
+    pmesh->verty = pmesh->vertx + padded;
+    pmesh->vertz = pmesh->verty + padded;
+
+    for (i=0 ; i<padded ; i++)
+    {
+        j = (i < pmesh->numverts) ? i : pmesh->numverts - 1;
+        pmesh->vertx[i] = pmesh->verts[j].v[0];
+        pmesh->verty[i] = pmesh->verts[j].v[1];
+        pmesh->vertz[i] = pmesh->verts[j].v[2];
+    }
+
+    free(pfaces);
+    return pmesh;
+
+Failed:
+    free(pfaces);
+    free(pmesh->verts);
+    free(pmesh->vertx);
+    free(pmesh->edges);
+    free(pmesh->faces);
+    free(pmesh);
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Point the object at the indexed mesh for its polygons, building
+// the mesh if no other object made of the same polygons already
+// has. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int SetUpObjectMesh(convexobject_t *pobject)
+{
+    mesh_t  *pmesh;
+
+    for (pmesh = meshes ; pmesh != NULL ; pmesh = pmesh->pnext)
+    {
+        if ((pmesh->ppoly == pobject->ppoly) &&
+            (pmesh->pdpoly == pobject->pdpoly) &&
+            (pmesh->numpolys == pobject->numpolys))
+        {
+            pobject->pmesh = pmesh;
+            return 1;
+        }
+    }
+
+    pmesh = BuildMesh(pobject);
+    if (pmesh == NULL)
+        return 0;
+
+    pmesh->pnext = meshes;
+    meshes = pmesh;
+    pobject->pmesh = pmesh;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Release all the meshes built by SetUpObjectMesh.
+/////////////////////////////////////////////////////////////////////
+void FreeMeshes(void)
+{
+    mesh_t  *pmesh;
+
+    while (meshes != NULL)
+    {
+        pmesh = meshes;
+        meshes = pmesh->pnext;
+        free(pmesh->verts);
+        free(pmesh->vertx);
+        free(pmesh->edges);
+        free(pmesh->faces);
+        free(pmesh);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Light each of an object's faces, by setting up its texture extents
+// in worldspace, on the lightmap grid, and sampling the light that
+// falls on it at every grid point, from the ambient light and each
+// of the lights that's in front of it and close enough to reach it.
+// Objects made of the same polygons share a mesh, but not lighting,
+// since they're in different places. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int SetUpObjectLighting(convexobject_t *pobject)
+{
+    int         i, j, k, axis, s, t, numlights;
+    vec_t       mins, maxs, dot, distance, detinv, dist, cosine, light;
+    mesh_t      *pmesh;
+    mface_t     *pface;
+    litface_t   *plit;
+    point_t     cross[3], point, delta;
+
+    pmesh = pobject->pmesh;
+    pobject->plitfaces = calloc(pmesh->numfaces, sizeof(litface_t));
+    if (pobject->plitfaces == NULL)
+        return 0;
+
+    numlights = sizeof(lights) / sizeof(lights[0]);
+
+    for (i=0 ; i<pmesh->numfaces ; i++)
+    {
+        pface = &pmesh->faces[i];
+        plit = &pobject->plitfaces[i];
+        plit->ptexture = pface->ptexture;
+
+        for (axis=0 ; axis<2 ; axis++)
+        {
+            mins = 999999.0;
+            maxs = -999999.0;
+
+            for (j=0 ; j<pface->numverts ; j++)
+            {
+                dot = DotProduct(&pmesh->verts[pface->verts[j]],
+                                 &pface->texaxis[axis]);
+                if (dot < mins)
+                    mins = dot;
+                if (dot > maxs)
+                    maxs = dot;
+            }
+
+            dot = DotProduct(&pobject->center, &pface->texaxis[axis]);
+            mins = floor((mins + dot) / LIGHTMAP_GRID);
+            maxs = ceil((maxs + dot) / LIGHTMAP_GRID);
+            plit->texturemins[axis] = (int)mins * LIGHTMAP_GRID;
+            plit->extents[axis] = (int)(maxs - mins) * LIGHTMAP_GRID;
+        }
+
+        plit->lightwidth = (plit->extents[0] >> LIGHTMAP_SHIFT) + 1;
+        plit->lightmap = malloc(plit->lightwidth *
+                                ((plit->extents[1] >> LIGHTMAP_SHIFT) + 1));
+        if (plit->lightmap == NULL)
+            return 0;
+
+        // The worldspace point at texture coordinates s,t on the
+        // face's plane is where the planes s = s axis . p,
+        // t = t axis . p, and distance = normal . p meet
+        distance = pface->plane.distance +
+                DotProduct(&pobject->center, &pface->plane.normal);
+        CrossProduct(&pface->texaxis[1], &pface->plane.normal, &cross[0]);
+        CrossProduct(&pface->plane.normal, &pface->texaxis[0], &cross[1]);
+        CrossProduct(&pface->texaxis[0], &pface->texaxis[1], &cross[2]);
+        detinv = 1.0 / DotProduct(&pface->texaxis[0], &cross[0]);
+
+        for (t=0 ; t<=(plit->extents[1] >> LIGHTMAP_SHIFT) ; t++)
+        {
+            for (s=0 ; s<plit->lightwidth ; s++)
+            {
+                for (k=0 ; k<3 ; k++)
+                {
+                    point.v[k] = ((plit->texturemins[0] +
+                                   (s << LIGHTMAP_SHIFT)) * cross[0].v[k] +
+                                  (plit->texturemins[1] +
+                                   (t << LIGHTMAP_SHIFT)) * cross[1].v[k] +
+                                  distance * cross[2].v[k]) * detinv;
+                }
+
+                light = AMBIENT_LIGHT;
+
+                for (j=0 ; j<numlights ; j++)
+                {
+                    for (k=0 ; k<3 ; k++)
+                        delta.v[k] = lights[j].origin.v[k] - point.v[k];
+                    dist = sqrt(DotProduct(&delta, &delta));
+                    if ((dist >= lights[j].intensity) || (dist == 0.0))
+                        continue;
+
+                    cosine = DotProduct(&delta, &pface->plane.normal) /
+                            dist;
+                    if (cosine > 0.0)
+                        light += (lights[j].intensity - dist) * cosine;
+                }
+
+                if (light > 255.0)
+                    light = 255.0;
+
+                plit->lightmap[t * plit->lightwidth + s] =
+                        (unsigned char)light;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Release the lighting of all the objects in the world, emptying
+// the surface cache, which holds textures lit with it.
+/////////////////////////////////////////////////////////////////////
+void FreeLighting(void)
+{
+    int             i;
+    convexobject_t  *pobject;
+
+    FlushSurfaceCache();
+
+    for (pobject = objecthead.pnext ; pobject != &objecthead ;
+         pobject = pobject->pnext)
+    {
+        if (pobject->plitfaces == NULL)
+            continue;
+
+        for (i=0 ; i<pobject->pmesh->numfaces ; i++)
+            free(pobject->plitfaces[i].lightmap);
+        free(pobject->plitfaces);
+        pobject->plitfaces = NULL;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns which side of the plane the polygon is on: BSP_FRONT,
+// BSP_BACK, BSP_ON if it lies in the plane, or BSP_SPLIT if it's on
+// both sides.
+/////////////////////////////////////////////////////////////////////
+int ClassifyPolygon(polygon_t *ppoly, plane_t *pplane)
+{
+    int     i, front, back;
+    vec_t   dist;
+
+    front = back = 0;
+
+    for (i=0 ; i<ppoly->numverts ; i++)
+    {
+        dist = DotProduct(&ppoly->verts[i], &pplane->normal) -
+                pplane->distance;
+        if (dist > BSP_EPSILON)
+            front = 1;
+        else if (dist < -BSP_EPSILON)
+            back = 1;
+    }
+
+    if (front && back)
+        return BSP_SPLIT;
+    if (front)
+        return BSP_FRONT;
+    if (back)
+        return BSP_BACK;
+
+    return BSP_ON;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Split a polygon that ClassifyPolygon says the plane splits into
+// the parts in front of and behind the plane. Vertices on the plane
+// go in both. The polygon must have fewer than MAX_POLY_VERTS
+// vertices, since a part can have one more than it has.
+/////////////////////////////////////////////////////////////////////
+void SplitPolygon(polygon_t *pin, plane_t *pplane, polygon_t *pfront,
+                  polygon_t *pback)
+{
+    int     i, j, nextvert, sides[MAX_POLY_VERTS];
+    vec_t   dists[MAX_POLY_VERTS], scale;
+    point_t *pcur, *pnext, mid;
+
+    for (i=0 ; i<pin->numverts ; i++)
+    {
+        dists[i] = DotProduct(&pin->verts[i], &pplane->normal) -
+                pplane->distance;
+        if (dists[i] > BSP_EPSILON)
+            sides[i] = BSP_FRONT;
+        else if (dists[i] < -BSP_EPSILON)
+            sides[i] = BSP_BACK;
+        else
+            sides[i] = BSP_ON;
+    }
+
+    pfront->numverts = pback->numverts = 0;
+
+    for (i=0 ; i<pin->numverts ; i++)
+    {
+        nextvert = (i + 1) % pin->numverts;
+        pcur = &pin->verts[i];
+        pnext = &pin->verts[nextvert];
+
+        if (sides[i] != BSP_BACK)
+            pfront->verts[pfront->numverts++] = *pcur;
+        if (sides[i] != BSP_FRONT)
+            pback->verts[pback->numverts++] = *pcur;
+
+        // Add a vertex to both where the edge to the next vertex
+        // goes from one side right through to the other
+        if ((sides[i] == BSP_ON) || (sides[nextvert] == BSP_ON) ||
+            (sides[i] == sides[nextvert]))
+        {
+            continue;
+        }
+
+        scale = dists[i] / (dists[i] - dists[nextvert]);
+        for (j=0 ; j<3 ; j++)
+            mid.v[j] = pcur->v[j] + (pnext->v[j] - pcur->v[j]) * scale;
+
+        pfront->verts[pfront->numverts++] = mid;
+        pback->verts[pback->numverts++] = mid;
+    }
+
+    pfront->color = pback->color = pin->color;
+    pfront->plane = pback->plane = pin->plane;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Cut a polygon with MAX_POLY_VERTS vertices in two along the
+// diagonal from its first vertex, so each half has few enough to be
+// split.
+/////////////////////////////////////////////////////////////////////
+void HalvePolygon(polygon_t *pin, polygon_t *pout0, polygon_t *pout1)
+{
+    int     i, half;
+
+    half = pin->numverts / 2;
+
+    for (i=0 ; i<=half ; i++)
+        pout0->verts[i] = pin->verts[i];
+    pout0->numverts = half + 1;
+
+    for (i=half ; i<pin->numverts ; i++)
+        pout1->verts[i - half] = pin->verts[i];
+    pout1->verts[i - half] = pin->verts[0];
+    pout1->numverts = i - half + 1;
+
+    pout0->color = pout1->color = pin->color;
+    pout0->plane = pout1->plane = pin->plane;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Pick the face whose plane is the best one to split a list of faces
+// with, trying up to BSP_CANDIDATES of them, spread evenly through
+// the list. Splits cost the most, since each adds a face for the
+// rest of the tree to deal with; faces on the plane count in its
+// favor, since they're done with, and the fewer planes there are to
+// use up, the fewer nodes and leaves there are; and imbalance counts
+// against it, since it makes the tree deeper.
+/////////////////////////////////////////////////////////////////////
+bspface_t *ChooseBSPSplitter(bspface_t *pfaces)
+{
+    int         i, count, step, score, bestscore;
+    int         front, back, on, splits;
+    bspface_t   *pcandidate, *pface, *pbest;
+
+    count = 0;
+    for (pface = pfaces ; pface ; pface = pface->pnext)
+        count++;
+
+    step = (count + BSP_CANDIDATES - 1) / BSP_CANDIDATES;
+    pbest = pfaces;
+    bestscore = 0x7FFFFFFF;
+
+    for (pcandidate = pfaces, i = 0 ; pcandidate ;
+         pcandidate = pcandidate->pnext, i++)
+    {
+        if (i % step)
+            continue;
+
+        front = back = on = splits = 0;
+
+        for (pface = pfaces ; pface ; pface = pface->pnext)
+        {
+            switch (ClassifyPolygon(&pface->poly,
+                                    &pcandidate->poly.plane))
+            {
+            case BSP_FRONT:
+                front++;
+                break;
+            case BSP_BACK:
+                back++;
+                break;
+            case BSP_ON:
+                on++;
+                break;
+            default:
+                splits++;
+                break;
+            }
+        }
+
+        score = splits * BSP_SPLIT_COST + abs(front - back) - on;
+        if (score < bestscore)
+        {
+            bestscore = score;
+            pbest = pcandidate;
+        }
+    }
+
+    return pbest;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free a list of BSP faces.
+/////////////////////////////////////////////////////////////////////
+void FreeBSPFaces(bspface_t *pfaces)
+{
+    bspface_t   *pnext;
+
+    while (pfaces)
+    {
+        pnext = pfaces->pnext;
+        free(pfaces);
+        pfaces = pnext;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free a BSP node and everything under it.
+/////////////////////////////////////////////////////////////////////
+void FreeBSPNode(bspnode_t *pnode)
+{
+    if (pnode == NULL)
+        return;
+
+    FreeBSPNode(pnode->children[0]);
+    FreeBSPNode(pnode->children[1]);
+    FreeBSPFaces(pnode->faces);
+    free(pnode);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the BSP subtree for a list of faces, which it takes over;
+// a leaf if the list is empty. Returns NULL, having freed the list,
+// if it runs out of memory.
+/////////////////////////////////////////////////////////////////////
+bspnode_t *BuildBSPNode(bspface_t *pfaces)
+{
+    int         i, j, side;
+    bspnode_t   *pnode, *pchild;
+    bspface_t   *pface, *pnewface, *plists[2];
+    polygon_t   parts[2];
+
+    pnode = malloc(sizeof(bspnode_t));
+    if (pnode == NULL)
+    {
+        FreeBSPFaces(pfaces);
+        return NULL;
+    }
+
+    pnode->parent = pnode->children[0] = pnode->children[1] = NULL;
+    pnode->faces = NULL;
+    pnode->visframe = 0;
+    pnode->markfaces = NULL;
+    pnode->nummarkfaces = 0;
+    pnode->visofs = -1;
+    pnode->portals = NULL;
+    pnode->portalframe = 0;
+
+    if (pfaces == NULL)
+    {
+        pnode->leaf = numbspleaves++;
+        return pnode;
+    }
+
+    pnode->leaf = -1;
+    pnode->plane = ChooseBSPSplitter(pfaces)->poly.plane;
+    numbspnodes++;
+
+    // Sort the faces onto the node and the lists for each side,
+    // splitting those that are on both sides
+    plists[0] = plists[1] = NULL;
+
+    while (pfaces)
+    {
+        pface = pfaces;
+        pfaces = pface->pnext;
+
+        side = ClassifyPolygon(&pface->poly, &pnode->plane);
+
+        if (side == BSP_ON)
+        {
+            pface->flipped = (DotProduct(&pface->poly.plane.normal,
+                                         &pnode->plane.normal) < 0.0);
+            pface->pnext = pnode->faces;
+            pnode->faces = pface;
+            continue;
+        }
+
+        if (side != BSP_SPLIT)
+        {
+            pface->pnext = plists[side];
+            plists[side] = pface;
+            continue;
+        }
+
+        pnewface = malloc(sizeof(bspface_t));
+        if (pnewface == NULL)
+        {
+            FreeBSPFaces(pface);    // and the rest of the list after it
+            FreeBSPFaces(plists[0]);
+            FreeBSPFaces(plists[1]);
+            FreeBSPNode(pnode);
+            return NULL;
+        }
+
+        *pnewface = *pface;
+        numbspfaces++;
+
+        if (pface->poly.numverts == MAX_POLY_VERTS)
+        {
+            // No room to split it; cut it in two first, and sort the
+            // halves out in turn
+            HalvePolygon(&pface->poly, &parts[0], &parts[1]);
+            pface->poly = parts[0];
+            pnewface->poly = parts[1];
+            pnewface->pnext = pfaces;
+            pface->pnext = pnewface;
+            pfaces = pface;
+            continue;
+        }
+
+        SplitPolygon(&pface->poly, &pnode->plane, &parts[0], &parts[1]);
+        pface->poly = parts[0];
+        pface->pnext = plists[0];
+        plists[0] = pface;
+        pnewface->poly = parts[1];
+        pnewface->pnext = plists[1];
+        plists[1] = pnewface;
+    }
+
+    pnode->children[0] = BuildBSPNode(plists[0]);
+    pnode->children[1] = BuildBSPNode(plists[1]);
+    if ((pnode->children[0] == NULL) || (pnode->children[1] == NULL))
+    {
+        FreeBSPNode(pnode);
+        return NULL;
+    }
+
+    pnode->children[0]->parent = pnode->children[1]->parent = pnode;
+
+    // Box in the faces on the node and under it, so the whole
+    // subtree can be tested against the frustum at once
+    for (j=0 ; j<3 ; j++)
+    {
+        pnode->mins.v[j] = 999999.0;
+        pnode->maxs.v[j] = -999999.0;
+    }
+
+    for (pface = pnode->faces ; pface ; pface = pface->pnext)
+    {
+        for (i=0 ; i<pface->poly.numverts ; i++)
+        {
+            for (j=0 ; j<3 ; j++)
+            {
+                if (pface->poly.verts[i].v[j] < pnode->mins.v[j])
+                    pnode->mins.v[j] = pface->poly.verts[i].v[j];
+                if (pface->poly.verts[i].v[j] > pnode->maxs.v[j])
+                    pnode->maxs.v[j] = pface->poly.verts[i].v[j];
+            }
+        }
+    }
+
+    for (i=0 ; i<2 ; i++)
+    {
+        pchild = pnode->children[i];
+        if (pchild->leaf >= 0)
+            continue;
+
+        for (j=0 ; j<3 ; j++)
+        {
+            if (pchild->mins.v[j] < pnode->mins.v[j])
+                pnode->mins.v[j] = pchild->mins.v[j];
+            if (pchild->maxs.v[j] > pnode->maxs.v[j])
+                pnode->maxs.v[j] = pchild->maxs.v[j];
+        }
+    }
+
+    return pnode;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Compile the faces of all the objects in the world into a BSP
+// tree. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildBSPTree(void)
+{
+    int             i, j;
+    double          start;
+    convexobject_t  *pobject;
+    mesh_t          *pmesh;
+    mface_t         *pmface;
+    bspface_t       *pfaces, *pface;
+
+    FreeBSPTree();
+
+    start = FrameClock();
+    numbspnodes = numbspleaves = numbspfaces = 0;
+    pfaces = NULL;
+
+    for (pobject = objecthead.pnext ; pobject != &objecthead ;
+         pobject = pobject->pnext)
+    {
+        pmesh = pobject->pmesh;
+
+        for (i=0 ; i<pmesh->numfaces ; i++)
+        {
+            pface = malloc(sizeof(bspface_t));
+            if (pface == NULL)
+            {
+                FreeBSPFaces(pfaces);
+                return 0;
+            }
+
+            // Mesh faces are relative to the object's center
+            pmface = &pmesh->faces[i];
+            pface->pobject = pobject;
+            pface->face = i;
+            pface->flipped = 0;
+            pface->visframe = 0;
+            pface->poly.color = pmface->color;
+            pface->poly.numverts = pmface->numverts;
+            for (j=0 ; j<pmface->numverts ; j++)
+            {
+                pface->poly.verts[j].v[0] = pobject->center.v[0] +
+                        pmesh->verts[pmface->verts[j]].v[0];
+                pface->poly.verts[j].v[1] = pobject->center.v[1] +
+                        pmesh->verts[pmface->verts[j]].v[1];
+                pface->poly.verts[j].v[2] = pobject->center.v[2] +
+                        pmesh->verts[pmface->verts[j]].v[2];
+            }
+            pface->poly.plane.normal = pmface->plane.normal;
+            pface->poly.plane.distance = pmface->plane.distance +
+                    DotProduct(&pobject->center, &pmface->plane.normal);
+
+            pface->pnext = pfaces;
+            pfaces = pface;
+            numbspfaces++;
+        }
+    }
+
+    bsptree = BuildBSPNode(pfaces);
+    bspcompiletime = FrameClock() - start;
+
+    return (bsptree != NULL);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free the BSP tree built by BuildBSPTree, if there is one.
+/////////////////////////////////////////////////////////////////////
+void FreeBSPTree(void)
+{
+    FreePortals();
+    FreePVS();
+    FreeLeafFaces();
+    FreeBSPNode(bsptree);
+    bsptree = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the BSP leaf the point is in.
+/////////////////////////////////////////////////////////////////////
+bspnode_t *PointInLeaf(point_t *ppoint)
+{
+    bspnode_t   *pnode;
+
+    pnode = bsptree;
+
+    while (pnode->leaf < 0)
+    {
+        pnode = pnode->children[DotProduct(ppoint, &pnode->plane.normal) <
+                                pnode->plane.distance];
+    }
+
+    return pnode;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Put every leaf under pnode in bspleaves, by leaf number.
+/////////////////////////////////////////////////////////////////////
+void CollectBSPLeaves(bspnode_t *pnode)
+{
+    if (pnode->leaf >= 0)
+    {
+        bspleaves[pnode->leaf] = pnode;
+        return;
+    }
+
+    CollectBSPLeaves(pnode->children[0]);
+    CollectBSPLeaves(pnode->children[1]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Record that a piece of a face is on the boundary of a leaf and
+// faces into it. Returns 0 if it runs out of memory.
+/////////////////////////////////////////////////////////////////////
+int AddLeafMark(bspnode_t *pleaf, bspface_t *pface)
+{
+    leafmark_t  *pmarks;
+
+    if (numleafmarks == maxleafmarks)
+    {
+        maxleafmarks = maxleafmarks ? maxleafmarks * 2 : 4096;
+        pmarks = realloc(leafmarks, maxleafmarks * sizeof(leafmark_t));
+        if (pmarks == NULL)
+            return 0;
+        leafmarks = pmarks;
+    }
+
+    leafmarks[numleafmarks].pleaf = pleaf;
+    leafmarks[numleafmarks].pface = pface;
+    numleafmarks++;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Push a piece of a face down the subtree on the side it faces,
+// splitting it as it goes, and mark it in every leaf it reaches.
+// Returns 0 if it runs out of memory.
+/////////////////////////////////////////////////////////////////////
+int MarkFacePiece(bspnode_t *pnode, bspface_t *pface, polygon_t *ppiece)
+{
+    int         side;
+    polygon_t   parts[2];
+
+    while (pnode->leaf < 0)
+    {
+        side = ClassifyPolygon(ppiece, &pnode->plane);
+
+        if (side == BSP_ON)
+        {
+            side = (DotProduct(&pface->poly.plane.normal,
+                               &pnode->plane.normal) < 0.0);
+        }
+        else if (side == BSP_SPLIT)
+        {
+            if (ppiece->numverts == MAX_POLY_VERTS)
+                HalvePolygon(ppiece, &parts[0], &parts[1]);
+            else
+                SplitPolygon(ppiece, &pnode->plane, &parts[0], &parts[1]);
+
+            return MarkFacePiece(pnode, pface, &parts[0]) &&
+                   MarkFacePiece(pnode, pface, &parts[1]);
+        }
+
+        pnode = pnode->children[side];
+    }
+
+    return AddLeafMark(pnode, pface);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Mark all the faces on nodes under pnode in the leaves they face
+// into. Returns 0 if it runs out of memory.
+/////////////////////////////////////////////////////////////////////
+int MarkBSPFaces(bspnode_t *pnode)
+{
+    bspface_t   *pface;
+
+    if (pnode->leaf >= 0)
+        return 1;
+
+    for (pface = pnode->faces ; pface ; pface = pface->pnext)
+    {
+        if (!MarkFacePiece(pnode->children[pface->flipped], pface,
+                           &pface->poly))
+        {
+            return 0;
+        }
+    }
+
+    return MarkBSPFaces(pnode->children[0]) &&
+           MarkBSPFaces(pnode->children[1]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Compress a row of the PVS, replacing each run of zero bytes with a
+// zero and the length of the run, as Quake does. Returns the size of
+// the compressed row, which is at most twice the size of the row.
+/////////////////////////////////////////////////////////////////////
+int CompressVis(unsigned char *pin, unsigned char *pout)
+{
+    int             i, count;
+    unsigned char   *pstart;
+
+    pstart = pout;
+
+    for (i=0 ; i<pvsrowbytes ; i++)
+    {
+        *pout++ = pin[i];
+        if (pin[i])
+            continue;
+
+        count = 1;
+        while ((i + 1 < pvsrowbytes) && (pin[i+1] == 0) && (count < 255))
+        {
+            count++;
+            i++;
+        }
+        *pout++ = count;
+    }
+
+    return pout - pstart;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Expand a row of the PVS compressed by CompressVis.
+/////////////////////////////////////////////////////////////////////
+void DecompressVis(unsigned char *pin, unsigned char *pout)
+{
+    int             count;
+    unsigned char   *pend;
+
+    pend = pout + pvsrowbytes;
+
+    while (pout < pend)
+    {
+        if (*pin)
+        {
+            *pout++ = *pin++;
+            continue;
+        }
+
+        count = pin[1];
+        pin += 2;
+        while (count-- && (pout < pend))
+            *pout++ = 0;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Cut away the part of a winding behind a plane. Vertices past
+// MAX_CELL_VERTS are dropped.
+/////////////////////////////////////////////////////////////////////
+void CutWinding(winding_t *pw, plane_t *pplane)
+{
+    int             i, j, nextvert;
+    vec_t           dists[MAX_CELL_VERTS], scale;
+    winding_t       in;
+
+    in = *pw;
+    pw->numverts = 0;
+
+    for (i=0 ; i<in.numverts ; i++)
+    {
+        dists[i] = DotProduct(&in.verts[i], &pplane->normal) -
+                pplane->distance;
+    }
+
+    for (i=0 ; (i<in.numverts) && (pw->numverts<MAX_CELL_VERTS) ; i++)
+    {
+        nextvert = (i + 1) % in.numverts;
+
+        if (dists[i] >= 0.0)
+            pw->verts[pw->numverts++] = in.verts[i];
+
+        if (((dists[i] >= 0.0) == (dists[nextvert] >= 0.0)) ||
+            (pw->numverts == MAX_CELL_VERTS))
+        {
+            continue;
+        }
+
+        scale = dists[i] / (dists[i] - dists[nextvert]);
+        for (j=0 ; j<3 ; j++)
+        {
+            pw->verts[pw->numverts].v[j] = in.verts[i].v[j] +
+                    (in.verts[nextvert].v[j] - in.verts[i].v[j]) * scale;
+        }
+        pw->numverts++;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Put the planes of the convex cell a leaf bounds in pplanes, facing
+// into it: those of the nodes above it, nearest first, then those of
+// the box given by pmins and pmaxs. For each node plane, pfar gets
+// the subtree on the plane's far side; for the box's, NULL. Returns
+// the number of planes.
+/////////////////////////////////////////////////////////////////////
+int LeafCellPlanes(bspnode_t *pleaf, point_t *pmins, point_t *pmaxs,
+                   plane_t *pplanes, bspnode_t **pfar)
+{
+    int         i, j, k, numplanes;
+    bspnode_t   *pnode;
+
+    numplanes = 0;
+    for (pnode = pleaf ; pnode->parent && (numplanes < MAX_BSP_DEPTH) ;
+         pnode = pnode->parent)
+    {
+        pplanes[numplanes] = pnode->parent->plane;
+        pfar[numplanes] = pnode->parent->children[0];
+        if (pfar[numplanes] == pnode)
+        {
+            pfar[numplanes] = pnode->parent->children[1];
+        }
+        else
+        {
+            for (j=0 ; j<3 ; j++)
+                pplanes[numplanes].normal.v[j] *= -1.0;
+            pplanes[numplanes].distance = -pplanes[numplanes].distance;
+        }
+        numplanes++;
+    }
+
+    for (i=0 ; i<3 ; i++)
+    {
+        for (j=0 ; j<2 ; j++)
+        {
+            for (k=0 ; k<3 ; k++)
+                pplanes[numplanes].normal.v[k] = 0.0;
+            pplanes[numplanes].normal.v[i] = j ? -1.0 : 1.0;
+            pplanes[numplanes].distance = j ? -pmaxs->v[i] : pmins->v[i];
+            pfar[numplanes] = NULL;
+            numplanes++;
+        }
+    }
+
+    return numplanes;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Find the face of a cell on one of its planes, by cutting a square
+// on the plane, big enough to cover the box given by pmins and
+// pmaxs, by all the others. Returns 0 if the plane doesn't touch the
+// cell.
+/////////////////////////////////////////////////////////////////////
+int CellFaceWinding(plane_t *pplanes, int numplanes, int face,
+                    point_t *pmins, point_t *pmaxs, winding_t *pw)
+{
+    int         i, j, axis;
+    vec_t       size, dist;
+    point_t     center, up, right, origin;
+    plane_t     *pplane;
+
+    pplane = &pplanes[face];
+
+    size = 0.0;
+    for (i=0 ; i<3 ; i++)
+    {
+        center.v[i] = (pmins->v[i] + pmaxs->v[i]) * 0.5;
+        size += pmaxs->v[i] - pmins->v[i];
+    }
+
+    // Center the square where the box's center is closest to the
+    // plane
+    axis = 0;
+    for (i=1 ; i<3 ; i++)
+    {
+        if (fabs(pplane->normal.v[i]) > fabs(pplane->normal.v[axis]))
+            axis = i;
+    }
+    for (i=0 ; i<3 ; i++)
+        up.v[i] = 0.0;
+    up.v[(axis + 1) % 3] = 1.0;
+    CrossProduct(&up, &pplane->normal, &right);
+    CrossProduct(&pplane->normal, &right, &up);
+    dist = DotProduct(&center, &pplane->normal) - pplane->distance;
+    for (i=0 ; i<3 ; i++)
+    {
+        origin.v[i] = center.v[i] - pplane->normal.v[i] * dist;
+        up.v[i] *= size / sqrt(DotProduct(&up, &up));
+        right.v[i] *= size / sqrt(DotProduct(&right, &right));
+    }
+
+    pw->numverts = 4;
+    for (i=0 ; i<3 ; i++)
+    {
+        pw->verts[0].v[i] = origin.v[i] + up.v[i] + right.v[i];
+        pw->verts[1].v[i] = origin.v[i] + up.v[i] - right.v[i];
+        pw->verts[2].v[i] = origin.v[i] - up.v[i] - right.v[i];
+        pw->verts[3].v[i] = origin.v[i] - up.v[i] + right.v[i];
+    }
+
+    for (j=0 ; (j<numplanes) && (pw->numverts >= 3) ; j++)
+    {
+        if (j != face)
+            CutWinding(pw, &pplanes[j]);
+    }
+
+    return (pw->numverts >= 3);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Number the BSP tree's leaves, and find the faces each one's cell
+// is bounded by and faces into: each face is marked in the leaves it
+// faces into, a piece at a time, and the marks are sorted by leaf.
+// Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildLeafFaces(void)
+{
+    int             i, j, leaf, *seen;
+    leafmark_t      *psorted;
+    bspnode_t       *pleaf;
+    bspface_t       **pmarkface;
+
+    FreeLeafFaces();
+    if (bsptree == NULL)
+        return 0;
+
+    bspleaves = calloc(numbspleaves, sizeof(bspnode_t *));
+    leaffirstmark = calloc(numbspleaves + 1, sizeof(int));
+    seen = calloc(numbspleaves, sizeof(int));
+    psorted = NULL;
+
+    if ((bspleaves == NULL) || (leaffirstmark == NULL) || (seen == NULL))
+        goto failed;
+
+    CollectBSPLeaves(bsptree);
+
+    numleafmarks = 0;
+    if (!MarkBSPFaces(bsptree))
+        goto failed;
+
+    psorted = malloc((numleafmarks + 1) * sizeof(leafmark_t));
+    bspmarkfaces = malloc((numleafmarks + 1) * sizeof(bspface_t *));
+    if ((psorted == NULL) || (bspmarkfaces == NULL))
+        goto failed;
+
+    for (i=0 ; i<numleafmarks ; i++)
+        seen[leafmarks[i].pleaf->leaf]++;
+    for (i=0 ; i<numbspleaves ; i++)
+    {
+        leaffirstmark[i+1] = leaffirstmark[i] + seen[i];
+        seen[i] = 0;
+    }
+    for (i=0 ; i<numleafmarks ; i++)
+    {
+        leaf = leafmarks[i].pleaf->leaf;
+        psorted[leaffirstmark[leaf] + seen[leaf]++] = leafmarks[i];
+    }
+
+    free(leafmarks);
+    leafmarks = psorted;
+    maxleafmarks = numleafmarks + 1;
+    psorted = NULL;
+
+    // Each leaf's faces are the faces of its marks, which come a
+    // piece at a time
+    pmarkface = bspmarkfaces;
+    for (i=0 ; i<numbspleaves ; i++)
+    {
+        pleaf = bspleaves[i];
+        pleaf->markfaces = pmarkface;
+
+        for (j=leaffirstmark[i] ; j<leaffirstmark[i+1] ; j++)
+        {
+            if ((pmarkface == pleaf->markfaces) ||
+                (pmarkface[-1] != leafmarks[j].pface))
+            {
+                *pmarkface++ = leafmarks[j].pface;
+            }
+        }
+
+        pleaf->nummarkfaces = pmarkface - pleaf->markfaces;
+    }
+
+    free(seen);
+    free(leafmarks);
+    free(leaffirstmark);
+    leafmarks = NULL;
+    leaffirstmark = NULL;
+    numleafmarks = maxleafmarks = 0;
+
+    return 1;
+
+failed:
+    free(seen);
+    free(psorted);
+    FreeLeafFaces();
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free what BuildLeafFaces built, if anything.
+/////////////////////////////////////////////////////////////////////
+void FreeLeafFaces(void)
+{
+    int     i;
+
+    if (bspleaves)
+    {
+        for (i=0 ; (i<numbspleaves) && bspleaves[i] ; i++)
+        {
+            bspleaves[i]->markfaces = NULL;
+            bspleaves[i]->nummarkfaces = 0;
+        }
+    }
+
+    free(bspleaves);
+    free(bspmarkfaces);
+    free(leafmarks);
+    free(leaffirstmark);
+    bspleaves = NULL;
+    bspmarkfaces = NULL;
+    leafmarks = NULL;
+    leaffirstmark = NULL;
+    numleafmarks = maxleafmarks = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Cut away the part of a winding more than PVS_EPSILON behind a
+// plane, so nothing that might be seen is lost to rounding. If none
+// of it is more than PVS_EPSILON in front, though, a line of sight
+// could only graze it, and it's all cut away, as Quake's vis does.
+// Cutting adds at most one vertex, so a winding that might run out
+// of room is left whole, which only means more is taken to be seen.
+// Returns 0 if there's nothing left.
+/////////////////////////////////////////////////////////////////////
+int ClipFlowWinding(winding_t *pw, plane_t *pplane)
+{
+    int         i, front, back;
+    vec_t       dist;
+    plane_t     plane;
+
+    front = back = 0;
+    for (i=0 ; i<pw->numverts ; i++)
+    {
+        dist = DotProduct(&pw->verts[i], &pplane->normal) -
+                pplane->distance;
+        if (dist > PVS_EPSILON)
+            front = 1;
+        else if (dist < -PVS_EPSILON)
+            back = 1;
+    }
+
+    if (!front)
+    {
+        pw->numverts = 0;
+        return 0;
+    }
+
+    if (back && (pw->numverts < MAX_CELL_VERTS))
+    {
+        plane.normal = pplane->normal;
+        plane.distance = pplane->distance - PVS_EPSILON;
+        CutWinding(pw, &plane);
+    }
+
+    return (pw->numverts >= 3);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns 0 if none of a box is more than PVS_EPSILON in front of a
+// plane, 1 if none of it is more than PVS_EPSILON behind, and 2 if
+// the plane cuts through it, so that ClipFlowWinding only has to be
+// called for a winding in the box if it might cut something off.
+/////////////////////////////////////////////////////////////////////
+int BoxPlaneSide(point_t *pmins, point_t *pmaxs, plane_t *pplane)
+{
+    int         i;
+    vec_t       nearest, farthest;
+
+    nearest = farthest = -pplane->distance;
+    for (i=0 ; i<3 ; i++)
+    {
+        if (pplane->normal.v[i] > 0.0)
+        {
+            nearest += pplane->normal.v[i] * pmins->v[i];
+            farthest += pplane->normal.v[i] * pmaxs->v[i];
+        }
+        else
+        {
+            nearest += pplane->normal.v[i] * pmaxs->v[i];
+            farthest += pplane->normal.v[i] * pmins->v[i];
+        }
+    }
+
+    if (farthest <= PVS_EPSILON)
+        return 0;
+    if (nearest >= -PVS_EPSILON)
+        return 1;
+    return 2;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Copy a portal into a winding.
+/////////////////////////////////////////////////////////////////////
+void PortalWinding(portal_t *pportal, winding_t *pw)
+{
+    int     i;
+
+    pw->numverts = pportal->poly.numverts;
+    for (i=0 ; i<pportal->poly.numverts ; i++)
+        pw->verts[i] = pportal->poly.verts[i];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Find the box around a winding.
+/////////////////////////////////////////////////////////////////////
+void WindingBox(winding_t *pw, point_t *pmins, point_t *pmaxs)
+{
+    int     i, j;
+
+    *pmins = *pmaxs = pw->verts[0];
+    for (i=1 ; i<pw->numverts ; i++)
+    {
+        for (j=0 ; j<3 ; j++)
+        {
+            if (pw->verts[i].v[j] < pmins->v[j])
+                pmins->v[j] = pw->verts[i].v[j];
+            if (pw->verts[i].v[j] > pmaxs->v[j])
+                pmaxs->v[j] = pw->verts[i].v[j];
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Find the planes that separate a box the viewer can be anywhere in
+// from a box around what's been seen of a portal, facing away from
+// the viewer's. A separating plane runs through an edge of the
+// viewer's box and a corner of the other, with all of the viewer's
+// box behind it and all of the other in front of it; any line of
+// sight through both boxes stays in front of every such plane once
+// it's past the portal, so a portal beyond that's behind any of them
+// can't be seen through it. These are the planes Quake's vis clips
+// the view through a run of portals to. Since the edges of a box run
+// along the axes, so does every such plane, and they can be found
+// from the boxes' outlines looking down each axis: a line through a
+// corner of each outline with all of one outline on one side of it
+// and all of the other on the other side. Two outlines that don't
+// overlap have just two such lines between them, so looking down
+// each axis stops at two. Returns the number of planes, at most 6.
+/////////////////////////////////////////////////////////////////////
+int BoxSeparators(point_t *psmins, point_t *psmaxs, point_t *ppmins,
+                  point_t *ppmaxs, plane_t *pplanes)
+{
+    int         i, j, k, axis, u, v, numplanes, found, front, back;
+    vec_t       su[4], sv[4], pu[4], pv[4], nu, nv, dist, d, length;
+    plane_t     *pplane;
+
+    numplanes = 0;
+
+    for (axis=0 ; axis<3 ; axis++)
+    {
+        u = (axis + 1) % 3;
+        v = (axis + 2) % 3;
+
+        // Outlines that overlap can't be separated
+        if ((psmins->v[u] < ppmaxs->v[u] + PVS_ON_EPSILON) &&
+            (ppmins->v[u] < psmaxs->v[u] + PVS_ON_EPSILON) &&
+            (psmins->v[v] < ppmaxs->v[v] + PVS_ON_EPSILON) &&
+            (ppmins->v[v] < psmaxs->v[v] + PVS_ON_EPSILON))
+        {
+            continue;
+        }
+
+        for (i=0 ; i<4 ; i++)
+        {
+            su[i] = (i & 1) ? psmaxs->v[u] : psmins->v[u];
+            sv[i] = (i & 2) ? psmaxs->v[v] : psmins->v[v];
+            pu[i] = (i & 1) ? ppmaxs->v[u] : ppmins->v[u];
+            pv[i] = (i & 2) ? ppmaxs->v[v] : ppmins->v[v];
+        }
+
+        found = 0;
+
+        for (i=0 ; (i<4) && (found<2) ; i++)
+        {
+            // A flat outline has each corner twice
+            if (((i & 1) && (su[i] == su[i ^ 1])) ||
+                ((i & 2) && (sv[i] == sv[i ^ 2])))
+            {
+                continue;
+            }
+
+            for (j=0 ; (j<4) && (found<2) ; j++)
+            {
+                if (((j & 1) && (pu[j] == pu[j ^ 1])) ||
+                    ((j & 2) && (pv[j] == pv[j ^ 2])))
+                {
+                    continue;
+                }
+
+                nu = sv[i] - pv[j];
+                nv = pu[j] - su[i];
+                length = nu * nu + nv * nv;
+                if (length < PVS_EPSILON)
+                    continue;       // the corners all but coincide
+
+                length = 1.0 / sqrt(length);
+                nu *= length;
+                nv *= length;
+                dist = nu * pu[j] + nv * pv[j];
+
+                // The viewer's outline has to be all on one side,
+                // which the plane's turned to face away from...
+                front = back = 0;
+                for (k=0 ; k<4 ; k++)
+                {
+                    d = nu * su[k] + nv * sv[k] - dist;
+                    if (d > PVS_ON_EPSILON)
+                        front = 1;
+                    else if (d < -PVS_ON_EPSILON)
+                        back = 1;
+                }
+                if (front == back)
+                    continue;
+
+                if (front)
+                {
+                    nu = -nu;
+                    nv = -nv;
+                    dist = -dist;
+                }
+
+                // ...and the other all on the other
+                front = back = 0;
+                for (k=0 ; k<4 ; k++)
+                {
+                    d = nu * pu[k] + nv * pv[k] - dist;
+                    if (d > PVS_ON_EPSILON)
+                        front = 1;
+                    else if (d < -PVS_ON_EPSILON)
+                        back = 1;
+                }
+                if (!front || back)
+                    continue;
+
+                pplane = &pplanes[numplanes++];
+                found++;
+                pplane->normal.v[axis] = 0.0;
+                pplane->normal.v[u] = nu;
+                pplane->normal.v[v] = nv;
+                pplane->distance = dist;
+            }
+        }
+    }
+
+    return numplanes;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Find the box around the convex cell a node or leaf bounds, clipped
+// to the box given by pmins and pmaxs. Returns 0 if the cell is
+// empty.
+/////////////////////////////////////////////////////////////////////
+int CellBox(bspnode_t *pnode, point_t *pmins, point_t *pmaxs,
+            point_t *pcellmins, point_t *pcellmaxs)
+{
+    int         i, j, k, numplanes, found;
+    plane_t     planes[MAX_BSP_DEPTH + 6];
+    bspnode_t   *pfar[MAX_BSP_DEPTH + 6];
+    winding_t   w;
+
+    numplanes = LeafCellPlanes(pnode, pmins, pmaxs, planes, pfar);
+    found = 0;
+
+    for (i=0 ; i<numplanes ; i++)
+    {
+        if (!CellFaceWinding(planes, numplanes, i, pmins, pmaxs, &w))
+            continue;
+
+        for (j=0 ; j<w.numverts ; j++)
+        {
+            for (k=0 ; k<3 ; k++)
+            {
+                if (!found || (w.verts[j].v[k] < pcellmins->v[k]))
+                    pcellmins->v[k] = w.verts[j].v[k];
+                if (!found || (w.verts[j].v[k] > pcellmaxs->v[k]))
+                    pcellmaxs->v[k] = w.verts[j].v[k];
+            }
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Group the leaves under pnode into clusters, as Quake 2 does, so
+// the PVS builder only has to flood out from each cluster rather
+// than each leaf: a subtree with no more than PVS_CLUSTER_LEAVES
+// leaves under it whose parent has more is a cluster. Returns the
+// number of leaves under pnode.
+/////////////////////////////////////////////////////////////////////
+int FindPVSClusters(bspnode_t *pnode)
+{
+    int     i, numleaves[2];
+
+    if (pnode->leaf >= 0)
+        return 1;
+
+    for (i=0 ; i<2 ; i++)
+        numleaves[i] = FindPVSClusters(pnode->children[i]);
+
+    if (numleaves[0] + numleaves[1] > PVS_CLUSTER_LEAVES)
+    {
+        for (i=0 ; i<2 ; i++)
+        {
+            if (numleaves[i] <= PVS_CLUSTER_LEAVES)
+            {
+                pvsclusternodes[numpvsclusters] = pnode->children[i];
+                pvsclusterleaves[numpvsclusters] = numleaves[i];
+                numpvsclusters++;
+            }
+        }
+    }
+
+    return numleaves[0] + numleaves[1];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note that a flood out from a cluster has seen through a portal,
+// and that what's been seen of it is inside the box given by pmins
+// and pmaxs: mark the leaf it leads into in the flood's row, and
+// widen the box around what's been seen through the portal to take
+// it in, queueing the portal to be flooded on from if the box is new
+// or has grown.
+/////////////////////////////////////////////////////////////////////
+void SeeThroughPortal(pvsflood_t *pflood, int cluster,
+                      portal_t *pportal, point_t *pmins, point_t *pmaxs)
+{
+    int         i, num, grown;
+    point_t     *ppassmins, *ppassmaxs;
+
+    num = pportal->pleaf->leaf;
+    if (!(pflood->prow[num >> 3] & (1 << (num & 7))))
+    {
+        pflood->prow[num >> 3] |= 1 << (num & 7);
+        pflood->unseen--;
+    }
+
+    num = pportal->num;
+    ppassmins = &pflood->ppassmins[num];
+    ppassmaxs = &pflood->ppassmaxs[num];
+
+    if (pflood->ppassfrom[num] != cluster)
+    {
+        pflood->ppassfrom[num] = cluster;
+        *ppassmins = *pmins;
+        *ppassmaxs = *pmaxs;
+        grown = 1;
+    }
+    else
+    {
+        grown = 0;
+        for (i=0 ; i<3 ; i++)
+        {
+            if (pmins->v[i] < ppassmins->v[i])
+            {
+                grown |= (pmins->v[i] < ppassmins->v[i] - PVS_EPSILON);
+                ppassmins->v[i] = pmins->v[i];
+            }
+            if (pmaxs->v[i] > ppassmaxs->v[i])
+            {
+                grown |= (pmaxs->v[i] > ppassmaxs->v[i] + PVS_EPSILON);
+                ppassmaxs->v[i] = pmaxs->v[i];
+            }
+        }
+    }
+
+    if (grown && (pflood->pqueuedfrom[num] != cluster))
+    {
+        pflood->pqueuedfrom[num] = cluster;
+        pflood->pqueue[pflood->queuetail] = pportal;
+        pflood->queuetail = (pflood->queuetail + 1) % (numportals + 1);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Flood out from a cluster through the portals, marking every leaf
+// that might be seen from somewhere in the box around its cell in
+// the flood's row. The cluster's leaves, and every leaf next to
+// them, can be. Beyond them, a portal out of a leaf can only be seen
+// through another into it if it's in front of that one, and in front
+// of the planes that separate the cluster's box from the box around
+// what's been seen through that one; whatever's left of it widens
+// the box around what's been seen through it, and it's flooded on
+// from, again if it's been flooded on from with a smaller box
+// before, until no box grows. Since every box covers all that's been
+// seen through its portal, nothing that can be seen is left out. A
+// cluster with no cell sees everything.
+/////////////////////////////////////////////////////////////////////
+void FloodFromCluster(pvsflood_t *pflood, int cluster)
+{
+    int         i, first, last, num, numplanes, side, whole;
+    point_t     mins, maxs, *pcutmins, *pcutmaxs, cutmins, cutmaxs;
+    plane_t     planes[3 * 2 + 1];
+    portal_t    *pportal, *pnext;
+    winding_t   w;
+
+    if (!CellBox(pvsclusternodes[cluster], &pvsworldmins, &pvsworldmaxs,
+                 &mins, &maxs))
+    {
+        memset(pflood->prow, 0xFF, pvsrowbytes);
+        return;
+    }
+
+    memset(pflood->prow, 0, pvsrowbytes);
+    pflood->queuehead = pflood->queuetail = 0;
+    pflood->unseen = numpvsentered;
+
+    first = pvsclusterfirst[cluster];
+    last = first + pvsclusterleaves[cluster];
+    for (num=first ; num<last ; num++)
+    {
+        pflood->prow[num >> 3] |= 1 << (num & 7);
+        if (pvsentered[num >> 3] & (1 << (num & 7)))
+            pflood->unseen--;
+
+        for (pportal = bspleaves[num]->portals ; pportal ;
+             pportal = pportal->pnext)
+        {
+            if (pvsleafcluster[pportal->pleaf->leaf] != cluster)
+            {
+                SeeThroughPortal(pflood, cluster, pportal,
+                                 &pvsportalmins[pportal->num],
+                                 &pvsportalmaxs[pportal->num]);
+            }
+        }
+    }
+
+    while ((pflood->queuehead != pflood->queuetail) &&
+           (pflood->unseen > 0))
+    {
+        pportal = pflood->pqueue[pflood->queuehead];
+        pflood->queuehead = (pflood->queuehead + 1) % (numportals + 1);
+        num = pportal->num;
+        pflood->pqueuedfrom[num] = -1;
+
+        planes[0] = pportal->poly.plane;
+        numplanes = 1 + BoxSeparators(&mins, &maxs,
+                                      &pflood->ppassmins[num],
+                                      &pflood->ppassmaxs[num],
+                                      &planes[1]);
+
+        for (pnext = pportal->pleaf->portals ; pnext ;
+             pnext = pnext->pnext)
+        {
+            // A line of sight can't go back the way it came, or back
+            // into the cluster, which is convex
+            if ((pvsleafcluster[pnext->pleaf->leaf] == cluster) ||
+                ((DotProduct(&pnext->poly.plane.normal,
+                             &planes[0].normal) < PVS_EPSILON - 1.0) &&
+                 (fabs(pnext->poly.plane.distance + planes[0].distance) <
+                    PVS_EPSILON)))
+            {
+                continue;
+            }
+
+            // Most portals are all in front of or all behind most of
+            // the planes, so only the rest need cutting
+            pcutmins = &pvsportalmins[pnext->num];
+            pcutmaxs = &pvsportalmaxs[pnext->num];
+            whole = 1;
+
+            for (i=0 ; i<numplanes ; i++)
+            {
+                side = BoxPlaneSide(pcutmins, pcutmaxs, &planes[i]);
+                if (side == 0)
+                    break;
+                if (side == 1)
+                    continue;
+
+                if (whole)
+                {
+                    PortalWinding(pnext, &w);
+                    whole = 0;
+                }
+                if (!ClipFlowWinding(&w, &planes[i]))
+                    break;
+            }
+
+            // The box from before the cuts still holds what's left for
+            // the tests above, but what's seen needs the one around it
+            if (i < numplanes)
+                continue;
+
+            if (!whole)
+            {
+                WindingBox(&w, &cutmins, &cutmaxs);
+                pcutmins = &cutmins;
+                pcutmaxs = &cutmaxs;
+            }
+            SeeThroughPortal(pflood, cluster, pnext, pcutmins, pcutmaxs);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// RunJobs job that floods out from one of the next clusters, each
+// with a flood of its own.
+/////////////////////////////////////////////////////////////////////
+void FloodClusterJob (int job)
+{
+    FloodFromCluster(&pvsfloods[job], nextpvscluster + job);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free what StartPVS set up to flood through the portals with.
+/////////////////////////////////////////////////////////////////////
+void FreePVSFlood(void)
+{
+    int         i;
+    pvsflood_t  *pflood;
+
+    for (i=0 ; i<numpvsfloods ; i++)
+    {
+        pflood = &pvsfloods[i];
+        free(pflood->ppassmins);
+        free(pflood->ppassmaxs);
+        free(pflood->ppassfrom);
+        free(pflood->pqueuedfrom);
+        free(pflood->pqueue);
+        free(pflood->prow);
+        memset(pflood, 0, sizeof(*pflood));
+    }
+    numpvsfloods = 0;
+
+    free(pvsportalmins);
+    free(pvsportalmaxs);
+    free(pvsentered);
+    free(pvsclusternodes);
+    free(pvsclusterfirst);
+    free(pvsclusterleaves);
+    free(pvsleafcluster);
+    pvsportalmins = pvsportalmaxs = NULL;
+    pvsentered = NULL;
+    pvsclusternodes = NULL;
+    pvsclusterfirst = pvsclusterleaves = pvsleafcluster = NULL;
+    numpvsclusters = nextpvscluster = 0;
+    pvsbuilding = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Start building the PVS for the BSP tree from its portals: group
+// the leaves into clusters with FindPVSClusters, whose leaves will
+// share a row, and set up a flood out from a cluster for each
+// thread. Until ContinuePVS has flooded out from a leaf's cluster,
+// the leaf sees everything. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int StartPVS(void)
+{
+    int         i, j;
+    double      start;
+    bspnode_t   *pnode;
+    portal_t    *pportal;
+    pvsflood_t  *pflood;
+    winding_t   w;
+
+    FreePVS();
+    if (bsptree == NULL)
+        return 0;
+
+    start = FrameClock();
+
+    if ((numportals == 0) && !BuildPortals())
+        return 0;
+
+    pvsrowbytes = (numbspleaves + 7) >> 3;
+    pvsrow = malloc(pvsrowbytes);
+    pvsportalmins = malloc((numportals + 1) * sizeof(point_t));
+    pvsportalmaxs = malloc((numportals + 1) * sizeof(point_t));
+    pvsentered = calloc(pvsrowbytes, 1);
+    pvsclusternodes = malloc(numbspleaves * sizeof(bspnode_t *));
+    pvsclusterfirst = malloc(numbspleaves * sizeof(int));
+    pvsclusterleaves = malloc(numbspleaves * sizeof(int));
+    pvsleafcluster = malloc(numbspleaves * sizeof(int));
+    pvsbuilding = 1;
+
+    if ((pvsrow == NULL) || (pvsportalmins == NULL) ||
+        (pvsportalmaxs == NULL) || (pvsentered == NULL) ||
+        (pvsclusternodes == NULL) || (pvsclusterfirst == NULL) ||
+        (pvsclusterleaves == NULL) || (pvsleafcluster == NULL))
+    {
+        goto failed;
+    }
+
+    for (numpvsfloods=0 ; numpvsfloods<numthreads ; numpvsfloods++)
+    {
+        pflood = &pvsfloods[numpvsfloods];
+        pflood->ppassmins = malloc((numportals + 1) * sizeof(point_t));
+        pflood->ppassmaxs = malloc((numportals + 1) * sizeof(point_t));
+        pflood->ppassfrom = malloc((numportals + 1) * sizeof(int));
+        pflood->pqueuedfrom = malloc((numportals + 1) * sizeof(int));
+        pflood->pqueue = malloc((numportals + 1) * sizeof(portal_t *));
+        pflood->prow = malloc(pvsrowbytes);
+
+        if ((pflood->ppassmins == NULL) || (pflood->ppassmaxs == NULL) ||
+            (pflood->ppassfrom == NULL) || (pflood->pqueuedfrom == NULL) ||
+            (pflood->pqueue == NULL) || (pflood->prow == NULL))
+        {
+            numpvsfloods++;
+            goto failed;
+        }
+
+        for (i=0 ; i<numportals ; i++)
+            pflood->ppassfrom[i] = pflood->pqueuedfrom[i] = -1;
+    }
+
+    // Find the box around each portal, and which leaves they lead
+    // into
+    numpvsentered = 0;
+    for (i=0 ; i<numbspleaves ; i++)
+    {
+        for (pportal = bspleaves[i]->portals ; pportal ;
+             pportal = pportal->pnext)
+        {
+            PortalWinding(pportal, &w);
+            WindingBox(&w, &pvsportalmins[pportal->num],
+                       &pvsportalmaxs[pportal->num]);
+
+            j = pportal->pleaf->leaf;
+            if (!(pvsentered[j >> 3] & (1 << (j & 7))))
+            {
+                pvsentered[j >> 3] |= 1 << (j & 7);
+                numpvsentered++;
+            }
+        }
+    }
+
+    numpvsclusters = 0;
+    if (FindPVSClusters(bsptree) <= PVS_CLUSTER_LEAVES)
+    {
+        pvsclusternodes[0] = bsptree;
+        pvsclusterleaves[0] = numbspleaves;
+        numpvsclusters = 1;
+    }
+
+    // The leaves under a node are numbered one after another, from
+    // the one reached by always going to the front
+    for (i=0 ; i<numpvsclusters ; i++)
+    {
+        for (pnode = pvsclusternodes[i] ; pnode->leaf < 0 ;
+             pnode = pnode->children[0])
+            ;
+        pvsclusterfirst[i] = pnode->leaf;
+        for (j=0 ; j<pvsclusterleaves[i] ; j++)
+            pvsleafcluster[pnode->leaf + j] = i;
+    }
+
+    for (i=0 ; i<3 ; i++)
+    {
+        pvsworldmins.v[i] = bsptree->mins.v[i] - CELL_MARGIN;
+        pvsworldmaxs.v[i] = bsptree->maxs.v[i] + CELL_MARGIN;
+    }
+
+    nextpvscluster = 0;
+    pvsbuildtime = FrameClock() - start;
+
+    return 1;
+
+failed:
+    FreePVS();
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Go on building the PVS StartPVS started, flooding out from as
+// many clusters at once as there are threads, and adding their rows
+// to the PVS, until it's done, or, if pvsslice is set, until that
+// much time has gone by. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int ContinuePVS(void)
+{
+    int             i, j, count, size, cluster;
+    double          start;
+    unsigned char   *pdata;
+
+    start = FrameClock();
+
+    while (nextpvscluster < numpvsclusters)
+    {
+        count = min(numpvsfloods, numpvsclusters - nextpvscluster);
+        RunJobs(FloodClusterJob, count);
+
+        for (i=0 ; i<count ; i++)
+        {
+            if (pvssize + pvsrowbytes * 2 > pvsmaxsize)
+            {
+                pvsmaxsize = pvsmaxsize * 2 + pvsrowbytes * 2;
+                pdata = realloc(pvsdata, pvsmaxsize);
+                if (pdata == NULL)
+                {
+                    FreePVS();
+                    return 0;
+                }
+                pvsdata = pdata;
+            }
+
+            cluster = nextpvscluster + i;
+            size = CompressVis(pvsfloods[i].prow, pvsdata + pvssize);
+            for (j=0 ; j<pvsclusterleaves[cluster] ; j++)
+                bspleaves[pvsclusterfirst[cluster] + j]->visofs = pvssize;
+            pvssize += size;
+        }
+        nextpvscluster += count;
+
+        if ((pvsslice > 0.0) && (FrameClock() - start >= pvsslice))
+            break;
+    }
+
+    if (nextpvscluster == numpvsclusters)
+        FreePVSFlood();
+
+    viewleaf = NULL;
+    pvsbuildtime += FrameClock() - start;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the PVS for the BSP tree with StartPVS and ContinuePVS. Like
+// Quake's, it's conservative: everything that can be seen from
+// somewhere in a leaf is in its row, though so may be some that
+// can't. If pvsslice is set, that's as much as is built now, and
+// UpdateWorld builds the rest a slice a frame. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildPVS(void)
+{
+    return StartPVS() && ContinuePVS();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free the PVS built by BuildPVS, or as much as there is of it.
+/////////////////////////////////////////////////////////////////////
+void FreePVS(void)
+{
+    int     i;
+
+    if (bspleaves)
+    {
+        for (i=0 ; (i<numbspleaves) && bspleaves[i] ; i++)
+            bspleaves[i]->visofs = -1;
+    }
+
+    FreePVSFlood();
+    free(pvsdata);
+    free(pvsrow);
+    pvsdata = NULL;
+    pvsrow = NULL;
+    pvssize = pvsmaxsize = 0;
+    viewleaf = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if a face covers all of a polygon on its plane.
+/////////////////////////////////////////////////////////////////////
+int FaceCoversPolygon(polygon_t *pface, polygon_t *ppoly)
+{
+    int     i, j, nextvert;
+    vec_t   inside;
+    point_t edge, normal, center, tovert;
+
+    for (j=0 ; j<3 ; j++)
+    {
+        center.v[j] = 0.0;
+        for (i=0 ; i<pface->numverts ; i++)
+            center.v[j] += pface->verts[i].v[j];
+        center.v[j] /= pface->numverts;
+    }
+
+    for (i=0 ; i<pface->numverts ; i++)
+    {
+        // The plane through the edge at right angles to the face,
+        // facing the face's center
+        nextvert = (i + 1) % pface->numverts;
+        for (j=0 ; j<3 ; j++)
+        {
+            edge.v[j] = pface->verts[nextvert].v[j] - pface->verts[i].v[j];
+            tovert.v[j] = center.v[j] - pface->verts[i].v[j];
+        }
+        CrossProduct(&edge, &pface->plane.normal, &normal);
+        inside = (DotProduct(&tovert, &normal) < 0.0) ? -1.0 : 1.0;
+        inside /= sqrt(DotProduct(&normal, &normal));
+
+        for (j=0 ; j<ppoly->numverts ; j++)
+        {
+            tovert.v[0] = ppoly->verts[j].v[0] - pface->verts[i].v[0];
+            tovert.v[1] = ppoly->verts[j].v[1] - pface->verts[i].v[1];
+            tovert.v[2] = ppoly->verts[j].v[2] - pface->verts[i].v[2];
+            if (DotProduct(&tovert, &normal) * inside < -BSP_EPSILON)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add portals out of pleaf for a face of its cell, on the plane
+// pplane faces away from it, splitting the face between the leaves
+// it borders in the subtree pnode on the far side of the plane, as
+// fans of polygons, and leaving out pieces covered by a face on the
+// plane that faces into pleaf. Returns 0 if it runs out of memory.
+/////////////////////////////////////////////////////////////////////
+int AddLeafPortals(bspnode_t *pleaf, bspnode_t *pnode, plane_t *pplane,
+                   winding_t *pw)
+{
+    int         i, n, front, back;
+    vec_t       dist;
+    plane_t     flipped;
+    winding_t   piece;
+    polygon_t   poly;
+    portal_t    *pportal;
+    bspnode_t   *pplanenode;
+    bspface_t   *pface;
+
+    pplanenode = pnode->parent;
+
+    while (pnode->leaf < 0)
+    {
+        front = back = 0;
+        for (i=0 ; i<pw->numverts ; i++)
+        {
+            dist = DotProduct(&pw->verts[i], &pnode->plane.normal) -
+                    pnode->plane.distance;
+            if (dist > BSP_EPSILON)
+                front = 1;
+            else if (dist < -BSP_EPSILON)
+                back = 1;
+        }
+
+        if (front && back)
+        {
+            piece = *pw;
+            CutWinding(&piece, &pnode->plane);
+            if (!AddLeafPortals(pleaf, pnode->children[0], pplane, &piece))
+                return 0;
+
+            for (i=0 ; i<3 ; i++)
+                flipped.normal.v[i] = -pnode->plane.normal.v[i];
+            flipped.distance = -pnode->plane.distance;
+            CutWinding(pw, &flipped);
+        }
+
+        pnode = pnode->children[back];
+    }
+
+    // Sliver cuts can leave nothing
+    if (pw->numverts < 3)
+        return 1;
+
+    i = 1;
+    while (i < pw->numverts - 1)
+    {
+        poly.verts[0] = pw->verts[0];
+        for (n=1 ; (n<MAX_POLY_VERTS) && (i<pw->numverts) ; n++, i++)
+            poly.verts[n] = pw->verts[i];
+        poly.numverts = n;
+        i--;                // the next one starts at this one's end
+
+        // Faces are one-sided, so only one facing back into pleaf
+        // can be a wall; the viewer sees straight through the back
+        // of one facing the other way
+        for (pface = pplanenode->faces ; pface ; pface = pface->pnext)
+        {
+            if ((DotProduct(&pface->poly.plane.normal,
+                            &pplane->normal) < 0.0) &&
+                FaceCoversPolygon(&pface->poly, &poly))
+            {
+                break;
+            }
+        }
+        if (pface)
+            continue;       // a wall, not an opening
+
+        pportal = malloc(sizeof(portal_t));
+        if (pportal == NULL)
+            return 0;
+
+        pportal->pleaf = pnode;
+        pportal->num = numportals;
+        pportal->poly = poly;
+        pportal->poly.color = 0;
+        pportal->poly.plane = *pplane;
+        pportal->pnext = pleaf->portals;
+        pleaf->portals = pportal;
+        numportals++;
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the portals between the BSP tree's leaves, by cutting each
+// face of each leaf's cell (clipped to a box a little bigger than
+// the world) between the leaves on the other side of it. Every
+// portal is built once from each side, so each leaf has its own
+// list of the ones out of it. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildPortals(void)
+{
+    int             i, j, numplanes;
+    double          start;
+    point_t         mins, maxs;
+    plane_t         planes[MAX_BSP_DEPTH + 6], outward;
+    bspnode_t       *pfar[MAX_BSP_DEPTH + 6];
+    winding_t       w;
+
+    FreePortals();
+    if (bsptree == NULL)
+        return 0;
+
+    start = FrameClock();
+
+    if ((bspleaves == NULL) && !BuildLeafFaces())
+        return 0;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        mins.v[i] = bsptree->mins.v[i] - CELL_MARGIN;
+        maxs.v[i] = bsptree->maxs.v[i] + CELL_MARGIN;
+    }
+
+    for (i=0 ; i<numbspleaves ; i++)
+    {
+        numplanes = LeafCellPlanes(bspleaves[i], &mins, &maxs, planes,
+                                   pfar);
+
+        for (j=0 ; j<numplanes ; j++)
+        {
+            // There's nothing beyond the box
+            if ((pfar[j] == NULL) ||
+                !CellFaceWinding(planes, numplanes, j, &mins, &maxs, &w))
+            {
+                continue;
+            }
+
+            outward.normal.v[0] = -planes[j].normal.v[0];
+            outward.normal.v[1] = -planes[j].normal.v[1];
+            outward.normal.v[2] = -planes[j].normal.v[2];
+            outward.distance = -planes[j].distance;
+
+            if (!AddLeafPortals(bspleaves[i], pfar[j], &outward, &w))
+            {
+                FreePortals();
+                return 0;
+            }
+        }
+    }
+
+    portalbuildtime = FrameClock() - start;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free the portals built by BuildPortals, if there are any.
+/////////////////////////////////////////////////////////////////////
+void FreePortals(void)
+{
+    int         i;
+    portal_t    *pportal, *pnext;
+
+    if (bspleaves)
+    {
+        for (i=0 ; (i<numbspleaves) && bspleaves[i] ; i++)
+        {
+            for (pportal = bspleaves[i]->portals ; pportal ;
+                 pportal = pnext)
+            {
+                pnext = pportal->pnext;
+                free(pportal);
+            }
+            bspleaves[i]->portals = NULL;
+        }
+    }
+
+    numportals = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Get the box around an object, in worldspace.
+/////////////////////////////////////////////////////////////////////
+void ObjectBox(convexobject_t *pobject, point_t *pmins, point_t *pmaxs)
+{
+    int     i;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        pmins->v[i] = pobject->center.v[i] + pobject->mins.v[i];
+        pmaxs->v[i] = pobject->center.v[i] + pobject->maxs.v[i];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Grow a box to take in another.
+/////////////////////////////////////////////////////////////////////
+void AddToBox(point_t *pmins, point_t *pmaxs, point_t *paddmins,
+              point_t *paddmaxs)
+{
+    int     i;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        if (paddmins->v[i] < pmins->v[i])
+            pmins->v[i] = paddmins->v[i];
+        if (paddmaxs->v[i] > pmaxs->v[i])
+            pmaxs->v[i] = paddmaxs->v[i];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns half the surface area of a box.
+/////////////////////////////////////////////////////////////////////
+double BoxArea(point_t *pmins, point_t *pmaxs)
+{
+    double  x, y, z;
+
+    x = pmaxs->v[0] - pmins->v[0];
+    y = pmaxs->v[1] - pmins->v[1];
+    z = pmaxs->v[2] - pmins->v[2];
+
+    return x * y + y * z + z * x;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the center of an object's box along one axis.
+/////////////////////////////////////////////////////////////////////
+vec_t ObjectBoxCenter(convexobject_t *pobject, int axis)
+{
+    return pobject->center.v[axis] +
+            (pobject->mins.v[axis] + pobject->maxs.v[axis]) * 0.5;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set a BVH node's box to the one around all its objects. Returns
+// true if that changed it.
+/////////////////////////////////////////////////////////////////////
+int FitBVHNode(bvhnode_t *pnode)
+{
+    int     i;
+    point_t mins, maxs, oldmins, oldmaxs;
+
+    oldmins = pnode->mins;
+    oldmaxs = pnode->maxs;
+
+    ObjectBox(bvhobjects[pnode->firstobject], &pnode->mins, &pnode->maxs);
+    for (i=1 ; i<pnode->numobjects ; i++)
+    {
+        ObjectBox(bvhobjects[pnode->firstobject + i], &mins, &maxs);
+        AddToBox(&pnode->mins, &pnode->maxs, &mins, &maxs);
+    }
+
+    return memcmp(&oldmins, &pnode->mins, sizeof(point_t)) ||
+           memcmp(&oldmaxs, &pnode->maxs, sizeof(point_t));
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the BVH subtree over count objects in bvhobjects, starting
+// at first, into pnode. The objects are binned by the centers of
+// their boxes along the axis those spread out the most on, and split
+// between the two bins the surface area heuristic says is cheapest:
+// the number of objects on each side, times the area of that side's
+// box as a fraction of the node's, which is about how likely a view
+// that sees the node is to see that side. If that's no cheaper than
+// testing every object, and there aren't too many of them, the node
+// is a leaf. The objects are rearranged so each subtree's are
+// together. Returns 0 if the tree's too deep.
+/////////////////////////////////////////////////////////////////////
+int BuildBVHNode(bvhnode_t *pnode, bvhnode_t *pparent, int first,
+                 int count, int depth)
+{
+    int             i, j, axis, bin, best, numleft, numright;
+    int             bincounts[BVH_BINS];
+    double          scale, cost, bestcost, area, leftarea[BVH_BINS];
+    vec_t           center, mincenter, maxcenter, extent, bestextent;
+    vec_t           axismin;
+    point_t         binmins[BVH_BINS], binmaxs[BVH_BINS];
+    point_t         mins, maxs;
+    convexobject_t  *ptemp, **pobjects;
+
+    if (depth >= MAX_BVH_DEPTH)
+        return 0;
+
+    pobjects = &bvhobjects[first];
+    pnode->parent = pparent;
+    pnode->children[0] = pnode->children[1] = NULL;
+    pnode->firstobject = first;
+    pnode->numobjects = count;
+    FitBVHNode(pnode);
+    numbvhnodes++;
+
+    // Find the axis the objects' centers spread out the most on
+    axis = 0;
+    axismin = 0.0;
+    bestextent = -1.0;
+    for (j=0 ; j<3 ; j++)
+    {
+        mincenter = maxcenter = ObjectBoxCenter(pobjects[0], j);
+        for (i=1 ; i<count ; i++)
+        {
+            center = ObjectBoxCenter(pobjects[i], j);
+            if (center < mincenter)
+                mincenter = center;
+            if (center > maxcenter)
+                maxcenter = center;
+        }
+
+        extent = maxcenter - mincenter;
+        if (extent > bestextent)
+        {
+            axis = j;
+            axismin = mincenter;
+            bestextent = extent;
+        }
+    }
+
+    best = -1;
+    bestcost = 0.0;
+    scale = (bestextent > 0.0) ? BVH_BINS / bestextent : 0.0;
+
+    if (bestextent > 0.0)
+    {
+        // Bin the objects by their centers
+        for (i=0 ; i<BVH_BINS ; i++)
+            bincounts[i] = 0;
+
+        for (i=0 ; i<count ; i++)
+        {
+            bin = (int)((ObjectBoxCenter(pobjects[i], axis) - axismin) *
+                        scale);
+            if (bin >= BVH_BINS)
+                bin = BVH_BINS - 1;
+
+            ObjectBox(pobjects[i], &mins, &maxs);
+            if (bincounts[bin]++ == 0)
+            {
+                binmins[bin] = mins;
+                binmaxs[bin] = maxs;
+            }
+            else
+            {
+                AddToBox(&binmins[bin], &binmaxs[bin], &mins, &maxs);
+            }
+        }
+
+        // Sweep in from the left, noting the area of the box around
+        // everything up to each bin, then in from the right, costing
+        // the split after each bin on the way
+        numleft = 0;
+        for (i=0 ; i<BVH_BINS-1 ; i++)
+        {
+            if (bincounts[i])
+            {
+                if (numleft == 0)
+                {
+                    mins = binmins[i];
+                    maxs = binmaxs[i];
+                }
+                else
+                {
+                    AddToBox(&mins, &maxs, &binmins[i], &binmaxs[i]);
+                }
+                numleft += bincounts[i];
+            }
+            leftarea[i] = numleft ? BoxArea(&mins, &maxs) : 0.0;
+        }
+
+        area = BoxArea(&pnode->mins, &pnode->maxs);
+        numright = 0;
+        for (i=BVH_BINS-1 ; i>0 ; i--)
+        {
+            if (bincounts[i])
+            {
+                if (numright == 0)
+                {
+                    mins = binmins[i];
+                    maxs = binmaxs[i];
+                }
+                else
+                {
+                    AddToBox(&mins, &maxs, &binmins[i], &binmaxs[i]);
+                }
+                numright += bincounts[i];
+            }
+
+            numleft = count - numright;
+            if ((numright == 0) || (numleft == 0))
+                continue;
+
+            cost = BVH_NODE_COST + count;
+            if (area > 0.0)
+            {
+                cost = BVH_NODE_COST + (leftarea[i-1] * numleft +
+                        BoxArea(&mins, &maxs) * numright) / area;
+            }
+
+            if ((best < 0) || (cost < bestcost))
+            {
+                best = i;
+                bestcost = cost;
+            }
+        }
+    }
+
+    if ((best < 0) || (bestcost >= count))
+    {
+        if (count <= MAX_BVH_LEAF_OBJECTS)
+        {
+            numbvhleaves++;
+            for (i=0 ; i<count ; i++)
+                pobjects[i]->pbvhleaf = pnode;
+            return 1;
+        }
+
+        // Too many to leave in one leaf, but no better split, so
+        // split them however they lie
+        if (best < 0)
+            numleft = count / 2;
+    }
+
+    // Put the objects in the bins before the split first
+    if (best >= 0)
+    {
+        numleft = 0;
+        for (i=0 ; i<count ; i++)
+        {
+            bin = (int)((ObjectBoxCenter(pobjects[i], axis) - axismin) *
+                        scale);
+            if (bin < best)
+            {
+                ptemp = pobjects[i];
+                pobjects[i] = pobjects[numleft];
+                pobjects[numleft++] = ptemp;
+            }
+        }
+
+        // Rounding could put every object on one side
+        if ((numleft == 0) || (numleft == count))
+            numleft = count / 2;
+    }
+
+    pnode->children[0] = &bvhnodes[numbvhnodes];
+    if (!BuildBVHNode(pnode->children[0], pnode, first, numleft,
+                      depth + 1))
+    {
+        return 0;
+    }
+    pnode->children[1] = &bvhnodes[numbvhnodes];
+
+    return BuildBVHNode(pnode->children[1], pnode, first + numleft,
+                        count - numleft, depth + 1);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build a bounding volume hierarchy over the boxes of all the
+// objects in the world, and of the entities, which are refit into
+// it wherever they've moved to each frame. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int BuildBVH(void)
+{
+    int             i, count;
+    double          start;
+    convexobject_t  *pobject;
+
+    FreeBVH();
+
+    start = FrameClock();
+    numbvhnodes = numbvhleaves = 0;
+
+    count = numobjects + NUM_ENTITIES;
+    bvhobjects = malloc(count * sizeof(convexobject_t *));
+    bvhnodes = malloc((count * 2 - 1) * sizeof(bvhnode_t));
+    if ((bvhobjects == NULL) || (bvhnodes == NULL))
+    {
+        FreeBVH();
+        return 0;
+    }
+
+    i = 0;
+    for (pobject = objecthead.pnext ; pobject != &objecthead ;
+         pobject = pobject->pnext)
+    {
+        bvhobjects[i++] = pobject;
+    }
+    for (i=0 ; i<NUM_ENTITIES ; i++)
+        bvhobjects[numobjects + i] = &entities[i];
+
+    if (!BuildBVHNode(bvhnodes, NULL, 0, count, 0))
+    {
+        FreeBVH();
+        return 0;
+    }
+
+    bvhbuildtime = FrameClock() - start;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free the BVH built by BuildBVH, if there is one.
+/////////////////////////////////////////////////////////////////////
+void FreeBVH(void)
+{
+    int     i;
+
+    for (i=0 ; i<NUM_ENTITIES ; i++)
+        entities[i].pbvhleaf = NULL;
+
+    free(bvhnodes);
+    bvhnodes = NULL;
+    free(bvhobjects);
+    bvhobjects = NULL;
+    numbvhnodes = numbvhleaves = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Refit the BVH around an object that's moved: reset its leaf's box
+// to fit the leaf's objects, and each node's above it to fit its
+// children's, stopping at the first that doesn't change, since
+// nothing above that can.
+/////////////////////////////////////////////////////////////////////
+void RefitBVH(convexobject_t *pobject)
+{
+    bvhnode_t   *pnode;
+    point_t     oldmins, oldmaxs;
+
+    pnode = pobject->pbvhleaf;
+    if (pnode == NULL)
+        return;
+
+    bvhnodesrefit++;
+    if (!FitBVHNode(pnode))
+        return;
+
+    for (pnode = pnode->parent ; pnode ; pnode = pnode->parent)
+    {
+        oldmins = pnode->mins;
+        oldmaxs = pnode->maxs;
+
+        pnode->mins = pnode->children[0]->mins;
+        pnode->maxs = pnode->children[0]->maxs;
+        AddToBox(&pnode->mins, &pnode->maxs, &pnode->children[1]->mins,
+                 &pnode->children[1]->maxs);
+        bvhnodesrefit++;
+
+        if (!memcmp(&oldmins, &pnode->mins, sizeof(point_t)) &&
+            !memcmp(&oldmaxs, &pnode->maxs, sizeof(point_t)))
+        {
+            break;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// 3-D dot product.
+/////////////////////////////////////////////////////////////////////
+vec_t DotProduct(point_t *vec1, point_t *vec2)
+{
+    return vec1->v[0] * vec2->v[0] +
+           vec1->v[1] * vec2->v[1] +
+           vec1->v[2] * vec2->v[2];
+}
+
+/////////////////////////////////////////////////////////////////////
+// 3-D cross product.
+/////////////////////////////////////////////////////////////////////
+void CrossProduct(point_t *in1, point_t *in2, point_t *out)
+{
+    out->v[0] = in1->v[1] * in2->v[2] - in1->v[2] * in2->v[1];
+    out->v[1] = in1->v[2] * in2->v[0] - in1->v[0] * in2->v[2];
+    out->v[2] = in1->v[0] * in2->v[1] - in1->v[1] * in2->v[0];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Concatenate two 3x3 matrices.
+/////////////////////////////////////////////////////////////////////
+void MConcat(vec_t in1[3][3], vec_t in2[3][3], vec_t out[3][3])
+{
+    int     i, j;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        for (j=0 ; j<3 ; j++)
+        {
+            out[i][j] = in1[i][0] * in2[0][j] +
+                        in1[i][1] * in2[1][j] +
+                        in1[i][2] * in2[2][j];
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Project a viewspace point into screen coordinates. Note that the
+// y axis goes up in worldspace and viewspace, but goes down in
+// screenspace.
+/////////////////////////////////////////////////////////////////////
+void ProjectPoint (point_t *ppoint, point2D_t *ppoint2D)
+{
+    vec_t   zrecip;
+
+    zrecip = 1.0 / ppoint->v[2];
+    ppoint2D->x = ppoint->v[0] * zrecip * maxscale + xcenter;
+    ppoint2D->y = ycenter - (ppoint->v[1] * zrecip * maxscale);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Project viewspace polygon vertices into screen coordinates.
+/////////////////////////////////////////////////////////////////////
+void ProjectPolygon (polygon_t *ppoly, polygon2D_t *ppoly2D)
+{
+    int     i;
+
+    for (i=0 ; i<ppoly->numverts ; i++)
+    {
+        ProjectPoint(&ppoly->verts[i], &ppoly2D->verts[i]);
+    }
+
+    ppoly2D->numverts = ppoly->numverts;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clamp a projected point to the screen, just in case some very
+// near points have wandered out of range due to floating-point
+// imprecision.
+/////////////////////////////////////////////////////////////////////
+void ClampScreenPoint (point2D_t *ppoint2D)
+{
+    if (ppoint2D->x < -0.5)
+        ppoint2D->x = -0.5;
+    if (ppoint2D->x > ((vec_t)DIBWidth - 0.5))
+        ppoint2D->x = (vec_t)DIBWidth - 0.5;
+    if (ppoint2D->y < -0.5)
+        ppoint2D->y = -0.5;
+    if (ppoint2D->y > ((vec_t)DIBHeight - 0.5))
+        ppoint2D->y = (vec_t)DIBHeight - 0.5;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Move the view position and set the world->view transform.
+/////////////////////////////////////////////////////////////////////
+void UpdateViewPos()
+{
+    int     i;
+    point_t motionvec;
+    vec_t   s, c, mtemp1[3][3], mtemp2[3][3];
+
+    // Move in the view direction, across the x-y plane, as if
+    // walking. This approach moves slower when looking up or
+    // down at more of an angle
+    motionvec.v[0] = DotProduct(&vpn, &xaxis);
+    motionvec.v[1] = 0.0;
+    motionvec.v[2] = DotProduct(&vpn, &zaxis);
+
+    for (i=0 ; i<3 ; i++)
+    {
+        currentpos.v[i] += motionvec.v[i] * currentspeed;
+        if (currentpos.v[i] > MAX_COORD)
+            currentpos.v[i] = MAX_COORD;
+        if (currentpos.v[i] < -MAX_COORD)
+            currentpos.v[i] = -MAX_COORD;
+    }
+
+    // Set up the world-to-view rotation.
+    // Note: much of the work done in concatenating these matrices
+    // can be factored out, since it contributes nothing to the
+    // final result; multiply the three matrices together on paper
+    // to generate a minimum equation for each of the 9 final elements
+    s = sin(roll);
+    c = cos(roll);
+    mroll[0][0] = c;
+    mroll[0][1] = s;
+    mroll[1][0] = -s;
+    mroll[1][1] = c;
+
+    s = sin(pitch);
+    c = cos(pitch);
+    mpitch[1][1] = c;
+    mpitch[1][2] = s;
+    mpitch[2][1] = -s;
+    mpitch[2][2] = c;
+
+    s = sin(yaw);
+    c = cos(yaw);
+    myaw[0][0] = c;
+    myaw[0][2] = -s;
+    myaw[2][0] = s;
+    myaw[2][2] = c;
+
+    MConcat(mroll, myaw, mtemp1);
+    MConcat(mpitch, mtemp1, mtemp2);
+
+    // Break out the rotation matrix into vright, vup, and vpn.
+    // We could work directly with the matrix; breaking it out
+    // into three vectors is just to make things clearer
+    for (i=0 ; i<3 ; i++)
+    {
+        vright.v[i] = mtemp2[0][i];
+        vup.v[i] = mtemp2[1][i];
+        vpn.v[i] = mtemp2[2][i];
+    }
+
+    // Simulate crude friction
+    if (currentspeed > (MOVEMENT_SPEED * speedscale / 2.0))
+        currentspeed -= MOVEMENT_SPEED * speedscale / 2.0;
+    else if (currentspeed < -(MOVEMENT_SPEED * speedscale / 2.0))
+        currentspeed += MOVEMENT_SPEED * speedscale / 2.0;
+    else
+        currentspeed = 0.0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Rotate a vector from viewspace to worldspace.
+/////////////////////////////////////////////////////////////////////
+void BackRotateVector(point_t *pin, point_t *pout)
+{
+    int     i;
+
+    // Rotate into the world orientation
+    for (i=0 ; i<3 ; i++)
+    {
+        pout->v[i] = pin->v[0] * vright.v[i] +
+                     pin->v[1] * vup.v[i] +
+                     pin->v[2] * vpn.v[i];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Transform a point from worldspace to viewspace.
+/////////////////////////////////////////////////////////////////////
+void TransformPoint(point_t *pin, point_t *pout)
+{
+    int     i;
+    point_t tvert;
+
+    // Translate into a viewpoint-relative coordinate
+    for (i=0 ; i<3 ; i++)
+    {
+        tvert.v[i] = pin->v[i] - currentpos.v[i];
+    }
+
+    // Rotate into the view orientation
+    pout->v[0] = DotProduct(&tvert, &vright);
+    pout->v[1] = DotProduct(&tvert, &vup);
+    pout->v[2] = DotProduct(&tvert, &vpn);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Transform a polygon from worldspace to viewspace.
+/////////////////////////////////////////////////////////////////////
+void TransformPolygon(polygon_t *pinpoly, polygon_t *poutpoly)
+{
+    int     i;
+
+    for (i=0 ; i<pinpoly->numverts ; i++)
+    {
+        TransformPoint(&pinpoly->verts[i], &poutpoly->verts[i]);
+    }
+
+    poutpoly->numverts = pinpoly->numverts;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if the polygon with the specified worldspace vertex
+// and plane faces the viewpoint, assuming a clockwise winding of
+// vertices as seen from the front.
+/////////////////////////////////////////////////////////////////////
+int PolyFacesViewer(point_t *pvert, plane_t *pplane)
+{
+    int     i;
+    point_t viewvec;
+
+    for (i=0 ; i<3 ; i++)
+    {
+        viewvec.v[i] = pvert->v[i] - currentpos.v[i];
+    }
+
+    // Use an epsilon here so we don't get polygons tilted so
+    // sharply that the gradients are unusable or invalid
+    if (DotProduct (&viewvec, &pplane->normal) < -0.01)
+        return 1;
+    else
+        return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up a clip plane with the specified normal.
+/////////////////////////////////////////////////////////////////////
+void SetWorldspaceClipPlane(point_t *normal, plane_t *plane)
+{
+
+    // Rotate the plane normal into worldspace
+    BackRotateVector(normal, &plane->normal);
+
+    plane->distance = DotProduct(&currentpos, &plane->normal) +
+            CLIP_PLANE_EPSILON;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up the planes of the frustum, in worldspace coordinates.
+/////////////////////////////////////////////////////////////////////
+void SetUpFrustum(void)
+{
+    vec_t   angle, s, c;
+    point_t normal;
+
+    angle = atan(2.0 / fieldofview * maxscale / xscreenscale);
+    s = sin(angle);
+    c = cos(angle);
+
+    // Left clip plane
+    normal.v[0] = s;
+    normal.v[1] = 0;
+    normal.v[2] = c;
+    SetWorldspaceClipPlane(&normal, &frustumplanes[0]);
+
+    // Right clip plane
+    normal.v[0] = -s;
+    SetWorldspaceClipPlane(&normal, &frustumplanes[1]);
+
+    frustumoutline[0].x = frustumoutline[3].x = -c / s;
+    frustumoutline[1].x = frustumoutline[2].x = c / s;
+
+    angle = atan(2.0 / fieldofview * maxscale / yscreenscale);
+    s = sin(angle);
+    c = cos(angle);
+
+    // Bottom clip plane
+    normal.v[0] = 0;
+    normal.v[1] = s;
+    normal.v[2] = c;
+    SetWorldspaceClipPlane(&normal, &frustumplanes[2]);
+
+    // Top clip plane
+    normal.v[1] = -s;
+    SetWorldspaceClipPlane(&normal, &frustumplanes[3]);
+
+    frustumoutline[0].y = frustumoutline[1].y = -c / s;
+    frustumoutline[2].y = frustumoutline[3].y = c / s;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clip a polygon to a plane.
+/////////////////////////////////////////////////////////////////////
+int ClipToPlane(polygon_t *pin, plane_t *pplane, polygon_t *pout)
+{
+    int     i, j, nextvert, curin, nextin;
+    vec_t   curdot, nextdot, scale;
+    point_t *pinvert, *poutvert;
+
+    pinvert = pin->verts;
+    poutvert = pout->verts;
+
+    curdot = DotProduct(pinvert, &pplane->normal);
+    curin = (curdot >= pplane->distance);
+
+    for (i=0 ; i<pin->numverts ; i++)
+    {
+        nextvert = (i + 1) % pin->numverts;
+
+        // Keep the current vertex if it's inside the plane
+        if (curin)
+            *poutvert++ = *pinvert;
+
+        nextdot = DotProduct(&pin->verts[nextvert], &pplane->normal);
+        nextin = (nextdot >= pplane->distance);
+
+        // Add a clipped vertex if one end of the current edge is
+        // inside the plane and the other is outside
+        if (curin != nextin)
+        {
+            scale = (pplane->distance - curdot) /
+                    (nextdot - curdot);
+            for (j=0 ; j<3 ; j++)
+            {
+                poutvert->v[j] = pinvert->v[j] +
+                    ((pin->verts[nextvert].v[j] - pinvert->v[j]) *
+                     scale);
+            }
+            poutvert++;
+        }
+
+        curdot = nextdot;
+        curin = nextin;
+        pinvert++;
+    }
+
+    pout->numverts = poutvert - pout->verts;
+    if (pout->numverts < 3)
+        return 0;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Test an object's bounding sphere against the frustum. Returns -1
+// if the object is entirely outside the frustum; otherwise, returns
+// the clip flags for the object's polygons: a bit set for each
+// frustum plane the sphere crosses. Planes the sphere is entirely
+// inside of can't clip any of the object's polygons.
+/////////////////////////////////////////////////////////////////////
+int ObjectClipFlags(convexobject_t *pobject)
+{
+    int     i, clipflags;
+    vec_t   dist;
+
+    clipflags = 0;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
+    {
+        dist = DotProduct(&pobject->center, &frustumplanes[i].normal) -
+                frustumplanes[i].distance;
+
+        if (dist < -pobject->radius)
+            return -1;      // entirely outside this plane
+
+        if (dist < pobject->radius)
+            clipflags |= 1 << i;
+    }
+
+    return clipflags;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Test an axis-aligned box against the frustum planes in clipflags.
+// Returns -1 if the box is entirely outside any of them; otherwise,
+// returns clipflags less the planes it's entirely inside of, which
+// can't clip anything in it.
+/////////////////////////////////////////////////////////////////////
+int BoxClipFlags(point_t *pmins, point_t *pmaxs, int clipflags)
+{
+    int     i, j;
+    point_t incorner, outcorner;
+    plane_t *pplane;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
+    {
+        if (!(clipflags & (1 << i)))
+            continue;
+
+        // Find the corners farthest into and out of the frustum,
+        // along the plane's normal
+        pplane = &frustumplanes[i];
+        for (j=0 ; j<3 ; j++)
+        {
+            if (pplane->normal.v[j] >= 0.0)
+            {
+                outcorner.v[j] = pmins->v[j];
+                incorner.v[j] = pmaxs->v[j];
+            }
+            else
+            {
+                outcorner.v[j] = pmaxs->v[j];
+                incorner.v[j] = pmins->v[j];
+            }
+        }
+
+        // Same test PointOutcode uses
+        if (DotProduct(&incorner, &pplane->normal) < pplane->distance)
+            return -1;      // entirely outside this plane
+
+        if (DotProduct(&outcorner, &pplane->normal) >= pplane->distance)
+            clipflags &= ~(1 << i);
+    }
+
+    return clipflags;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the outcode of a point: a bit set for each of the frustum
+// planes in clipflags that the point is outside of.
+/////////////////////////////////////////////////////////////////////
+int PointOutcode(point_t *ppoint, int clipflags)
+{
+    int     i, outcode;
+
+    outcode = 0;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
+    {
+        if (!(clipflags & (1 << i)))
+            continue;
+
+        // Same test ClipToPlane uses, so a point that's in here is
+        // in there, too
+        if (DotProduct(ppoint, &frustumplanes[i].normal) <
+                frustumplanes[i].distance)
+        {
+            outcode |= 1 << i;
+        }
+    }
+
+    return outcode;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clip a polygon to the frustum planes in clipflags, which are the
+// ones its vertices' outcodes show it straddles; it's known to be
+// inside the rest. Returns pout, or NULL if the polygon is entirely
+// clipped away.
+/////////////////////////////////////////////////////////////////////
+polygon_t *ClipToFrustum(polygon_t *pin, polygon_t *pout, int clipflags)
+{
+    int         i, curpoly;
+    polygon_t   tpoly[2], *ppoly, *pclipped;
+
+    // Clip to each plane in turn, with the last one clipping into
+    // pout
+    curpoly = 0;
+    ppoly = pin;
+
+    for (i=0 ; i<NUM_FRUSTUM_PLANES ; i++)
+    {
+        if (!(clipflags & (1 << i)))
+            continue;
+
+        clipflags &= ~(1 << i);
+        pclipped = clipflags ? &tpoly[curpoly] : pout;
+
+        if (!ClipToPlane(ppoly, &frustumplanes[i], pclipped))
+            return NULL;
+
+        ppoly = pclipped;
+        curpoly ^= 1;
+    }
+
+    return pout;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Start caching a new object's vertices and edges, invalidating
+// everything cached for the last one.
+/////////////////////////////////////////////////////////////////////
+void InvalidateMeshCache(void)
+{
+    int     i;
+
+    cachestamp++;
+
+    if (cachestamp == 0)
+    {
+        // The stamp has wrapped, so clear all the old stamps, lest
+        // one that's never been overwritten now look current
+        for (i=0 ; i<MAX_MESH_VERTS ; i++)
+            vertcache[i].stamp = 0;
+        for (i=0 ; i<MAX_MESH_EDGES ; i++)
+            edgecache[i].stamp = 0;
+
+        cachestamp = 1;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the cached worldspace position and outcode (against the
+// planes in clipflags) of one of the object's mesh vertices,
+// calculating them if no face has needed them yet this frame.
+/////////////////////////////////////////////////////////////////////
+cachedvert_t *CacheVertex(convexobject_t *pobject, int vert,
+                          int clipflags)
+{
+    int             k;
+    cachedvert_t    *pvert;
+
+    pvert = &vertcache[vert];
+
+    if (pvert->stamp != cachestamp)
+    {
+        // Move the vertex relative to the object center
+        for (k=0 ; k<3 ; k++)
+            pvert->world.v[k] = pobject->pmesh->verts[vert].v[k] +
+                    pobject->center.v[k];
+
+        pvert->outcode = clipflags ?
+                PointOutcode(&pvert->world, clipflags) : 0;
+        pvert->stamp = cachestamp;
+    }
+
+    return pvert;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Transform all of a mesh's vertices, offset by the object's center,
+// into viewspace, project them, and clamp them to the screen, into
+// pscreen. Does exactly what TransformPoint, ProjectPoint, and
+// ClampScreenPoint do for each vertex, one vertex at a time.
+/////////////////////////////////////////////////////////////////////
+void TransformMeshVertsScalar(mesh_t *pmesh, point_t *pcenter,
+                              point2D_t *pscreen)
+{
+    int     i, k;
+    point_t world, tvert;
+
+    for (i=0 ; i<pmesh->numverts ; i++)
+    {
+        for (k=0 ; k<3 ; k++)
+            world.v[k] = pmesh->verts[i].v[k] + pcenter->v[k];
+
+        TransformPoint(&world, &tvert);
+        ProjectPoint(&tvert, &pscreen[i]);
+        ClampScreenPoint(&pscreen[i]);
+    }
+}
+
+#ifdef SIMD_SSE2
+/////////////////////////////////////////////////////////////////////
+// TransformMeshVertsScalar SSE_LANES vertices at a time with SSE2.
+// Every operation is done in the same order as in the scalar code,
+// so the results are identical, just as they would be if the
+// vertices were done one at a time.
+/////////////////////////////////////////////////////////////////////
+void TransformMeshVertsSSE2(mesh_t *pmesh, point_t *pcenter,
+                            point2D_t *pscreen)
+{
+    int     i;
+    sse_t   cx, cy, cz, px, py, pz;
+    sse_t   rx, ry, rz, ux, uy, uz, nx, ny, nz;
+    sse_t   scale, xc, yc, one, xmin, xmax, ymin, ymax;
+    sse_t   x, y, z, vx, vy, vz, zrecip, sx, sy;
+
+    cx = SSE_SET1(pcenter->v[0]);
+    cy = SSE_SET1(pcenter->v[1]);
+    cz = SSE_SET1(pcenter->v[2]);
+    px = SSE_SET1(currentpos.v[0]);
+    py = SSE_SET1(currentpos.v[1]);
+    pz = SSE_SET1(currentpos.v[2]);
+    rx = SSE_SET1(vright.v[0]);
+    ry = SSE_SET1(vright.v[1]);
+    rz = SSE_SET1(vright.v[2]);
+    ux = SSE_SET1(vup.v[0]);
+    uy = SSE_SET1(vup.v[1]);
+    uz = SSE_SET1(vup.v[2]);
+    nx = SSE_SET1(vpn.v[0]);
+    ny = SSE_SET1(vpn.v[1]);
+    nz = SSE_SET1(vpn.v[2]);
+    scale = SSE_SET1(maxscale);
+    xc = SSE_SET1(xcenter);
+    yc = SSE_SET1(ycenter);
+    one = SSE_SET1(1.0);
+    xmin = ymin = SSE_SET1(-0.5);
+    xmax = SSE_SET1((vec_t)DIBWidth - 0.5);
+    ymax = SSE_SET1((vec_t)DIBHeight - 0.5);
+
+    // The vertex arrays are padded, so there's no partial batch at
+    // the end
+    for (i=0 ; i<pmesh->numverts ; i+=SSE_LANES)
+    {
+        // Move relative to the object center, then to the viewpoint
+        x = SSE_SUB(SSE_ADD(SSE_LOAD(&pmesh->vertx[i]), cx), px);
+        y = SSE_SUB(SSE_ADD(SSE_LOAD(&pmesh->verty[i]), cy), py);
+        z = SSE_SUB(SSE_ADD(SSE_LOAD(&pmesh->vertz[i]), cz), pz);
+
+        // Rotate into the view orientation
+        vx = SSE_ADD(SSE_ADD(SSE_MUL(x, rx), SSE_MUL(y, ry)),
+                     SSE_MUL(z, rz));
+        vy = SSE_ADD(SSE_ADD(SSE_MUL(x, ux), SSE_MUL(y, uy)),
+                     SSE_MUL(z, uz));
+        vz = SSE_ADD(SSE_ADD(SSE_MUL(x, nx), SSE_MUL(y, ny)),
+                     SSE_MUL(z, nz));
+
+        // Project and clamp
+        zrecip = SSE_DIV(one, vz);
+        sx = SSE_ADD(SSE_MUL(SSE_MUL(vx, zrecip), scale), xc);
+        sy = SSE_SUB(yc, SSE_MUL(SSE_MUL(vy, zrecip), scale));
+        sx = SSE_MIN(SSE_MAX(sx, xmin), xmax);
+        sy = SSE_MIN(SSE_MAX(sy, ymin), ymax);
+
+        // Interleave back into x,y pairs
+        SSE_STORE(&pscreen[i].x, SSE_UNPACKLO(sx, sy));
+        SSE_STORE(&pscreen[i + SSE_LANES/2].x, SSE_UNPACKHI(sx, sy));
+    }
+}
+#endif  // SIMD_SSE2
+
+#ifdef SIMD_AVX
+/////////////////////////////////////////////////////////////////////
+// TransformMeshVertsScalar AVX_LANES vertices at a time with AVX. As
+// with the SSE2 version, the results are identical to the scalar
+// code's. Note that this deliberately doesn't use FMA, which would
+// round differently.
+/////////////////////////////////////////////////////////////////////
+AVX_FUNCTION
+void TransformMeshVertsAVX(mesh_t *pmesh, point_t *pcenter,
+                           point2D_t *pscreen)
+{
+    int     i;
+    avx_t   cx, cy, cz, px, py, pz;
+    avx_t   rx, ry, rz, ux, uy, uz, nx, ny, nz;
+    avx_t   scale, xc, yc, one, xmin, xmax, ymin, ymax;
+    avx_t   x, y, z, vx, vy, vz, zrecip, sx, sy, lo, hi;
+
+    cx = AVX_SET1(pcenter->v[0]);
+    cy = AVX_SET1(pcenter->v[1]);
+    cz = AVX_SET1(pcenter->v[2]);
+    px = AVX_SET1(currentpos.v[0]);
+    py = AVX_SET1(currentpos.v[1]);
+    pz = AVX_SET1(currentpos.v[2]);
+    rx = AVX_SET1(vright.v[0]);
+    ry = AVX_SET1(vright.v[1]);
+    rz = AVX_SET1(vright.v[2]);
+    ux = AVX_SET1(vup.v[0]);
+    uy = AVX_SET1(vup.v[1]);
+    uz = AVX_SET1(vup.v[2]);
+    nx = AVX_SET1(vpn.v[0]);
+    ny = AVX_SET1(vpn.v[1]);
+    nz = AVX_SET1(vpn.v[2]);
+    scale = AVX_SET1(maxscale);
+    xc = AVX_SET1(xcenter);
+    yc = AVX_SET1(ycenter);
+    one = AVX_SET1(1.0);
+    xmin = ymin = AVX_SET1(-0.5);
+    xmax = AVX_SET1((vec_t)DIBWidth - 0.5);
+    ymax = AVX_SET1((vec_t)DIBHeight - 0.5);
+
+    for (i=0 ; i<pmesh->numverts ; i+=AVX_LANES)
+    {
+        x = AVX_SUB(AVX_ADD(AVX_LOAD(&pmesh->vertx[i]), cx), px);
+        y = AVX_SUB(AVX_ADD(AVX_LOAD(&pmesh->verty[i]), cy), py);
+        z = AVX_SUB(AVX_ADD(AVX_LOAD(&pmesh->vertz[i]), cz), pz);
+
+        vx = AVX_ADD(AVX_ADD(AVX_MUL(x, rx), AVX_MUL(y, ry)),
+                     AVX_MUL(z, rz));
+        vy = AVX_ADD(AVX_ADD(AVX_MUL(x, ux), AVX_MUL(y, uy)),
+                     AVX_MUL(z, uz));
+        vz = AVX_ADD(AVX_ADD(AVX_MUL(x, nx), AVX_MUL(y, ny)),
+                     AVX_MUL(z, nz));
+
+        zrecip = AVX_DIV(one, vz);
+        sx = AVX_ADD(AVX_MUL(AVX_MUL(vx, zrecip), scale), xc);
+        sy = AVX_SUB(yc, AVX_MUL(AVX_MUL(vy, zrecip), scale));
+        sx = AVX_MIN(AVX_MAX(sx, xmin), xmax);
+        sy = AVX_MIN(AVX_MAX(sy, ymin), ymax);
+
+        // Unpacking works within each 128-bit half, so it gives the
+        // first and third quarters of the pairs in lo and the second
+        // and fourth in hi; swap the middle quarters to get them in
+        // order
+        lo = AVX_UNPACKLO(sx, sy);
+        hi = AVX_UNPACKHI(sx, sy);
+        AVX_STORE(&pscreen[i].x, AVX_PERMUTE2F128(lo, hi, 0x20));
+        AVX_STORE(&pscreen[i + AVX_LANES/2].x,
+                  AVX_PERMUTE2F128(lo, hi, 0x31));
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if both the CPU and the OS support AVX.
+/////////////////////////////////////////////////////////////////////
+int CPUHasAVX(void)
+{
+#ifdef _MSC_VER
+    int     info[4];
+
+    // AVX, and OSXSAVE, meaning we can ask the OS whether it saves
+    // the YMM registers on context switches
+    __cpuid(info, 1);
+    if ((info[2] & ((1 << 28) | (1 << 27))) != ((1 << 28) | (1 << 27)))
+        return 0;
+
+    return (_xgetbv(0) & 6) == 6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx");
+#endif
+}
+#endif  // SIMD_AVX
+
+/////////////////////////////////////////////////////////////////////
+// Point TransformMeshVerts at the widest kernel the CPU supports.
+// SSE2 is always there if we've been built to use it.
+/////////////////////////////////////////////////////////////////////
+void SelectTransformKernel(void)
+{
+    TransformMeshVerts = TransformMeshVertsScalar;
+    transformkernelname = "scalar";
+
+#ifdef SIMD_SSE2
+    TransformMeshVerts = TransformMeshVertsSSE2;
+    transformkernelname = "sse2";
+#endif
+
+#ifdef SIMD_AVX
+    if (CPUHasAVX())
+    {
+        TransformMeshVerts = TransformMeshVertsAVX;
+        transformkernelname = "avx";
+    }
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up an edge from screen point pv0 to screen point pv1 for
+// stepping down the scan lines it crosses. Returns 0 if it doesn't
+// cross any.
+/////////////////////////////////////////////////////////////////////
+int SetUpEdge (point2D_t *pv0, point2D_t *pv1, cachededge_t *pedge)
+{
+    vec_t       deltax, deltay, slope;
+    point2D_t   *ptop, *pbottom;
+    int         height;
+
+    pedge->topy = (int)ceil(pv0->y);
+    pedge->bottomy = (int)ceil(pv1->y);
+    height = pedge->bottomy - pedge->topy;
+    if (height == 0)
+        return 0;       // doesn't cross any scan lines
+    if (height < 0)
+    {
+        // Leading edge
+        pedge->topy = pedge->bottomy;
+        pedge->bottomy = pedge->topy - height;
+        pedge->leading = 1;
+        ptop = pv1;
+        pbottom = pv0;
+    }
+    else
+    {
+        // Trailing edge
+        pedge->leading = 0;
+        ptop = pv0;
+        pbottom = pv1;
+    }
+
+    // Step from the top vertex to the bottom one either way, so
+    // both faces that share an edge get exactly the same stepping
+    deltax = pbottom->x - ptop->x;
+    deltay = pbottom->y - ptop->y;
+    slope = deltax / deltay;
+
+    // Edge coordinates are in 16.16 fixed point
+    pedge->xstep = (int)(slope * (vec_t)0x10000);
+    pedge->x = (int)((ptop->x +
+        ((vec_t)pedge->topy - ptop->y) * slope) * (vec_t)0x10000);
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add a block of numitems items to the end of an arena. Returns 0
+// on failure.
+/////////////////////////////////////////////////////////////////////
+int AddArenaBlock(arena_t *parena, int numitems)
+{
+    arenablock_t    *pblock, **ppblock;
+
+    pblock = malloc(sizeof(arenablock_t));
+    if (pblock == NULL)
+        return 0;
+
+    pblock->pitems = malloc(numitems * parena->itemsize);
+    if (pblock->pitems == NULL)
+    {
+        free(pblock);
+        return 0;
+    }
+
+    pblock->numitems = numitems;
+    pblock->pnext = NULL;
+
+    for (ppblock = &parena->pblocks ; *ppblock ;
+         ppblock = &(*ppblock)->pnext)
+    {
+        ;
+    }
+    *ppblock = pblock;
+
+    parena->capacity += numitems;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Free all of an arena's blocks.
+/////////////////////////////////////////////////////////////////////
+void FreeArenaBlocks(arena_t *parena)
+{
+    arenablock_t    *pblock;
+
+    while (parena->pblocks)
+    {
+        pblock = parena->pblocks;
+        parena->pblocks = pblock->pnext;
+        free(pblock->pitems);
+        free(pblock);
+    }
+
+    parena->pcurrent = NULL;
+    parena->capacity = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Allocate the starting blocks of an edge table's pools, if that
+// hasn't been done already. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int InitTableArenas(edgetable_t *ptable)
+{
+    int     i, numitems;
+    arena_t *parena;
+
+    for (i=0 ; i<NUM_TABLE_ARENAS ; i++)
+    {
+        parena = &ptable->arenas[i];
+        if (parena->pblocks)
+            continue;
+
+        parena->name = tablearenas[i].name;
+        parena->itemsize = tablearenas[i].itemsize;
+        parena->movable = tablearenas[i].movable;
+
+        numitems = (i == TABLE_EDGES) ? INITIAL_EDGES : INITIAL_SURFS;
+
+        if (!AddArenaBlock(parena, numitems))
+            return 0;
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Allocate the starting blocks of the per-frame pools that are
+// always used, if that hasn't been done already. Returns 0 on
+// failure.
+/////////////////////////////////////////////////////////////////////
+int InitArenas(void)
+{
+    if (!InitTableArenas(&edgetables[0]))
+        return 0;
+
+    return InitBandArenas(&bands[0]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Start counting peak use, growth, and overflows of the pools
+// afresh.
+/////////////////////////////////////////////////////////////////////
+void ResetArenaStats(void)
+{
+    int     i, j;
+    arena_t *parena;
+
+    for (i=0 ; i<2 ; i++)
+    {
+        for (j=0 ; j<NUM_TABLE_ARENAS ; j++)
+        {
+            parena = &edgetables[i].arenas[j];
+            parena->used = parena->peak = 0;
+            parena->grew = parena->growframes = 0;
+            parena->overflowed = parena->overflowframes = 0;
+        }
+    }
+
+    for (i=0 ; i<MAX_BANDS ; i++)
+    {
+        for (j=0 ; j<NUM_BAND_ARENAS ; j++)
+        {
+            parena = &bands[i].arenas[j];
+            parena->used = parena->peak = 0;
+            parena->grew = parena->growframes = 0;
+            parena->overflowed = parena->overflowframes = 0;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Empty an arena for a new frame, first merging its blocks into one
+// if it grew, so the frame's items are contiguous again. Returns a
+// pointer to the first free item.
+/////////////////////////////////////////////////////////////////////
+void *ArenaReset(arena_t *parena)
+{
+    arena_t     merged;
+
+    if (parena->pblocks->pnext)
+    {
+        // If the merged block can't be allocated, just keep using
+        // the chain
+        merged = *parena;
+        merged.pblocks = NULL;
+        merged.capacity = 0;
+
+        if (AddArenaBlock(&merged, parena->capacity))
+        {
+            FreeArenaBlocks(parena);
+            parena->pblocks = merged.pblocks;
+            parena->capacity = merged.capacity;
+        }
+    }
+
+    parena->pcurrent = parena->pblocks;
+    parena->plimit = parena->pcurrent->pitems +
+            parena->pcurrent->numitems * parena->itemsize;
+    parena->usedbefore = 0;
+    parena->grew = 0;
+    parena->overflowed = 0;
+
+    return parena->pcurrent->pitems;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Make more room in an arena whose current block has just been
+// filled; pfull is the end of that block. Items that can't move
+// carry on in the next block, which is added, doubling the
+// arena's capacity, if there isn't one already; items that can are
+// reallocated into one block twice the size. Returns a pointer to
+// the next free item. If memory runs out, returns pfull, leaving
+// the arena full; whatever would have gone in the next item has to
+// be dropped, and counted in overflowed, instead.
+/////////////////////////////////////////////////////////////////////
+void *ArenaGrow(arena_t *parena, void *pfull)
+{
+    arenablock_t    *pblock;
+    char            *pitems;
+    int             numitems;
+
+    pblock = parena->pcurrent;
+
+    if (parena->movable)
+    {
+        numitems = pblock->numitems * 2;
+        pitems = realloc(pblock->pitems, numitems * parena->itemsize);
+        if (pitems == NULL)
+            return pfull;
+
+        parena->capacity += numitems - pblock->numitems;
+        pblock->pitems = pitems;
+        pblock->numitems = numitems;
+        parena->plimit = pitems + numitems * parena->itemsize;
+        parena->grew = 1;
+
+        return pitems + (numitems / 2) * parena->itemsize;
+    }
+
+    if (pblock->pnext == NULL)
+    {
+        if (!AddArenaBlock(parena, parena->capacity))
+            return pfull;
+        parena->grew = 1;
+    }
+
+    parena->usedbefore += pblock->numitems;
+    parena->pcurrent = pblock = pblock->pnext;
+    parena->plimit = pblock->pitems + pblock->numitems * parena->itemsize;
+
+    return pblock->pitems;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note how much of an arena this frame used; pavail is the next
+// free item.
+/////////////////////////////////////////////////////////////////////
+void ArenaEndFrame(arena_t *parena, void *pavail)
+{
+    parena->used = parena->usedbefore + (int)(((char *)pavail -
+            parena->pcurrent->pitems) / parena->itemsize);
+
+    if (parena->used > parena->peak)
+        parena->peak = parena->used;
+    if (parena->grew)
+        parena->growframes++;
+    if (parena->overflowed)
+        parena->overflowframes++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add an edge that's been set up by SetUpEdge to the global edge
+// table, as a leading or trailing edge of the surface being built.
+/////////////////////////////////////////////////////////////////////
+void AddEdge (cachededge_t *psetup, int leading)
+{
+    edgebucket_t    *pbucket;
+    edgetable_t     *ptable;
+
+    ptable = pbuildtable;
+
+    pavailedge->x = pavailedge->topx = psetup->x;
+    pavailedge->xstep = psetup->xstep;
+    pavailedge->leading = leading;
+    pavailedge->topy = psetup->topy;
+    pavailedge->bottomy = psetup->bottomy;
+
+    // Just note that there are edges to add on top scan and remove
+    // after final scan; SortEdgeLists puts the edge on those scans'
+    // lists once they're all in
+    pbucket = &ptable->newbuckets[psetup->topy];
+    if (pbucket->count++ == 0)
+        ptable->dirtynew[ptable->numdirtynew++] = psetup->topy;
+
+    pbucket = &ptable->removebuckets[psetup->bottomy - 1];
+    if (pbucket->count++ == 0)
+    {
+        ptable->dirtyremove[ptable->numdirtyremove++] =
+                psetup->bottomy - 1;
+    }
+
+    // Associate the edge with the surface we'll create for
+    // this polygon
+    pavailedge->surf = pavailsurf - ptable->surfs;
+
+    // Grow the pool if that was the last free edge
+    if (++pavailedge == pedgelimit)
+    {
+        pavailedge = ArenaGrow(&ptable->arenas[TABLE_EDGES], pavailedge);
+        pedgelimit = (edge_t *)ptable->arenas[TABLE_EDGES].plimit;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Make sure an edge table's lists of edges to add and remove, and
+// the lists they're sorted through, have room for count edges.
+// Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int GrowEdgeLists(edgetable_t *ptable, int count)
+{
+    int     i;
+
+    if (count > edgesortsize)
+    {
+        edgesortsize = 0;
+        for (i=0 ; i<2 ; i++)
+        {
+            free(edgesortlists[i]);
+            edgesortlists[i] = malloc(count * sizeof(edge_t *));
+        }
+        if ((edgesortlists[0] == NULL) || (edgesortlists[1] == NULL))
+            return 0;
+        edgesortsize = count;
+    }
+
+    if (count > ptable->edgelistsize)
+    {
+        ptable->edgelistsize = 0;
+        free(ptable->newedges);
+        free(ptable->removeedges);
+        ptable->newedges = malloc(count * sizeof(edge_t *));
+        ptable->removeedges = malloc(count * sizeof(edge_t *));
+        if ((ptable->newedges == NULL) || (ptable->removeedges == NULL))
+            return 0;
+        ptable->edgelistsize = count;
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Put all the edges added to an edge table on the lists of edges to
+// add and remove on each scan line. AddEdge only marks the scan
+// lines that have any; here the edges are gathered up, newest first,
+// and dealt out to the scan lines they're removed after, then sorted
+// by x with an LSD radix sort, a byte at a time, and dealt out to
+// the scan lines they're added on, so each of those scan lines' is
+// sorted too. The sort is stable, so edges at the same x are newest
+// first, as they were when they were inserted into sorted linked
+// lists, but it takes time linear in the number of edges, rather
+// than the square of the number on a scan line. If there's no
+// memory for the lists, the edges are dropped.
+/////////////////////////////////////////////////////////////////////
+void SortEdgeLists(edgetable_t *ptable)
+{
+    int             i, pass, shift, digit, total, count, numedges;
+    int             counts[SORT_PASSES][SORT_BUCKETS];
+    unsigned int    key;
+    edge_t          *pedge, **psrc, **pdst;
+    edgebucket_t    *pbucket;
+    arenablock_t    *pblock;
+    arena_t         *parena;
+
+    parena = &ptable->arenas[TABLE_EDGES];
+    numedges = parena->used;
+
+    // The buckets are counted afresh from the edges themselves, in
+    // case the pool couldn't grow and some edges were overwritten
+    for (i=0 ; i<ptable->numdirtynew ; i++)
+        ptable->newbuckets[ptable->dirtynew[i]].count = 0;
+    for (i=0 ; i<ptable->numdirtyremove ; i++)
+        ptable->removebuckets[ptable->dirtyremove[i]].count = 0;
+
+    if (!GrowEdgeLists(ptable, parena->capacity))
+        return;
+
+    // Gather the edges from their pool's blocks, newest first, and
+    // count them toward their scan lines and by each byte of x,
+    // with the sign flipped so negative x comes first
+    psrc = edgesortlists[0];
+    pdst = edgesortlists[1];
+    memset(counts, 0, sizeof(counts));
+    i = numedges;
+
+    for (pblock = parena->pblocks ; i > 0 ; pblock = pblock->pnext)
+    {
+        pedge = (edge_t *)pblock->pitems;
+        for (count = pblock->numitems ; (count > 0) && (i > 0) ; count--)
+        {
+            psrc[--i] = pedge;
+
+            ptable->newbuckets[pedge->topy].count++;
+            ptable->removebuckets[pedge->bottomy - 1].count++;
+
+            key = (unsigned int)pedge->x ^ 0x80000000;
+            for (pass=0 ; pass<SORT_PASSES ; pass++)
+            {
+                digit = (key >> (pass * SORT_RADIX_BITS)) &
+                        (SORT_BUCKETS - 1);
+                counts[pass][digit]++;
+            }
+
+            pedge++;
+        }
+    }
+
+    // Lay the remove buckets out one after another, and deal the
+    // edges out to them
+    total = 0;
+    for (i=0 ; i<ptable->numdirtyremove ; i++)
+    {
+        pbucket = &ptable->removebuckets[ptable->dirtyremove[i]];
+        pbucket->first = total;
+        total += pbucket->count;
+        pbucket->count = 0;
+    }
+
+    for (i=0 ; i<numedges ; i++)
+    {
+        pbucket = &ptable->removebuckets[psrc[i]->bottomy - 1];
+        ptable->removeedges[pbucket->first + pbucket->count++] = psrc[i];
+    }
+
+    // Sort on each byte of x in turn, lowest first, skipping bytes
+    // that are the same in every edge
+    for (pass=0 ; (pass<SORT_PASSES) && (numedges > 0) ; pass++)
+    {
+        shift = pass * SORT_RADIX_BITS;
+        key = (unsigned int)psrc[0]->x ^ 0x80000000;
+        digit = (key >> shift) & (SORT_BUCKETS - 1);
+        if (counts[pass][digit] == numedges)
+            continue;
+
+        // Turn the counts into where each bucket starts
+        total = 0;
+        for (digit=0 ; digit<SORT_BUCKETS ; digit++)
+        {
+            count = counts[pass][digit];
+            counts[pass][digit] = total;
+            total += count;
+        }
+
+        for (i=0 ; i<numedges ; i++)
+        {
+            key = (unsigned int)psrc[i]->x ^ 0x80000000;
+            digit = (key >> shift) & (SORT_BUCKETS - 1);
+            pdst[counts[pass][digit]++] = psrc[i];
+        }
+
+        edgesortlists[0] = pdst;
+        edgesortlists[1] = psrc;
+        psrc = edgesortlists[0];
+        pdst = edgesortlists[1];
+    }
+
+    // And the same for the add buckets
+    total = 0;
+    for (i=0 ; i<ptable->numdirtynew ; i++)
+    {
+        pbucket = &ptable->newbuckets[ptable->dirtynew[i]];
+        pbucket->first = total;
+        total += pbucket->count;
+        pbucket->count = 0;
+    }
+
+    for (i=0 ; i<numedges ; i++)
+    {
+        pbucket = &ptable->newbuckets[psrc[i]->topy];
+        ptable->newedges[pbucket->first + pbucket->count++] = psrc[i];
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up the screenspace gradients of a texture coordinate divided
+// by z, which unlike the coordinate itself is linear in screenspace,
+// from the coordinate's worldspace axis and the surface's 1/z
+// gradients. grads gets the value at screen coordinate 0,0 and the
+// x and y steps, in that order. The coordinate is the dot product of
+// the axis with the worldspace point, less mins, the lowest it gets
+// on the face, scaled down to the surface's mip level, so it indexes
+// the face's lit texture in the surface cache. In viewspace, that's
+// the dot product with the axis rotated into view orientation, plus
+// the dot product with the viewpoint, less mins.
+/////////////////////////////////////////////////////////////////////
+void SetUpTextureGradients(surf_t *psurf, point_t *paxis, int mins,
+                           vec_t *grads, vec_t scale)
+{
+    vec_t   offset, mipscale;
+    point_t taxis;
+
+    mipscale = 1.0 / (1 << psurf->miplevel);
+
+    taxis.v[0] = DotProduct(paxis, &vright) * mipscale;
+    taxis.v[1] = DotProduct(paxis, &vup) * mipscale;
+    taxis.v[2] = DotProduct(paxis, &vpn) * mipscale;
+
+    offset = (DotProduct(paxis, &currentpos) - mins) * mipscale;
+
+    // s/z = s.x * x/z + s.y * y/z + s.z + offset * 1/z, with
+    // x/z = (screen x - xcenter) * scale and
+    // y/z = (ycenter - screen y) * scale
+    grads[1] = taxis.v[0] * scale + offset * psurf->zinvstepx;
+    grads[2] = -taxis.v[1] * scale + offset * psurf->zinvstepy;
+    grads[0] = taxis.v[2] - xcenter * taxis.v[0] * scale +
+            ycenter * taxis.v[1] * scale + offset * psurf->zinv00;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up the 1/z gradients for a polygon from its viewspace plane.
+// grads gets the value at screen coordinate 0,0 and the x and y
+// steps, in that order, so screen coordinates can be used directly
+// when calculating 1/z from the gradients.
+/////////////////////////////////////////////////////////////////////
+void SetUpZInvGradients(plane_t *plane, vec_t *grads)
+{
+    vec_t   distinv, scale;
+
+    scale = maxscreenscaleinv * (fieldofview / 2.0);
+    distinv = 1.0 / plane->distance;
+    grads[1] = plane->normal.v[0] * distinv * scale;
+    grads[2] = -plane->normal.v[1] * distinv * scale;
+    grads[0] = plane->normal.v[2] * distinv - xcenter * grads[1] -
+            ycenter * grads[2];
+}
+
+/////////////////////////////////////////////////////////////////////
+// Create the surface for the polygon whose edges were just added,
+// so we'll know how to sort and draw from the edges. The polygon's
+// numverts screen vertices are pverts, or, if pindices isn't NULL,
+// the ones in pverts it indexes; a textured surface is drawn at the
+// mip level that puts no more than one texel on a pixel at its
+// nearest vertex, or as near to that as there are mips for.
+// RoomForPolygon has already made sure there's room for it.
+/////////////////////////////////////////////////////////////////////
+void AddSurface (plane_t *plane, point2D_t *pverts, int *pindices,
+                 int numverts)
+{
+    int         i;
+    vec_t       scale, zinv, nearzinv, texels;
+    point2D_t   *pvert;
+    litface_t   *plit;
+    arena_t     *parena;
+
+    pavailsurf->state = 0;
+    pavailsurf->color = currentcolor;
+    pavailsurf->key = currentkey;
+
+    SetUpZInvGradients(plane, &pavailsurf->zinv00);
+    scale = maxscreenscaleinv * (fieldofview / 2.0);
+
+    pavailsurf->plitface = NULL;
+    if (texturemapping && pcurrentlitface && pcurrentlitface->ptexture)
+    {
+        plit = pcurrentlitface;
+        pavailsurf->plitface = plit;
+
+        nearzinv = 0.0;
+        for (i=0 ; i<numverts ; i++)
+        {
+            pvert = pindices ? &pverts[pindices[i]] : &pverts[i];
+            zinv = pavailsurf->zinv00 + pvert->x * pavailsurf->zinvstepx +
+                    pvert->y * pavailsurf->zinvstepy;
+            if (zinv > nearzinv)
+                nearzinv = zinv;
+        }
+
+        pavailsurf->miplevel = 0;
+        if (nearzinv > 0.0)
+        {
+            // Texels per pixel at the nearest vertex
+            texels = TEXELS_PER_UNIT / (maxscale * nearzinv);
+
+            while ((texels > 1.0) &&
+                   (pavailsurf->miplevel < (MIP_LEVELS - 1)))
+            {
+                texels *= 0.5;
+                pavailsurf->miplevel++;
+            }
+        }
+
+        SetUpTextureGradients(pavailsurf, &pcurrenttexaxis[0],
+                              plit->texturemins[0],
+                              &pavailsurf->sdivz00, scale);
+        SetUpTextureGradients(pavailsurf, &pcurrenttexaxis[1],
+                              plit->texturemins[1],
+                              &pavailsurf->tdivz00, scale);
+    }
+
+    // Grow the pool if that was the last free surface
+    if (++pavailsurf == psurflimit)
+    {
+        parena = &pbuildtable->arenas[TABLE_SURFS];
+        pavailsurf = ArenaGrow(parena, pavailsurf);
+        psurflimit = (surf_t *)parena->plimit;
+        pbuildtable->surfs = (surf_t *)parena->pblocks->pitems;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Make sure the global edge table has room for a polygon's surface
+// and up to numedges of its edges, so it goes in whole or not at
+// all; a polygon with some of its edges missing would leave its
+// surface on the stack across the rest of the screen. Returns 0,
+// counting an overflow, if memory has run out.
+/////////////////////////////////////////////////////////////////////
+int RoomForPolygon (int numedges)
+{
+    arena_t *parena;
+
+    // Growing the pools when the last polygon filled them may have
+    // failed; try again
+    parena = &pbuildtable->arenas[TABLE_SURFS];
+    if (pavailsurf == psurflimit)
+    {
+        pavailsurf = ArenaGrow(parena, pavailsurf);
+        psurflimit = (surf_t *)parena->plimit;
+        pbuildtable->surfs = (surf_t *)parena->pblocks->pitems;
+        if (pavailsurf == psurflimit)
+        {
+            parena->overflowed++;
+            return 0;
+        }
+    }
+
+    parena = &pbuildtable->arenas[TABLE_EDGES];
+    if (pavailedge == pedgelimit)
+    {
+        pavailedge = ArenaGrow(parena, pavailedge);
+        pedgelimit = (edge_t *)parena->plimit;
+        if (pavailedge == pedgelimit)
+        {
+            parena->overflowed++;
+            return 0;
+        }
+    }
+
+    // Edges carry on in the next block when they fill this one, so
+    // if they might, make sure there is one now, before any are
+    // added
+    if ((pedgelimit - pavailedge < numedges) &&
+        (parena->pcurrent->pnext == NULL))
+    {
+        if (!AddArenaBlock(parena, parena->capacity))
+        {
+            parena->overflowed++;
+            return 0;
+        }
+        parena->grew = 1;
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the polygon's edges to the global edge table, or drop it if
+// there's no room.
+/////////////////////////////////////////////////////////////////////
+void AddPolygonEdges (plane_t *plane, polygon2D_t *screenpoly)
+{
+    int             i, nextvert, numverts;
+    cachededge_t    tedge;
+
+    numverts = screenpoly->numverts;
+
+    if (!RoomForPolygon(numverts))
+        return;
+
+    for (i=0 ; i<numverts ; i++)
+        ClampScreenPoint(&screenpoly->verts[i]);
+
+    // Add each edge in turn
+    for (i=0 ; i<numverts ; i++)
+    {
+        nextvert = i + 1;
+        if (nextvert >= numverts)
+            nextvert = 0;
+
+        if (SetUpEdge(&screenpoly->verts[i],
+                      &screenpoly->verts[nextvert], &tedge))
+        {
+            AddEdge(&tedge, tedge.leading);
+        }
+    }
+
+    AddSurface(plane, screenpoly->verts, NULL, numverts);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the edges of a mesh face that's entirely inside the frustum
+// to the global edge table. Its vertices must already have been
+// projected into screenverts. Each edge is set up only by the
+// first face to use it; the face on the other side of it reuses
+// the setup, as a trailing edge if it's leading for the first face
+// and vice versa. Drops the face if there's no room for it.
+/////////////////////////////////////////////////////////////////////
+void AddMeshPolygonEdges (plane_t *plane, mesh_t *pmesh, mface_t *pface)
+{
+    int             i, edge;
+    medge_t         *pmedge;
+    cachededge_t    *pedge;
+
+    if (!RoomForPolygon(pface->numverts))
+        return;
+
+    for (i=0 ; i<pface->numverts ; i++)
+    {
+        edge = pface->edges[i];
+        if (edge < 0)
+            edge = -edge;
+
+        pedge = &edgecache[edge];
+
+        if (pedge->stamp != cachestamp)
+        {
+            // Leaves topy equal to bottomy if the edge crosses no
+            // scan lines
+            pmedge = &pmesh->edges[edge];
+            SetUpEdge(&screenverts[pmedge->v[0]],
+                      &screenverts[pmedge->v[1]], pedge);
+            pedge->stamp = cachestamp;
+        }
+
+        if (pedge->bottomy == pedge->topy)
+            continue;       // doesn't cross any scan lines
+
+        AddEdge(pedge, (pface->edges[i] < 0) ? !pedge->leading :
+                                               pedge->leading);
+    }
+
+    AddSurface(plane, screenverts, pface->verts, pface->numverts);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Run jobs from the current RunJobs call until there are none left.
+/////////////////////////////////////////////////////////////////////
+void DoJobs (void)
+{
+    int     job;
+
+    for (;;)
+    {
+#ifdef _WIN32
+        job = InterlockedIncrement(&nextjob) - 1;
+#else
+        job = __sync_fetch_and_add(&nextjob, 1);
+#endif
+        if (job >= numjobs)
+            break;
+        jobfunc(job);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Worker thread body: wait to be started by RunJobs, help run the
+// jobs, say when there are none left, and wait again, until told to
+// quit.
+/////////////////////////////////////////////////////////////////////
+#ifdef _WIN32
+DWORD WINAPI WorkerThread (LPVOID param)
+{
+    int     worker = *(int *)param;
+
+    for (;;)
+    {
+        WaitForSingleObject(workerstart[worker], INFINITE);
+        if (workersquit)
+            break;
+
+        DoJobs();
+        SetEvent(workerdone[worker]);
+    }
+
+    return 0;
+}
+#else
+void *WorkerThread (void *param)
+{
+    int     round = *(int *)param;
+    int     quit;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&joblock);
+        while ((jobround == round) && !workersquit)
+            pthread_cond_wait(&jobstart, &joblock);
+        round = jobround;
+        quit = workersquit;
+        pthread_mutex_unlock(&joblock);
+
+        if (quit)
+            break;
+
+        DoJobs();
+
+        pthread_mutex_lock(&joblock);
+        if (--workersbusy == 0)
+            pthread_cond_signal(&jobsdone);
+        pthread_mutex_unlock(&joblock);
+    }
+
+    return NULL;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////
+// Call func once for each job from 0 to count-1, on the worker
+// threads and this one, and return when they've all finished. Jobs
+// are handed out in order, as threads come free.
+/////////////////////////////////////////////////////////////////////
+void RunJobs (jobfunc_t func, int count)
+{
+    jobfunc = func;
+    numjobs = count;
+    nextjob = 0;
+
+#ifdef _WIN32
+    {
+        int     i;
+
+        for (i=0 ; i<numworkers ; i++)
+            SetEvent(workerstart[i]);
+
+        DoJobs();
+
+        if (numworkers)
+        {
+            WaitForMultipleObjects(numworkers, workerdone, TRUE,
+                                   INFINITE);
+        }
+    }
+#else
+    if (numworkers)
+    {
+        pthread_mutex_lock(&joblock);
+        workersbusy = numworkers;
+        jobround++;
+        pthread_cond_broadcast(&jobstart);
+        pthread_mutex_unlock(&joblock);
+    }
+
+    DoJobs();
+
+    if (numworkers)
+    {
+        pthread_mutex_lock(&joblock);
+        while (workersbusy)
+            pthread_cond_wait(&jobsdone, &joblock);
+        pthread_mutex_unlock(&joblock);
+    }
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Tell all the worker threads to quit, and wait until they have.
+/////////////////////////////////////////////////////////////////////
+void StopWorkers (void)
+{
+    int     i;
+
+    if (numworkers == 0)
+        return;
+
+#ifdef _WIN32
+    workersquit = 1;
+    for (i=0 ; i<numworkers ; i++)
+        SetEvent(workerstart[i]);
+    WaitForMultipleObjects(numworkers, workerthreads, TRUE, INFINITE);
+    for (i=0 ; i<numworkers ; i++)
+    {
+        CloseHandle(workerthreads[i]);
+        CloseHandle(workerstart[i]);
+        CloseHandle(workerdone[i]);
+    }
+#else
+    pthread_mutex_lock(&joblock);
+    workersquit = 1;
+    pthread_cond_broadcast(&jobstart);
+    pthread_mutex_unlock(&joblock);
+    for (i=0 ; i<numworkers ; i++)
+        pthread_join(workerthreads[i], NULL);
+#endif
+
+    workersquit = 0;
+    numworkers = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Start up to count worker threads. Returns the number started.
+/////////////////////////////////////////////////////////////////////
+int StartWorkers (int count)
+{
+    while (numworkers < count)
+    {
+#ifdef _WIN32
+        DWORD   threadid;
+
+        workerindex[numworkers] = numworkers;
+        workerstart[numworkers] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        workerdone[numworkers] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        workerthreads[numworkers] = NULL;
+        if (workerstart[numworkers] && workerdone[numworkers])
+        {
+            workerthreads[numworkers] = CreateThread(NULL, 0,
+                    WorkerThread, &workerindex[numworkers], 0,
+                    &threadid);
+        }
+        if (workerthreads[numworkers] == NULL)
+        {
+            if (workerstart[numworkers])
+                CloseHandle(workerstart[numworkers]);
+            if (workerdone[numworkers])
+                CloseHandle(workerdone[numworkers]);
+            break;
+        }
+#else
+        // No RunJobs can be under way, so the worker starts out
+        // waiting for the next round
+        workerround[numworkers] = jobround;
+        if (pthread_create(&workerthreads[numworkers], NULL,
+                           WorkerThread, &workerround[numworkers]))
+        {
+            break;
+        }
+#endif
+        numworkers++;
+    }
+
+    return numworkers;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the number of processors the system has.
+/////////////////////////////////////////////////////////////////////
+int CountCPUs (void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO     info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long    count;
+
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int)count : 1;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Allocate the starting blocks of a band's pools, if that hasn't
+// been done already. The first band never copies edges or surfaces,
+// so it only needs a span pool. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int InitBandArenas (band_t *pband)
+{
+    int     i, numarenas, numitems;
+    arena_t *parena;
+
+    numarenas = (pband == &bands[0]) ? 1 : NUM_BAND_ARENAS;
+
+    for (i=0 ; i<numarenas ; i++)
+    {
+        parena = &pband->arenas[i];
+        if (parena->pblocks)
+            continue;
+
+        parena->name = bandarenas[i].name;
+        parena->itemsize = bandarenas[i].itemsize;
+        parena->movable = bandarenas[i].movable;
+
+        if (i == BAND_SPANS)
+            numitems = (pband == &bands[0]) ? INITIAL_SPANS :
+                                              INITIAL_BAND_SPANS;
+        else if (i == BAND_EDGES)
+            numitems = INITIAL_BAND_EDGES;
+        else
+            numitems = INITIAL_SURFS;
+
+        if (!AddArenaBlock(parena, numitems))
+            return 0;
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Scan and draw with the specified number of threads, including
+// this one, or one per processor if threads is 0, splitting the
+// screen into BANDS_PER_THREAD bands per thread. Falls back to
+// fewer threads if they can't all be started. Returns the number
+// of threads in use.
+/////////////////////////////////////////////////////////////////////
+int SetRenderThreads (int threads)
+{
+    int     i;
+
+    if (threads <= 0)
+        threads = CountCPUs();
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    StopWorkers();
+    numthreads = StartWorkers(threads - 1) + 1;
+
+    // One band scans just as fast as several on a single thread
+    numbands = (numthreads > 1) ? numthreads * BANDS_PER_THREAD : 1;
+
+    for (i=0 ; i<numbands ; i++)
+    {
+        if (!InitBandArenas(&bands[i]))
+        {
+            numbands = max(i, 1);
+            break;
+        }
+    }
+
+    return numthreads;
+}
+
+/////////////////////////////////////////////////////////////////////
+// qsort comparison for edges, by x.
+/////////////////////////////////////////////////////////////////////
+int CompareEdgeX(const void *p1, const void *p2)
+{
+    int     x1 = ((const edge_t *)p1)->x;
+    int     x2 = ((const edge_t *)p2)->x;
+
+    if (x1 < x2)
+        return -1;
+    if (x1 > x2)
+        return 1;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up a band's active edge list as it would be at the band's
+// top scan line if scanning had started at the top of the screen,
+// with copies of all the edges that start above it and end in or
+// below it, stepped down to it and sorted by x. Only ever reads the
+// fields of the global edges that don't change during scanning, so
+// other bands can be scanning at the same time. Returns 0, counting
+// an overflow, if memory runs out for the copies.
+/////////////////////////////////////////////////////////////////////
+int EnterBandEdges (band_t *pband)
+{
+    int             i, y, numcopies;
+    edge_t          *pedge, *pcopy, *pcopylimit, *pcopies, *plast;
+    edgebucket_t    *pbucket;
+    arena_t         *parena;
+
+    parena = &pband->arenas[BAND_EDGES];
+    pcopy = ArenaReset(parena);
+    pcopylimit = (edge_t *)parena->plimit;
+
+    // Every edge that's active at the top scan line ends on it or
+    // below, so it's on one of those scan lines' remove lists
+    for (y=pband->top ; y<DIBHeight ; y++)
+    {
+        pbucket = &pscantable->removebuckets[y];
+        for (i=0 ; i<pbucket->count ; i++)
+        {
+            pedge = pscantable->removeedges[pbucket->first + i];
+            if (pedge->topy >= pband->top)
+                continue;   // starts in this band or below
+
+            // Growing the pool for the last copy failed
+            if (pcopy == pcopylimit)
+            {
+                parena->overflowed++;
+                ArenaEndFrame(parena, pcopy);
+                return 0;
+            }
+
+            pcopy->x = pedge->topx +
+                    (pband->top - pedge->topy) * pedge->xstep;
+            pcopy->xstep = pedge->xstep;
+            pcopy->leading = pedge->leading;
+            pcopy->surf = pedge->surf;
+            pcopy->topy = pedge->topy;
+            pcopy->bottomy = pedge->bottomy;
+
+            // Grow the pool if that was the last free copy. Nothing
+            // points to the copies yet, so they can move
+            if (++pcopy == pcopylimit)
+            {
+                pcopy = ArenaGrow(parena, pcopy);
+                pcopylimit = (edge_t *)parena->plimit;
+            }
+        }
+    }
+
+    ArenaEndFrame(parena, pcopy);
+    pcopies = (edge_t *)parena->pblocks->pitems;
+    numcopies = pcopy - pcopies;
+
+    // Active edges are always sorted by x. Edges at the same x can
+    // be in any order without changing the spans
+    qsort(pcopies, numcopies, sizeof(edge_t), CompareEdgeX);
+
+    // Link the copies into the active edge list, and onto the lists
+    // to be removed after their final scans, if that's in the band
+    plast = &pband->edgehead;
+
+    for (i=0 ; i<numcopies ; i++)
+    {
+        pcopy = &pcopies[i];
+        pcopy->pprev = plast;
+        plast->pnext = pcopy;
+        plast = pcopy;
+
+        if (pcopy->bottomy <= pband->bottom)
+        {
+            pcopy->pnextremove = removecopies[pcopy->bottomy - 1];
+            removecopies[pcopy->bottomy - 1] = pcopy;
+        }
+    }
+
+    plast->pnext = &pband->edgetail;
+    pband->edgetail.pprev = plast;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Scan the edges in the global edge table that cross a band into
+// spans. Bands can be scanned at the same time, by different
+// threads: the global edges that start in the band are used and
+// stepped by this band alone, and everything else the band changes
+// is its own. If memory runs out for the band's copies of the
+// surfaces or edges, it's left unscanned, with psurfs NULL; if it
+// runs out for spans, the spans that don't fit are dropped.
+/////////////////////////////////////////////////////////////////////
+void ScanBand (band_t *pband)
+{
+    int             i, x, y, numsurfs, count;
+    vec_t           fx, fy, zinv, zinv2;
+    edge_t          *pedge, *pedge2, *ptemp;
+    edgebucket_t    *pbucket;
+    span_t          *pspan, *pspanlimit;
+    surf_t          *psurf, *psurf2, *psurfs, *psurflimit, *surfs;
+    arena_t         *parena;
+
+    // The first band scans with the surfaces themselves; the others
+    // take copies, so they each have a surface stack of their own
+    surfs = pscantable->surfs;
+    numsurfs = pscantable->numsurfs;
+
+    if (pband == &bands[0])
+    {
+        psurfs = surfs;
+        for (i=0 ; i<numsurfs ; i++)
+            psurfs[i].spans = NULL;
+    }
+    else
+    {
+        parena = &pband->arenas[BAND_SURFS];
+        psurf = ArenaReset(parena);
+        psurflimit = (surf_t *)parena->plimit;
+
+        for (i=0 ; i<numsurfs ; i++)
+        {
+            // Growing the pool for the last copy failed
+            if (psurf == psurflimit)
+            {
+                parena->overflowed++;
+                break;
+            }
+
+            // Only the fields that aren't scanning state; the first
+            // band is changing those as this runs
+            psurf->color = surfs[i].color;
+            psurf->key = surfs[i].key;
+            psurf->zinv00 = surfs[i].zinv00;
+            psurf->zinvstepx = surfs[i].zinvstepx;
+            psurf->zinvstepy = surfs[i].zinvstepy;
+            psurf->sdivz00 = surfs[i].sdivz00;
+            psurf->sdivzstepx = surfs[i].sdivzstepx;
+            psurf->sdivzstepy = surfs[i].sdivzstepy;
+            psurf->tdivz00 = surfs[i].tdivz00;
+            psurf->tdivzstepx = surfs[i].tdivzstepx;
+            psurf->tdivzstepy = surfs[i].tdivzstepy;
+            psurf->state = 0;
+            psurf->spans = NULL;
+
+            // Grow the pool if that was the last free surface
+            if (++psurf == psurflimit)
+            {
+                psurf = ArenaGrow(parena, psurf);
+                psurflimit = (surf_t *)parena->plimit;
+            }
+        }
+
+        ArenaEndFrame(parena, psurf);
+        psurfs = (surf_t *)parena->pblocks->pitems;
+
+        if (i < numsurfs)
+        {
+            pband->psurfs = NULL;
+            pband->numspans = pband->numpixels = 0;
+            return;
+        }
+    }
+
+    pband->psurfs = psurfs;
+
+    parena = &pband->arenas[BAND_SPANS];
+    pspan = ArenaReset(parena);
+    pspanlimit = (span_t *)parena->plimit;
+    pband->numpixels = 0;
+
+    // Set up the active edge list as initially empty, containing
+    // only the sentinels (which are also the background fill). Most
+    // of these fields could be set up just once at start-up
+    pband->edgehead.pnext = &pband->edgetail;
+    pband->edgehead.pprev = NULL;
+    pband->edgehead.x = -0xFFFF;    // left edge of screen
+    pband->edgehead.leading = 1;
+    pband->edgehead.surf = 0;
+
+    pband->edgetail.pnext = NULL;   // mark edge of list
+    pband->edgetail.pprev = &pband->edgehead;
+    pband->edgetail.x = DIBWidth << 16; // right edge of screen
+    pband->edgetail.leading = 0;
+    pband->edgetail.surf = 0;
+
+    // The background surface is the entire stack initially
+    psurfs->pnext = psurfs->pprev = psurfs;
+
+    for (y=pband->top ; y<pband->bottom ; y++)
+        removecopies[y] = NULL;
+
+    // Pick up the edges that are already under way
+    if ((pband->top > 0) && !EnterBandEdges(pband))
+    {
+        ArenaEndFrame(parena, pspan);
+        pband->psurfs = NULL;
+        pband->numspans = 0;
+        return;
+    }
+
+    for (y=pband->top ; y<pband->bottom ; y++)
+    {
+        fy = (vec_t)y;
+
+        // Merge in any edges that start on this scan, which are
+        // sorted by x
+        pbucket = &pscantable->newbuckets[y];
+        pedge2 = &pband->edgehead;
+        for (i=0 ; i<pbucket->count ; i++)
+        {
+            pedge = pscantable->newedges[pbucket->first + i];
+            while (pedge->x > pedge2->pnext->x)
+                pedge2 = pedge2->pnext;
+
+            pedge->pnext = pedge2->pnext;
+            pedge->pprev = pedge2;
+            pedge2->pnext->pprev = pedge;
+            pedge2->pnext = pedge;
+
+            pedge2 = pedge;
+        }
+
+        // Scan out the active edges into spans
+
+        // Start out with the left background edge already inserted,
+        // and the surface stack containing only the background
+        psurfs->state = 1;
+        psurfs->visxstart = 0;
+
+        for (pedge=pband->edgehead.pnext ; pedge ; pedge=pedge->pnext)
+        {
+            psurf = &psurfs[pedge->surf];
+
+            if (pedge->leading)
+            {
+                // It's a leading edge. Figure out where it is
+                // relative to the current surfaces and insert in
+                // the surface stack; if it's on top, emit the span
+                // for the current top.
+                // First, make sure the edges don't cross
+                if (++psurf->state == 1)
+                {
+                    fx = (vec_t)pedge->x * (1.0 / (vec_t)0x10000);
+                    // Calculate the surface's 1/z value at this pixel
+                    zinv = psurf->zinv00 + psurf->zinvstepx * fx +
+                            psurf->zinvstepy * fy;
+
+                    // See if that makes it a new top surface. A
+                    // lower key is always in front; only surfaces
+                    // with the same key need their 1/z compared
+                    psurf2 = psurfs->pnext;
+                    zinv2 = psurf2->zinv00 + psurf2->zinvstepx * fx +
+                            psurf2->zinvstepy * fy;
+                    if ((psurf->key < psurf2->key) ||
+                        ((psurf->key == psurf2->key) && (zinv >= zinv2)))
+                    {
+                        // It's a new top surface
+                        // emit the span for the current top
+                        x = (pedge->x + 0xFFFF) >> 16;
+                        count = x - psurf2->visxstart;
+                        if ((count > 0) && (pspan == pspanlimit))
+                        {
+                            // Growing the pool for the last span
+                            // failed; drop this one
+                            parena->overflowed++;
+                        }
+                        else if (count > 0)
+                        {
+                            pband->numpixels += count;
+                            pspan->count = count;
+                            pspan->y = y;
+                            pspan->x = psurf2->visxstart;
+                            pspan->pnext = psurf2->spans;
+                            psurf2->spans = pspan;
+
+                            // Grow the pool if that was the
+                            // last free span
+                            if (++pspan == pspanlimit)
+                            {
+                                pspan = ArenaGrow(parena, pspan);
+                                pspanlimit = (span_t *)parena->plimit;
+                            }
+                        }
+
+                        psurf->visxstart = x;
+
+                        // Add the edge to the stack
+                        psurf->pnext = psurf2;
+                        psurf2->pprev = psurf;
+                        psurfs->pnext = psurf;
+                        psurf->pprev = psurfs;
+                    }
+                    else
+                    {
+                        // Not a new top; sort into the surface stack.
+                        // Guaranteed to terminate due to sentinel
+                        // background surface
+                        do
+                        {
+                            psurf2 = psurf2->pnext;
+                            zinv2 = psurf2->zinv00 +
+                                    psurf2->zinvstepx * fx +
+                                    psurf2->zinvstepy * fy;
+                        } while ((psurf->key > psurf2->key) ||
+                                 ((psurf->key == psurf2->key) &&
+                                  (zinv < zinv2)));
+
+                        // Insert the surface into the stack
+                        psurf->pnext = psurf2;
+                        psurf->pprev = psurf2->pprev;
+                        psurf2->pprev->pnext = psurf;
+                        psurf2->pprev = psurf;
+                    }
+                }
+            }
+            else
+            {
+                // It's a trailing edge; if this was the top surface,
+                // emit the span and remove it.
+                // First, make sure the edges didn't cross
+                if (--psurf->state == 0)
+                {
+                    if (psurfs->pnext == psurf)
+                    {
+                        // It's on top, emit the span
+                        x = ((pedge->x + 0xFFFF) >> 16);
+                        count = x - psurf->visxstart;
+                        if ((count > 0) && (pspan == pspanlimit))
+                        {
+                            // Growing the pool for the last span
+                            // failed; drop this one
+                            parena->overflowed++;
+                        }
+                        else if (count > 0)
+                        {
+                            pband->numpixels += count;
+                            pspan->count = count;
+                            pspan->y = y;
+                            pspan->x = psurf->visxstart;
+                            pspan->pnext = psurf->spans;
+                            psurf->spans = pspan;
+
+                            // Grow the pool if that was the
+                            // last free span
+                            if (++pspan == pspanlimit)
+                            {
+                                pspan = ArenaGrow(parena, pspan);
+                                pspanlimit = (span_t *)parena->plimit;
+                            }
+                        }
+
+                        psurf->pnext->visxstart = x;
+                    }
+
+                    // Remove the surface from the stack
+                    psurf->pnext->pprev = psurf->pprev;
+                    psurf->pprev->pnext = psurf->pnext;
+                }
+            }
+        }
+
+        // Remove edges that are done. Those that started above the
+        // band were never added; their copies were
+        pbucket = &pscantable->removebuckets[y];
+        for (i=0 ; i<pbucket->count ; i++)
+        {
+            pedge = pscantable->removeedges[pbucket->first + i];
+            if (pedge->topy >= pband->top)
+            {
+                pedge->pprev->pnext = pedge->pnext;
+                pedge->pnext->pprev = pedge->pprev;
+            }
+        }
+
+        pedge = removecopies[y];
+        while (pedge)
+        {
+            pedge->pprev->pnext = pedge->pnext;
+            pedge->pnext->pprev = pedge->pprev;
+            pedge = pedge->pnextremove;
+        }
+
+        // Step the remaining edges one scan line, and re-sort
+        for (pedge=pband->edgehead.pnext ; pedge != &pband->edgetail ; )
+        {
+            ptemp = pedge->pnext;
+
+            // Step the edge
+            pedge->x += pedge->xstep;
+
+            // Move the edge back to the proper sorted location,
+            // if necessary
+            while (pedge->x < pedge->pprev->x)
+            {
+                pedge2 = pedge->pprev;
+                pedge2->pnext = pedge->pnext;
+                pedge->pnext->pprev = pedge2;
+                pedge2->pprev->pnext = pedge;
+                pedge->pprev = pedge2->pprev;
+                pedge->pnext = pedge2;
+                pedge2->pprev = pedge;
+            }
+
+            pedge = ptemp;
+        }
+    }
+
+    ArenaEndFrame(parena, pspan);
+    pband->numspans = parena->used;
+}
+
+/////////////////////////////////////////////////////////////////////
+// RunJobs job that scans one band.
+/////////////////////////////////////////////////////////////////////
+void ScanBandJob (int job)
+{
+    ScanBand(&bands[job]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Scan all the edges in the global edge table into spans, a band of
+// the screen at a time, spreading the bands over the worker threads
+// if there's more than one.
+/////////////////////////////////////////////////////////////////////
+void ScanEdges (void)
+{
+    int     i;
+
+    // Split the screen into bands of equal height
+    for (i=0 ; i<numbands ; i++)
+    {
+        bands[i].top = DIBHeight * i / numbands;
+        bands[i].bottom = DIBHeight * (i + 1) / numbands;
+    }
+
+    if (numbands > 1)
+        RunJobs(ScanBandJob, numbands);
+    else
+        ScanBand(&bands[0]);
+
+    numspans = 0;
+    for (i=0 ; i<numbands ; i++)
+        numspans += bands[i].numspans;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clear the per-pixel write counts for a new frame, reallocating
+// them if the DIB has changed size. Turns overdraw checking off if
+// there's not enough memory for the counts.
+/////////////////////////////////////////////////////////////////////
+void ClearWriteCounts(void)
+{
+    if (writecountsize != DIBWidth*DIBHeight)
+    {
+        free(pwritecounts);
+        writecountsize = DIBWidth*DIBHeight;
+        pwritecounts = malloc(writecountsize);
+        if (pwritecounts == NULL)
+        {
+            writecountsize = 0;
+            overdrawcheck = 0;
+            return;
+        }
+    }
+
+    memset(pwritecounts, 0, writecountsize);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Count one more write to each pixel of a span. Counts stick at 255.
+/////////////////////////////////////////////////////////////////////
+void CountSpanWrites(int x, int y, int count)
+{
+    unsigned char   *pcount;
+
+    pcount = pwritecounts + (DIBWidth * y) + x;
+
+    while (count-- > 0)
+    {
+        if (*pcount < 255)
+            (*pcount)++;
+        pcount++;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the depth complexity histogram, and the max and mean number
+// of writes per pixel, from the write counts for the frame just
+// drawn.
+/////////////////////////////////////////////////////////////////////
+void GatherOverdrawStats(void)
+{
+    int     i, depth, total;
+
+    for (i=0 ; i<MAX_DEPTH_COMPLEXITY ; i++)
+        depthhist[i] = 0;
+
+    maxdepth = 0;
+    total = 0;
+
+    for (i=0 ; i<writecountsize ; i++)
+    {
+        depth = pwritecounts[i];
+        total += depth;
+        if (depth > maxdepth)
+            maxdepth = depth;
+        if (depth >= MAX_DEPTH_COMPLEXITY)
+            depth = MAX_DEPTH_COMPLEXITY - 1;
+        depthhist[depth]++;
+    }
+
+    meandepth = (double)total / (double)writecountsize;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Write the write counts for the last frame out as a false-color
+// heatmap, in binary PPM format. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int WriteOverdrawHeatmap(char *filename)
+{
+    int             i, depth;
+    unsigned char   *pcolor;
+    FILE            *f;
+
+    if (pwritecounts == NULL)
+        return 0;
+
+    f = fopen(filename, "wb");
+    if (f == NULL)
+        return 0;
+
+    fprintf(f, "P6\n%d %d\n255\n", DIBWidth, DIBHeight);
+
+    for (i=0 ; i<writecountsize ; i++)
+    {
+        depth = pwritecounts[i];
+        if (depth >= NUM_HEAT_COLORS)
+            depth = NUM_HEAT_COLORS - 1;
+        pcolor = heatcolors[depth];
+        fwrite(pcolor, 1, 3, f);
+    }
+
+    fclose(f);
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build the colormap, allocate the surface cache if it hasn't been
+// already, and empty it. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int InitSurfaceCache(void)
+{
+    int     level, color, i, rgb[3];
+
+    if (!colormapbuilt)
+    {
+        for (level=0 ; level<LIGHT_LEVELS ; level++)
+        {
+            for (color=0 ; color<256 ; color++)
+            {
+                PaletteRGB(color, rgb);
+                for (i=0 ; i<3 ; i++)
+                {
+                    rgb[i] = rgb[i] * level / LIGHT_FULLBRIGHT;
+                    if (rgb[i] > 255)
+                        rgb[i] = 255;
+                }
+
+                colormap[level][color] = NearestColor(rgb, color >= 216);
+            }
+        }
+
+        colormapbuilt = 1;
+    }
+
+    if (surfcachebase == NULL)
+    {
+        surfcachebase = malloc(SURFCACHE_SIZE);
+        if (surfcachebase == NULL)
+            return 0;
+    }
+
+    FlushSurfaceCache();
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Empty the surface cache, leaving one free block the size of the
+// whole thing. Doesn't clear the cachespots that point at the blocks
+// in use, so it's for when the faces they belong to are going away.
+/////////////////////////////////////////////////////////////////////
+void FlushSurfaceCache(void)
+{
+    surfcache_t *pblock;
+
+    if (surfcachebase == NULL)
+        return;
+
+    pblock = (surfcache_t *)surfcachebase;
+    pblock->pnext = pblock->pprev = NULL;
+    pblock->plrunext = pblock->plruprev = NULL;
+    pblock->powner = NULL;
+    pblock->size = SURFCACHE_SIZE;
+    plruhead = plrutail = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Take a surface cache block off the most recently used list.
+/////////////////////////////////////////////////////////////////////
+void UnlinkCacheBlock(surfcache_t *pblock)
+{
+    if (pblock->plruprev)
+        pblock->plruprev->plrunext = pblock->plrunext;
+    else
+        plruhead = pblock->plrunext;
+
+    if (pblock->plrunext)
+        pblock->plrunext->plruprev = pblock->plruprev;
+    else
+        plrutail = pblock->plruprev;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Put a surface cache block at the head of the most recently used
+// list, as used this frame.
+/////////////////////////////////////////////////////////////////////
+void TouchCacheBlock(surfcache_t *pblock)
+{
+    pblock->plruprev = NULL;
+    pblock->plrunext = plruhead;
+    if (plruhead)
+        plruhead->plruprev = pblock;
+    else
+        plrutail = pblock;
+    plruhead = pblock;
+
+    pblock->lastframe = cacheframe;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Evict the lit texture in a surface cache block, clearing the
+// cachespot that pointed at it, and merge the block with any free
+// blocks on either side.
+/////////////////////////////////////////////////////////////////////
+void FreeCacheBlock(surfcache_t *pblock)
+{
+    surfcache_t *pnext, *pprev;
+
+    UnlinkCacheBlock(pblock);
+    *pblock->powner = NULL;
+    pblock->powner = NULL;
+
+    pnext = pblock->pnext;
+    if (pnext && (pnext->powner == NULL))
+    {
+        pblock->size += pnext->size;
+        pblock->pnext = pnext->pnext;
+        if (pblock->pnext)
+            pblock->pnext->pprev = pblock;
+    }
+
+    pprev = pblock->pprev;
+    if (pprev && (pprev->powner == NULL))
+    {
+        pprev->size += pblock->size;
+        pprev->pnext = pblock->pnext;
+        if (pprev->pnext)
+            pprev->pnext->pprev = pprev;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Allocate a surface cache block for a width by height lit texture,
+// pointed at by *powner, from the first free block big enough,
+// splitting off what's left over. If there's none, evict least
+// recently used textures until there is, but never one drawn this
+// frame. Returns NULL if there's no room even so.
+/////////////////////////////////////////////////////////////////////
+surfcache_t *AllocCacheBlock(int width, int height, surfcache_t **powner)
+{
+    int         size;
+    surfcache_t *pblock, *pnew;
+
+    size = (sizeof(surfcache_t) + width * height + 7) & ~7;
+
+    for (;;)
+    {
+        for (pblock = (surfcache_t *)surfcachebase ; pblock ;
+             pblock = pblock->pnext)
+        {
+            if ((pblock->powner == NULL) && (pblock->size >= size))
+                break;
+        }
+
+        if (pblock)
+            break;
+
+        if ((plrutail == NULL) || (plrutail->lastframe == cacheframe))
+            return NULL;
+
+        FreeCacheBlock(plrutail);
+        cacheevictions++;
+    }
+
+    if ((pblock->size - size) >= MIN_CACHE_BLOCK)
+    {
+        pnew = (surfcache_t *)((unsigned char *)pblock + size);
+        pnew->size = pblock->size - size;
+        pnew->powner = NULL;
+        pnew->pprev = pblock;
+        pnew->pnext = pblock->pnext;
+        if (pnew->pnext)
+            pnew->pnext->pprev = pnew;
+        pblock->pnext = pnew;
+        pblock->size = size;
+    }
+
+    pblock->powner = powner;
+    pblock->width = width;
+    pblock->height = height;
+    *powner = pblock;
+    TouchCacheBlock(pblock);
+
+    return pblock;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Build a face's lit texture at a mip level into a surface cache
+// block. The base texture is tiled across the face's extents, and
+// each texel is lit through the colormap, with the light
+// interpolated bilinearly across each lightmap grid square from the
+// samples at its corners.
+/////////////////////////////////////////////////////////////////////
+void BuildSurfaceCache(litface_t *plit, int miplevel, surfcache_t *pcache)
+{
+    int             s, t, x, y, blocksize, mask, smin, tmin, width;
+    int             left, right, leftstep, rightstep, light, lightstep;
+    unsigned char   *ptexture, *psrc, *pdest, *plight;
+
+    blocksize = LIGHTMAP_GRID >> miplevel;
+    mask = (TEXTURE_SIZE >> miplevel) - 1;
+    ptexture = plit->ptexture + mipoffsets[miplevel];
+    smin = plit->texturemins[0] / (1 << miplevel);
+    tmin = plit->texturemins[1] / (1 << miplevel);
+    width = pcache->width;
+
+    for (t=0 ; t<(pcache->height / blocksize) ; t++)
+    {
+        for (s=0 ; s<(width / blocksize) ; s++)
+        {
+            plight = plit->lightmap + t * plit->lightwidth + s;
+
+            // Light in 16.16 fixed point down the left and right
+            // sides of the square
+            left = plight[0] * 0x10000;
+            right = plight[1] * 0x10000;
+            leftstep = (plight[plit->lightwidth] - plight[0]) * 0x10000 /
+                    blocksize;
+            rightstep = (plight[plit->lightwidth + 1] - plight[1]) *
+                    0x10000 / blocksize;
+
+            for (y=0 ; y<blocksize ; y++)
+            {
+                pdest = (unsigned char *)(pcache + 1) +
+                        (t * blocksize + y) * width + s * blocksize;
+                psrc = ptexture + (((tmin + t * blocksize + y) & mask) *
+                                   (mask + 1));
+
+                light = left;
+                lightstep = (right - left) / blocksize;
+
+                for (x=0 ; x<blocksize ; x++)
+                {
+                    pdest[x] = colormap[light >> 19]
+                                       [psrc[(smin + s * blocksize + x) &
+                                             mask]];
+                    light += lightstep;
+                }
+
+                left += leftstep;
+                right += rightstep;
+            }
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the surface cache block holding the lit texture a surface
+// is to be drawn with, building it if it's not there, or NULL if
+// there's no room for it.
+/////////////////////////////////////////////////////////////////////
+surfcache_t *CacheSurface(surf_t *psurf)
+{
+    int         width, height;
+    litface_t   *plit;
+    surfcache_t *pcache;
+
+    plit = psurf->plitface;
+    pcache = plit->cachespots[psurf->miplevel];
+
+    if (pcache)
+    {
+        cachehits++;
+        UnlinkCacheBlock(pcache);
+        TouchCacheBlock(pcache);
+        return pcache;
+    }
+
+    cachemisses++;
+
+    width = plit->extents[0] >> psurf->miplevel;
+    height = plit->extents[1] >> psurf->miplevel;
+    pcache = AllocCacheBlock(width, height,
+                             &plit->cachespots[psurf->miplevel]);
+    if (pcache == NULL)
+        return NULL;
+
+    BuildSurfaceCache(plit, psurf->miplevel, pcache);
+    cachebytesbuilt += width * height;
+
+    return pcache;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Find or build the lit textures for all the textured surfaces that
+// have spans to draw this frame, before the bands are drawn, so the
+// bands only read the cache. Surfaces there's no room for are
+// filled with their colors.
+/////////////////////////////////////////////////////////////////////
+void CacheSurfaces(void)
+{
+    int     i, j, numsurfs;
+    surf_t  *psurf;
+
+    cacheframe++;
+    cachehits = cachemisses = cacheevictions = cachebytesbuilt = 0;
+
+    psurf = pscantable->surfs;
+    numsurfs = pscantable->numsurfs;
+
+    for (i=0 ; i<numsurfs ; i++, psurf++)
+    {
+        psurf->pcache = NULL;
+        if (psurf->plitface == NULL)
+            continue;
+
+        // Skip it if it's hidden in every band
+        for (j=0 ; j<numbands ; j++)
+        {
+            if (bands[j].psurfs && bands[j].psurfs[i].spans)
+                break;
+        }
+
+        if (j < numbands)
+            psurf->pcache = CacheSurface(psurf);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the surface cache counters for the last frame drawn, and
+// whether there were any textured surfaces in it.
+/////////////////////////////////////////////////////////////////////
+int GetSurfaceCacheStats(int *hits, int *misses, int *evictions,
+                         int *bytesbuilt)
+{
+    *hits = cachehits;
+    *misses = cachemisses;
+    *evictions = cacheevictions;
+    *bytesbuilt = cachebytesbuilt;
+
+    return (cachehits + cachemisses) != 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Draw the spans of one surface. Anything that's the same across
+// the surface is set up once here, rather than once per span.
+/////////////////////////////////////////////////////////////////////
+void DrawSurface (surf_t *psurf)
+{
+    int     color;
+    span_t  *pspan;
+
+    color = psurf->color;
+
+    for (pspan=psurf->spans ; pspan ; pspan=pspan->pnext)
+    {
+        memset (pDIB + (DIBPitch * pspan->y) + pspan->x,
+                color,
+                pspan->count);
+
+        if (overdrawcheck)
+            CountSpanWrites(pspan->x, pspan->y, pspan->count);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Draw the spans of a textured surface, perspective correct. s/z,
+// t/z, and 1/z are linear in screenspace, so they're stepped across
+// each span, and s and t are found exactly from them with a divide
+// every SPAN_SUBDIV pixels and at the end of the span; in between,
+// s and t are stepped linearly in 16.16 fixed point, which is close
+// enough that the difference can't be seen, for about the cost of
+// an affine mapper. The texels come from the face's lit texture in
+// the surface cache, pcache, which doesn't repeat, so s and t are
+// clamped to it; a little imprecision at the edges of the surface
+// would otherwise run off it. The far end of each subspan is kept
+// off the low edge, so rounding the steps down can't overshoot it.
+/////////////////////////////////////////////////////////////////////
+void DrawTexturedSurface (surf_t *psurf, surfcache_t *pcache)
+{
+    int             count, spancount, s, t, snext, tnext, sstep, tstep;
+    int             width, smax, tmax;
+    unsigned char   *pbase, *pdest;
+    span_t          *pspan;
+    vec_t           sdivz, tdivz, zi, z, du, dv;
+    vec_t           sdivzstep, tdivzstep, zistep;
+
+    pbase = (unsigned char *)(pcache + 1);
+    width = pcache->width;
+    smax = (pcache->width << 16) - 1;
+    tmax = (pcache->height << 16) - 1;
+
+    sdivzstep = psurf->sdivzstepx * SPAN_SUBDIV;
+    tdivzstep = psurf->tdivzstepx * SPAN_SUBDIV;
+    zistep = psurf->zinvstepx * SPAN_SUBDIV;
+
+    for (pspan=psurf->spans ; pspan ; pspan=pspan->pnext)
+    {
+        pdest = (unsigned char *)pDIB + (DIBPitch * pspan->y) + pspan->x;
+        count = pspan->count;
+
+        // Calculate the initial s/z, t/z, 1/z, s, and t
+        du = (vec_t)pspan->x;
+        dv = (vec_t)pspan->y;
+
+        sdivz = psurf->sdivz00 + dv * psurf->sdivzstepy +
+                du * psurf->sdivzstepx;
+        tdivz = psurf->tdivz00 + dv * psurf->tdivzstepy +
+                du * psurf->tdivzstepx;
+        zi = psurf->zinv00 + dv * psurf->zinvstepy +
+                du * psurf->zinvstepx;
+        if (zi < MIN_TEXTURE_ZINV)
+            zi = MIN_TEXTURE_ZINV;  // guard against edge imprecision
+        z = (vec_t)0x10000 / zi;    // prescale to 16.16 fixed point
+
+        s = (int)(sdivz * z);
+        if (s > smax)
+            s = smax;
+        else if (s < 0)
+            s = 0;
+
+        t = (int)(tdivz * z);
+        if (t > tmax)
+            t = tmax;
+        else if (t < 0)
+            t = 0;
+
+        do
+        {
+            // Calculate s and t at the far end of the subspan
+            spancount = (count >= SPAN_SUBDIV) ? SPAN_SUBDIV : count;
+            count -= spancount;
+
+            if (count)
+            {
+                sdivz += sdivzstep;
+                tdivz += tdivzstep;
+                zi += zistep;
+                if (zi < MIN_TEXTURE_ZINV)
+                    zi = MIN_TEXTURE_ZINV;
+                z = (vec_t)0x10000 / zi;
+
+                snext = (int)(sdivz * z);
+                if (snext > smax)
+                    snext = smax;
+                else if (snext < 8)
+                    snext = 8;
+
+                tnext = (int)(tdivz * z);
+                if (tnext > tmax)
+                    tnext = tmax;
+                else if (tnext < 8)
+                    tnext = 8;
+
+                sstep = (snext - s) >> SPAN_SUBDIV_SHIFT;
+                tstep = (tnext - t) >> SPAN_SUBDIV_SHIFT;
+            }
+            else
+            {
+                // Last subspan: calculate s and t at the last pixel,
+                // so the mapping ends exactly, and step there evenly
+                sdivz += psurf->sdivzstepx * (spancount - 1);
+                tdivz += psurf->tdivzstepx * (spancount - 1);
+                zi += psurf->zinvstepx * (spancount - 1);
+                if (zi < MIN_TEXTURE_ZINV)
+                    zi = MIN_TEXTURE_ZINV;
+                z = (vec_t)0x10000 / zi;
+
+                snext = (int)(sdivz * z);
+                if (snext > smax)
+                    snext = smax;
+                else if (snext < 8)
+                    snext = 8;
+
+                tnext = (int)(tdivz * z);
+                if (tnext > tmax)
+                    tnext = tmax;
+                else if (tnext < 8)
+                    tnext = 8;
+
+                sstep = tstep = 0;
+                if (spancount > 1)
+                {
+                    sstep = (snext - s) / (spancount - 1);
+                    tstep = (tnext - t) / (spancount - 1);
+                }
+            }
+
+            do
+            {
+                *pdest++ = pbase[(t >> 16) * width + (s >> 16)];
+                s += sstep;
+                t += tstep;
+            } while (--spancount > 0);
+
+            s = snext;
+            t = tnext;
+
+        } while (count > 0);
+
+        if (overdrawcheck)
+            CountSpanWrites(pspan->x, pspan->y, pspan->count);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Make sure the 1/z buffer is the size of the screen. Returns 0 if
+// there's no memory for it.
+/////////////////////////////////////////////////////////////////////
+int SetUpZBuffer(void)
+{
+    if (pzbuffer && (zbufferwidth == DIBWidth) &&
+        (zbufferheight == DIBHeight))
+    {
+        return 1;
+    }
+
+    free(pzbuffer);
+    pzbuffer = malloc(DIBWidth * DIBHeight * sizeof(unsigned short));
+    if (pzbuffer == NULL)
+        return 0;
+
+    zbufferwidth = DIBWidth;
+    zbufferheight = DIBHeight;
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns 1/z as stored in the 1/z buffer, in 16.16 fixed point;
+// the buffer holds the integer part.
+/////////////////////////////////////////////////////////////////////
+unsigned ZInvToFixed(vec_t zinv)
+{
+    if (zinv < 0.0)
+        zinv = 0.0;     // the background is infinitely far away
+    else if (zinv > MAX_ZBUFFER_ZINV)
+        zinv = MAX_ZBUFFER_ZINV;
+
+    return (unsigned)(zinv * ((vec_t)ZBUFFER_SCALE * (vec_t)0x10000));
+}
+
+/////////////////////////////////////////////////////////////////////
+// Write 1/z for a surface's spans into the 1/z buffer. Since every
+// pixel is in exactly one world span, this is one write per pixel,
+// with no reads; 1/z is found at both ends of each span, and stepped
+// linearly in between, which is exact, since 1/z is linear in
+// screenspace.
+/////////////////////////////////////////////////////////////////////
+void DrawZSpans (surf_t *psurf)
+{
+    int             count, izistep;
+    unsigned        izi, iziend;
+    unsigned short  *pz;
+    span_t          *pspan;
+    vec_t           zi;
+
+    for (pspan=psurf->spans ; pspan ; pspan=pspan->pnext)
+    {
+        pz = pzbuffer + zbufferwidth * pspan->y + pspan->x;
+        count = pspan->count;
+
+        zi = psurf->zinv00 + pspan->y * psurf->zinvstepy +
+                pspan->x * psurf->zinvstepx;
+        izi = ZInvToFixed(zi);
+
+        izistep = 0;
+        if (count > 1)
+        {
+            iziend = ZInvToFixed(zi + (count - 1) * psurf->zinvstepx);
+            izistep = (int)(((double)iziend - (double)izi) / (count - 1));
+        }
+
+        do
+        {
+            *pz++ = (unsigned short)(izi >> 16);
+            izi += izistep;
+        } while (--count > 0);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Draw one entity polygon, z-buffered: only the pixels where it's at
+// least as near as what's already there are drawn, and their 1/z is
+// written. The polygon's edges are stepped into the left and right
+// edge arrays, the same way world edges are stepped, so entities
+// cover pixels by the same rules the world does. Returns the number
+// of pixels drawn.
+/////////////////////////////////////////////////////////////////////
+int DrawEntityPoly (entitypoly_t *pentpoly)
+{
+    int             i, x, y, top, bottom, count, izistep, nextvert;
+    int             drawn, x2;
+    unsigned        izi, iziend;
+    unsigned short  *pz;
+    unsigned char   *pdest;
+    polygon2D_t     *ppoly;
+    cachededge_t    edge;
+    vec_t           zi;
+
+    ppoly = &pentpoly->screenpoly;
+    top = DIBHeight;
+    bottom = 0;
+
+    for (i=0 ; i<ppoly->numverts ; i++)
+    {
+        nextvert = (i + 1) % ppoly->numverts;
+        if (!SetUpEdge(&ppoly->verts[i], &ppoly->verts[nextvert], &edge))
+            continue;
+
+        if (edge.topy < top)
+            top = edge.topy;
+        if (edge.bottomy > bottom)
+            bottom = edge.bottomy;
+
+        for (y=edge.topy ; y<edge.bottomy ; y++)
+        {
+            if (edge.leading)
+                entityleft[y] = edge.x;
+            else
+                entityright[y] = edge.x;
+            edge.x += edge.xstep;
+        }
+    }
+
+    drawn = 0;
+
+    for (y=top ; y<bottom ; y++)
+    {
+        x = (entityleft[y] + 0xFFFF) >> 16;
+        x2 = (entityright[y] + 0xFFFF) >> 16;
+        count = x2 - x;
+        if (count <= 0)
+            continue;
+
+        pz = pzbuffer + zbufferwidth * y + x;
+        pdest = (unsigned char *)pDIB + DIBPitch * y + x;
+
+        zi = pentpoly->zinv00 + y * pentpoly->zinvstepy +
+                x * pentpoly->zinvstepx;
+        izi = ZInvToFixed(zi);
+
+        izistep = 0;
+        if (count > 1)
+        {
+            iziend = ZInvToFixed(zi + (count - 1) * pentpoly->zinvstepx);
+            izistep = (int)(((double)iziend - (double)izi) / (count - 1));
+        }
+
+        for (i=0 ; i<count ; i++)
+        {
+            if (*pz <= (izi >> 16))
+            {
+                *pz = (unsigned short)(izi >> 16);
+                *pdest = pentpoly->color;
+                drawn++;
+
+                if (overdrawcheck)
+                    CountSpanWrites(x + i, y, 1);
+            }
+
+            pz++;
+            pdest++;
+            izi += izistep;
+        }
+    }
+
+    return drawn;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Draw all the entity polygons in the edge table being drawn, into
+// the world and its 1/z buffer. They're drawn in no particular
+// order; the z-buffer sorts them, against each other and the world.
+/////////////////////////////////////////////////////////////////////
+void DrawEntities (void)
+{
+    int     i;
+
+    for (i=0 ; i<pscantable->numentitypolys ; i++)
+        numpixels += DrawEntityPoly(&pscantable->entitypolys[i]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Draw the spans a band scanned out, a surface at a time, if it was
+// scanned.
+/////////////////////////////////////////////////////////////////////
+void DrawBand (band_t *pband)
+{
+    int     i, numsurfs;
+    surf_t  *psurf, *surfs;
+
+    psurf = pband->psurfs;
+    if (psurf == NULL)
+        return;     // ran out of memory for the copies
+    surfs = pscantable->surfs;
+    numsurfs = pscantable->numsurfs;
+
+    for (i=0 ; i<numsurfs ; i++, psurf++)
+    {
+        if (psurf->spans == NULL)
+            continue;
+
+        // The lit texture is only looked up for the surface itself,
+        // not the band's copy
+        if (surfs[i].pcache)
+            DrawTexturedSurface(psurf, surfs[i].pcache);
+        else
+            DrawSurface(psurf);
+
+        if (zfilling)
+            DrawZSpans(psurf);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// RunJobs job that draws one band.
+/////////////////////////////////////////////////////////////////////
+void DrawBandJob (int job)
+{
+    DrawBand(&bands[job]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Draw all the spans that were scanned out. Each band's spans are
+// drawn by one thread, surface by surface; no two bands share a
+// scan line, so the threads don't have to coordinate. Every pixel
+// is drawn exactly once, so bands of the same height have the same
+// number of pixels to draw, give or take a scan line. The surface
+// cache is brought up to date first, on this thread alone. When
+// z-buffering, the bands fill the 1/z buffer too, and the entities
+// are drawn into it once they're done.
+/////////////////////////////////////////////////////////////////////
+void DrawSpans (void)
+{
+    int     i;
+
+    numpixels = 0;
+    for (i=0 ; i<numbands ; i++)
+        numpixels += bands[i].numpixels;
+
+    CacheSurfaces();
+
+    zfilling = pscantable->zbuffered && SetUpZBuffer();
+
+    if (numbands > 1)
+        RunJobs(DrawBandJob, numbands);
+    else
+        DrawBand(&bands[0]);
+
+    if (zfilling)
+        DrawEntities();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clear the lists of edges to add and remove on each scan line.
+// Only the scan lines the last frame built into the table had edges
+// on need it.
+/////////////////////////////////////////////////////////////////////
+void ClearEdgeLists(void)
+{
+    int i;
+
+    for (i=0 ; i<pbuildtable->numdirtynew ; i++)
+        pbuildtable->newbuckets[pbuildtable->dirtynew[i]].count = 0;
+    for (i=0 ; i<pbuildtable->numdirtyremove ; i++)
+    {
+        pbuildtable->removebuckets[pbuildtable->dirtyremove[i]].count =
+                0;
+    }
+
+    pbuildtable->numdirtynew = pbuildtable->numdirtyremove = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the current time in seconds from an arbitrary base.
+/////////////////////////////////////////////////////////////////////
+double FrameClock(void)
+{
+#if !defined(HEADLESS) || defined(_WIN32)
+    static LARGE_INTEGER    freq;
+    LARGE_INTEGER           count;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * (1.0 / 1000000000.0);
+#endif
+}
+
+#ifdef STAGE_TIMING
+
+/////////////////////////////////////////////////////////////////////
+// Start a new frame in the stage time history, overwriting the
+// oldest one once the history is full.
+/////////////////////////////////////////////////////////////////////
+void BeginStageFrame(void)
+{
+    double  now;
+
+    now = FrameClock();
+    if (numstageframes == 0)
+        stagebase = now;
+
+    pstageframe = &stagehistory[numstageframes % STAGE_HISTORY];
+    memset(pstageframe, 0, sizeof(*pstageframe));
+    pstageframe->frame = numstageframes;
+    pstageframe->start = now - stagebase;
+    pstageframe->pipelined = pipelining;
+    frameticks = ReadStageTicks();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Finish the current frame in the stage time history, turning the
+// ticks of the inner stages into seconds at the rate they went by
+// over the whole frame.
+/////////////////////////////////////////////////////////////////////
+void EndStageFrame(void)
+{
+    int                 i;
+    unsigned long long  ticks;
+    double              secondspertick;
+
+    pstageframe->end = FrameClock() - stagebase;
+    ticks = ReadStageTicks() - frameticks;
+
+    secondspertick = 0.0;
+    if (ticks > 0)
+        secondspertick = (pstageframe->end - pstageframe->start) / ticks;
+
+    for (i=0 ; i<NUM_STAGES ; i++)
+    {
+        pstageframe->stagetime[i] += pstageframe->stageticks[i] *
+                secondspertick;
+    }
+
+    numstageframes++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note the start of a call to a stage.
+/////////////////////////////////////////////////////////////////////
+void BeginStage(int stage)
+{
+    double  now;
+
+    now = FrameClock() - stagebase;
+    if (pstageframe->stagecalls[stage] == 0)
+        pstageframe->stagestart[stage] = now;
+    stageentry[stage] = now;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note the end of a call to a stage, and add its time to the total
+// for the frame.
+/////////////////////////////////////////////////////////////////////
+void EndStage(int stage)
+{
+    pstageframe->stagetime[stage] +=
+            FrameClock() - stagebase - stageentry[stage];
+    pstageframe->stagecalls[stage]++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note the start of a call to a stage entered once per object. Only
+// the first call of the frame reads the frame clock.
+/////////////////////////////////////////////////////////////////////
+void BeginInnerStage(int stage)
+{
+    if (pstageframe->stagecalls[stage] == 0)
+        pstageframe->stagestart[stage] = FrameClock() - stagebase;
+    stageentryticks[stage] = ReadStageTicks();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note the end of a call to a stage entered once per object, and add
+// its ticks to the frame's total for it.
+/////////////////////////////////////////////////////////////////////
+void EndInnerStage(int stage)
+{
+    pstageframe->stageticks[stage] +=
+            ReadStageTicks() - stageentryticks[stage];
+    pstageframe->stagecalls[stage]++;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the time of a stage in milliseconds, not counting any
+// stages nested inside it.
+/////////////////////////////////////////////////////////////////////
+double ExclusiveStageTime(stageframe_t *pframe, int stage)
+{
+    double  time;
+
+    time = pframe->stagetime[stage];
+    if (stage == STAGE_OBJECTS)
+        time -= pframe->stagetime[STAGE_ADDEDGES];
+
+    return time * 1000.0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Copy the stage times, in milliseconds, of the last frame drawn
+// into times, and return the number of stages. The object loop's
+// time doesn't include AddPolygonEdges.
+/////////////////////////////////////////////////////////////////////
+int GetStageTimes(double *times)
+{
+    int             i;
+    stageframe_t    *pframe;
+
+    if (numstageframes == 0)
+        return 0;
+
+    pframe = &stagehistory[(numstageframes - 1) % STAGE_HISTORY];
+    for (i=0 ; i<NUM_STAGES ; i++)
+        times[i] = ExclusiveStageTime(pframe, i);
+
+    return NUM_STAGES;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Write the stage times for the frames in the history out, oldest
+// first, as CSV (milliseconds per stage per frame, with the object
+// loop not counting AddPolygonEdges) and as a Chrome trace event
+// file. Either name can be NULL. Returns 0 on failure.
+/////////////////////////////////////////////////////////////////////
+int WriteStageTimes(char *csvname, char *tracename)
+{
+    int             i, j, first, count;
+    stageframe_t    *pframe;
+    FILE            *f;
+
+    count = numstageframes;
+    if (count > STAGE_HISTORY)
+        count = STAGE_HISTORY;
+    first = numstageframes - count;
+
+    if (csvname)
+    {
+        f = fopen(csvname, "w");
+        if (f == NULL)
+            return 0;
+
+        fprintf(f, "frame,total");
+        for (j=0 ; j<NUM_STAGES ; j++)
+            fprintf(f, ",%s", stagenames[j]);
+        fprintf(f, "\n");
+
+        for (i=first ; i<numstageframes ; i++)
+        {
+            pframe = &stagehistory[i % STAGE_HISTORY];
+            fprintf(f, "%d,%.4f", pframe->frame,
+                    (pframe->end - pframe->start) * 1000.0);
+            for (j=0 ; j<NUM_STAGES ; j++)
+                fprintf(f, ",%.4f", ExclusiveStageTime(pframe, j));
+            fprintf(f, "\n");
+        }
+
+        fclose(f);
+    }
+
+    if (tracename)
+    {
+        f = fopen(tracename, "w");
+        if (f == NULL)
+            return 0;
+
+        // One complete event per frame, with one per stage nested
+        // inside it. A stage called more than once per frame is
+        // shown as a single event that starts at the first call and
+        // lasts for the total time of all the calls. When the frame
+        // was pipelined, ScanEdges and DrawSpans (for the frame
+        // before) ran on the back end thread, and go on a track of
+        // their own
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (i=first ; i<numstageframes ; i++)
+        {
+            pframe = &stagehistory[i % STAGE_HISTORY];
+            fprintf(f, "%s{\"name\":\"UpdateWorld\",\"ph\":\"X\","
+                    "\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"frame\":%d}}",
+                    (i == first) ? "" : ",\n",
+                    pframe->start * 1000000.0,
+                    (pframe->end - pframe->start) * 1000000.0,
+                    pframe->frame);
+
+            for (j=0 ; j<NUM_STAGES ; j++)
+            {
+                if (pframe->stagecalls[j] == 0)
+                    continue;
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\","
+                        "\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                        "\"dur\":%.3f,\"args\":{\"calls\":%d}}",
+                        stagenames[j],
+                        (pframe->pipelined && ((j == STAGE_SCANEDGES) ||
+                         (j == STAGE_DRAWSPANS))) ? 2 : 1,
+                        pframe->stagestart[j] * 1000000.0,
+                        pframe->stagetime[j] * 1000000.0,
+                        pframe->stagecalls[j]);
+            }
+        }
+        fprintf(f, "\n]}\n");
+
+        fclose(f);
+    }
+
+    return 1;
+}
+
+#else   // !STAGE_TIMING
+
+#define BeginStageFrame()
+#define EndStageFrame()
+
+int WriteStageTimes(char *csvname, char *tracename)
+{
+    (void)csvname;
+    (void)tracename;
+
+    return 0;
+}
+
+#endif  // STAGE_TIMING
+
+#ifdef STAGE_TIMING
+/////////////////////////////////////////////////////////////////////
+// Add the edges of all the queued faces to the global edge table, in
+// the order they were queued, each with its own surface state.
+/////////////////////////////////////////////////////////////////////
+void AddQueuedFaces (void)
+{
+    int             i;
+    queuedface_t    *pqueued;
+
+    if (numqueuedfaces == 0)
+        return;
+
+    BEGIN_INNER_STAGE(STAGE_ADDEDGES);
+    for (i=0 ; i<numqueuedfaces ; i++)
+    {
+        pqueued = &queuedfaces[i];
+        currentcolor = pqueued->color;
+        pcurrentlitface = pqueued->plitface;
+        pcurrenttexaxis = pqueued->ptexaxis;
+
+        if (pqueued->pmesh)
+        {
+            AddMeshPolygonEdges (&pqueued->plane, pqueued->pmesh,
+                    pqueued->pface);
+        }
+        else
+        {
+            AddPolygonEdges (&pqueued->plane, &pqueued->screenpoly);
+        }
+    }
+    END_INNER_STAGE(STAGE_ADDEDGES);
+
+    numqueuedfaces = 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Queue a face to have its edges added by AddQueuedFaces with the
+// current surface state, adding the faces already queued first if
+// the queue's full. pscreenpoly is NULL for a mesh face whose
+// vertices are in screenverts.
+/////////////////////////////////////////////////////////////////////
+void QueueFace (plane_t *pplane, polygon2D_t *pscreenpoly,
+                mesh_t *pmesh, mface_t *pface)
+{
+    queuedface_t    *pqueued;
+
+    if (numqueuedfaces == MAX_QUEUED_FACES)
+        AddQueuedFaces();
+
+    pqueued = &queuedfaces[numqueuedfaces++];
+    pqueued->plane = *pplane;
+    pqueued->color = currentcolor;
+    pqueued->plitface = pcurrentlitface;
+    pqueued->ptexaxis = pcurrenttexaxis;
+    pqueued->pface = pface;
+    pqueued->pmesh = pscreenpoly ? NULL : pmesh;
+    if (pscreenpoly)
+        pqueued->screenpoly = *pscreenpoly;
+}
+#endif  // STAGE_TIMING
+
+/////////////////////////////////////////////////////////////////////
+// Add the edges of all an object's visible faces to the global edge
+// table. clipflags are the frustum planes the object's bounding
+// sphere crosses, as returned by ObjectClipFlags.
+/////////////////////////////////////////////////////////////////////
+void AddObjectEdges (convexobject_t *pobject, int clipflags)
+{
+    polygon2D_t     screenpoly;
+    polygon_t       tpoly0, tpoly1, tpoly2, *pclipped;
+    mesh_t          *pmesh;
+    mface_t         *pface;
+    cachedvert_t    *pvert;
+    int             i, j, andcodes, orcodes, projected;
+    plane_t         plane;
+
+    pmesh = pobject->pmesh;
+    InvalidateMeshCache();
+    projected = 0;
+
+    for (i=0 ; i<pmesh->numfaces ; i++)
+    {
+        pface = &pmesh->faces[i];
+
+        pvert = CacheVertex(pobject, pface->verts[0], clipflags);
+        if (!PolyFacesViewer(&pvert->world, &pface->plane))
+            continue;
+
+        // Classify the face by its vertices' outcodes. If every
+        // vertex is outside the same plane, the face is entirely
+        // outside the frustum; if no vertex is outside any plane,
+        // it's entirely inside, and needs no clipping
+        andcodes = clipflags;
+        orcodes = 0;
+
+        for (j=0 ; j<pface->numverts ; j++)
+        {
+            pvert = CacheVertex(pobject, pface->verts[j], clipflags);
+            andcodes &= pvert->outcode;
+            orcodes |= pvert->outcode;
+        }
+
+        if (andcodes)
+            continue;       // trivially rejected
+
+        if (orcodes)
+        {
+            // Copy the vertices and clip to just the planes the face
+            // straddles
+            tpoly0.numverts = pface->numverts;
+            for (j=0 ; j<tpoly0.numverts ; j++)
+                tpoly0.verts[j] = vertcache[pface->verts[j]].world;
+
+            pclipped = ClipToFrustum(&tpoly0, &tpoly1, orcodes);
+            if (!pclipped)
+                continue;
+
+            TransformPolygon (pclipped, &tpoly2);
+            ProjectPolygon (&tpoly2, &screenpoly);
+        }
+        else if (!projected)
+        {
+            // Transform and project all the object's vertices in one
+            // batch, for this face and the rest
+            TransformMeshVerts(pmesh, &pobject->center, screenverts);
+            projected = 1;
+        }
+
+        currentcolor = pface->color;
+        pcurrentlitface = pobject->plitfaces ?
+                &pobject->plitfaces[i] : NULL;
+        pcurrenttexaxis = pface->texaxis;
+
+        TransformPlane(&pface->plane, &pobject->center, &plane);
+
+        if (orcodes)
+            ADD_POLYGON_EDGES(&plane, &screenpoly);
+        else
+            ADD_MESH_POLYGON_EDGES(&plane, pmesh, pface);
+    }
+
+    // The next object's faces will overwrite screenverts
+    ADD_QUEUED_FACES();
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the edges of a BSP face that faces the viewer to the global
+// edge table, clipped to the frustum planes in clipflags that it
+// crosses. Pieces of mesh faces have no edges in common with the
+// rest of the mesh, so they're clipped and projected on their own.
+/////////////////////////////////////////////////////////////////////
+void AddBSPFaceEdges (bspface_t *pface, int clipflags)
+{
+    polygon2D_t     screenpoly;
+    polygon_t       tpoly0, tpoly1, *pclipped;
+    convexobject_t  *pobject;
+    mface_t         *pmface;
+    int             i, outcode, andcodes, orcodes;
+    plane_t         plane;
+
+    andcodes = clipflags;
+    orcodes = 0;
+
+    for (i=0 ; i<pface->poly.numverts ; i++)
+    {
+        outcode = PointOutcode(&pface->poly.verts[i], clipflags);
+        andcodes &= outcode;
+        orcodes |= outcode;
+    }
+
+    if (andcodes)
+        return;             // trivially rejected
+
+    pclipped = &pface->poly;
+    if (orcodes)
+    {
+        pclipped = ClipToFrustum(&pface->poly, &tpoly0, orcodes);
+        if (!pclipped)
+            return;
+    }
+
+    TransformPolygon (pclipped, &tpoly1);
+    ProjectPolygon (&tpoly1, &screenpoly);
+
+    pobject = pface->pobject;
+    pmface = &pobject->pmesh->faces[pface->face];
+    currentcolor = pmface->color;
+    pcurrentlitface = pobject->plitfaces ?
+            &pobject->plitfaces[pface->face] : NULL;
+    pcurrenttexaxis = pmface->texaxis;
+
+    TransformPlane(&pmface->plane, &pobject->center, &plane);
+
+    ADD_POLYGON_EDGES(&plane, &screenpoly);
+}
+
+/////////////////////////////////////////////////////////////////////
+// If the viewer's moved into another leaf since the last frame,
+// decompress its row of the PVS, and mark the faces in the leaves
+// that says can be seen, and the nodes above them, with a new
+// visframe; otherwise last frame's marks still hold, as in Quake.
+/////////////////////////////////////////////////////////////////////
+void MarkVisibleLeaves (void)
+{
+    int         i, j;
+    double      start;
+    bspnode_t   *pleaf, *pnode;
+
+    pleaf = PointInLeaf(&currentpos);
+
+    if (pleaf == viewleaf)
+    {
+        pvsdecompresstime = 0.0;
+        return;
+    }
+
+    start = FrameClock();
+    if (pleaf->visofs < 0)
+        memset(pvsrow, 0xFF, pvsrowbytes);
+    else
+        DecompressVis(pvsdata + pleaf->visofs, pvsrow);
+    pvsdecompresstime = FrameClock() - start;
+    viewleaf = pleaf;
+
+    visframecount++;
+    pvsfacesvisible = 0;
+
+    for (i=0 ; i<numbspleaves ; i++)
+    {
+        if (!(pvsrow[i >> 3] & (1 << (i & 7))))
+            continue;
+
+        pleaf = bspleaves[i];
+
+        for (j=0 ; j<pleaf->nummarkfaces ; j++)
+        {
+            if (pleaf->markfaces[j]->visframe != visframecount)
+            {
+                pleaf->markfaces[j]->visframe = visframecount;
+                pvsfacesvisible++;
+            }
+        }
+
+        // The faces' nodes are all above the leaf
+        if (pleaf->nummarkfaces)
+        {
+            for (pnode = pleaf->parent ;
+                 pnode && (pnode->visframe != visframecount) ;
+                 pnode = pnode->parent)
+            {
+                pnode->visframe = visframecount;
+            }
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the edges of the visible faces in a BSP subtree to the global
+// edge table, front to back from the viewpoint: first everything on
+// the viewer's side of the node's plane, then the faces on the plane
+// that face the viewer, then everything on the far side. Each node's
+// surfaces get a key one greater than the last's, so surfaces sort
+// by the order they're added in, and no 1/z compares are needed
+// except between faces of the same node. clipflags are the frustum
+// planes the subtree might cross. With the PVS, only nodes and faces
+// MarkVisibleLeaves marked this frame are walked.
+/////////////////////////////////////////////////////////////////////
+void AddBSPEdges (bspnode_t *pnode, int clipflags)
+{
+    int         side, facing;
+    vec_t       dist;
+    bspface_t   *pface;
+
+    if (pnode->leaf >= 0)
+        return;             // leaves are empty space
+
+    if ((vismode == VIS_PVS) && (pnode->visframe != visframecount))
+        return;
+
+    bspnodesvisited++;
+
+    // Skip the whole subtree if its box is outside the frustum, and
+    // stop testing against planes the box is entirely inside of
+    if (clipflags)
+    {
+        clipflags = BoxClipFlags(&pnode->mins, &pnode->maxs, clipflags);
+        if (clipflags == -1)
+        {
+            bspnodesculled++;
+            return;
+        }
+    }
+
+    dist = DotProduct(&currentpos, &pnode->plane.normal) -
+            pnode->plane.distance;
+    side = (dist < 0.0);
+
+    AddBSPEdges(pnode->children[side], clipflags);
+
+    // Use the same epsilon as PolyFacesViewer, so faces seen too
+    // nearly edge-on to have usable gradients aren't drawn
+    if (dist > 0.01)
+        facing = 0;
+    else if (dist < -0.01)
+        facing = 1;
+    else
+        facing = -1;
+
+    for (pface = pnode->faces ; pface ; pface = pface->pnext)
+    {
+        if ((pface->flipped == facing) && ((vismode != VIS_PVS) ||
+            (pface->visframe == visframecount)))
+        {
+            AddBSPFaceEdges(pface, clipflags);
+        }
+    }
+
+    // The faces on the node share its key
+    ADD_QUEUED_FACES();
+    currentkey++;
+
+    AddBSPEdges(pnode->children[!side], clipflags);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if a polygon is entirely outside any of the planes.
+/////////////////////////////////////////////////////////////////////
+int PolygonOutsidePlanes(polygon_t *ppoly, plane_t *pplanes,
+                         int numplanes)
+{
+    int     i, j;
+
+    for (i=0 ; i<numplanes ; i++)
+    {
+        for (j=0 ; j<ppoly->numverts ; j++)
+        {
+            if (DotProduct(&ppoly->verts[j], &pplanes[i].normal) >=
+                    pplanes[i].distance)
+            {
+                break;
+            }
+        }
+
+        if (j == ppoly->numverts)
+            return 1;
+    }
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Set up the planes through the viewpoint and the edges of a view
+// outline, a convex polygon on the plane a unit in front of it with
+// its vertices counterclockwise, in worldspace.
+/////////////////////////////////////////////////////////////////////
+void SetUpViewPlanes(point2D_t *pverts, int numverts, plane_t *pplanes)
+{
+    int         i;
+    vec_t       length;
+    point_t     normal;
+    point2D_t   *pv0, *pv1;
+
+    for (i=0 ; i<numverts ; i++)
+    {
+        pv0 = &pverts[i];
+        pv1 = &pverts[(i + 1) % numverts];
+
+        // The cross product of the vectors from the viewpoint to the
+        // two vertices
+        normal.v[0] = pv0->y - pv1->y;
+        normal.v[1] = pv1->x - pv0->x;
+        normal.v[2] = pv0->x * pv1->y - pv0->y * pv1->x;
+
+        length = sqrt(DotProduct(&normal, &normal));
+        normal.v[0] /= length;
+        normal.v[1] /= length;
+        normal.v[2] /= length;
+        SetWorldspaceClipPlane(&normal, &pplanes[i]);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Wrap points in their convex hull, by Andrew's monotone chain, with
+// its vertices counterclockwise in phull, which must have room for
+// one more than there are points. The points are sorted by x, then
+// y. Returns the number of vertices.
+/////////////////////////////////////////////////////////////////////
+int ConvexHull2D(point2D_t *ppoints, int numpoints, point2D_t *phull)
+{
+    int         i, j, h, lower;
+    point2D_t   point, *pa, *pb;
+
+    for (i=1 ; i<numpoints ; i++)
+    {
+        point = ppoints[i];
+        for (j=i ; (j>0) && ((point.x < ppoints[j-1].x) ||
+             ((point.x == ppoints[j-1].x) && (point.y < ppoints[j-1].y))) ;
+             j--)
+        {
+            ppoints[j] = ppoints[j-1];
+        }
+        ppoints[j] = point;
+    }
+
+    // The lower hull left to right, then the upper right to left,
+    // dropping points where it doesn't turn left
+    h = 0;
+    for (i=0 ; i<numpoints ; i++)
+    {
+        for ( ; h >= 2 ; h--)
+        {
+            pa = &phull[h-2];
+            pb = &phull[h-1];
+            if ((pb->x - pa->x) * (ppoints[i].y - pa->y) -
+                (pb->y - pa->y) * (ppoints[i].x - pa->x) > 0.0)
+            {
+                break;
+            }
+        }
+        phull[h++] = ppoints[i];
+    }
+
+    lower = h + 1;
+    for (i=numpoints-2 ; i>=0 ; i--)
+    {
+        for ( ; h >= lower ; h--)
+        {
+            pa = &phull[h-2];
+            pb = &phull[h-1];
+            if ((pb->x - pa->x) * (ppoints[i].y - pa->y) -
+                (pb->y - pa->y) * (ppoints[i].x - pa->x) > 0.0)
+            {
+                break;
+            }
+        }
+        phull[h++] = ppoints[i];
+    }
+
+    return (h > 1) ? h - 1 : h;     // the first point's at the end too
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if all of the points are inside a convex outline with
+// its vertices counterclockwise.
+/////////////////////////////////////////////////////////////////////
+int PointsInsideOutline(point2D_t *ppoints, int numpoints,
+                        point2D_t *pverts, int numverts)
+{
+    int         i, j;
+    point2D_t   *pa, *pb;
+
+    for (i=0 ; i<numverts ; i++)
+    {
+        pa = &pverts[i];
+        pb = &pverts[(i + 1) % numverts];
+
+        for (j=0 ; j<numpoints ; j++)
+        {
+            if ((pb->x - pa->x) * (ppoints[j].y - pa->y) -
+                (pb->y - pa->y) * (ppoints[j].x - pa->x) < 0.0)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Note that a leaf can be seen into through the outline of the
+// points given, on the plane a unit in front of the viewpoint: widen
+// the outline of the views into it this frame to take them in, and
+// mark it and the nodes above it to be walked. If the outline has
+// too many vertices, the rectangle around it is used instead.
+/////////////////////////////////////////////////////////////////////
+void SeeIntoLeaf(bspnode_t *pleaf, point2D_t *ppoints, int numpoints)
+{
+    int         i, numverts;
+    vec_t       mins[2], maxs[2];
+    point2D_t   points[MAX_POLY_VERTS + MAX_VIEW_VERTS];
+    point2D_t   verts[MAX_POLY_VERTS + MAX_VIEW_VERTS + 1];
+    bspnode_t   *pnode;
+
+    if (pleaf->portalframe == visframecount)
+    {
+        if (PointsInsideOutline(ppoints, numpoints, pleaf->viewverts,
+                                pleaf->numviewverts))
+        {
+            return;
+        }
+
+        for (i=0 ; i<pleaf->numviewverts ; i++)
+            points[i] = pleaf->viewverts[i];
+    }
+    else
+    {
+        pleaf->numviewverts = 0;
+    }
+
+    for (i=0 ; i<numpoints ; i++)
+        points[pleaf->numviewverts + i] = ppoints[i];
+    numpoints += pleaf->numviewverts;
+
+    numverts = ConvexHull2D(points, numpoints, verts);
+    if (numverts < 3)
+        return;             // seen edge on
+
+    if (numverts > MAX_VIEW_VERTS)
+    {
+        mins[0] = maxs[0] = verts[0].x;
+        mins[1] = maxs[1] = verts[0].y;
+        for (i=1 ; i<numverts ; i++)
+        {
+            mins[0] = (verts[i].x < mins[0]) ? verts[i].x : mins[0];
+            maxs[0] = (verts[i].x > maxs[0]) ? verts[i].x : maxs[0];
+            mins[1] = (verts[i].y < mins[1]) ? verts[i].y : mins[1];
+            maxs[1] = (verts[i].y > maxs[1]) ? verts[i].y : maxs[1];
+        }
+        verts[0].x = verts[3].x = mins[0];
+        verts[1].x = verts[2].x = maxs[0];
+        verts[0].y = verts[1].y = mins[1];
+        verts[2].y = verts[3].y = maxs[1];
+        numverts = 4;
+    }
+
+    pleaf->numviewverts = numverts;
+    for (i=0 ; i<numverts ; i++)
+        pleaf->viewverts[i] = verts[i];
+
+    for (pnode = pleaf ; pnode && (pnode->portalframe != visframecount) ;
+         pnode = pnode->parent)
+    {
+        pnode->portalframe = visframecount;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Look through a portal into the leaf beyond it: clip the portal to
+// the planes of the view, starting with firstplane, and if any of
+// it's left, widen the view into the leaf to take it in. A portal
+// with as many vertices as a polygon can have is halved before it's
+// clipped again, lest clipping add one too many.
+/////////////////////////////////////////////////////////////////////
+void LookThroughPortal(bspnode_t *pleaf, polygon_t *pportal,
+                       plane_t *pplanes, int numplanes, int firstplane)
+{
+    int         i, cur;
+    point_t     viewvert;
+    point2D_t   points[MAX_POLY_VERTS];
+    polygon_t   clipped[2], halves[2];
+
+    clipped[0] = *pportal;
+    cur = 0;
+
+    for (i=firstplane ; i<numplanes ; i++)
+    {
+        if (clipped[cur].numverts == MAX_POLY_VERTS)
+        {
+            HalvePolygon(&clipped[cur], &halves[0], &halves[1]);
+            LookThroughPortal(pleaf, &halves[0], pplanes, numplanes, i);
+            LookThroughPortal(pleaf, &halves[1], pplanes, numplanes, i);
+            return;
+        }
+
+        if (!ClipToPlane(&clipped[cur], &pplanes[i], &clipped[cur ^ 1]))
+            return;
+        cur ^= 1;
+    }
+
+    portalspassed++;
+
+    // Project what's left onto the plane a unit in front of the
+    // viewpoint. It's inside the view, so it's in front of the
+    // viewpoint, but rounding can leave a vertex right at it
+    for (i=0 ; i<clipped[cur].numverts ; i++)
+    {
+        TransformPoint(&clipped[cur].verts[i], &viewvert);
+        if (viewvert.v[2] < CLIP_PLANE_EPSILON)
+            viewvert.v[2] = CLIP_PLANE_EPSILON;
+        points[i].x = viewvert.v[0] / viewvert.v[2];
+        points[i].y = viewvert.v[1] / viewvert.v[2];
+    }
+
+    SeeIntoLeaf(pleaf, points, clipped[cur].numverts);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the edges of the faces of a leaf's cell that face the viewer
+// and aren't outside the outline of the views into it, then look
+// through each portal out of it that faces away from the viewer.
+// Surfaces sort by 1/z, as they do when walking the objects.
+/////////////////////////////////////////////////////////////////////
+void AddPortalLeafEdges(bspnode_t *pleaf)
+{
+    int         i, numplanes;
+    vec_t       dist;
+    plane_t     planes[MAX_VIEW_VERTS];
+    bspface_t   *pface;
+    portal_t    *pportal;
+
+    portalcellsvisited++;
+
+    numplanes = pleaf->numviewverts;
+    SetUpViewPlanes(pleaf->viewverts, numplanes, planes);
+
+    for (i=0 ; i<pleaf->nummarkfaces ; i++)
+    {
+        pface = pleaf->markfaces[i];
+        if ((pface->visframe == visframecount) ||
+            !PolyFacesViewer(&pface->poly.verts[0], &pface->poly.plane) ||
+            PolygonOutsidePlanes(&pface->poly, planes, numplanes))
+        {
+            continue;
+        }
+
+        pface->visframe = visframecount;
+        portalfacesadded++;
+        AddBSPFaceEdges(pface, (1 << NUM_FRUSTUM_PLANES) - 1);
+    }
+
+    ADD_QUEUED_FACES();
+
+    for (pportal = pleaf->portals ; pportal ; pportal = pportal->pnext)
+    {
+        dist = DotProduct(&currentpos, &pportal->poly.plane.normal) -
+                pportal->poly.plane.distance;
+
+        // Right on a portal out of its own leaf, the viewer can see
+        // as much of the next leaf as of this one; any other portal
+        // it's on or in front of can't be seen through
+        if (dist > -PORTAL_EPSILON)
+        {
+            if (pleaf == portalviewleaf)
+            {
+                SeeIntoLeaf(pportal->pleaf, pleaf->viewverts,
+                            pleaf->numviewverts);
+            }
+            continue;
+        }
+
+        LookThroughPortal(pportal->pleaf, &pportal->poly, planes,
+                          numplanes, 0);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Walk the leaves under a BSP node that are seen into through
+// portals this frame front to back, adding the edges of their faces
+// that can be seen. Seeing through a portal the viewer's behind
+// always leads to a leaf farther on, on the far side of the node
+// the portal's on, so by the time a leaf's walked, all the views
+// into it are known, and it's walked just once, with the outline of
+// all of them.
+/////////////////////////////////////////////////////////////////////
+void AddPortalEdges(bspnode_t *pnode)
+{
+    int     side;
+
+    if (pnode->portalframe != visframecount)
+        return;
+
+    if (pnode->leaf >= 0)
+    {
+        AddPortalLeafEdges(pnode);
+        return;
+    }
+
+    side = (DotProduct(&currentpos, &pnode->plane.normal) <
+            pnode->plane.distance);
+
+    AddPortalEdges(pnode->children[side]);
+    AddPortalEdges(pnode->children[!side]);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the edges of everything under a BVH node that might be visible
+// to the edge table in ptable, culling by boxes. clipflags has a bit
+// set for each frustum plane the node's parent's box crosses; the
+// planes the parent is entirely inside of are ones its children are
+// inside of too, so they're never tested again below it, and once
+// none are left, nothing under the node is tested at all. Objects'
+// faces are clipped to just the planes their boxes cross. Entities
+// are only added when the frame's z-buffered.
+/////////////////////////////////////////////////////////////////////
+void AddBVHEdges (edgetable_t *ptable, bvhnode_t *pnode, int clipflags)
+{
+    int             i, objectflags;
+    point_t         mins, maxs;
+    convexobject_t  *pobject;
+
+    bvhnodesvisited++;
+
+    if (clipflags)
+    {
+        clipflags = BoxClipFlags(&pnode->mins, &pnode->maxs, clipflags);
+        if (clipflags == -1)
+        {
+            bvhnodesculled++;
+            return;
+        }
+    }
+
+    if (pnode->children[0])
+    {
+        AddBVHEdges(ptable, pnode->children[0], clipflags);
+        AddBVHEdges(ptable, pnode->children[1], clipflags);
+        return;
+    }
+
+    for (i=0 ; i<pnode->numobjects ; i++)
+    {
+        pobject = bvhobjects[pnode->firstobject + i];
+
+        objectflags = clipflags;
+        if (objectflags)
+        {
+            ObjectBox(pobject, &mins, &maxs);
+            objectflags = BoxClipFlags(&mins, &maxs, objectflags);
+            if (objectflags == -1)
+                continue;
+        }
+
+        if ((pobject >= entities) && (pobject < &entities[NUM_ENTITIES]))
+        {
+            if (ptable->zbuffered)
+                AddEntityPolys(ptable, pobject, objectflags);
+        }
+        else
+        {
+            AddObjectEdges(pobject, objectflags);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Front end of a frame: move the viewer, and build the global edge
+// table in pbuildtable from all the visible faces in all objects,
+// walking the object list, the BSP tree, the portals between its
+// leaves, or the BVH, as vismode says.
+/////////////////////////////////////////////////////////////////////
+void BuildEdgeTable (void)
+{
+    convexobject_t  *pobject;
+    int             clipflags;
+    edgetable_t     *ptable;
+    surf_t          *psurfs;
+
+    BEGIN_STAGE(STAGE_VIEWPOS);
+    UpdateViewPos();
+    END_STAGE(STAGE_VIEWPOS);
+
+    BEGIN_STAGE(STAGE_FRUSTUM);
+    SetUpFrustum();
+    END_STAGE(STAGE_FRUSTUM);
+
+    BEGIN_STAGE(STAGE_CLEAREDGES);
+    ClearEdgeLists();
+    END_STAGE(STAGE_CLEAREDGES);
+
+    ptable = pbuildtable;
+
+    // The first surface is the background, which is infinitely far
+    // away, so everything sorts in front of it
+    psurfs = ArenaReset(&ptable->arenas[TABLE_SURFS]);
+    psurflimit = (surf_t *)ptable->arenas[TABLE_SURFS].plimit;
+    psurfs->color = 0;
+    psurfs->key = 0x7FFFFFFF;
+    psurfs->plitface = NULL;
+    psurfs->pcache = NULL;
+    psurfs->zinv00 = -999999.0;
+    psurfs->zinvstepx = psurfs->zinvstepy = 0.0;
+    ptable->surfs = psurfs;
+    pavailsurf = psurfs + 1;
+    pavailedge = ArenaReset(&ptable->arenas[TABLE_EDGES]);
+    pedgelimit = (edge_t *)ptable->arenas[TABLE_EDGES].plimit;
+
+    // Draw all visible faces in all objects. The entities move
+    // first, since the BVH is refit around them as they do
+    BEGIN_STAGE(STAGE_OBJECTS);
+    currentkey = 0;
+    bspnodesvisited = bspnodesculled = 0;
+    bvhnodesvisited = bvhnodesculled = bvhnodesrefit = 0;
+
+    MoveEntities();
+    ptable->zbuffered = zbuffering;
+    ptable->numentitypolys = 0;
+
+    if (vismode == VIS_BVH)
+    {
+        // The entities are in the BVH, so they're added along with
+        // everything else
+        AddBVHEdges(ptable, bvhnodes, (1 << NUM_FRUSTUM_PLANES) - 1);
+    }
+    else if (vismode == VIS_PORTALS)
+    {
+        visframecount++;
+        portalcellsvisited = portalspassed = portalfacesadded = 0;
+        portalviewleaf = PointInLeaf(&currentpos);
+        SeeIntoLeaf(portalviewleaf, frustumoutline, 4);
+        AddPortalEdges(bsptree);
+    }
+    else if (vismode >= VIS_BSP)
+    {
+        if (vismode == VIS_PVS)
+            MarkVisibleLeaves();
+        AddBSPEdges(bsptree, (1 << NUM_FRUSTUM_PLANES) - 1);
+    }
+    else
+    {
+        for (pobject = objecthead.pnext ; pobject != &objecthead ;
+             pobject = pobject->pnext)
+        {
+            // Skip the object entirely if its bounding sphere is
+            // outside the frustum
+            clipflags = ObjectClipFlags(pobject);
+            if (clipflags != -1)
+                AddObjectEdges(pobject, clipflags);
+        }
+    }
+
+    if (vismode != VIS_BVH)
+        AddEntities(ptable);
+
+    ArenaEndFrame(&ptable->arenas[TABLE_EDGES], pavailedge);
+    ArenaEndFrame(&ptable->arenas[TABLE_SURFS], pavailsurf);
+    ptable->numsurfs = pavailsurf - ptable->surfs;
+
+    // Now that all the edges are in, put them on the lists of edges
+    // to add and remove on each scan line
+    BEGIN_INNER_STAGE(STAGE_ADDEDGES);
+    SortEdgeLists(ptable);
+    END_INNER_STAGE(STAGE_ADDEDGES);
+    END_STAGE(STAGE_OBJECTS);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Move an object-relative polygon plane into viewspace.
+/////////////////////////////////////////////////////////////////////
+void TransformPlane(plane_t *pin, point_t *pcenter, plane_t *pout)
+{
+    point_t tnormal;
+
+    // First move it into worldspace (object relative)
+    tnormal = pin->normal;
+    pout->distance = pin->distance + DotProduct (pcenter, &tnormal);
+    // Now transform it into viewspace
+    // Determine the distance from the viewpont
+    pout->distance -= DotProduct (&currentpos, &tnormal);
+    // Rotate the normal into view orientation
+    pout->normal.v[0] = DotProduct (&tnormal, &vright);
+    pout->normal.v[1] = DotProduct (&tnormal, &vup);
+    pout->normal.v[2] = DotProduct (&tnormal, &vpn);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Move the entities along their orbits around the middle of the
+// world, each at its own radius and phase, bobbing up and down.
+/////////////////////////////////////////////////////////////////////
+void MoveEntities(void)
+{
+    int     i;
+    vec_t   angle, radius;
+
+    entityframe++;
+
+    for (i=0 ; i<NUM_ENTITIES ; i++)
+    {
+        angle = entityframe * ENTITY_SPEED + i * (PI * 2 / NUM_ENTITIES);
+        if (i & 1)
+            angle = -angle;     // alternate directions
+        radius = 60.0 + (i % 3) * 20.0;
+
+        entities[i].center.v[0] = cos(angle) * radius;
+        entities[i].center.v[1] = 10.0 + sin(angle * 3.0) * 15.0;
+        entities[i].center.v[2] = sin(angle) * radius;
+
+        if (bvhnodes)
+            RefitBVH(&entities[i]);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Clip the faces of an entity that face the viewer to the frustum
+// planes in clipflags, and project them into the edge table in
+// ptable, each with its color and 1/z gradients, for the back end to
+// draw z-buffered once the world has filled the 1/z buffer.
+/////////////////////////////////////////////////////////////////////
+void AddEntityPolys(edgetable_t *ptable, convexobject_t *pentity,
+                    int clipflags)
+{
+    int             j, k;
+    polygon_t       tpoly0, tpoly1, tpoly2, *ppoly, *pclipped;
+    entitypoly_t    *pentpoly;
+    plane_t         plane;
+
+    for (j=0 ; j<pentity->numpolys ; j++)
+    {
+        ppoly = &pentity->ppoly[j];
+
+        // Move the polygon relative to the entity's center
+        tpoly0.numverts = ppoly->numverts;
+        for (k=0 ; k<ppoly->numverts ; k++)
+        {
+            tpoly0.verts[k].v[0] = ppoly->verts[k].v[0] +
+                    pentity->center.v[0];
+            tpoly0.verts[k].v[1] = ppoly->verts[k].v[1] +
+                    pentity->center.v[1];
+            tpoly0.verts[k].v[2] = ppoly->verts[k].v[2] +
+                    pentity->center.v[2];
+        }
+
+        if (!PolyFacesViewer(&tpoly0.verts[0], &ppoly->plane))
+            continue;
+
+        pclipped = &tpoly0;
+        if (clipflags)
+        {
+            pclipped = ClipToFrustum(&tpoly0, &tpoly1, clipflags);
+            if (!pclipped)
+                continue;
+        }
+
+        pentpoly = &ptable->entitypolys[ptable->numentitypolys++];
+
+        TransformPolygon (pclipped, &tpoly2);
+        ProjectPolygon (&tpoly2, &pentpoly->screenpoly);
+        for (k=0 ; k<pentpoly->screenpoly.numverts ; k++)
+            ClampScreenPoint(&pentpoly->screenpoly.verts[k]);
+
+        pentpoly->color = ppoly->color;
+        TransformPlane(&ppoly->plane, &pentity->center, &plane);
+        SetUpZInvGradients(&plane, &pentpoly->zinv00);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Add the entities inside the frustum to the edge table being built,
+// if it's z-buffered. Entities don't go through the edge table
+// proper; they'd have to be added to it, and sorted, every frame.
+/////////////////////////////////////////////////////////////////////
+void AddEntities(edgetable_t *ptable)
+{
+    int     i, clipflags;
+
+    if (!ptable->zbuffered)
+        return;
+
+    for (i=0 ; i<NUM_ENTITIES ; i++)
+    {
+        clipflags = ObjectClipFlags(&entities[i]);
+        if (clipflags != -1)
+            AddEntityPolys(ptable, &entities[i], clipflags);
+    }
 }
 
 /////////////////////////////////////////////////////////////////////
-// Add the polygon's edges to the global edge table.
+// Back end of a frame: scan the global edge table in pscantable
+// into spans, and draw them.
 /////////////////////////////////////////////////////////////////////
-void AddPolygonEdges (plane_t *plane, polygon2D_t *screenpoly)
+void ScanAndDrawFrame (void)
 {
-    double  distinv, deltax, deltay, slope;
-    int     i, nextvert, numverts, temp, topy, bottomy, height;
-    edge_t  *pedge;
-
-    numverts = screenpoly->numverts;
+    BEGIN_STAGE(STAGE_SCANEDGES);
+    ScanEdges ();
+    END_STAGE(STAGE_SCANEDGES);
 
-    // Clamp the polygon's vertices just in case some very near
-    // points have wandered out of range due to floating-point
-    // imprecision
-    for (i=0 ; i<numverts ; i++)
-    {
-        if (screenpoly->verts[i].x < -0.5)
-            screenpoly->verts[i].x = -0.5;
-        if (screenpoly->verts[i].x > ((double)DIBWidth - 0.5))
-            screenpoly->verts[i].x = (double)DIBWidth - 0.5;
-        if (screenpoly->verts[i].y < -0.5)
-            screenpoly->verts[i].y = -0.5;
-        if (screenpoly->verts[i].y > ((double)DIBHeight - 0.5))
-            screenpoly->verts[i].y = (double)DIBHeight - 0.5;
-                }
+    if (overdrawcheck)
+        ClearWriteCounts();
 
-    // Add each edge in turn
-    for (i=0 ; i<numverts ; i++)
-    {
-        nextvert = i + 1;
-        if (nextvert >= numverts)
-            nextvert = 0;
+    BEGIN_STAGE(STAGE_DRAWSPANS);
+    DrawSpans ();
+    END_STAGE(STAGE_DRAWSPANS);
 
-        topy = (int)ceil(screenpoly->verts[i].y);
-        bottomy = (int)ceil(screenpoly->verts[nextvert].y);
-        height = bottomy - topy;
-        if (height == 0)
-            continue;       // doesn't cross any scan lines
-        if (height < 0)
-        {
-            // Leading edge
-            temp = topy;
-            topy = bottomy;
-            bottomy = temp;
+    if (overdrawcheck)
+        GatherOverdrawStats();
+}
 
-            pavailedge->leading = 1;
+/////////////////////////////////////////////////////////////////////
+// Back end thread body: wait to be started by StartBackEnd, scan and
+// draw pscantable, say it's done, and wait again, until told to
+// quit.
+/////////////////////////////////////////////////////////////////////
+#ifdef _WIN32
+DWORD WINAPI BackEndThread (LPVOID param)
+{
+    (void)param;
 
-            deltax = screenpoly->verts[i].x -
-                     screenpoly->verts[nextvert].x;
-            deltay = screenpoly->verts[i].y -
-                     screenpoly->verts[nextvert].y;
-            slope = deltax / deltay;
+    for (;;)
+    {
+        WaitForSingleObject(backendstart, INFINITE);
+        if (backendquit)
+            break;
 
-            // Edge coordinates are in 16.16 fixed point
-            pavailedge->xstep = (int)(slope * (float)0x10000);
-            pavailedge->x = (int)((screenpoly->verts[nextvert].x +
-                ((float)topy - screenpoly->verts[nextvert].y) *
-                slope) * (float)0x10000);
-        }
-        else
-        {
-            // Trailing edge
-            pavailedge->leading = 0;
+        ScanAndDrawFrame();
+        SetEvent(backenddone);
+    }
 
-            deltax = screenpoly->verts[nextvert].x -
-                     screenpoly->verts[i].x;
-            deltay = screenpoly->verts[nextvert].y -
-                     screenpoly->verts[i].y;
-            slope = deltax / deltay;
+    return 0;
+}
+#else
+void *BackEndThread (void *param)
+{
+    int     quit;
 
-            // Edge coordinates are in 16.16 fixed point
-            pavailedge->xstep = (int)(slope * (float)0x10000);
-            pavailedge->x = (int)((screenpoly->verts[i].x +
-                ((float)topy - screenpoly->verts[i].y) * slope) *
-                (float)0x10000);
-        }
+    (void)param;
 
-        // Put the edge on the list to be added on top scan
-        pedge = &newedges[topy];
-        while (pedge->pnext->x < pavailedge->x)
-            pedge = pedge->pnext;
-        pavailedge->pnext = pedge->pnext;
-        pedge->pnext = pavailedge;
+    for (;;)
+    {
+        pthread_mutex_lock(&joblock);
+        while (!backendbusy && !backendquit)
+            pthread_cond_wait(&backendcond, &joblock);
+        quit = backendquit;
+        pthread_mutex_unlock(&joblock);
 
-        // Put the edge on the list to be removed after final scan
-        pavailedge->pnextremove = removeedges[bottomy - 1];
-        removeedges[bottomy - 1] = pavailedge;
+        if (quit)
+            break;
 
-        // Associate the edge with the surface we'll create for
-        // this polygon
-        pavailedge->psurf = pavailsurf;
+        ScanAndDrawFrame();
 
-        // Make sure we don't overflow the edge array
-        if (pavailedge < &edges[MAX_EDGES])
-            pavailedge++;
+        pthread_mutex_lock(&joblock);
+        backendbusy = 0;
+        pthread_cond_broadcast(&backendcond);
+        pthread_mutex_unlock(&joblock);
     }
 
-    // Create the surface, so we'll know how to sort and draw from
-    // the edges
-    pavailsurf->state = 0;
-    pavailsurf->color = currentcolor;
+    return NULL;
+}
+#endif
 
-    // Set up the 1/z gradients from the polygon, calculating the
-    // base value at screen coordinate 0,0 so we can use screen
-    // coordinates directly when calculating 1/z from the gradients
-    distinv = 1.0 / plane->distance;
-    pavailsurf->zinvstepx = plane->normal.v[0] * distinv *
-            maxscreenscaleinv * (fieldofview / 2.0);
-    pavailsurf->zinvstepy = -plane->normal.v[1] * distinv *
-            maxscreenscaleinv * (fieldofview / 2.0);
-    pavailsurf->zinv00 = plane->normal.v[2] * distinv -
-            xcenter * pavailsurf->zinvstepx -
-            ycenter * pavailsurf->zinvstepy;
+/////////////////////////////////////////////////////////////////////
+// Start the back end thread scanning and drawing pscantable.
+/////////////////////////////////////////////////////////////////////
+void StartBackEnd (void)
+{
+#ifdef _WIN32
+    SetEvent(backendstart);
+#else
+    pthread_mutex_lock(&joblock);
+    backendbusy = 1;
+    pthread_cond_broadcast(&backendcond);
+    pthread_mutex_unlock(&joblock);
+#endif
+}
 
-    // Make sure we don't overflow the surface array
-    if (pavailsurf < &surfs[MAX_SURFS])
-        pavailsurf++;
+/////////////////////////////////////////////////////////////////////
+// Wait for the back end thread to finish the frame it was started
+// on.
+/////////////////////////////////////////////////////////////////////
+void WaitBackEnd (void)
+{
+#ifdef _WIN32
+    WaitForSingleObject(backenddone, INFINITE);
+#else
+    pthread_mutex_lock(&joblock);
+    while (backendbusy)
+        pthread_cond_wait(&backendcond, &joblock);
+    pthread_mutex_unlock(&joblock);
+#endif
 }
 
 /////////////////////////////////////////////////////////////////////
-// Scan all the edges in the global edge table into spans.
+// Turn pipelining on or off, starting or stopping the back end
+// thread. Any frame that's been built but not yet scanned is
+// dropped. Returns whether pipelining is on, which it won't be if
+// the thread or the second edge table can't be set up.
 /////////////////////////////////////////////////////////////////////
-void ScanEdges (void)
+int SetPipelining (int on)
 {
-    int     x, y;
-    double  fx, fy, zinv, zinv2;
-    edge_t  *pedge, *pedge2, *ptemp;
-    span_t  *pspan;
-    surf_t  *psurf, *psurf2;
+    framepending = 0;
 
-    pspan = spans;
+    if (on == pipelining)
+        return pipelining;
 
-    // Set up the active edge list as initially empty, containing
-    // only the sentinels (which are also the background fill). Most
-    // of these fields could be set up just once at start-up
-    edgehead.pnext = &edgetail;
-    edgehead.pprev = NULL;
-    edgehead.x = -0xFFFF;           // left edge of screen
-    edgehead.leading = 1;
-    edgehead.psurf = &surfstack;
-
-    edgetail.pnext = NULL;          // mark edge of list
-    edgetail.pprev = &edgehead;
-    edgetail.x = DIBWidth << 16;    // right edge of screen
-    edgetail.leading = 0;
-    edgetail.psurf = &surfstack;
-
-    // The background surface is the entire stack initially, and
-    // is infinitely far away, so everything sorts in front of it.
-    // This could be set just once at start-up
-    surfstack.pnext = surfstack.pprev = &surfstack;
-    surfstack.color = 0;
-    surfstack.zinv00 = -999999.0;
-    surfstack.zinvstepx = surfstack.zinvstepy = 0.0;
-
-    for (y=0 ; y<DIBHeight ; y++)
-    {
-        fy = (double)y;
-
-        // Sort in any edges that start on this scan
-        pedge = newedges[y].pnext;
-        pedge2 = &edgehead;
-        while (pedge != &maxedge)
-        {
-            while (pedge->x > pedge2->pnext->x)
-                pedge2 = pedge2->pnext;
+    if (!on)
+    {
+#ifdef _WIN32
+        backendquit = 1;
+        SetEvent(backendstart);
+        WaitForSingleObject(backendthread, INFINITE);
+        CloseHandle(backendthread);
+        CloseHandle(backendstart);
+        CloseHandle(backenddone);
+#else
+        pthread_mutex_lock(&joblock);
+        backendquit = 1;
+        pthread_cond_broadcast(&backendcond);
+        pthread_mutex_unlock(&joblock);
+        pthread_join(backendthread, NULL);
+#endif
+        backendquit = 0;
+
+        pbuildtable = pscantable = &edgetables[0];
+        pipelining = 0;
+        return 0;
+    }
 
-            ptemp = pedge->pnext;
-            pedge->pnext = pedge2->pnext;
-            pedge->pprev = pedge2;
-            pedge2->pnext->pprev = pedge;
-            pedge2->pnext = pedge;
+    if (!InitTableArenas(&edgetables[1]))
+        return 0;
 
-            pedge2 = pedge;
-            pedge = ptemp;
-        }
+#ifdef _WIN32
+    {
+        DWORD   threadid;
 
-        // Scan out the active edges into spans
+        backendstart = CreateEvent(NULL, FALSE, FALSE, NULL);
+        backenddone = CreateEvent(NULL, FALSE, FALSE, NULL);
+        backendthread = NULL;
+        if (backendstart && backenddone)
+        {
+            backendthread = CreateThread(NULL, 0, BackEndThread, NULL, 0,
+                                         &threadid);
+        }
+        if (backendthread == NULL)
+        {
+            if (backendstart)
+                CloseHandle(backendstart);
+            if (backenddone)
+                CloseHandle(backenddone);
+            return 0;
+        }
+    }
+#else
+    backendbusy = 0;
+    if (pthread_create(&backendthread, NULL, BackEndThread, NULL))
+        return 0;
+#endif
 
-        // Start out with the left background edge already inserted,
-        // and the surface stack containing only the background
-        surfstack.state = 1;
-        surfstack.visxstart = 0;
+    pbuildtable = &edgetables[0];
+    pscantable = &edgetables[1];
+    pipelining = 1;
+    return 1;
+}
 
-        for (pedge=edgehead.pnext ; pedge ; pedge=pedge->pnext)
-        {
-            psurf = pedge->psurf;
+/////////////////////////////////////////////////////////////////////
+// Turn texture mapping on or off; surfaces with no texture are
+// always filled with their colors. Returns whether it's on.
+/////////////////////////////////////////////////////////////////////
+int SetTextureMapping (int on)
+{
+    texturemapping = (on != 0);
 
-            if (pedge->leading)
-            {
-                // It's a leading edge. Figure out where it is
-                // relative to the current surfaces and insert in
-                // the surface stack; if it's on top, emit the span
-                // for the current top.
-                // First, make sure the edges don't cross
-                if (++psurf->state == 1)
-                {
-                    fx = (double)pedge->x * (1.0 / (double)0x10000);
-                    // Calculate the surface's 1/z value at this pixel
-                    zinv = psurf->zinv00 + psurf->zinvstepx * fx +
-                            psurf->zinvstepy * fy;
+    return texturemapping;
+}
 
-                    // See if that makes it a new top surface
-                    psurf2 = surfstack.pnext;
-                    zinv2 = psurf2->zinv00 + psurf2->zinvstepx * fx +
-                            psurf2->zinvstepy * fy;
-                    if (zinv >= zinv2)
-                    {
-                        // It's a new top surface
-                        // emit the span for the current top
-                        x = (pedge->x + 0xFFFF) >> 16;
-                        pspan->count = x - psurf2->visxstart;
-                        if (pspan->count > 0)
-                        {
-                            pspan->y = y;
-                            pspan->x = psurf2->visxstart;
-                            pspan->color = psurf2->color;
+/////////////////////////////////////////////////////////////////////
+// Turn z-buffering on or off: whether the world's spans fill a 1/z
+// buffer as they're drawn, and the entities are drawn into it.
+// Returns whether it's on.
+/////////////////////////////////////////////////////////////////////
+int SetZBuffering (int on)
+{
+    zbuffering = (on != 0);
 
-                            // Make sure we don't overflow
-                            // the span array
-                            if (pspan < &spans[MAX_SPANS])
-                                pspan++;
-                        }
+    return zbuffering;
+}
 
-                        psurf->visxstart = x;
+/////////////////////////////////////////////////////////////////////
+// Set how the front end finds the faces that might be visible, one
+// of the VIS_ modes, compiling the BSP tree and building the PVS or
+// portals, or building the BVH, if they're needed and there aren't
+// any yet. Returns the mode in effect, which is VIS_OBJECTS if the
+// mode's out of range or the tree or BVH can't be built, and
+// VIS_BSP if the PVS or portals can't be.
+/////////////////////////////////////////////////////////////////////
+int SetVisibility (int mode)
+{
+    if ((mode < 0) || (mode >= NUM_VIS_MODES))
+        mode = VIS_OBJECTS;
 
-                        // Add the edge to the stack
-                        psurf->pnext = psurf2;
-                        psurf2->pprev = psurf;
-                        surfstack.pnext = psurf;
-                        psurf->pprev = &surfstack;
-                    }
-                    else
-                    {
-                        // Not a new top; sort into the surface stack.
-                        // Guaranteed to terminate due to sentinel
-                        // background surface
-                        do
-                        {
-                            psurf2 = psurf2->pnext;
-                            zinv2 = psurf2->zinv00 +
-                                    psurf2->zinvstepx * fx +
-                                    psurf2->zinvstepy * fy;
-                        } while (zinv < zinv2);
+    if ((mode >= VIS_BSP) && (mode <= VIS_PORTALS) &&
+        (bsptree == NULL) && !BuildBSPTree())
+    {
+        mode = VIS_OBJECTS;
+    }
 
-                        // Insert the surface into the stack
-                        psurf->pnext = psurf2;
-                        psurf->pprev = psurf2->pprev;
-                        psurf2->pprev->pnext = psurf;
-                        psurf2->pprev = psurf;
-                    }
-                }
-            }
-            else
-            {
-                // It's a trailing edge; if this was the top surface,
-                // emit the span and remove it.
-                // First, make sure the edges didn't cross
-                if (--psurf->state == 0)
-                {
-                    if (surfstack.pnext == psurf)
-                    {
-                        // It's on top, emit the span
-                        x = ((pedge->x + 0xFFFF) >> 16);
-                        pspan->count = x - psurf->visxstart;
-                        if (pspan->count > 0)
-                        {
-                            pspan->y = y;
-                            pspan->x = psurf->visxstart;
-                            pspan->color = psurf->color;
+    if ((mode == VIS_BVH) && (bvhnodes == NULL) && !BuildBVH())
+        mode = VIS_OBJECTS;
 
-                            // Make sure we don't overflow
-                            // the span array
-                            if (pspan < &spans[MAX_SPANS])
-                                pspan++;
-                        }
+    if ((mode == VIS_PVS) && (pvsrow == NULL) && !BuildPVS())
+        mode = VIS_BSP;
 
-                        psurf->pnext->visxstart = x;
-                    }
+    if ((mode == VIS_PORTALS) && (numportals == 0) && !BuildPortals())
+        mode = VIS_BSP;
 
-                    // Remove the surface from the stack
-                    psurf->pnext->pprev = psurf->pprev;
-                    psurf->pprev->pnext = psurf->pnext;
-                }
-            }
-        }
+    vismode = mode;
+    viewleaf = NULL;
 
-        // Remove edges that are done
-        pedge = removeedges[y];
-        while (pedge)
-        {
-            pedge->pprev->pnext = pedge->pnext;
-            pedge->pnext->pprev = pedge->pprev;
-            pedge = pedge->pnextremove;
-        }
+    return vismode;
+}
 
-        // Step the remaining edges one scan line, and re-sort
-        for (pedge=edgehead.pnext ; pedge != &edgetail ; )
-        {
-            ptemp = pedge->pnext;
+/////////////////////////////////////////////////////////////////////
+// Get the size of the BSP tree and how long it took to compile, and
+// the number of nodes the last frame built visited and how many of
+// those it culled by their boxes. Returns 0, with everything zeroed,
+// if the front end isn't walking the BSP tree.
+/////////////////////////////////////////////////////////////////////
+int GetBSPStats(int *nodes, int *leaves, int *faces, double *compilems,
+                int *visited, int *culled)
+{
+    if (((vismode != VIS_BSP) && (vismode != VIS_PVS)) ||
+        (bsptree == NULL))
+    {
+        *nodes = *leaves = *faces = *visited = *culled = 0;
+        *compilems = 0.0;
+        return 0;
+    }
 
-            // Step the edge
-            pedge->x += pedge->xstep;
+    *nodes = numbspnodes;
+    *leaves = numbspleaves;
+    *faces = numbspfaces;
+    *compilems = bspcompiletime * 1000.0;
+    *visited = bspnodesvisited;
+    *culled = bspnodesculled;
 
-            // Move the edge back to the proper sorted location,
-            // if necessary
-            while (pedge->x < pedge->pprev->x)
-            {
-                pedge2 = pedge->pprev;
-                pedge2->pnext = pedge->pnext;
-                pedge->pnext->pprev = pedge2;
-                pedge2->pprev->pnext = pedge;
-                pedge->pprev = pedge2->pprev;
-                pedge->pnext = pedge2;
-                pedge2->pprev = pedge;
-            }
+    return 1;
+}
 
-            pedge = ptemp;
-        }
+/////////////////////////////////////////////////////////////////////
+// Get the compressed and uncompressed sizes of the PVS in bytes and
+// how long it took to build, how long the last frame built spent
+// decompressing a row of it (0 unless the viewer changed leaves),
+// and how many faces that frame left out because the PVS said they
+// couldn't be seen. Returns 0, with everything zeroed, if the front
+// end isn't using the PVS.
+/////////////////////////////////////////////////////////////////////
+int GetPVSStats(int *compressed, int *uncompressed, double *buildms,
+                double *decompressms, int *culled)
+{
+    if ((vismode != VIS_PVS) || (pvsrow == NULL))
+    {
+        *compressed = *uncompressed = *culled = 0;
+        *buildms = *decompressms = 0.0;
+        return 0;
     }
 
-    pspan->x = -1;  // mark the end of the list
+    *compressed = pvssize;
+    *uncompressed = numbspleaves * pvsrowbytes;
+    *buildms = pvsbuildtime * 1000.0;
+    *decompressms = pvsdecompresstime * 1000.0;
+    *culled = numbspfaces - pvsfacesvisible;
+
+    return 1;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Draw all the spans that were scanned out.
+// Get the number of cells (the BSP tree's leaves) and portals
+// between them and how long the portals took to build, and the
+// number of cells the last frame built visited (each is visited
+// once, however many ways it's seen into), portals it looked
+// through, and faces it added. Returns 0, with everything zeroed,
+// if the front end isn't walking the portals.
 /////////////////////////////////////////////////////////////////////
-void DrawSpans (void)
+int GetPortalStats(int *cells, int *portals, double *buildms,
+                   int *visited, int *passed, int *faces)
 {
-    span_t  *pspan;
-
-    for (pspan=spans ; pspan->x != -1 ; pspan++)
+    if ((vismode != VIS_PORTALS) || (bsptree == NULL))
     {
-        memset (pDIB + (DIBPitch * pspan->y) + pspan->x,
-                pspan->color,
-                pspan->count);
+        *cells = *portals = *visited = *passed = *faces = 0;
+        *buildms = 0.0;
+        return 0;
     }
+
+    *cells = numbspleaves;
+    *portals = numportals;
+    *buildms = portalbuildtime * 1000.0;
+    *visited = portalcellsvisited;
+    *passed = portalspassed;
+    *faces = portalfacesadded;
+
+    return 1;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Clear the lists of edges to add and remove on each scan line.
+// Get the size of the BVH and how long it took to build, and the
+// number of nodes the last frame built visited, how many of those it
+// culled by their boxes, and how many were refit around the moving
+// entities. Returns 0, with everything zeroed, if the front end
+// isn't walking the BVH.
 /////////////////////////////////////////////////////////////////////
-void ClearEdgeLists(void)
+int GetBVHStats(int *nodes, int *leaves, double *buildms, int *visited,
+                int *culled, int *refit)
 {
-    int i;
-
-    for (i=0 ; i<DIBHeight ; i++)
+    if ((vismode != VIS_BVH) || (bvhnodes == NULL))
     {
-        newedges[i].pnext = &maxedge;
-        removeedges[i] = NULL;
+        *nodes = *leaves = *visited = *culled = *refit = 0;
+        *buildms = 0.0;
+        return 0;
     }
+
+    *nodes = numbvhnodes;
+    *leaves = numbvhleaves;
+    *buildms = bvhbuildtime * 1000.0;
+    *visited = bvhnodesvisited;
+    *culled = bvhnodesculled;
+    *refit = bvhnodesrefit;
+
+    return 1;
 }
 
 /////////////////////////////////////////////////////////////////////
-// Render the current state of the world to the screen.
+// Render the current state of the world to the screen. Normally
+// each frame is built, scanned, and drawn in turn. When pipelining,
+// the last frame's table is scanned and drawn on the back end thread
+// while this frame's is built, so what's presented is a frame
+// behind, and the first call presents nothing.
 /////////////////////////////////////////////////////////////////////
 void UpdateWorld()
 {
+#ifndef HEADLESS
 	HPALETTE        holdpal;
     HDC             hdcScreen, hdcDIBSection;
     HBITMAP         holdbitmap;
-    polygon2D_t     screenpoly;
-    polygon_t       *ppoly, tpoly0, tpoly1, tpoly2;
-    convexobject_t  *pobject;
-    int             i, j, k;
-    plane_t         plane;
-    point_t         tnormal;
+    char            text[128];
+    int             i, j;
+#endif
+    int             present;
+    edgetable_t     *ptable;
 
-    UpdateViewPos();
-    SetUpFrustum();
-    ClearEdgeLists();
-    pavailsurf = surfs;
-    pavailedge = edges;
+    // Go on with the PVS if it's being built a slice a frame, and
+    // fall back to the BSP tree alone if that fails
+    if (pvsbuilding && !ContinuePVS() && (vismode == VIS_PVS))
+        vismode = VIS_BSP;
 
+    BeginStageFrame();
 
-    // Draw all visible faces in all objects
-    pobject = objecthead.pnext;
+    pbuildtable->starttime = FrameClock();
 
-    while (pobject != &objecthead)
+    if (pipelining)
     {
-        ppoly = pobject->ppoly;
+        present = framepending;
+        if (present)
+            StartBackEnd();
 
-        for (i=0 ; i<pobject->numpolys ; i++)
-        {
-            // Move the polygon relative to the object center
-            tpoly0.numverts = ppoly[i].numverts;
-            for (j=0 ; j<tpoly0.numverts ; j++)
-            {
-                for (k=0 ; k<3 ; k++)
-                    tpoly0.verts[j].v[k] = ppoly[i].verts[j].v[k] +
-                            pobject->center.v[k];
-            }
+        BuildEdgeTable();
+
+        if (present)
+            WaitBackEnd();
+
+        // Swap tables, so this frame's is scanned next time
+        ptable = pscantable;
+        pscantable = pbuildtable;
+        pbuildtable = ptable;
+        framepending = 1;
+    }
+    else
+    {
+        BuildEdgeTable();
+        ScanAndDrawFrame();
+        present = 1;
+    }
+
+    if (!present)
+    {
+        EndStageFrame();
+        return;
+    }
 
-            if (PolyFacesViewer(&tpoly0, &ppoly[i].plane))
+    // Time the frame presented was begun
+    ptable = pipelining ? pbuildtable : pscantable;
+
+    BEGIN_STAGE(STAGE_PRESENT);
+#ifndef HEADLESS
+    for (j=0 ; j<NUM_TABLE_ARENAS ; j++)
+    {
+        if (ptable->arenas[j].grew)
+        {
+            sprintf(text, "%s pool grew to %d\n",
+                    ptable->arenas[j].name, ptable->arenas[j].capacity);
+            OutputDebugString(text);
+        }
+    }
+    for (i=0 ; i<numbands ; i++)
+    {
+        for (j=0 ; j<NUM_BAND_ARENAS ; j++)
+        {
+            if (bands[i].arenas[j].grew)
             {
-                if (ClipToFrustum(&tpoly0, &tpoly1))
-                {
-                    currentcolor = ppoly[i].color;
-                    TransformPolygon (&tpoly1, &tpoly2);
-                    ProjectPolygon (&tpoly2, &screenpoly);
-
-                    // Move the polygon's plane into viewspace
-                    // First move it into worldspace (object relative)
-                    tnormal = ppoly[i].plane.normal;
-                    plane.distance = ppoly[i].plane.distance +
-                        DotProduct (&pobject->center, &tnormal);
-                    // Now transform it into viewspace
-                    // Determine the distance from the viewpont
-                    plane.distance -=
-                          DotProduct (&currentpos, &tnormal);
-                    // Rotate the normal into view orientation
-                    plane.normal.v[0] =
-                            DotProduct (&tnormal, &vright);
-                    plane.normal.v[1] =
-                            DotProduct (&tnormal, &vup);
-                    plane.normal.v[2] =
-                            DotProduct (&tnormal, &vpn);
-
-                    AddPolygonEdges (&plane, &screenpoly);
-                }
+                sprintf(text, "band %d %s pool grew to %d\n", i,
+                        bands[i].arenas[j].name,
+                        bands[i].arenas[j].capacity);
+                OutputDebugString(text);
             }
         }
-
-        pobject = pobject->pnext;
     }
 
-    ScanEdges ();
-    DrawSpans ();
+    if (overdrawcheck)
+    {
+        sprintf(text, "%s - depth complexity mean %.2f, max %d",
+                szTitle, meandepth, maxdepth);
+        SetWindowText(hwndOutput, text);
+    }
 
 	// We've drawn the frame; copy it to the screen
 	hdcScreen = GetDC(hwndOutput);
@@ -1560,4 +10307,10 @@ void UpdateWorld()
 	ReleaseDC(hwndOutput, hdcScreen);
     SelectObject(hdcDIBSection, holdbitmap);
     DeleteDC(hdcDIBSection);
+#endif
+    END_STAGE(STAGE_PRESENT);
+
+    framelatency = FrameClock() - ptable->starttime;
+
+    EndStageFrame();
 }